@@ -0,0 +1,1555 @@
+#include "../include/arena.h"
+#include "../include/batch.h"
+#include "../include/bytecode.h"
+#include "../include/calc.h"
+#include "../include/calcbin.h"
+#include "../include/columneval.h"
+#include "../include/exprgen.h"
+#include "../include/fileeval.h"
+#include "../include/lexer.h"
+#include "../include/numfmt.h"
+#include "../include/optimizer.h"
+#include "../include/pareval.h"
+#include "../include/parser.h"
+#include "../include/prepared.h"
+#include "../include/streameval.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Evaluations per expression in every timed loop
+#define BENCH_ITERATIONS 200000
+
+// Generated expressions per workload of the phase benchmark, each phase is
+// timed PHASE_REPEAT times and the fastest pass is kept
+#define PHASE_EXPRS 20000
+#define PHASE_REPEAT 5
+
+// Most metrics a run records for --save and --compare
+#define MAX_METRICS 256
+
+// Relative change a comparison reports as better or worse, not noise
+#define COMPARE_THRESHOLD 0.10
+
+// Bytes of every synthetic input of the lexer scan benchmark, each is
+// lexed SCAN_REPEAT times and the fastest pass is kept
+#define SCAN_BYTES (32 << 20)
+#define SCAN_REPEAT 3
+
+// Size of every single expression file the streaming benchmark evaluates
+#define STREAM_BYTES (64 << 20)
+
+// Levels of the balanced tree of the parallel benchmark, about 2^21 nodes,
+// every thread count is timed PARALLEL_REPEAT times and the best kept
+#define PARALLEL_LEVELS 20
+#define PARALLEL_REPEAT 3
+
+// Terms of the chains of the reassociation benchmark, and the input rows
+// each chain is evaluated on
+#define REASSOC_TERMS 100000
+#define REASSOC_ROWS 64
+
+// Formulas of the calcbin benchmark's library
+#define CALCBIN_FORMULAS 20000
+#define CALCBIN_REPEAT 5
+
+// Rows of every column of the columnar benchmark
+#define COLUMN_ROWS (1 << 20)
+#define COLUMN_REPEAT 3
+
+// Distinct input rows fed to the prepared expression benchmark
+#define PREPARED_ROWS 1000000
+
+// Calls made through the library, and processes spawned for comparison
+#define LIBRARY_CALLS 200000
+#define SPAWN_CALLS 200
+
+// Generated lines piped through batch mode
+#define BATCH_LINES 200000
+
+// Generated results formatted by the formatting benchmark, each repeated
+#define FORMAT_RESULTS 20000
+#define FORMAT_REPEAT 20
+
+// Distinct expressions repeated through the cache benchmark
+#define CACHE_DISTINCT 2000
+
+// Generated lines evaluated by file mode at each thread count
+#define FILE_LINES 1000000
+
+// Current monotonic time in nanoseconds
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// One named measurement of the current run
+typedef struct {
+    char name[64];
+    double value;
+    int higher_better; // set for throughputs, clear for costs
+} Metric_t;
+
+static Metric_t metrics[MAX_METRICS];
+static int metric_count = 0;
+
+// Remember a measurement so it can be saved or compared to a baseline
+static void record_metric(const char *name, double value, int higher_better) {
+    if (metric_count >= MAX_METRICS)
+        return;
+
+    Metric_t *metric = &metrics[metric_count++];
+    snprintf(metric->name, sizeof(metric->name), "%s", name);
+    metric->value = value;
+    metric->higher_better = higher_better;
+}
+
+// Write every recorded metric as "name value" lines. Returns 0 on success.
+static int save_metrics(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot write baseline '%s'\n", path);
+        return -1;
+    }
+
+    fprintf(file, "# calc bench baseline\n");
+    for (int i = 0; i < metric_count; i++)
+        fprintf(file, "%s %.17g\n", metrics[i].name, metrics[i].value);
+
+    fclose(file);
+    return 0;
+}
+
+// Print every recorded metric next to its value in a saved baseline.
+// Returns the number of metrics that got worse, or -1 if unreadable.
+static int compare_metrics(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot read baseline '%s'\n", path);
+        return -1;
+    }
+
+    char name[64];
+    double value;
+    double baseline[MAX_METRICS];
+    int found[MAX_METRICS] = {0};
+    char line[256];
+
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || sscanf(line, "%63s %lf", name, &value) != 2)
+            continue;
+        for (int i = 0; i < metric_count; i++) {
+            if (strcmp(metrics[i].name, name) == 0) {
+                baseline[i] = value;
+                found[i] = 1;
+                break;
+            }
+        }
+    }
+    fclose(file);
+
+    int worse = 0;
+    printf("\n=== comparison with %s ===\n", path);
+    printf("%-36s %14s %14s %9s\n", "metric", "baseline", "current", "change");
+
+    for (int i = 0; i < metric_count; i++) {
+        if (!found[i] || baseline[i] == 0.0) {
+            printf("%-36s %14s %14.1f %9s\n", metrics[i].name, "-", metrics[i].value,
+                   "new");
+            continue;
+        }
+
+        double change = (metrics[i].value - baseline[i]) / baseline[i];
+        double gain = metrics[i].higher_better ? change : -change;
+        const char *verdict = "";
+        if (gain > COMPARE_THRESHOLD) {
+            verdict = "better";
+        } else if (gain < -COMPARE_THRESHOLD) {
+            verdict = "WORSE";
+            worse++;
+        }
+
+        printf("%-36s %14.1f %14.1f %+8.1f%% %s\n", metrics[i].name, baseline[i],
+               metrics[i].value, change * 100.0, verdict);
+    }
+
+    printf("%d of %d metrics worse by more than %.0f%%\n", worse, metric_count,
+           COMPARE_THRESHOLD * 100.0);
+    return worse;
+}
+
+// Build a long left-associative chain that mixes every operator
+static char *make_chain(int terms) {
+    static const char *ops[] = {" + ", " - ", " * ", " / "};
+    char *buffer = malloc(terms * 24 + 1);
+    int len = 0;
+
+    for (int i = 0; i < terms; i++) {
+        if (i > 0)
+            len += sprintf(buffer + len, "%s", ops[i % 4]);
+        len += sprintf(buffer + len, "%d.%d", i % 17 + 1, i % 10);
+    }
+
+    return buffer;
+}
+
+// Build a deeply parenthesized expression with unary operators and powers
+static char *make_nested(int depth) {
+    char *buffer = malloc(depth * 16 + 16);
+    int len = 0;
+
+    for (int i = 0; i < depth; i++)
+        len += sprintf(buffer + len, "-(1.%d + ", i % 10);
+    len += sprintf(buffer + len, "2 ^ 0.5");
+    for (int i = 0; i < depth; i++)
+        len += sprintf(buffer + len, ") * 0.9");
+
+    return buffer;
+}
+
+// Time ast_eval against bytecode_eval for one expression
+static void bench_expression(const char *name, const char *input, Arena_t *arena) {
+    Lexer_t *lexer = lexer_init(input);
+    Parser_t *parser = parser_init(lexer, arena);
+    ASTNode_t *ast = parser_parse(parser);
+
+    if (!ast) {
+        printf("%-12s parse failed\n", name);
+        parser_free(parser);
+        lexer_free(lexer);
+        return;
+    }
+
+    Bytecode_t *bc = bytecode_compile(ast);
+    double tree_result = ast_eval(ast);
+    double vm_result = bytecode_eval(bc, NULL);
+    int match = memcmp(&tree_result, &vm_result, sizeof(double)) == 0;
+
+    // Keep the compiler from dropping the loops
+    volatile double sink = 0.0;
+
+    double start = now_ns();
+    for (int i = 0; i < BENCH_ITERATIONS; i++)
+        sink = ast_eval(ast);
+    double tree_ns = (now_ns() - start) / BENCH_ITERATIONS;
+
+    start = now_ns();
+    for (int i = 0; i < BENCH_ITERATIONS; i++)
+        sink = bytecode_eval(bc, NULL);
+    double vm_ns = (now_ns() - start) / BENCH_ITERATIONS;
+    (void)sink;
+
+    printf("%-12s %6d instrs %10.1f ns %10.1f ns %7.2fx  %s\n", name, bc->code_len,
+           tree_ns, vm_ns, tree_ns / vm_ns, match ? "ok" : "MISMATCH");
+
+    char metric[64];
+    snprintf(metric, sizeof(metric), "eval.%s.ast_ns", name);
+    record_metric(metric, tree_ns, 0);
+    snprintf(metric, sizeof(metric), "eval.%s.bytecode_ns", name);
+    record_metric(metric, vm_ns, 0);
+
+    bytecode_free(bc);
+    parser_free(parser);
+    lexer_free(lexer);
+    arena_reset(arena);
+}
+
+// One workload of the phase benchmark, a generator configuration
+typedef struct {
+    const char *name;
+    int max_depth;
+    int max_terms;
+    int op_weights[EXPRGEN_OP_COUNT];
+    ExprGenLiteral literal;
+} Workload_t;
+
+// Time lexing, parsing and evaluation separately over generated expressions.
+// Parse time is reported without the lexing it drives, and evaluation uses
+// ast_eval_checked, the body of ast_eval without printing errors.
+static void bench_phases(Arena_t *arena) {
+    static const Workload_t workloads[] = {
+        {"small", 1, 3, {1, 1, 1, 1, 1}, EXPRGEN_LITERAL_MIXED},
+        {"wide", 2, 12, {1, 1, 1, 1, 1}, EXPRGEN_LITERAL_MIXED},
+        {"deep", 10, 3, {1, 1, 1, 1, 1}, EXPRGEN_LITERAL_MIXED},
+        {"additive", 3, 6, {1, 1, 0, 0, 0}, EXPRGEN_LITERAL_INTEGER},
+        {"long-literals", 3, 4, {1, 1, 1, 1, 0}, EXPRGEN_LITERAL_LONG},
+    };
+    int workload_count = sizeof(workloads) / sizeof(workloads[0]);
+
+    char **texts = malloc(PHASE_EXPRS * sizeof(char *));
+    int *lengths = malloc(PHASE_EXPRS * sizeof(int));
+    ASTNode_t **asts = malloc(PHASE_EXPRS * sizeof(ASTNode_t *));
+    Lexer_t *lexer = lexer_init("");
+    Parser_t *parser = lexer ? parser_init(lexer, arena) : NULL;
+    Arena_t *tree_arena = arena_init(1 << 20);
+    if (!texts || !lengths || !asts || !parser || !tree_arena) {
+        printf("phase setup failed\n");
+        goto cleanup;
+    }
+    parser->silent = 1;
+
+    printf("\n=== phases: %d generated expressions per workload ===\n", PHASE_EXPRS);
+    printf("%-14s %7s %7s %9s %9s %9s %9s %12s %8s\n", "workload", "tokens", "nodes",
+           "lex", "parse", "eval", "allocs", "expr/sec", "MB/s");
+    printf("%-14s %7s %7s %9s %9s %9s %9s %12s %8s\n", "", "/expr", "/expr", "ns/token",
+           "ns/node", "ns/node", "/expr", "", "");
+
+    for (int w = 0; w < workload_count; w++) {
+        const Workload_t *workload = &workloads[w];
+        ExprGen_t gen;
+        exprgen_init(&gen, 1000 + w);
+        gen.max_depth = workload->max_depth;
+        gen.max_terms = workload->max_terms;
+        gen.literal = workload->literal;
+        for (int i = 0; i < EXPRGEN_OP_COUNT; i++)
+            gen.op_weights[i] = workload->op_weights[i];
+
+        char line[4096];
+        size_t bytes = 0;
+        int count = 0;
+        while (count < PHASE_EXPRS) {
+            int len = exprgen_expression(&gen, line, sizeof(line));
+            if (len < 0)
+                continue;
+            texts[count] = strdup(line);
+            lengths[count] = len;
+            bytes += len;
+            count++;
+        }
+
+        // Lexing alone, every token up to EOF
+        long tokens = 0;
+        double lex_ns = 0.0;
+        for (int r = 0; r < PHASE_REPEAT; r++) {
+            tokens = 0;
+            double start = now_ns();
+            for (int i = 0; i < count; i++) {
+                lexer_reset(lexer, texts[i], lengths[i]);
+                while (lexer_next_token(lexer).type != TOKEN_EOF)
+                    tokens++;
+            }
+            double elapsed = now_ns() - start;
+            if (r == 0 || elapsed < lex_ns)
+                lex_ns = elapsed;
+        }
+
+        // Parsing, which drives the lexer, into an arena reset per expression
+        long allocs = 0;
+        double parse_ns = 0.0;
+        for (int r = 0; r < PHASE_REPEAT; r++) {
+            allocs = 0;
+            double start = now_ns();
+            for (int i = 0; i < count; i++) {
+                lexer_reset(lexer, texts[i], lengths[i]);
+                arena_reset(arena);
+                parser_reset(parser);
+                if (parser_parse(parser))
+                    allocs += arena->alloc_count;
+            }
+            double elapsed = now_ns() - start;
+            if (r == 0 || elapsed < parse_ns)
+                parse_ns = elapsed;
+        }
+        parse_ns -= lex_ns;
+
+        // Evaluation over trees kept alive together
+        long nodes = 0;
+        arena_reset(tree_arena);
+        parser->arena = tree_arena;
+        for (int i = 0; i < count; i++) {
+            lexer_reset(lexer, texts[i], lengths[i]);
+            parser_reset(parser);
+            asts[i] = parser_parse(parser);
+            nodes += ast_count_nodes(asts[i]);
+        }
+        parser->arena = arena;
+
+        volatile double sink = 0.0;
+        const char *error;
+        double eval_ns = 0.0;
+        for (int r = 0; r < PHASE_REPEAT; r++) {
+            double start = now_ns();
+            for (int i = 0; i < count; i++) {
+                error = NULL;
+                sink = ast_eval_checked(asts[i], NULL, &error);
+            }
+            double elapsed = now_ns() - start;
+            if (r == 0 || elapsed < eval_ns)
+                eval_ns = elapsed;
+        }
+        (void)sink;
+
+        double token_ns = lex_ns / tokens;
+        double node_parse_ns = parse_ns / nodes;
+        double node_eval_ns = eval_ns / nodes;
+        double per_expr_ns = (lex_ns + parse_ns + eval_ns) / count;
+
+        printf("%-14s %7.1f %7.1f %9.2f %9.2f %9.2f %9.1f %12.0f %8.1f\n", workload->name,
+               (double)tokens / count, (double)nodes / count, token_ns, node_parse_ns,
+               node_eval_ns, (double)allocs / count, 1e9 / per_expr_ns,
+               bytes / (per_expr_ns * count / 1e3));
+
+        char metric[64];
+        snprintf(metric, sizeof(metric), "phase.%s.lex_ns_per_token", workload->name);
+        record_metric(metric, token_ns, 0);
+        snprintf(metric, sizeof(metric), "phase.%s.parse_ns_per_node", workload->name);
+        record_metric(metric, node_parse_ns, 0);
+        snprintf(metric, sizeof(metric), "phase.%s.eval_ns_per_node", workload->name);
+        record_metric(metric, node_eval_ns, 0);
+        snprintf(metric, sizeof(metric), "phase.%s.allocs_per_expr", workload->name);
+        record_metric(metric, (double)allocs / count, 0);
+        snprintf(metric, sizeof(metric), "phase.%s.exprs_per_sec", workload->name);
+        record_metric(metric, 1e9 / per_expr_ns, 1);
+
+        for (int i = 0; i < count; i++)
+            free(texts[i]);
+    }
+
+cleanup:
+    arena_reset(arena);
+    arena_free(tree_arena);
+    parser_free(parser);
+    lexer_free(lexer);
+    free(asts);
+    free(lengths);
+    free(texts);
+}
+
+// Lex large inputs made of one repeated pattern with the vector scan and one
+// byte at a time, and report the throughput of both
+static void bench_scan(void) {
+    const struct {
+        const char *name;
+        const char *pattern;
+    } inputs[] = {
+        {"spaced", "1234 +                              ( x_1 *      2.5 )         -\n"},
+        {"digits", "12345678901234567890123456789012.5 * 98765432109876543210 - "},
+        {"idents", "interest_rate_2024_q3 * principal_amount_outstanding + "},
+        {"compact", "1+2*(3-4)/5^6-"},
+    };
+
+    char *text = malloc(SCAN_BYTES);
+    Lexer_t *lexer = lexer_init("");
+    if (!text || !lexer) {
+        printf("scan setup failed\n");
+        free(text);
+        lexer_free(lexer);
+        return;
+    }
+
+    printf("\n=== lexer scan: %d MB per input, %d bytes per vector ===\n",
+           SCAN_BYTES >> 20, lexer_simd_width());
+    printf("%-10s %12s %12s %12s %8s\n", "input", "tokens", "scalar", "vector",
+           "speedup");
+
+    for (int i = 0; i < (int)(sizeof(inputs) / sizeof(inputs[0])); i++) {
+        size_t pattern_len = strlen(inputs[i].pattern);
+        for (size_t pos = 0; pos < SCAN_BYTES; pos += pattern_len) {
+            size_t n = SCAN_BYTES - pos < pattern_len ? SCAN_BYTES - pos : pattern_len;
+            memcpy(text + pos, inputs[i].pattern, n);
+        }
+
+        // Scalar first, then the width the machine supports
+        double gbps[2] = {0.0, 0.0};
+        long tokens = 0;
+        for (int mode = 0; mode < 2; mode++) {
+            lexer->simd = mode ? lexer_simd_width() : 0;
+            double best = 0.0;
+
+            for (int r = 0; r < SCAN_REPEAT; r++) {
+                lexer_reset(lexer, text, SCAN_BYTES);
+                tokens = 0;
+                double start = now_ns();
+                while (lexer_next_token(lexer).type != TOKEN_EOF)
+                    tokens++;
+                double elapsed = now_ns() - start;
+                if (best == 0.0 || elapsed < best)
+                    best = elapsed;
+            }
+
+            gbps[mode] = SCAN_BYTES / best;
+        }
+
+        printf("%-10s %12ld %7.2f GB/s %7.2f GB/s %7.2fx\n", inputs[i].name, tokens,
+               gbps[0], gbps[1], gbps[1] / gbps[0]);
+
+        char metric[64];
+        snprintf(metric, sizeof(metric), "scan.%s.scalar_gbps", inputs[i].name);
+        record_metric(metric, gbps[0], 1);
+        snprintf(metric, sizeof(metric), "scan.%s.vector_gbps", inputs[i].name);
+        record_metric(metric, gbps[1], 1);
+    }
+
+    lexer_free(lexer);
+    free(text);
+}
+
+// Time one formula over many inputs: re-parsing the text for every row,
+// walking the prepared AST, and executing the prepared program
+static void bench_prepared(Arena_t *arena) {
+    const char *formula = "x*x + 3*x*y - y/2 + 1*(x - 0)";
+    const char *names[] = {"x", "y"};
+
+    PreparedExpr_t *expr = expr_prepare(formula, names, 2);
+    if (!expr) {
+        printf("prepare failed\n");
+        return;
+    }
+
+    double *rows = malloc(PREPARED_ROWS * 2 * sizeof(double));
+    for (int i = 0; i < PREPARED_ROWS; i++) {
+        rows[2 * i] = i * 0.001;
+        rows[2 * i + 1] = 1.0 + (i % 97);
+    }
+
+    volatile double sink = 0.0;
+
+    // Baseline: substitute the values into the text and start from scratch
+    int reparse_rows = PREPARED_ROWS / 10;
+    char text[192];
+    double start = now_ns();
+    for (int i = 0; i < reparse_rows; i++) {
+        double x = rows[2 * i];
+        double y = rows[2 * i + 1];
+        snprintf(text, sizeof(text),
+                 "%.17g*%.17g + 3*%.17g*%.17g"
+                 " - %.17g/2 + 1*(%.17g - 0)",
+                 x, x, x, y, y, x);
+        Lexer_t *lexer = lexer_init(text);
+        Parser_t *parser = parser_init(lexer, arena);
+        sink = ast_eval(parser_parse(parser));
+        parser_free(parser);
+        lexer_free(lexer);
+        arena_reset(arena);
+    }
+    double reparse_ns = (now_ns() - start) / reparse_rows;
+
+    start = now_ns();
+    for (int i = 0; i < PREPARED_ROWS; i++)
+        sink = ast_eval_vars(expr->ast, rows + 2 * i);
+    double tree_ns = (now_ns() - start) / PREPARED_ROWS;
+
+    start = now_ns();
+    for (int i = 0; i < PREPARED_ROWS; i++)
+        sink = expr_execute(expr, rows + 2 * i);
+    double execute_ns = (now_ns() - start) / PREPARED_ROWS;
+
+    // Same loop once the expression has native code
+    double jit_ns = 0.0;
+    if (expr_enable_jit(expr)) {
+        start = now_ns();
+        for (int i = 0; i < PREPARED_ROWS; i++)
+            sink = expr_execute(expr, rows + 2 * i);
+        jit_ns = (now_ns() - start) / PREPARED_ROWS;
+    }
+    (void)sink;
+
+    record_metric("prepared.reparse_ns", reparse_ns, 0);
+    record_metric("prepared.execute_ns", execute_ns, 0);
+    if (jit_ns > 0.0)
+        record_metric("prepared.jit_ns", jit_ns, 0);
+
+    printf("\n=== prepared expression: %s ===\n", formula);
+    printf("%-22s %10.1f ns/eval\n", "reparse per row", reparse_ns);
+    printf("%-22s %10.1f ns/eval\n", "ast_eval_vars", tree_ns);
+    printf("%-22s %10.1f ns/eval %7.2fx vs reparse\n", "expr_execute", execute_ns,
+           reparse_ns / execute_ns);
+    if (jit_ns > 0.0) {
+        printf("%-22s %10.1f ns/eval %7.2fx vs reparse\n", "expr_execute (jit)", jit_ns,
+               reparse_ns / jit_ns);
+    } else {
+        printf("%-22s %10s\n", "expr_execute (jit)", "unavailable");
+    }
+
+    free(rows);
+    expr_free(expr);
+}
+
+// Time powers with constant exponents through pow, with the correctly rounded
+// rewrites of the default passes, and with every exponent unrolled, on the
+// tree walker, the VM and the JIT. Also reports how far the unrolled results
+// drift from pow.
+static void bench_powers(void) {
+    const char *formula = "x^2 + y^3 - x^(-1) + y^0.5 * x^4 - (x + y)^(-3)";
+    const char *names[] = {"x", "y"};
+    const struct {
+        const char *name;
+        int flags;
+    } modes[] = {
+        {"pow", OPT_ALL & ~OPT_POWERS},
+        {"default", OPT_ALL},
+        {"fast", OPT_ALL | OPT_FAST_POWERS},
+    };
+
+    double *rows = malloc(PREPARED_ROWS * 2 * sizeof(double));
+    for (int i = 0; i < PREPARED_ROWS; i++) {
+        rows[2 * i] = 0.5 + i * 0.0001;
+        rows[2 * i + 1] = 1.0 + (i % 97) * 0.25;
+    }
+
+    printf("\n=== constant powers: %s ===\n", formula);
+    printf("%-10s %12s %12s %12s %10s\n", "exponents", "ast_eval", "bytecode", "jit",
+           "max ulp");
+
+    volatile double sink = 0.0;
+    double *reference = malloc(PREPARED_ROWS * sizeof(double));
+
+    for (int m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++) {
+        PreparedExpr_t *expr = expr_prepare_opt(formula, names, 2, modes[m].flags);
+        if (!expr) {
+            printf("%-10s prepare failed\n", modes[m].name);
+            continue;
+        }
+
+        double start = now_ns();
+        for (int i = 0; i < PREPARED_ROWS; i++)
+            sink = ast_eval_vars(expr->ast, rows + 2 * i);
+        double tree_ns = (now_ns() - start) / PREPARED_ROWS;
+
+        start = now_ns();
+        for (int i = 0; i < PREPARED_ROWS; i++)
+            sink = bytecode_eval(expr->bc, rows + 2 * i);
+        double vm_ns = (now_ns() - start) / PREPARED_ROWS;
+
+        double jit_ns = 0.0;
+        if (expr_enable_jit(expr)) {
+            start = now_ns();
+            for (int i = 0; i < PREPARED_ROWS; i++)
+                sink = expr->jit->fn(rows + 2 * i);
+            jit_ns = (now_ns() - start) / PREPARED_ROWS;
+        }
+
+        // Distance of every row from the pow results of the first mode
+        double max_ulps = 0.0;
+        for (int i = 0; i < PREPARED_ROWS; i++) {
+            double value = ast_eval_vars(expr->ast, rows + 2 * i);
+            if (m == 0) {
+                reference[i] = value;
+                continue;
+            }
+            double ulp = nextafter(fabs(reference[i]), INFINITY) - fabs(reference[i]);
+            if (fabs(value - reference[i]) / ulp > max_ulps)
+                max_ulps = fabs(value - reference[i]) / ulp;
+        }
+
+        printf("%-10s %9.1f ns %9.1f ns", modes[m].name, tree_ns, vm_ns);
+        if (jit_ns > 0.0)
+            printf(" %9.1f ns", jit_ns);
+        else
+            printf(" %12s", "unavailable");
+        printf(" %10.1f\n", max_ulps);
+
+        char metric[64];
+        snprintf(metric, sizeof(metric), "powers.%s.ast_ns", modes[m].name);
+        record_metric(metric, tree_ns, 0);
+        snprintf(metric, sizeof(metric), "powers.%s.bytecode_ns", modes[m].name);
+        record_metric(metric, vm_ns, 0);
+        if (jit_ns > 0.0) {
+            snprintf(metric, sizeof(metric), "powers.%s.jit_ns", modes[m].name);
+            record_metric(metric, jit_ns, 0);
+        }
+
+        expr_free(expr);
+    }
+    (void)sink;
+
+    free(reference);
+    free(rows);
+}
+
+// Time formatting the results of generated expressions next to the cost of
+// evaluating them
+static void bench_format(void) {
+    double *results = malloc(FORMAT_RESULTS * sizeof(double));
+    if (!results) {
+        printf("format setup failed\n");
+        return;
+    }
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 17);
+    gen.var_count = 2;
+
+    const char *names[] = {"x", "y"};
+    double vars[2] = {1.5, -2.25};
+    char line[1024];
+    double eval_ns = 0.0;
+    int count = 0;
+
+    while (count < FORMAT_RESULTS) {
+        if (exprgen_expression(&gen, line, sizeof(line)) < 0)
+            continue;
+
+        PreparedExpr_t *expr = expr_prepare(line, names, 2);
+        if (!expr)
+            continue;
+
+        double start = now_ns();
+        for (int i = 0; i < FORMAT_REPEAT; i++)
+            results[count] = expr_execute(expr, vars);
+        eval_ns += now_ns() - start;
+
+        count++;
+        expr_free(expr);
+    }
+    eval_ns /= (double)count * FORMAT_REPEAT;
+
+    char text[64];
+    volatile int sink = 0;
+    double times[3];
+
+    for (int mode = 0; mode < 3; mode++) {
+        double start = now_ns();
+        for (int r = 0; r < FORMAT_REPEAT; r++) {
+            for (int i = 0; i < count; i++) {
+                if (mode == 0)
+                    sink += snprintf(text, sizeof(text), "%.6g", results[i]);
+                else
+                    sink += numfmt_format(results[i],
+                                          mode == 1 ? NUMFMT_G6 : NUMFMT_SHORTEST, text);
+            }
+        }
+        times[mode] = (now_ns() - start) / ((double)count * FORMAT_REPEAT);
+    }
+    (void)sink;
+
+    record_metric("format.snprintf_ns", times[0], 0);
+    record_metric("format.g6_ns", times[1], 0);
+    record_metric("format.shortest_ns", times[2], 0);
+
+    printf("\n=== result formatting: %d generated results ===\n", count);
+    printf("%-22s %10.1f ns/result\n", "evaluate (bytecode)", eval_ns);
+    printf("%-22s %10.1f ns/result\n", "snprintf %.6g", times[0]);
+    printf("%-22s %10.1f ns/result %7.2fx vs snprintf\n", "numfmt %.6g", times[1],
+           times[0] / times[1]);
+    printf("%-22s %10.1f ns/result %7.2fx vs snprintf\n", "numfmt shortest", times[2],
+           times[0] / times[2]);
+
+    free(results);
+}
+
+extern char **environ;
+
+// Time one request through a reused library context against spawning
+// bin/calc for it, the way callers without the library had to
+static void bench_library(void) {
+    CalcContext_t *ctx = calc_init(0);
+    char(*pool)[256] = malloc(1000 * sizeof(*pool));
+    if (!ctx || !pool) {
+        printf("library setup failed\n");
+        calc_free(ctx);
+        free(pool);
+        return;
+    }
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 23);
+    for (int i = 0; i < 1000; i++) {
+        while (exprgen_expression(&gen, pool[i], sizeof(pool[i])) < 0)
+            ;
+    }
+
+    volatile double sink = 0.0;
+    double result;
+    double start = now_ns();
+    for (int i = 0; i < LIBRARY_CALLS; i++) {
+        const char *input = pool[i % 1000];
+        calc_eval(ctx, input, strlen(input), &result, NULL);
+        sink = result;
+    }
+    double library_ns = (now_ns() - start) / LIBRARY_CALLS;
+    (void)sink;
+
+    // Spawning needs the calculator binary next to the benchmark
+    double spawn_ns = 0.0;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+    if (access("bin/calc", X_OK) == 0) {
+        start = now_ns();
+        for (int i = 0; i < SPAWN_CALLS; i++) {
+            char *argv[] = {"bin/calc", pool[i % 1000], NULL};
+            pid_t pid;
+            int status;
+            if (posix_spawn(&pid, "bin/calc", &actions, NULL, argv, environ) != 0)
+                break;
+            waitpid(pid, &status, 0);
+        }
+        spawn_ns = (now_ns() - start) / SPAWN_CALLS;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    printf("\n=== library context vs process per request ===\n");
+    printf("%-22s %10.1f ns/request\n", "calc_eval", library_ns);
+    record_metric("library.calc_eval_ns", library_ns, 0);
+    if (spawn_ns > 0.0) {
+        printf("%-22s %10.1f ns/request %7.0fx slower\n", "spawn bin/calc", spawn_ns,
+               spawn_ns / library_ns);
+    } else {
+        printf("%-22s %10s\n", "spawn bin/calc", "unavailable");
+    }
+
+    calc_free(ctx);
+    free(pool);
+}
+
+// Time batch mode over generated newline separated expressions
+static void bench_batch(void) {
+    FILE *input = tmpfile();
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (!input || null_fd < 0) {
+        printf("batch setup failed\n");
+        return;
+    }
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 7);
+    char line[1024];
+    for (int i = 0; i < BATCH_LINES; i++) {
+        if (exprgen_expression(&gen, line, sizeof(line)) >= 0)
+            fprintf(input, "%s\n", line);
+    }
+    fflush(input);
+    lseek(fileno(input), 0, SEEK_SET);
+
+    BatchOptions_t options = {0, NUMFMT_G6, OPT_ALL};
+    BatchStats_t stats;
+    double start = now_ns();
+    int status = batch_run(fileno(input), null_fd, &options, &stats);
+    double elapsed = now_ns() - start;
+
+    printf("\n=== batch mode: %zu generated lines ===\n", stats.lines);
+    if (status != 0) {
+        printf("batch run failed\n");
+    } else {
+        printf("%-22s %10.0f lines/sec\n", "throughput", stats.lines / (elapsed / 1e9));
+        printf("%-22s %10.1f MB/s\n", "input", stats.bytes / (elapsed / 1e3));
+        printf("%-22s %10.1f ns/line\n", "latency", elapsed / stats.lines);
+        record_metric("batch.lines_per_sec", stats.lines / (elapsed / 1e9), 1);
+    }
+
+    close(null_fd);
+    fclose(input);
+}
+
+// Time batch mode over repeated expressions with and without the cache
+static void bench_cache(void) {
+    FILE *input = tmpfile();
+    int null_fd = open("/dev/null", O_WRONLY);
+    char(*pool)[1024] = malloc(CACHE_DISTINCT * sizeof(*pool));
+    if (!input || null_fd < 0 || !pool) {
+        printf("cache setup failed\n");
+        free(pool);
+        return;
+    }
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 13);
+    for (int i = 0; i < CACHE_DISTINCT; i++) {
+        if (exprgen_expression(&gen, pool[i], sizeof(pool[i])) < 0)
+            strcpy(pool[i], "1");
+    }
+    for (int i = 0; i < BATCH_LINES; i++) {
+        fprintf(input, "%s\n", pool[exprgen_next(&gen) % CACHE_DISTINCT]);
+    }
+    fflush(input);
+
+    printf("\n=== batch mode: %d lines over %d distinct expressions ===\n", BATCH_LINES,
+           CACHE_DISTINCT);
+
+    size_t sizes[] = {0, CACHE_DEFAULT_BYTES};
+    double rates[2] = {0.0, 0.0};
+    for (int i = 0; i < 2; i++) {
+        lseek(fileno(input), 0, SEEK_SET);
+
+        BatchOptions_t options = {sizes[i], NUMFMT_G6, OPT_ALL};
+        BatchStats_t stats;
+        double start = now_ns();
+        int status = batch_run(fileno(input), null_fd, &options, &stats);
+        double elapsed = now_ns() - start;
+
+        if (status != 0) {
+            printf("cache run failed\n");
+            break;
+        }
+
+        rates[i] = stats.lines / (elapsed / 1e9);
+        printf("%-22s %10.0f lines/sec\n", i ? "with cache" : "without cache", rates[i]);
+        const char *metric = i ? "cache.on.lines_per_sec" : "cache.off.lines_per_sec";
+        record_metric(metric, rates[i], 1);
+    }
+
+    if (rates[0] > 0.0)
+        printf("%-22s %10.2fx\n", "speedup", rates[1] / rates[0]);
+
+    close(null_fd);
+    fclose(input);
+    free(pool);
+}
+
+// Time file mode from one thread up to the number of online CPUs
+static void bench_file(void) {
+    char path[] = "/tmp/calc-bench-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *input = fd >= 0 ? fdopen(fd, "w") : NULL;
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (!input || null_fd < 0) {
+        printf("file setup failed\n");
+        return;
+    }
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 11);
+    char line[1024];
+    for (int i = 0; i < FILE_LINES; i++) {
+        if (exprgen_expression(&gen, line, sizeof(line)) >= 0)
+            fprintf(input, "%s\n", line);
+    }
+    fclose(input);
+
+    int max_threads = fileeval_default_threads();
+    double base = 0.0;
+
+    printf("\n=== file mode: %d generated lines ===\n", FILE_LINES);
+    printf("%-10s %14s %10s %10s\n", "threads", "lines/sec", "MB/s", "speedup");
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        BatchOptions_t options = {0, NUMFMT_G6, OPT_ALL};
+        BatchStats_t stats;
+        double start = now_ns();
+        int status = fileeval_run(path, threads, &options, null_fd, &stats);
+        double elapsed = now_ns() - start;
+
+        if (status != 0) {
+            printf("file run failed\n");
+            break;
+        }
+
+        double rate = stats.lines / (elapsed / 1e9);
+        if (threads == 1)
+            base = rate;
+
+        printf("%-10d %14.0f %10.1f %9.2fx\n", threads, rate,
+               stats.bytes / (elapsed / 1e3), rate / base);
+
+        char metric[64];
+        snprintf(metric, sizeof(metric), "file.threads_%d.lines_per_sec", threads);
+        record_metric(metric, rate, 1);
+    }
+
+    close(null_fd);
+    unlink(path);
+}
+
+// Stream single expressions far larger than the lexer's window from a file,
+// their memory use stays at the window and a few stack entries
+static void bench_stream(void) {
+    const struct {
+        const char *name;
+        const char *first;
+        const char *term; // repeated after first until STREAM_BYTES
+    } inputs[] = {
+        {"flat", "1", " + 3 * 2 - 5"},
+        {"grouped", "0.5", " + (1.25 - 0.75 / 4) * 2"},
+        {"spaced", "1", "    -    2.5 *  (  4   /  8  )   "},
+    };
+
+    printf("\n=== streamed expression: %d MB, %d KB window ===\n", STREAM_BYTES >> 20,
+           LEXER_STREAM_BUFFER >> 10);
+    printf("%-10s %12s %10s %12s %8s\n", "input", "tokens", "MB/s", "ns/token", "depth");
+
+    for (int i = 0; i < (int)(sizeof(inputs) / sizeof(inputs[0])); i++) {
+        char path[] = "/tmp/calc-bench-XXXXXX";
+        int fd = mkstemp(path);
+        FILE *output = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!output) {
+            printf("stream setup failed\n");
+            return;
+        }
+
+        fputs(inputs[i].first, output);
+        size_t term_len = strlen(inputs[i].term);
+        for (size_t bytes = strlen(inputs[i].first); bytes + term_len <= STREAM_BYTES;
+             bytes += term_len)
+            fputs(inputs[i].term, output);
+        fclose(output);
+
+        fd = open(path, O_RDONLY);
+        Lexer_t *lexer = fd >= 0 ? lexer_init_fd(fd, LEXER_STREAM_BUFFER) : NULL;
+        if (!lexer) {
+            printf("stream setup failed\n");
+            unlink(path);
+            return;
+        }
+        lexer->silent = 1;
+
+        StreamResult_t result;
+        double start = now_ns();
+        streameval_run(lexer, &result);
+        double elapsed = now_ns() - start;
+        size_t bytes = lexer->base + lexer->length;
+
+        printf("%-10s %12zu %10.1f %12.2f %8d\n", inputs[i].name, result.tokens,
+               bytes / (elapsed / 1e3), elapsed / result.tokens, result.max_depth);
+
+        char metric[64];
+        snprintf(metric, sizeof(metric), "stream.%s.ns_per_token", inputs[i].name);
+        record_metric(metric, elapsed / result.tokens, 0);
+
+        lexer_free(lexer);
+        close(fd);
+        unlink(path);
+    }
+}
+
+// Text of a balanced tree of the given levels, appended at pos. Returns the
+// position after it.
+static size_t balanced_text(char *text, size_t pos, int levels, unsigned *seed) {
+    static const char ops[] = "+-*";
+    if (levels == 0) {
+        *seed = *seed * 1103515245 + 12345;
+        return pos + sprintf(text + pos, (*seed >> 16) % 2 ? "x" : "0.75");
+    }
+
+    text[pos++] = '(';
+    pos = balanced_text(text, pos, levels - 1, seed);
+    text[pos++] = ops[levels % 3];
+    pos = balanced_text(text, pos, levels - 1, seed);
+    text[pos++] = ')';
+    return pos;
+}
+
+// Build the text of one tree shape with about 2^(PARALLEL_LEVELS+1) nodes:
+// wide is one balanced tree, deep a spine of 1024 operators each with a
+// balanced side tree, degenerate a left-deep chain without any parallelism
+static char *parallel_text(const char *shape) {
+    size_t leaves = (size_t)1 << PARALLEL_LEVELS;
+    char *text = malloc(leaves * 16);
+    unsigned seed = 5;
+    size_t pos = 0;
+    if (!text)
+        return NULL;
+
+    if (strcmp(shape, "wide") == 0) {
+        pos = balanced_text(text, 0, PARALLEL_LEVELS, &seed);
+    } else if (strcmp(shape, "deep") == 0) {
+        // x + (side * (side - (side + ...))), the spine leans right
+        int spine = 1024;
+        int side_levels = PARALLEL_LEVELS - 10;
+        for (int i = 0; i < spine; i++) {
+            pos = balanced_text(text, pos, side_levels, &seed);
+            pos += sprintf(text + pos, "%c(", "+*-"[i % 3]);
+        }
+        text[pos++] = 'x';
+        memset(text + pos, ')', spine);
+        pos += spine;
+    } else {
+        for (size_t i = 0; i < leaves; i++)
+            pos += sprintf(text + pos, i % 2 ? "x-" : "0.75+");
+        text[pos++] = 'x';
+    }
+
+    text[pos] = '\0';
+    return text;
+}
+
+// Evaluate very large single trees split into tasks on 1 to all online
+// CPUs. The plan is built once per tree, as after parser_parse, and every
+// result is checked against the one-thread run since no reassociation is
+// allowed.
+static void bench_parallel(void) {
+    const char *shapes[] = {"wide", "deep", "degenerate"};
+    int max_threads = fileeval_default_threads();
+    if (max_threads < 2)
+        max_threads = 2;
+
+    printf("\n=== parallel evaluation: grain %d nodes, %d online CPUs ===\n",
+           PAREVAL_DEFAULT_GRAIN, fileeval_default_threads());
+    printf("%-12s %10s %8s %8s %12s %10s %9s\n", "shape", "nodes", "tasks", "threads",
+           "ms", "ns/node", "speedup");
+
+    for (int i = 0; i < (int)(sizeof(shapes) / sizeof(shapes[0])); i++) {
+        char *text = parallel_text(shapes[i]);
+        Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+        Lexer_t *lexer = text ? lexer_init(text) : NULL;
+        Parser_t *parser = lexer && arena ? parser_init(lexer, arena) : NULL;
+        ASTNode_t *ast = parser ? parser_parse(parser) : NULL;
+        ParPlan_t *plan = ast ? pareval_plan(ast, PAREVAL_DEFAULT_GRAIN) : NULL;
+
+        if (!plan) {
+            printf("parallel setup failed for %s\n", shapes[i]);
+        } else {
+            double vars[1] = {1.25};
+            double base = 0.0;
+            double base_value = 0.0;
+
+            for (int threads = 1; threads <= max_threads; threads *= 2) {
+                double best = 0.0;
+                double value = 0.0;
+                for (int r = 0; r < PARALLEL_REPEAT; r++) {
+                    const char *error = NULL;
+                    double start = now_ns();
+                    value = pareval_run(plan, vars, threads, &error);
+                    double elapsed = now_ns() - start;
+                    if (best == 0.0 || elapsed < best)
+                        best = elapsed;
+                }
+
+                if (threads == 1) {
+                    base = best;
+                    base_value = value;
+                }
+
+                int same = memcmp(&value, &base_value, sizeof(double)) == 0;
+                printf("%-12s %10ld %8d %8d %12.2f %10.2f %8.2fx%s\n", shapes[i],
+                       plan->nodes, plan->task_count, threads, best / 1e6,
+                       best / plan->nodes, base / best, same ? "" : "  MISMATCH");
+
+                char metric[64];
+                snprintf(metric, sizeof(metric), "parallel.%s.threads_%d.ns_per_node",
+                         shapes[i], threads);
+                record_metric(metric, best / plan->nodes, 0);
+            }
+
+            // The sequential evaluator on one thread
+            double best = 0.0;
+            double value = 0.0;
+            for (int r = 0; r < PARALLEL_REPEAT; r++) {
+                const char *error = NULL;
+                double start = now_ns();
+                value = ast_eval_checked(ast, vars, &error);
+                double elapsed = now_ns() - start;
+                if (best == 0.0 || elapsed < best)
+                    best = elapsed;
+            }
+
+            int same = memcmp(&value, &base_value, sizeof(double)) == 0;
+            printf("%-12s %10ld %8s %8s %12.2f %10.2f %8.2fx%s\n", shapes[i], plan->nodes,
+                   "-", "ast_eval", best / 1e6, best / plan->nodes, base / best,
+                   same ? "" : "  MISMATCH");
+        }
+
+        pareval_free(plan);
+        parser_free(parser);
+        lexer_free(lexer);
+        arena_free(arena);
+        free(text);
+    }
+}
+
+// Time the start of a process that needs a library of formulas: preparing
+// every formula from text, against mapping a calcbin file compiled from the
+// same text. Also times evaluating every formula once both ways.
+static void bench_calcbin(void) {
+    char text_path[] = "/tmp/calc-bench-XXXXXX";
+    char bin_path[] = "/tmp/calc-bench-XXXXXX";
+    int text_fd = mkstemp(text_path);
+    int bin_fd = mkstemp(bin_path);
+    FILE *text = text_fd >= 0 ? fdopen(text_fd, "w") : NULL;
+    if (bin_fd >= 0)
+        close(bin_fd);
+
+    char *lines = malloc((size_t)CALCBIN_FORMULAS * 256);
+    size_t *starts = malloc(CALCBIN_FORMULAS * sizeof(size_t));
+    PreparedExpr_t **exprs = calloc(CALCBIN_FORMULAS, sizeof(PreparedExpr_t *));
+    if (!text || bin_fd < 0 || !lines || !starts || !exprs) {
+        printf("calcbin setup failed\n");
+        goto done;
+    }
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 17);
+    gen.var_count = EXPRGEN_MAX_VARS;
+    size_t pos = 0;
+    for (int i = 0; i < CALCBIN_FORMULAS; i++) {
+        starts[i] = pos;
+        int len = exprgen_expression(&gen, lines + pos, 200);
+        if (len < 0)
+            len = sprintf(lines + pos, "x");
+        fprintf(text, "f%d = %s\n", i, lines + pos);
+        pos += len + 1;
+    }
+    fclose(text);
+    text = NULL;
+
+    printf("\n=== calcbin: %d formulas, %.1f KB of text ===\n", CALCBIN_FORMULAS,
+           pos / 1024.0);
+
+    // What a process does at every start without a calcbin file
+    double start = now_ns();
+    for (int i = 0; i < CALCBIN_FORMULAS; i++)
+        exprs[i] = expr_prepare(lines + starts[i], NULL, 0);
+    double prepare_ms = (now_ns() - start) / 1e6;
+
+    start = now_ns();
+    int count = 0;
+    int status = calcbin_compile(text_path, bin_path, OPT_ALL, &count);
+    double compile_ms = (now_ns() - start) / 1e6;
+
+    CalcBin_t bin;
+    double open_ms = 0.0;
+    for (int r = 0; status == 0 && r < CALCBIN_REPEAT; r++) {
+        start = now_ns();
+        status = calcbin_open(&bin, bin_path);
+        double elapsed = (now_ns() - start) / 1e6;
+        if (status == 0 && r < CALCBIN_REPEAT - 1)
+            calcbin_close(&bin);
+        if (r == 0 || elapsed < open_ms)
+            open_ms = elapsed;
+    }
+    if (status != 0) {
+        printf("calcbin compile failed\n");
+        goto done;
+    }
+
+    // Evaluate every formula once, looked up by name like a caller would
+    double vars[EXPRGEN_MAX_VARS] = {1.5, -0.25, 3.0, 0.75};
+    double *scratch = malloc(calcbin_scratch_size(&bin) * sizeof(double));
+    volatile double sink = 0.0;
+    char name[16];
+
+    start = now_ns();
+    for (int i = 0; i < CALCBIN_FORMULAS; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        sink = calcbin_eval(&bin, calcbin_find(&bin, name), vars, scratch);
+    }
+    double calcbin_ns = (now_ns() - start) / CALCBIN_FORMULAS;
+
+    start = now_ns();
+    for (int i = 0; i < CALCBIN_FORMULAS; i++)
+        sink = exprs[i] ? bytecode_eval(exprs[i]->bc, vars) : 0.0;
+    double prepared_ns = (now_ns() - start) / CALCBIN_FORMULAS;
+    (void)sink;
+
+    printf("%-24s %10.2f ms\n", "expr_prepare all", prepare_ms);
+    printf("%-24s %10.2f ms (once, %zu KB file)\n", "calcbin_compile", compile_ms,
+           bin.size / 1024);
+    printf("%-24s %10.2f ms %7.1fx faster start\n", "calcbin_open (cached)", open_ms,
+           prepare_ms / open_ms);
+    printf("%-24s %10.1f ns/formula, name lookup included\n", "calcbin_eval", calcbin_ns);
+    printf("%-24s %10.1f ns/formula\n", "bytecode_eval", prepared_ns);
+
+    record_metric("calcbin.prepare_ms", prepare_ms, 0);
+    record_metric("calcbin.open_ms", open_ms, 0);
+    record_metric("calcbin.eval_ns", calcbin_ns, 0);
+
+    free(scratch);
+    calcbin_close(&bin);
+
+done:
+    if (text)
+        fclose(text);
+    for (int i = 0; exprs && i < CALCBIN_FORMULAS; i++)
+        expr_free(exprs[i]);
+    free(exprs);
+    free(starts);
+    free(lines);
+    unlink(text_path);
+    unlink(bin_path);
+}
+
+// Text of a chain of REASSOC_TERMS terms over x0 to x3, joined by the
+// operators of ops in turn
+static char *reassoc_text(const char *ops) {
+    char *text = malloc(REASSOC_TERMS * 4 + 1);
+    size_t pos = 0;
+    if (!text)
+        return NULL;
+
+    for (int i = 0; i < REASSOC_TERMS; i++) {
+        if (i)
+            text[pos++] = ops[i % strlen(ops)];
+        pos += sprintf(text + pos, "x%d", i % 4);
+    }
+
+    text[pos] = '\0';
+    return text;
+}
+
+// Time long left-deep chains in parse order and rebalanced by
+// OPT_REASSOCIATE, on the tree walker, the VM and the JIT. Also reports how
+// far the rebalanced results are from the ones in parse order.
+static void bench_reassoc(void) {
+    const struct {
+        const char *name;
+        const char *ops;
+        double scale; // x0 to x3 are near this, products stay finite
+    } chains[] = {
+        {"sum", "+-++", 1.0},
+        {"product", "*", 1.0 + 1.0 / REASSOC_TERMS},
+    };
+    const struct {
+        const char *name;
+        int flags;
+    } modes[] = {
+        {"strict", OPT_ALL},
+        {"reassoc", OPT_ALL | OPT_REASSOCIATE},
+    };
+    const char *names[] = {"x0", "x1", "x2", "x3"};
+
+    double *rows = malloc(REASSOC_ROWS * 4 * sizeof(double));
+    double *reference = malloc(REASSOC_ROWS * sizeof(double));
+
+    printf("\n=== reassociation: chains of %d terms ===\n", REASSOC_TERMS);
+    printf("%-10s %-8s %12s %12s %12s %10s %10s\n", "chain", "order", "ast_eval",
+           "bytecode", "jit", "max ulp", "max rel");
+
+    volatile double sink = 0.0;
+
+    for (int c = 0; c < (int)(sizeof(chains) / sizeof(chains[0])); c++) {
+        char *text = reassoc_text(chains[c].ops);
+        unsigned seed = 11;
+        for (int i = 0; i < REASSOC_ROWS * 4; i++) {
+            seed = seed * 1103515245 + 12345;
+            rows[i] = chains[c].scale * (1.0 + ((seed >> 16) % 1000) / 1e6);
+        }
+
+        for (int m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++) {
+            PreparedExpr_t *expr =
+                text ? expr_prepare_opt(text, names, 4, modes[m].flags) : NULL;
+            if (!expr) {
+                printf("%-10s %-8s prepare failed\n", chains[c].name, modes[m].name);
+                continue;
+            }
+
+            double start = now_ns();
+            for (int i = 0; i < REASSOC_ROWS; i++)
+                sink = ast_eval_vars(expr->ast, rows + 4 * i);
+            double tree_ns = (now_ns() - start) / REASSOC_ROWS / REASSOC_TERMS;
+
+            start = now_ns();
+            for (int i = 0; i < REASSOC_ROWS; i++)
+                sink = bytecode_eval(expr->bc, rows + 4 * i);
+            double vm_ns = (now_ns() - start) / REASSOC_ROWS / REASSOC_TERMS;
+
+            double jit_ns = 0.0;
+            if (expr_enable_jit(expr)) {
+                start = now_ns();
+                for (int i = 0; i < REASSOC_ROWS; i++)
+                    sink = expr->jit->fn(rows + 4 * i);
+                jit_ns = (now_ns() - start) / REASSOC_ROWS / REASSOC_TERMS;
+            }
+
+            // Distance of every row from the result in parse order
+            double max_ulps = 0.0;
+            double max_rel = 0.0;
+            for (int i = 0; i < REASSOC_ROWS; i++) {
+                double value = ast_eval_vars(expr->ast, rows + 4 * i);
+                if (m == 0) {
+                    reference[i] = value;
+                    continue;
+                }
+                double diff = fabs(value - reference[i]);
+                double ulp = nextafter(fabs(reference[i]), INFINITY) - fabs(reference[i]);
+                if (diff / ulp > max_ulps)
+                    max_ulps = diff / ulp;
+                if (diff / fabs(reference[i]) > max_rel)
+                    max_rel = diff / fabs(reference[i]);
+            }
+
+            printf("%-10s %-8s %9.2f ns %9.2f ns", chains[c].name, modes[m].name, tree_ns,
+                   vm_ns);
+            if (jit_ns > 0.0)
+                printf(" %9.2f ns", jit_ns);
+            else
+                printf(" %12s", "unavailable");
+            printf(" %10.1f %10.2g\n", max_ulps, max_rel);
+
+            char metric[64];
+            snprintf(metric, sizeof(metric), "reassoc.%s.%s.ast_ns_per_term",
+                     chains[c].name, modes[m].name);
+            record_metric(metric, tree_ns, 0);
+            snprintf(metric, sizeof(metric), "reassoc.%s.%s.bytecode_ns_per_term",
+                     chains[c].name, modes[m].name);
+            record_metric(metric, vm_ns, 0);
+            if (jit_ns > 0.0) {
+                snprintf(metric, sizeof(metric), "reassoc.%s.%s.jit_ns_per_term",
+                         chains[c].name, modes[m].name);
+                record_metric(metric, jit_ns, 0);
+            }
+
+            expr_free(expr);
+        }
+
+        free(text);
+    }
+
+    (void)sink;
+    free(rows);
+    free(reference);
+}
+
+// Print how to run the benchmarks
+// Rows/sec of one expression over columns: a call per row on the AST, the
+// VM and native code, against columneval_run at each vector width. Every
+// mode is timed COLUMN_REPEAT times and the fastest pass kept.
+static void bench_columns(void) {
+    const char *labels[] = {"arith", "neg_div", "pow"};
+    const char *formulas[] = {"x*y + x/y - z*0.5", "-(x - y)*(x + y)/z + x*x",
+                              "x^y*0.5 + y^3 - z^0.5"};
+    const char *names[] = {"x", "y", "z"};
+    const char *modes[] = {"ast", "bytecode", "jit", "columns_w1", "columns_w2",
+                           "columns_w4"};
+
+    double *data = malloc(3 * COLUMN_ROWS * sizeof(double));
+    double *out = malloc(COLUMN_ROWS * sizeof(double));
+    if (!data || !out) {
+        printf("columns setup failed\n");
+        free(data);
+        free(out);
+        return;
+    }
+
+    const double *columns[3] = {data, data + COLUMN_ROWS, data + 2 * COLUMN_ROWS};
+    for (int i = 0; i < COLUMN_ROWS; i++) {
+        data[i] = 0.5 + (i % 1000) * 0.001;
+        data[COLUMN_ROWS + i] = 1.0 + (i % 97) * 0.01;
+        data[2 * COLUMN_ROWS + i] = 2.0 + (i % 13);
+    }
+
+    printf("\n=== columns: %d rows, SIMD width %d ===\n", COLUMN_ROWS,
+           columneval_simd_width());
+
+    for (int f = 0; f < 3; f++) {
+        PreparedExpr_t *expr = expr_prepare(formulas[f], names, 3);
+        if (!expr) {
+            printf("prepare failed: %s\n", formulas[f]);
+            continue;
+        }
+        int jit = expr_enable_jit(expr);
+
+        printf("%s\n", formulas[f]);
+        double scalar_ns = 0.0;
+        for (int m = 0; m < 6; m++) {
+            int width = m < 3 ? 0 : 1 << (m - 3);
+            if ((m == 2 && !jit) || width > columneval_simd_width())
+                continue;
+
+            double best = 0.0;
+            for (int r = 0; r < COLUMN_REPEAT; r++) {
+                double start = now_ns();
+                if (width) {
+                    columneval_run(expr->bc, columns, COLUMN_ROWS, out, width);
+                } else {
+                    double vars[3];
+                    for (int i = 0; i < COLUMN_ROWS; i++) {
+                        vars[0] = columns[0][i];
+                        vars[1] = columns[1][i];
+                        vars[2] = columns[2][i];
+                        out[i] = m == 0   ? ast_eval_vars(expr->ast, vars)
+                                 : m == 1 ? bytecode_eval(expr->bc, vars)
+                                          : expr->jit->fn(vars);
+                    }
+                }
+                double elapsed = now_ns() - start;
+                if (r == 0 || elapsed < best)
+                    best = elapsed;
+            }
+
+            double ns = best / COLUMN_ROWS;
+            if (m == 1)
+                scalar_ns = ns;
+            char metric[64];
+            snprintf(metric, sizeof(metric), "columns.%s.%s_mrows_per_sec", labels[f],
+                     modes[m]);
+            record_metric(metric, 1e3 / ns, 1);
+
+            printf("  %-14s %8.2f ns/row %8.1f Mrows/s", modes[m], ns, 1e3 / ns);
+            if (width && scalar_ns > 0.0)
+                printf(" %6.2fx vs bytecode", scalar_ns / ns);
+            printf("\n");
+        }
+
+        expr_free(expr);
+    }
+
+    free(data);
+    free(out);
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [--phases] [--save FILE] [--compare FILE]\n", program);
+    printf("  --phases        Run only the lex/parse/eval phase benchmark\n");
+    printf("  --save FILE     Store this run's metrics as a baseline\n");
+    printf("  --compare FILE  Compare this run's metrics against a stored baseline\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *save_path = NULL;
+    const char *compare_path = NULL;
+    int phases_only = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--phases") == 0) {
+            phases_only = 1;
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compare_path = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char *chain = make_chain(200);
+    char *nested = make_nested(50);
+
+    const char *names[] = {"number", "simple", "precedence", "complex", "power", "chain",
+                           "nested"};
+    const char *inputs[] = {
+        "42", "3 + 4", "10 - 3 * 2", "3 + 4 * 2^2 - (5 + 1)", "2 ^ 3 ^ 2", chain, nested,
+    };
+    int count = sizeof(inputs) / sizeof(inputs[0]);
+
+    Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+
+    if (phases_only) {
+        bench_phases(arena);
+        goto done;
+    }
+
+    printf("=== ast_eval vs bytecode_eval (%d iterations) ===\n", BENCH_ITERATIONS);
+    printf("%-12s %13s %13s %13s %8s\n", "expression", "size", "ast_eval", "bytecode",
+           "speedup");
+
+    for (int i = 0; i < count; i++) {
+        bench_expression(names[i], inputs[i], arena);
+    }
+
+    bench_phases(arena);
+    bench_scan();
+    bench_stream();
+    bench_prepared(arena);
+    bench_powers();
+    bench_format();
+    bench_library();
+    bench_batch();
+    bench_cache();
+    bench_file();
+    bench_parallel();
+    bench_reassoc();
+    bench_calcbin();
+    bench_columns();
+
+done:;
+    int status = 0;
+    if (compare_path && compare_metrics(compare_path) != 0)
+        status = 1;
+    if (save_path && save_metrics(save_path) != 0)
+        status = 1;
+
+    arena_free(arena);
+    free(chain);
+    free(nested);
+    return status;
+}
@@ -0,0 +1,41 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Default size of a single arena chunk in bytes
+#define ARENA_DEFAULT_CHUNK_SIZE 4096
+
+// Every allocation handed out by the arena is aligned to this boundary
+#define ARENA_ALIGNMENT 16
+
+// A contiguous block of memory owned by an arena
+typedef struct ArenaChunk ArenaChunk_t;
+
+struct ArenaChunk {
+    ArenaChunk_t *next; // next chunk in the arena's list
+    size_t capacity;    // usable bytes in data
+    size_t used;        // bytes already handed out from data
+    unsigned char data[];
+};
+
+// Bump allocator that owns every allocation made through it. Individual
+// allocations are never freed, the whole arena is reset or freed at once.
+typedef struct {
+    ArenaChunk_t *first;   // first chunk in the list
+    ArenaChunk_t *curr;    // chunk currently being allocated from
+    size_t chunk_size;     // minimum size of a newly created chunk
+    size_t bytes_used;     // bytes handed out since the last reset
+    size_t bytes_reserved; // bytes held in all chunks
+    size_t chunk_count;    // number of chunks held by the arena
+    size_t alloc_count;    // allocations served since the last reset
+} Arena_t;
+
+Arena_t *arena_init(size_t chunk_size);
+void arena_free(Arena_t *arena);
+void *arena_alloc(Arena_t *arena, size_t size);
+void arena_reset(Arena_t *arena);
+size_t arena_bytes_used(const Arena_t *arena);
+size_t arena_bytes_reserved(const Arena_t *arena);
+
+#endif
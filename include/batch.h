@@ -0,0 +1,61 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "arena.h"
+#include "cache.h"
+#include "lexer.h"
+#include "numfmt.h"
+#include "parser.h"
+#include <stddef.h>
+
+// Bytes requested from the input per read() call
+#define BATCH_READ_SIZE (1 << 16)
+
+// Bytes of output collected before they are written out
+#define BATCH_WRITE_SIZE (1 << 16)
+
+// Output collected in memory and written with as few write() calls as possible
+typedef struct {
+    char *data; // buffered bytes
+    size_t len; // bytes buffered
+    size_t cap; // size of data
+    int fd;     // destination, -1 to only collect in memory
+    int failed; // set once a write or an allocation fails
+} OutBuf_t;
+
+// Settings shared by every line of a batch or file run
+typedef struct {
+    size_t cache_bytes;  // memory cap of the expression cache, 0 disables it
+    NumFormat format;    // how results are written
+    int optimizer_flags; // passes ast_optimize runs on every line, 0 for none
+} BatchOptions_t;
+
+// Lexer, parser and node storage reused for every line
+typedef struct {
+    Lexer_t *lexer;
+    Parser_t *parser;
+    Arena_t *arena;
+    ExprCache_t *cache;  // parsed expressions by source text, NULL if disabled
+    NumFormat format;    // how results are written
+    int optimizer_flags; // passes ast_optimize runs on every parsed line
+} BatchContext_t;
+
+// Counters describing one batch run
+typedef struct {
+    size_t lines;  // input lines processed
+    size_t errors; // lines answered with an error
+    size_t bytes;  // input bytes consumed
+} BatchStats_t;
+
+int outbuf_init(OutBuf_t *out, int fd, size_t cap);
+void outbuf_free(OutBuf_t *out);
+void outbuf_append(OutBuf_t *out, const char *data, size_t len);
+void outbuf_flush(OutBuf_t *out);
+
+int batch_context_init(BatchContext_t *ctx, const BatchOptions_t *options);
+void batch_context_free(BatchContext_t *ctx);
+int batch_eval_line(BatchContext_t *ctx, const char *line, size_t len, OutBuf_t *out);
+
+int batch_run(int in_fd, int out_fd, const BatchOptions_t *options, BatchStats_t *stats);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "parser.h"
+#include <stdint.h>
+
+// Instructions understood by the stack VM
+typedef enum {
+    OP_CONST, // push consts[arg]
+    OP_LOAD,  // push vars[arg]
+    OP_ADD,   // pop b, pop a, push a + b
+    OP_SUB,   // pop b, pop a, push a - b
+    OP_MUL,   // pop b, pop a, push a * b
+    OP_DIV,   // pop b, pop a, push a / b (0 when b is 0, like ast_eval)
+    OP_POW,   // pop b, pop a, push pow(a, b)
+    OP_NEG,   // pop a, push -a
+    OP_POWI,  // pop a, push ast_powi(a, arg), arg is signed
+    OP_SQRT,  // pop a, push ast_sqrt(a)
+    OP_STORE, // temps[arg] = top of stack, leaves the stack unchanged
+    OP_TEMP,  // push temps[arg]
+    OP_END,   // stop and return the top of the stack
+} OpCode;
+
+// Every instruction is one 32-bit word, opcode in the low byte and the
+// operand in the upper 24 bits
+#define BC_OP(instr) ((OpCode)((instr) & 0xff))
+#define BC_ARG(instr) ((uint32_t)(instr) >> 8)
+#define BC_SARG(instr) ((int32_t)(instr) >> 8)
+#define BC_MAKE(op, arg) ((uint32_t)(op) | ((uint32_t)(arg) << 8))
+
+// Largest operand an instruction can hold, programs needing more constants,
+// variable slots or temps are not compiled
+#define BC_ARG_MAX 0xffffff
+
+// Flat program compiled from an AST
+typedef struct {
+    uint32_t *code;  // instructions ending with OP_END
+    int code_len;    // number of instructions including OP_END
+    double *consts;  // constant pool referenced by OP_CONST
+    int const_count; // number of constants
+    double *stack;   // scratch operand stack used by bytecode_eval
+    int max_stack;   // deepest the operand stack gets
+    int var_count;   // one more than the highest slot read by OP_LOAD
+    double *temps;   // values of shared subtrees, written by OP_STORE
+    int temp_count;  // number of temps
+} Bytecode_t;
+
+Bytecode_t *bytecode_compile(ASTNode_t *node);
+void bytecode_free(Bytecode_t *bc);
+double bytecode_eval(const Bytecode_t *bc, const double *vars);
+double bytecode_run(const uint32_t *code, const double *consts, double *stack,
+                    double *temps, const double *vars);
+void bytecode_print(const Bytecode_t *bc);
+const char *opcode_to_string(OpCode op);
+
+#endif
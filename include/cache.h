@@ -0,0 +1,60 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "parser.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory cap of a cache created without an explicit size
+#define CACHE_DEFAULT_BYTES (8 << 20)
+
+// Buckets allocated up front, the table doubles once it is fuller than this
+#define CACHE_INITIAL_BUCKETS 256
+
+// One cached expression, the header, its nodes, key and variable names live
+// in a single malloc block
+typedef struct CacheEntry CacheEntry_t;
+
+struct CacheEntry {
+    CacheEntry_t *bucket_next; // next entry in the same hash bucket
+    CacheEntry_t *newer;       // neighbour closer to the most recently used end
+    CacheEntry_t *older;       // neighbour closer to the least recently used end
+    uint64_t hash;             // hash of the normalized key
+    size_t key_len;            // bytes in key
+    size_t size;               // bytes of the whole block
+    const char *key;           // normalized source text, not NUL terminated
+    ASTNode_t *ast;            // root of the cached tree
+};
+
+// Node of a tree cache_insert walks, with the link its copy is stored into
+typedef struct {
+    ASTNode_t *node;
+    ASTNode_t **copy;
+} CacheWalk_t;
+
+// Bounded LRU map from whitespace normalized source text to an optimized AST
+typedef struct {
+    CacheEntry_t **buckets; // hash table of entries
+    size_t bucket_count;    // power of two
+    CacheEntry_t *newest;   // most recently used entry
+    CacheEntry_t *oldest;   // least recently used entry, evicted first
+    size_t entries;         // entries currently cached
+    size_t bytes;           // bytes held by cached entries
+    size_t max_bytes;       // cap on bytes, older entries are evicted past it
+    size_t hits;            // lookups answered from the cache
+    size_t misses;          // lookups that found nothing
+    size_t evictions;       // entries dropped to stay under max_bytes
+    char *scratch;          // buffer the key of a lookup is normalized into
+    size_t scratch_cap;     // size of scratch
+    CacheWalk_t *walk;      // stack of the tree walks of an insert, kept across inserts
+    size_t walk_cap;        // entries walk can hold
+} ExprCache_t;
+
+ExprCache_t *cache_init(size_t max_bytes);
+void cache_free(ExprCache_t *cache);
+ASTNode_t *cache_lookup(ExprCache_t *cache, const char *input, size_t len);
+ASTNode_t *cache_insert(ExprCache_t *cache, const char *input, size_t len,
+                        ASTNode_t *ast);
+void cache_print_stats(const ExprCache_t *cache);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef CALC_H
+#define CALC_H
+
+#include <stddef.h>
+
+// Public interface of libcalc. A context owns its lexer, parser, node storage
+// and cache and is reused across calls. Contexts are independent, so threads
+// may evaluate concurrently as long as each uses its own context. Nothing in
+// this interface exits the process, and parse and evaluation failures come
+// back as a status instead of stderr messages, parse failures also with an
+// input position. Only a failed allocation is still reported on stderr, as
+// everywhere else.
+
+// Functions exported from libcalc.so, every other symbol stays internal
+#define CALC_API __attribute__((visibility("default")))
+
+// Bytes calc_format may write, including the terminating NUL
+#define CALC_FORMAT_BUF_SIZE 32
+
+// Outcome of a library call
+typedef enum {
+    CALC_OK,                   // success
+    CALC_ERR_EMPTY,            // input holds nothing but whitespace
+    CALC_ERR_SYNTAX,           // input is not a valid expression
+    CALC_ERR_UNKNOWN_VARIABLE, // input names a variable never set
+    CALC_ERR_DIVISION_BY_ZERO, // evaluation divided by zero
+    CALC_ERR_EVAL,             // evaluation failed otherwise
+    CALC_ERR_MEMORY,           // an allocation failed
+    CALC_ERR_INVALID,          // a NULL argument or a malformed name
+} CalcStatus;
+
+// Details of a failed call
+typedef struct {
+    CalcStatus status;   // same value the call returned
+    int position;        // input offset of the offending token, -1 if none or
+                         // the error came from evaluation
+    const char *message; // static description, never freed
+} CalcError_t;
+
+// Opaque evaluation context
+typedef struct CalcContext CalcContext_t;
+
+CALC_API CalcContext_t *calc_init(size_t cache_bytes);
+CALC_API void calc_free(CalcContext_t *ctx);
+CALC_API CalcStatus calc_set_var(CalcContext_t *ctx, const char *name, double value);
+CALC_API CalcStatus calc_eval(CalcContext_t *ctx, const char *input, size_t length,
+                              double *result, CalcError_t *error);
+CALC_API CalcStatus calc_eval_format(CalcContext_t *ctx, const char *input, size_t length,
+                                     int shortest, char *buf, CalcError_t *error);
+CALC_API int calc_format(double value, int shortest, char *buf);
+CALC_API const char *calc_status_string(CalcStatus status);
+
+#endif
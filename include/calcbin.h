@@ -0,0 +1,84 @@
+#ifndef CALCBIN_H
+#define CALCBIN_H
+
+#include "prepared.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// First bytes of every file, the NUL included
+#define CALCBIN_MAGIC "CALCBIN"
+
+// Bumped whenever the layout or the instruction set changes, files of any
+// other version are rejected
+#define CALCBIN_VERSION 1
+
+// Written in the byte order of the compiling machine, a file read back
+// with the other order is rejected
+#define CALCBIN_BYTE_ORDER 0x01020304u
+
+// Start of a file. Every offset counts bytes from the start of the file and
+// every reference inside a section is an index, so a file can be used in
+// place wherever it is mapped.
+typedef struct {
+    char magic[8];          // CALCBIN_MAGIC
+    uint32_t version;       // CALCBIN_VERSION
+    uint32_t byte_order;    // CALCBIN_BYTE_ORDER
+    uint32_t expr_count;    // entries of the index
+    uint32_t max_stack;     // operand stack entries of the deepest program
+    uint32_t max_temps;     // temps of the program that needs the most
+    uint32_t max_vars;      // variable slots of the program that reads the most
+    uint64_t file_size;     // bytes of the whole file
+    uint64_t index_offset;  // CalcBinEntry_t by name, in strcmp order
+    uint64_t code_offset;   // instructions of every program, see bytecode.h
+    uint64_t code_count;    // instructions in the code section
+    uint64_t const_offset;  // constants of every program
+    uint64_t const_count;   // doubles in the constant section
+    uint64_t var_offset;    // string offsets of the variable names of every program
+    uint64_t var_count;     // entries in the variable section
+    uint64_t string_offset; // NUL terminated names
+    uint64_t string_size;   // bytes in the string section, ends with a NUL
+} CalcBinHeader_t;
+
+// One expression of a file. OP_CONST operands are relative to consts and
+// OP_LOAD reads slot i of the variable named by vars + i.
+typedef struct {
+    uint32_t name;        // string offset of the expression's name
+    uint32_t code;        // first instruction, the program ends with OP_END
+    uint32_t code_len;    // instructions including OP_END
+    uint32_t consts;      // first constant
+    uint32_t const_count; // constants of the program
+    uint32_t vars;        // first entry in the variable section
+    uint32_t var_count;   // variable slots the program reads
+    uint32_t max_stack;   // operand stack entries the program needs
+    uint32_t temp_count;  // temps the program's shared subtrees need
+    uint32_t reserved;    // 0, keeps entries a multiple of 8 bytes
+} CalcBinEntry_t;
+
+// A file mapped read only. Sections point into the mapping, nothing is
+// copied or allocated.
+typedef struct {
+    const unsigned char *base;      // start of the mapping
+    size_t size;                    // bytes mapped
+    const CalcBinHeader_t *header;  // start of the file
+    const CalcBinEntry_t *entries;  // index, sorted by name
+    const uint32_t *code;           // code section
+    const double *consts;           // constant section
+    const uint32_t *vars;           // variable section
+    const char *strings;            // string section
+    int count;                      // expressions in the index
+} CalcBin_t;
+
+int calcbin_write(const char *path, const char *const *names,
+                  PreparedExpr_t *const *exprs, int count);
+int calcbin_compile(const char *in_path, const char *out_path, int optimizer_flags,
+                    int *count);
+int calcbin_open(CalcBin_t *bin, const char *path);
+void calcbin_close(CalcBin_t *bin);
+int calcbin_find(const CalcBin_t *bin, const char *name);
+const char *calcbin_name(const CalcBin_t *bin, int index);
+int calcbin_var_count(const CalcBin_t *bin, int index);
+const char *calcbin_var_name(const CalcBin_t *bin, int index, int slot);
+size_t calcbin_scratch_size(const CalcBin_t *bin);
+double calcbin_eval(const CalcBin_t *bin, int index, const double *vars, double *scratch);
+
+#endif
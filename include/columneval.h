@@ -0,0 +1,34 @@
+#ifndef COLUMNEVAL_H
+#define COLUMNEVAL_H
+
+#include "bytecode.h"
+#include <stddef.h>
+
+// Rows run through one instruction before the next one, blocks of every
+// stack entry and temp stay in L1 for usual programs
+#define COLUMN_BLOCK 256
+
+// Doubles of scratch a run may use, programs with more stack entries and
+// temps than fit COLUMN_BLOCK rows each get shorter blocks
+#define COLUMN_WORKSPACE (1 << 16)
+
+// Named columns of doubles, all of the same length. A column nobody asked
+// for is kept by name only, its values are NULL.
+typedef struct {
+    char **names;     // name of every column, in input order
+    double **values;  // values of every column, or NULL if not loaded
+    int column_count; // entries in names and values
+    size_t rows;      // values in every loaded column
+} ColumnTable_t;
+
+int columneval_simd_width(void);
+int columneval_run(const Bytecode_t *bc, const double *const *columns, size_t rows,
+                   double *out, int width);
+
+int column_table_read_csv(ColumnTable_t *table, int fd, const char *const *wanted,
+                          int wanted_count);
+int column_table_add_binary(ColumnTable_t *table, const char *name, const char *path);
+int column_table_find(const ColumnTable_t *table, const char *name);
+void column_table_free(ColumnTable_t *table);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef EXPRGEN_H
+#define EXPRGEN_H
+
+#include <stdint.h>
+
+// Largest number of distinct variables a generated expression may use
+#define EXPRGEN_MAX_VARS 4
+
+// Binary operators a generated expression may use, in op_weights order
+#define EXPRGEN_OP_COUNT 5
+
+// Spelling of generated number literals
+typedef enum {
+    EXPRGEN_LITERAL_MIXED,   // any of the spellings below
+    EXPRGEN_LITERAL_INTEGER, // 42
+    EXPRGEN_LITERAL_DECIMAL, // 3.25, .5
+    EXPRGEN_LITERAL_LONG,    // 17 significant digits, 0.12345678901234567
+} ExprGenLiteral;
+
+// Names of the variables a generated expression may use, slot i is names[i]
+extern const char *const exprgen_var_names[EXPRGEN_MAX_VARS];
+
+// Seeded generator of random, always syntactically valid expressions
+typedef struct {
+    uint64_t state; // xorshift state, never zero
+    int max_depth;  // deepest level of parentheses
+    int max_terms;  // most operands joined by binary operators at one level
+    int var_count;  // variables to draw from, 0 for literals only
+    int op_weights[EXPRGEN_OP_COUNT]; // relative odds of + - * / ^, all 1 by default
+    ExprGenLiteral literal;           // spelling of number literals
+} ExprGen_t;
+
+void exprgen_init(ExprGen_t *gen, uint64_t seed);
+uint64_t exprgen_next(ExprGen_t *gen);
+double exprgen_uniform(ExprGen_t *gen);
+int exprgen_expression(ExprGen_t *gen, char *buffer, int size);
+
+#endif
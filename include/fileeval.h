@@ -0,0 +1,16 @@
+#ifndef FILEEVAL_H
+#define FILEEVAL_H
+
+#include "batch.h"
+
+// Target size of one unit of work, chunks end on a newline after this
+#define FILEEVAL_CHUNK_SIZE (1 << 20)
+
+// Chunks a worker may run ahead of the chunk being written out, per thread
+#define FILEEVAL_WINDOW_PER_THREAD 8
+
+int fileeval_default_threads(void);
+int fileeval_run(const char *path, int threads, const BatchOptions_t *options, int out_fd,
+                 BatchStats_t *stats);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "parser.h"
+#include <stddef.h>
+
+// The JIT emits x86-64 SysV code, other targets fall back to the interpreter
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(CALC_NO_JIT)
+#define CALC_JIT_SUPPORTED 1
+#endif
+
+// Signature of generated code, vars holds the value of every variable slot
+typedef double (*JitFn)(const double *vars);
+
+// Machine code for one expression living in its own executable mapping
+typedef struct {
+    void *code;  // start of the mapping
+    size_t size; // size of the mapping in bytes
+    JitFn fn;    // entry point, same address as code
+} JitCode_t;
+
+int jit_available(void);
+JitCode_t *jit_compile(ASTNode_t *node);
+void jit_free(JitCode_t *jit);
+
+#endif
@@ -1,9 +1,16 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes of input a streaming lexer holds at once, a token may not be longer
+#define LEXER_STREAM_BUFFER (1 << 20)
+
 // Token types recongnized by the lexer
 typedef enum {
     TOKEN_NUMBER,   // "123", "1"
+    TOKEN_IDENT,    // "x", "rate_2"
     TOKEN_PLUS,     // +
     TOKEN_MINUS,    // -
     TOKEN_MULTIPLY, // *
@@ -15,24 +22,41 @@ typedef enum {
     TOKEN_ERROR,    // unrecongnized or invalid character
 } TokenType;
 
-// Represents a single token in the input
+// Represents a single token in the input, the text is not copied, the token
+// only records where it lives inside the lexer's input. For a streaming
+// lexer the offset is into the current window, valid until the next token.
 typedef struct {
     TokenType type; // Kind of token
-    char *value;    // Actual text of the token
+    int offset;     // Index of the first character of the token in the input
+    int length;     // Number of characters in the token (0 for EOF)
+    int integer;    // Set for a TOKEN_NUMBER written without a decimal point
+    double value;   // Value of a TOKEN_NUMBER, parsed while lexing
 } Token_t;
 
-// Represents the state of the lexer while processing input
+// Represents the state of the lexer while processing input. A streaming
+// lexer reads its input from fd into a fixed buffer, input is then the
+// window of it not consumed yet and base the stream offset of input[0].
 typedef struct {
-    const char *input; // full input string
+    const char *input; // full input string, or the current window of a stream
     int pos;           // current position index
     int length;        // total length of the input
-    int curr_char;     // current character being processed
+    int silent;        // if set, errors are not printed to stderr
+    int simd;          // bytes scanned per vector compare, 0 for one at a time
+    int fd;            // descriptor input is streamed from, -1 for a string
+    char *buffer;      // window storage of a stream, malloc'd
+    int capacity;      // bytes buffer can hold
+    int eof;           // set once fd returned end of input or failed
+    int read_error;    // errno of a failed read, 0 if none
+    size_t base;       // stream offset of input[0], 0 for a string
 } Lexer_t;
 
 Lexer_t *lexer_init(const char *input);
+Lexer_t *lexer_init_fd(int fd, int capacity);
+void lexer_reset(Lexer_t *lexer, const char *input, int length);
 void lexer_free(Lexer_t *lexer);
-void token_free(Token_t *token);
-Token_t *lexer_next_token(Lexer_t *lexer);
+int lexer_simd_width(void);
+Token_t lexer_next_token(Lexer_t *lexer);
+int64_t lexer_token_integer(const Lexer_t *lexer, const Token_t *token);
 const char *token_type_to_string(TokenType type);
 void lexer_error(Lexer_t *lexer, const char *msg);
 void print_tokens(const char *input);
@@ -0,0 +1,20 @@
+#ifndef NUMFMT_H
+#define NUMFMT_H
+
+#include <stdint.h>
+
+// Bytes a caller's buffer needs for any formatted double, NUL included
+#define NUMFMT_BUF_SIZE 32
+
+// Ways a result can be written out
+typedef enum {
+    NUMFMT_G6,       // same text as printf("%.6g")
+    NUMFMT_SHORTEST, // fewest digits that read back as the same double
+} NumFormat;
+
+int numfmt_shortest(double value, char *buf);
+int numfmt_g6(double value, char *buf);
+int numfmt_format(double value, NumFormat format, char *buf);
+int numfmt_format_exact(double value, int64_t integer, NumFormat format, char *buf);
+
+#endif
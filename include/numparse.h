@@ -0,0 +1,9 @@
+#ifndef NUMPARSE_H
+#define NUMPARSE_H
+
+// Significant digits that still fit exactly into a 64-bit mantissa
+#define NUMPARSE_MAX_DIGITS 19
+
+double numparse_decimal(const char *text, int length);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "parser.h"
+
+// Individual rewrites performed by ast_optimize, combined as a bit mask
+typedef enum {
+    OPT_FOLD_CONSTANTS = 1 << 0, // evaluate subtrees made only of literals
+    OPT_SIMPLIFY_UNARY = 1 << 1, // drop unary plus and double negation
+    OPT_IDENTITIES = 1 << 2,     // x*1, 1*x, x/1, x-0, x+(-0), x^1
+    OPT_POWERS = 1 << 3,         // x^0, x^2, x^-1, x^0.5 correctly rounded, without pow
+    OPT_FAST_POWERS = 1 << 4,    // x^n up to POWI_MAX_EXPONENT, within |n| ulp
+    OPT_REASSOCIATE = 1 << 5,    // balance chains of +, - and *, not in IEEE order
+    OPT_ALL = OPT_FOLD_CONSTANTS | OPT_SIMPLIFY_UNARY | OPT_IDENTITIES | OPT_POWERS,
+} OptimizerFlags;
+
+// Counters describing what one optimizer run did
+typedef struct {
+    int nodes_before;       // nodes in the tree handed to the optimizer
+    int nodes_after;        // nodes in the optimized tree
+    int folded;             // operator nodes replaced by their constant value
+    int unary_removed;      // unary plus and double negation nodes dropped
+    int identities_applied; // identity operations removed
+    int powers_reduced;     // powers with a constant exponent that no longer call pow
+    int chains_balanced;    // chains of three or more terms rebuilt as balanced trees
+} OptimizerStats_t;
+
+ASTNode_t *ast_optimize(ASTNode_t *node, int flags, OptimizerStats_t *stats);
+void optimizer_print_stats(const OptimizerStats_t *stats);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef PAREVAL_H
+#define PAREVAL_H
+
+#include "parser.h"
+
+// Nodes a task evaluates at least before its subtree is cut off, trees
+// smaller than this are a single task
+#define PAREVAL_DEFAULT_GRAIN 4096
+
+// A subtree evaluated as one unit once the tasks below it are done
+typedef struct {
+    ASTNode_t *root; // subtree root, its shared field is the task's index
+    int parent;      // task whose subtree holds this one, -1 for the root
+    int children;    // tasks directly below this one
+    int nodes;       // nodes the task evaluates itself
+    int pending;     // children not finished yet during a run
+} ParTask_t;
+
+// Split of a tree into tasks, built once and run any number of times
+typedef struct {
+    ASTNode_t *root;
+    ParTask_t *tasks;    // children before parents, the root's task last
+    int task_count;      // entries in tasks
+    ASTValue_t *results; // value of every task during a run
+    long nodes;          // nodes of the whole tree
+} ParPlan_t;
+
+ParPlan_t *pareval_plan(ASTNode_t *root, int grain);
+double pareval_run(ParPlan_t *plan, const double *vars, int threads, const char **error);
+void pareval_free(ParPlan_t *plan);
+
+#endif
@@ -1,23 +1,48 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include "arena.h"
 #include "lexer.h"
+#include <stdint.h>
 
 // AST Node types for different kinds of expression
 typedef enum {
     AST_NUMBER,    // Node containing a number
     AST_BINARY_OP, // Binary operations (+, -, *, /, ^)
     AST_UNARY_OP,  // Unary operations (-, +)
+    AST_VARIABLE,  // Named variable resolved to a slot
+    AST_POWI,      // Base raised to a small constant integer, rewritten from ^
+    AST_SQRT,      // Square root of the base, rewritten from ^ 0.5
 } ASTNodeType;
 
+// Largest constant exponent magnitude the optimizer turns into multiplies
+#define POWI_MAX_EXPONENT 16
+
+// Shared subtrees one ast_eval call remembers without allocating, a DAG with
+// more gets a memo sized to its largest shared index
+#define EVAL_MEMO_SLOTS 64
+
+// Operator nodes one ast_eval call keeps waiting for their operands without
+// allocating, deeper trees get a stack on the heap
+#define EVAL_STACK_SLOTS 64
+
 // Forward declaration of the AST node structure
 typedef struct ASTNode ASTNode_t;
 
-// Structure representing a node in the AST
+// Structure representing a node in the AST. A subtree made only of integer
+// literals and operators is exact, the evaluator computes it in int64 and
+// only falls back to double where int64 cannot give the double result.
 struct ASTNode {
-    ASTNodeType type; // Kind of node
+    ASTNodeType type;      // Kind of node
+    signed int shared : 31; // Index of the temporary holding an operator node used
+                            // by several parents after hash-consing, -1 otherwise
+    unsigned int exact : 1; // Set for an integer literal, and for an operator whose
+                            // operands are exact, which is then tried in int64 first
     union {
-        double number; // Used if node is a number
+        struct {
+            double value;    // Value of the literal
+            int64_t integer; // Same value as an integer, valid if exact is set
+        } number;
         struct {
             TokenType op;     // Binary operator (+, -, *, /, ^)
             ASTNode_t *left;  // Left operand
@@ -27,28 +52,110 @@ struct ASTNode {
             TokenType op;       // Unary operator (+, -)
             ASTNode_t *operand; // Operand
         } unary_op;
+        struct {
+            ASTNode_t *base; // Operand of the power
+            int exponent;    // Constant exponent of AST_POWI, unused by AST_SQRT
+        } power;
+        struct {
+            const char *name; // Variable name, owned by the parser's arena
+            int slot;         // Index of the variable's value at evaluation
+        } variable;
     } data;
 };
 
-// Parser state structure including current token
+// Value of a subtree evaluated on its own, read back by the evaluation of
+// the rest of the tree in place of the subtree, or of a whole tree
+typedef struct {
+    double value;       // value in double
+    int64_t integer;    // int64 value of an exact subtree, INT64_MIN otherwise
+    const char *error;  // first evaluation error in the subtree, NULL if none
+} ASTValue_t;
+
+// Variable names known to a parser, a variable's slot is its index
+typedef struct {
+    const char **names; // NUL terminated names, owned by the arena
+    int count;          // Number of names in use
+    int capacity;       // Number of names the array can hold
+    int fixed;          // If set, names not already present are rejected
+} SymbolTable_t;
+
+// Nodes built by a hash-consing parser, used to find an existing node with
+// the same contents before a new one is allocated
+typedef struct {
+    ASTNode_t **slots; // open addressed, NULL marks a free slot, in the arena
+    int capacity;      // Number of slots, a power of two
+    int count;         // Number of distinct nodes built
+    int hits;          // Constructions answered with an existing node
+} ConsTable_t;
+
+// Operator waiting on the parser's stack for its right operand
+typedef struct {
+    TokenType op; // operator token, TOKEN_LPAREN marks an open group
+    int unary;    // set for a prefix sign
+    int prec;     // binding power, 0 for an open group
+} PendingOp_t;
+
+// Explicit stacks of the iterative parser, kept across parses so nesting
+// depth costs heap memory instead of C stack frames
+typedef struct {
+    ASTNode_t **operands; // finished subtrees
+    PendingOp_t *ops;     // operators still missing an operand
+    int operand_capacity; // entries operands can hold
+    int op_capacity;      // entries ops can hold
+} ParseStack_t;
+
+// Node on the stack of a tree walk
+typedef struct {
+    ASTNode_t *node;
+    int next; // operand to visit next
+} WalkFrame_t;
+
+// Explicit stack of a tree walk, malloc'd and freed by its user. Parsed trees
+// have no depth limit, a million nested parentheses or chained terms are
+// valid input, so passes over a tree never recurse per level but keep the
+// nodes waiting for their operands on a stack like this one.
+typedef struct {
+    WalkFrame_t *frames;
+    int depth;
+    int capacity;
+} WalkStack_t;
+
+// Parser state structure including current token, every node it builds
+// is allocated from the arena and lives until the arena is reset or freed
 typedef struct {
     Lexer_t *lexer;
-    Token_t *curr_token;
+    Token_t curr_token;
+    Arena_t *arena;
+    SymbolTable_t symbols;
+    ConsTable_t cons;   // distinct nodes, only filled when hash_cons is set
+    ParseStack_t stack; // operand and operator stacks, malloc'd and reused
+    const char *error;  // first error met while parsing, NULL if none
+    int error_pos;      // input offset of the token that caused the error
+    int silent;         // if set, errors are recorded but not printed
+    int hash_cons;      // if set, identical subtrees are built once and shared
 } Parser_t;
 
 // Parser function declarations
-Parser_t *parser_init(Lexer_t *lexer);
+Parser_t *parser_init(Lexer_t *lexer, Arena_t *arena);
 void parser_free(Parser_t *parser);
-void ast_free(ASTNode_t *node);
+void parser_reset(Parser_t *parser);
 ASTNode_t *parser_parse(Parser_t *parser);
+int parser_declare_variable(Parser_t *parser, const char *name, int length);
 double ast_eval(ASTNode_t *node);
+double ast_eval_vars(ASTNode_t *node, const double *vars);
+double ast_eval_checked(ASTNode_t *node, const double *vars, const char **error);
+ASTValue_t ast_eval_value(ASTNode_t *node, const double *vars);
+ASTValue_t ast_eval_task(ASTNode_t *root, const double *vars, const ASTValue_t *results);
+int ast_exact_binary(TokenType op, int64_t left, int64_t right, int64_t *result);
+int ast_exact_negate(int64_t operand, int64_t *result);
+double ast_powi(double base, int exponent);
+double ast_sqrt(double base);
 void parser_error(Parser_t *parser, const char *msg);
 void ast_print(ASTNode_t *node, int indent);
-
+int ast_count_nodes(ASTNode_t *node);
+ASTNode_t **ast_operand(ASTNode_t *node, int i);
+int ast_walk_push(WalkStack_t *stack, ASTNode_t *node);
+int ast_mark_shared(ASTNode_t *root);
 ASTNode_t *parse_expression(Parser_t *parser);
-ASTNode_t *parser_term(Parser_t *parser);
-ASTNode_t *parse_factor(Parser_t *parser);
-ASTNode_t *parser_power(Parser_t *parser);
-ASTNode_t *parse_primary(Parser_t *parser);
 
 #endif
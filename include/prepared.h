@@ -0,0 +1,28 @@
+#ifndef PREPARED_H
+#define PREPARED_H
+
+#include "arena.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "parser.h"
+
+// An expression parsed, optimized and compiled once, ready to be executed
+// against many sets of variable values
+typedef struct {
+    Arena_t *arena;         // owns the AST and the variable names
+    ASTNode_t *ast;         // optimized AST the program was compiled from
+    Bytecode_t *bc;         // compiled program run by expr_execute
+    JitCode_t *jit;         // native code preferred over bc, NULL if not compiled
+    const char **var_names; // name of every variable slot
+    int var_count;          // number of variable slots
+} PreparedExpr_t;
+
+PreparedExpr_t *expr_prepare(const char *input, const char *const *names, int name_count);
+PreparedExpr_t *expr_prepare_opt(const char *input, const char *const *names,
+                                 int name_count, int optimizer_flags);
+void expr_free(PreparedExpr_t *expr);
+int expr_enable_jit(PreparedExpr_t *expr);
+int expr_var_slot(const PreparedExpr_t *expr, const char *name);
+double expr_execute(const PreparedExpr_t *expr, const double *values);
+
+#endif
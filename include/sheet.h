@@ -0,0 +1,60 @@
+#ifndef SHEET_H
+#define SHEET_H
+
+#include "arena.h"
+#include "lexer.h"
+#include "numfmt.h"
+#include "parser.h"
+
+// Named definition of a sheet. Its expression may read other cells, which
+// makes it one of their users, and it is re-evaluated when one of them changes.
+typedef struct {
+    char *name;        // cell name, owned by the sheet
+    Arena_t *arena;    // owns the cell's tree, replaced when it is redefined
+    ASTNode_t *ast;    // optimized tree of the current definition
+    int *deps;         // distinct cells the tree reads, by slot
+    int dep_count;     // entries in deps
+    int *users;        // cells whose tree reads this one, by slot
+    int user_count;    // entries in users
+    int user_capacity; // entries users can hold
+    const char *error; // evaluation error of the current value, NULL if none
+    int pending;       // affected cells still to run before this one
+    int changed;       // set once the value differs from the one before
+    unsigned stamp;    // last update or search that visited the cell
+} Cell_t;
+
+// Counters of the incremental evaluation
+typedef struct {
+    size_t recomputed; // cells evaluated again
+    size_t reused;     // cells whose previous value was kept
+} SheetStats_t;
+
+// Cells by slot, a slot never changes once a name is defined, so trees can
+// refer to a cell's value by slot. values is what evaluation reads.
+typedef struct {
+    Cell_t *cells;       // definitions by slot
+    const char **names;  // cell names by slot, the parser's symbol table
+    double *values;      // current value of every cell by slot
+    int count;           // cells defined
+    int capacity;        // cells the arrays can hold
+    int *order;          // scratch list of slots for searches and updates
+    int affected;        // cells of order the latest update visited
+    Lexer_t *lexer;      // lexer reused for every definition
+    Parser_t *parser;    // parser reused for every definition
+    Arena_t *spare;      // parses into this arena, it is swapped into the cell
+    unsigned stamp;      // incremented by every update or search
+    int optimizer_flags; // passes applied to every definition
+    SheetStats_t last;   // counters of the latest update
+    SheetStats_t total;  // counters of every update so far
+} Sheet_t;
+
+int sheet_init(Sheet_t *sheet, int optimizer_flags);
+void sheet_free(Sheet_t *sheet);
+const char *sheet_split_assignment(const char *line, int *name_length, const char **expr);
+int sheet_find(const Sheet_t *sheet, const char *name, int length);
+int sheet_define(Sheet_t *sheet, const char *name, int name_length, const char *expr);
+void sheet_bind(const Sheet_t *sheet, Parser_t *parser);
+void sheet_print_update(const Sheet_t *sheet, NumFormat format);
+void sheet_print(const Sheet_t *sheet, NumFormat format);
+
+#endif
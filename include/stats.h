@@ -0,0 +1,57 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// Latency buckets per phase: four per power of two, up to 2^63 ns
+#define STATS_BUCKETS 252
+
+// Timed phases. Parsing drives the lexer, so parse time includes the lex
+// time of the same tokens, and a batch line includes all of them.
+typedef enum {
+    STATS_LEX,    // one lexer_next_token call
+    STATS_PARSE,  // one parser_parse call
+    STATS_EVAL,   // one tree evaluation (ast_eval and friends)
+    STATS_VM,     // one bytecode_eval call
+    STATS_FORMAT, // one numfmt_format call
+    STATS_WRITE,  // one outbuf_flush, the write(2) calls of batch output
+    STATS_LINE,   // one batch or file mode line, cache lookup to output
+    STATS_PHASE_COUNT,
+} StatsPhase;
+
+// Event and size counters
+typedef enum {
+    STATS_TOKENS,       // tokens produced by the lexer
+    STATS_NODES,        // AST nodes built by the parser
+    STATS_ARENA_ALLOCS, // allocations served by arenas
+    STATS_ARENA_BYTES,  // bytes handed out by arenas
+    STATS_MALLOCS,      // malloc calls for arena chunks, programs and cache entries
+    STATS_MALLOC_BYTES, // bytes requested by those malloc calls
+    STATS_COUNTER_COUNT,
+} StatsCounter;
+
+// Instrumentation is compiled in with -DCALC_STATS (make stats). Without it
+// every macro below expands to nothing and the timestamps are constant 0,
+// so instrumented code compiles to exactly what it was before.
+#ifdef CALC_STATS
+
+#define STATS_START() stats_now()
+#define STATS_STOP(phase, start) stats_record((phase), stats_now() - (start))
+#define STATS_COUNT(counter, n) stats_count((counter), (uint64_t)(n))
+
+uint64_t stats_now(void);
+void stats_record(StatsPhase phase, uint64_t ns);
+void stats_count(StatsCounter counter, uint64_t n);
+
+#else
+
+#define STATS_START() ((uint64_t)0)
+#define STATS_STOP(phase, start) ((void)(start))
+#define STATS_COUNT(counter, n) ((void)0)
+
+#endif
+
+int stats_install(void);
+void stats_dump(int fd);
+
+#endif
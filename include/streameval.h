@@ -0,0 +1,18 @@
+#ifndef STREAMEVAL_H
+#define STREAMEVAL_H
+
+#include "lexer.h"
+#include <stddef.h>
+
+// Outcome of evaluating one streamed expression
+typedef struct {
+    double value;        // result, a failed operation counts as 0, 0 after a parse error
+    const char *error;   // first parse or evaluation error, NULL if none
+    size_t error_offset; // stream offset of the token the error is about
+    size_t tokens;       // tokens read, without the end of input
+    int max_depth;       // most values held at once, grows with nesting only
+} StreamResult_t;
+
+int streameval_run(Lexer_t *lexer, StreamResult_t *result);
+
+#endif
@@ -0,0 +1,122 @@
+#include "../include/arena.h"
+#include "../include/stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Round size up to the next multiple of ARENA_ALIGNMENT
+static size_t align_up(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1);
+}
+
+// Allocate a new chunk that can hold at least min_capacity bytes
+static ArenaChunk_t *create_chunk(Arena_t *arena, size_t min_capacity) {
+    size_t capacity = arena->chunk_size;
+    if (capacity < min_capacity) {
+        capacity = min_capacity;
+    }
+
+    ArenaChunk_t *chunk = malloc(sizeof(ArenaChunk_t) + capacity);
+    if (!chunk) {
+        fprintf(stderr, "Error: Memory allocation failed for arena chunk\n");
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+
+    arena->bytes_reserved += capacity;
+    arena->chunk_count++;
+    STATS_COUNT(STATS_MALLOCS, 1);
+    STATS_COUNT(STATS_MALLOC_BYTES, sizeof(ArenaChunk_t) + capacity);
+
+    return chunk;
+}
+
+// Init an empty arena, chunks are created lazily on first allocation
+Arena_t *arena_init(size_t chunk_size) {
+    Arena_t *arena = malloc(sizeof(Arena_t));
+    if (!arena) {
+        fprintf(stderr, "Error: Memory allocation failed for arena\n");
+        return NULL;
+    }
+
+    arena->first = NULL;
+    arena->curr = NULL;
+    arena->chunk_size = chunk_size ? align_up(chunk_size) : ARENA_DEFAULT_CHUNK_SIZE;
+    arena->bytes_used = 0;
+    arena->bytes_reserved = 0;
+    arena->chunk_count = 0;
+    arena->alloc_count = 0;
+
+    return arena;
+}
+
+// Release every chunk and the arena itself
+void arena_free(Arena_t *arena) {
+    if (!arena)
+        return;
+
+    ArenaChunk_t *chunk = arena->first;
+    while (chunk) {
+        ArenaChunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    free(arena);
+}
+
+// Hand out size bytes from the arena, creating a new chunk if needed
+void *arena_alloc(Arena_t *arena, size_t size) {
+    size = align_up(size);
+
+    // Chunks after curr are only ever empty leftovers from a reset
+    while (arena->curr && arena->curr->used + size > arena->curr->capacity &&
+           arena->curr->next) {
+        arena->curr = arena->curr->next;
+    }
+
+    ArenaChunk_t *chunk = arena->curr;
+    if (!chunk || chunk->used + size > chunk->capacity) {
+        ArenaChunk_t *fresh = create_chunk(arena, size);
+        if (!fresh)
+            return NULL;
+
+        if (chunk) {
+            fresh->next = chunk->next;
+            chunk->next = fresh;
+        } else {
+            arena->first = fresh;
+        }
+
+        arena->curr = fresh;
+        chunk = fresh;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->bytes_used += size;
+    arena->alloc_count++;
+    STATS_COUNT(STATS_ARENA_ALLOCS, 1);
+    STATS_COUNT(STATS_ARENA_BYTES, size);
+
+    return ptr;
+}
+
+// Drop every allocation at once while keeping the chunks for reuse
+void arena_reset(Arena_t *arena) {
+    for (ArenaChunk_t *chunk = arena->first; chunk; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+
+    arena->curr = arena->first;
+    arena->bytes_used = 0;
+    arena->alloc_count = 0;
+}
+
+// Bytes handed out since the last reset
+size_t arena_bytes_used(const Arena_t *arena) { return arena->bytes_used; }
+
+// Bytes currently held in chunks, used or not
+size_t arena_bytes_reserved(const Arena_t *arena) { return arena->bytes_reserved; }
@@ -0,0 +1,300 @@
+#include "../include/batch.h"
+#include "../include/optimizer.h"
+#include "../include/stats.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Init an output buffer that drains into fd
+int outbuf_init(OutBuf_t *out, int fd, size_t cap) {
+    out->data = malloc(cap);
+    out->len = 0;
+    out->cap = cap;
+    out->fd = fd;
+    out->failed = 0;
+
+    if (!out->data) {
+        fprintf(stderr, "Error: Memory allocation failed for output buffer\n");
+        out->cap = 0;
+        out->failed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Release the buffer without flushing it
+void outbuf_free(OutBuf_t *out) {
+    free(out->data);
+    out->data = NULL;
+    out->len = 0;
+    out->cap = 0;
+}
+
+// Write every buffered byte to the file descriptor
+void outbuf_flush(OutBuf_t *out) {
+    if (out->fd < 0 || out->failed)
+        return;
+
+    uint64_t start = STATS_START();
+    size_t done = 0;
+    while (done < out->len) {
+        ssize_t n = write(out->fd, out->data + done, out->len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error: write failed");
+            out->failed = 1;
+            return;
+        }
+        done += n;
+    }
+
+    out->len = 0;
+    STATS_STOP(STATS_WRITE, start);
+}
+
+// Append bytes, draining to the file descriptor or growing when full
+void outbuf_append(OutBuf_t *out, const char *data, size_t len) {
+    if (out->failed)
+        return;
+
+    if (out->len + len > out->cap) {
+        outbuf_flush(out);
+    }
+
+    // In-memory buffers, and single appends larger than the buffer, grow
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : BATCH_WRITE_SIZE;
+        while (cap < out->len + len)
+            cap *= 2;
+
+        char *data_new = realloc(out->data, cap);
+        if (!data_new) {
+            fprintf(stderr, "Error: Memory allocation failed for output buffer\n");
+            out->failed = 1;
+            return;
+        }
+
+        out->data = data_new;
+        out->cap = cap;
+    }
+
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+// Create the lexer, parser and arena shared by every line, and the cache of
+// parsed lines the options ask for
+int batch_context_init(BatchContext_t *ctx, const BatchOptions_t *options) {
+    size_t cache_bytes = options->cache_bytes;
+
+    ctx->lexer = lexer_init("");
+    ctx->arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    ctx->parser = (ctx->lexer && ctx->arena) ? parser_init(ctx->lexer, ctx->arena) : NULL;
+    ctx->cache = cache_bytes ? cache_init(cache_bytes) : NULL;
+    ctx->format = options->format;
+    ctx->optimizer_flags = options->optimizer_flags;
+
+    if (!ctx->parser || (cache_bytes && !ctx->cache)) {
+        batch_context_free(ctx);
+        return -1;
+    }
+
+    // Errors are reported in the output instead of on stderr
+    ctx->lexer->silent = 1;
+    ctx->parser->silent = 1;
+
+    return 0;
+}
+
+// Clean up everything owned by a batch context
+void batch_context_free(BatchContext_t *ctx) {
+    cache_free(ctx->cache);
+    parser_free(ctx->parser);
+    arena_free(ctx->arena);
+    lexer_free(ctx->lexer);
+    ctx->cache = NULL;
+    ctx->parser = NULL;
+    ctx->arena = NULL;
+    ctx->lexer = NULL;
+}
+
+// Append an in-band error line
+static void append_error(OutBuf_t *out, const char *msg, int pos) {
+    char text[128];
+    int len;
+
+    if (pos >= 0)
+        len = snprintf(text, sizeof(text), "error: %s at position %d\n", msg, pos);
+    else
+        len = snprintf(text, sizeof(text), "error: %s\n", msg);
+
+    outbuf_append(out, text, len);
+}
+
+// Parse a line, or take its tree from the cache. Returns NULL for an empty
+// line or a parse error, which is left in the parser.
+static ASTNode_t *parse_line(BatchContext_t *ctx, const char *line, size_t len) {
+    if (ctx->cache) {
+        ASTNode_t *cached = cache_lookup(ctx->cache, line, len);
+        if (cached)
+            return cached;
+    }
+
+    lexer_reset(ctx->lexer, line, (int)len);
+    arena_reset(ctx->arena);
+    parser_reset(ctx->parser);
+
+    if (ctx->parser->curr_token.type == TOKEN_EOF)
+        return NULL;
+
+    ASTNode_t *ast = parser_parse(ctx->parser);
+
+    // Every tree gets the caller's passes, cached ones once for every repeat
+    if (ast && ctx->optimizer_flags)
+        ast = ast_optimize(ast, ctx->optimizer_flags, NULL);
+    if (ast && ctx->cache)
+        cache_insert(ctx->cache, line, len, ast);
+
+    return ast;
+}
+
+// Answer one line, the body of batch_eval_line
+static int answer_line(BatchContext_t *ctx, const char *line, size_t len, OutBuf_t *out) {
+    // Drop the '\r' of CRLF line endings
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+
+    ASTNode_t *ast = parse_line(ctx, line, len);
+    if (!ast) {
+        if (!ctx->parser->error) {
+            outbuf_append(out, "\n", 1);
+            return 0;
+        }
+
+        append_error(out, ctx->parser->error, ctx->parser->error_pos);
+        return 1;
+    }
+
+    ASTValue_t result = ast_eval_value(ast, NULL);
+    if (result.error) {
+        append_error(out, result.error, -1);
+        return 1;
+    }
+
+    char text[NUMFMT_BUF_SIZE + 1];
+    int text_len = numfmt_format_exact(result.value, result.integer, ctx->format, text);
+    text[text_len++] = '\n';
+    outbuf_append(out, text, text_len);
+
+    return 0;
+}
+
+// Evaluate one line and append its result or error to out. Lines that
+// contain only whitespace produce an empty line so output stays aligned
+// with the input. Returns 1 if the line was answered with an error.
+int batch_eval_line(BatchContext_t *ctx, const char *line, size_t len, OutBuf_t *out) {
+    uint64_t start = STATS_START();
+    int failed = answer_line(ctx, line, len, out);
+    STATS_STOP(STATS_LINE, start);
+
+    return failed;
+}
+
+// Evaluate every newline separated expression read from in_fd, writing one
+// output line per input line to out_fd. Returns 0 on success, -1 on I/O or
+// allocation failure.
+int batch_run(int in_fd, int out_fd, const BatchOptions_t *options, BatchStats_t *stats) {
+    BatchStats_t local;
+    if (!stats)
+        stats = &local;
+    memset(stats, 0, sizeof(BatchStats_t));
+
+    BatchContext_t ctx;
+    if (batch_context_init(&ctx, options) != 0)
+        return -1;
+
+    OutBuf_t out;
+    if (outbuf_init(&out, out_fd, BATCH_WRITE_SIZE) != 0) {
+        batch_context_free(&ctx);
+        return -1;
+    }
+
+    // Lines are evaluated in place, only a line cut by the end of a block
+    // is moved to the front, and the buffer grows for lines longer than it
+    size_t cap = BATCH_READ_SIZE;
+    char *buffer = malloc(cap);
+    size_t len = 0;
+    int status = 0;
+    int eof = 0;
+
+    if (!buffer) {
+        fprintf(stderr, "Error: Memory allocation failed for input buffer\n");
+        status = -1;
+        eof = 1;
+    }
+
+    while (!eof) {
+        if (len == cap) {
+            char *grown = realloc(buffer, cap * 2);
+            if (!grown) {
+                fprintf(stderr, "Error: Memory allocation failed for input buffer\n");
+                status = -1;
+                break;
+            }
+            buffer = grown;
+            cap *= 2;
+        }
+
+        ssize_t n = read(in_fd, buffer + len, cap - len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error: read failed");
+            status = -1;
+            break;
+        }
+
+        if (n == 0) {
+            eof = 1;
+        }
+
+        size_t scan_from = len;
+        len += n;
+        stats->bytes += n;
+
+        // Evaluate every complete line in the buffer
+        size_t start = 0;
+        char *newline;
+        while ((newline = memchr(buffer + scan_from, '\n', len - scan_from))) {
+            size_t end = newline - buffer;
+            stats->errors += batch_eval_line(&ctx, buffer + start, end - start, &out);
+            stats->lines++;
+            start = end + 1;
+            scan_from = start;
+        }
+
+        // The last line does not need a trailing newline
+        if (eof && start < len) {
+            stats->errors += batch_eval_line(&ctx, buffer + start, len - start, &out);
+            stats->lines++;
+            start = len;
+        }
+
+        memmove(buffer, buffer + start, len - start);
+        len -= start;
+    }
+
+    outbuf_flush(&out);
+    if (out.failed)
+        status = -1;
+
+    free(buffer);
+    outbuf_free(&out);
+    batch_context_free(&ctx);
+
+    return status;
+}
@@ -0,0 +1,477 @@
+#include "../include/bytecode.h"
+#include "../include/stats.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Use GCC/Clang labels-as-values for the dispatch loop when available
+#if defined(__GNUC__) && !defined(BC_NO_COMPUTED_GOTO)
+#define BC_COMPUTED_GOTO 1
+#endif
+
+// State threaded through the compile walk
+typedef struct {
+    Bytecode_t *bc;
+    int depth;              // current operand stack depth
+    unsigned char *emitted; // set once a shared subtree's temp is stored
+    int overflow;           // set once an operand did not fit BC_ARG_MAX
+} Compiler_t;
+
+// Count AST nodes and leaves to size the program up front, and the temps
+// needed for subtrees shared by several parents. A shared subtree is only
+// walked on its first use, later uses are a single OP_TEMP pushing one value.
+// Returns 0 if the walk ran out of memory.
+static int count_nodes(ASTNode_t *root, int *nodes, int *leaves, int *temps) {
+    WalkStack_t stack = {0};
+    unsigned char *seen = NULL;
+    int seen_len = 0;
+
+    int ok = !root || ast_walk_push(&stack, root);
+    while (ok && stack.depth > 0) {
+        ASTNode_t *node = stack.frames[--stack.depth].node;
+        int index = node->shared;
+        (*nodes)++;
+
+        if (index >= seen_len) {
+            int len = seen_len ? seen_len : 64;
+            while (len <= index)
+                len *= 2;
+
+            unsigned char *grown = realloc(seen, len);
+            if (!grown) {
+                fprintf(stderr, "Error: Memory allocation failed for bytecode\n");
+                ok = 0;
+                break;
+            }
+            memset(grown + seen_len, 0, len - seen_len);
+            seen = grown;
+            seen_len = len;
+        }
+
+        if (index >= 0) {
+            if (seen[index]) {
+                (*leaves)++;
+                continue;
+            }
+            seen[index] = 1;
+            if (index >= *temps)
+                *temps = index + 1;
+        }
+
+        if (node->type == AST_NUMBER || node->type == AST_VARIABLE)
+            (*leaves)++;
+
+        ASTNode_t **operand;
+        for (int i = 0; ok && (operand = ast_operand(node, i)) != NULL; i++) {
+            if (*operand)
+                ok = ast_walk_push(&stack, *operand);
+        }
+    }
+
+    free(stack.frames);
+    free(seen);
+    return ok;
+}
+
+// Append one instruction to the program. An operand too wide for the
+// instruction is flagged rather than silently cut to its low 24 bits.
+static void emit(Compiler_t *c, OpCode op, uint32_t arg) {
+    if (arg > BC_ARG_MAX)
+        c->overflow = 1;
+    c->bc->code[c->bc->code_len++] = BC_MAKE(op, arg);
+}
+
+// Track the operand stack depth after an instruction
+static void adjust_depth(Compiler_t *c, int delta) {
+    c->depth += delta;
+    if (c->depth > c->bc->max_stack) {
+        c->bc->max_stack = c->depth;
+    }
+}
+
+// Map a binary operator token to its opcode
+static int binary_opcode(TokenType op, OpCode *out) {
+    switch (op) {
+    case TOKEN_PLUS:
+        *out = OP_ADD;
+        return 1;
+    case TOKEN_MINUS:
+        *out = OP_SUB;
+        return 1;
+    case TOKEN_MULTIPLY:
+        *out = OP_MUL;
+        return 1;
+    case TOKEN_DIVIDE:
+        *out = OP_DIV;
+        return 1;
+    case TOKEN_POWER:
+        *out = OP_POW;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Emit the instruction computing a node once the code of its operands is out
+static int compile_value(Compiler_t *c, ASTNode_t *node) {
+    switch (node->type) {
+    case AST_NUMBER: {
+        Bytecode_t *bc = c->bc;
+        bc->consts[bc->const_count] = node->data.number.value;
+        emit(c, OP_CONST, bc->const_count++);
+        adjust_depth(c, 1);
+        return 1;
+    }
+
+    case AST_VARIABLE: {
+        int slot = node->data.variable.slot;
+        if (slot >= c->bc->var_count) {
+            c->bc->var_count = slot + 1;
+        }
+        emit(c, OP_LOAD, slot);
+        adjust_depth(c, 1);
+        return 1;
+    }
+
+    case AST_BINARY_OP: {
+        OpCode op;
+        if (!binary_opcode(node->data.binary_op.op, &op)) {
+            fprintf(stderr, "Error: Unknown binary operator\n");
+            return 0;
+        }
+
+        emit(c, op, 0);
+        adjust_depth(c, -1);
+        return 1;
+    }
+
+    case AST_UNARY_OP:
+        switch (node->data.unary_op.op) {
+        case TOKEN_MINUS:
+            emit(c, OP_NEG, 0);
+            return 1;
+        case TOKEN_PLUS:
+            return 1; // unary plus is a no-op
+        default:
+            fprintf(stderr, "Error: Unknown unary operator\n");
+            return 0;
+        }
+
+    case AST_POWI:
+        // The exponent is signed, it has to read back the same through BC_SARG
+        if (node->data.power.exponent < -(BC_ARG_MAX / 2 + 1) ||
+            node->data.power.exponent > BC_ARG_MAX / 2)
+            c->overflow = 1;
+        emit(c, OP_POWI, (uint32_t)node->data.power.exponent & BC_ARG_MAX);
+        return 1;
+
+    case AST_SQRT:
+        emit(c, OP_SQRT, 0);
+        return 1;
+    }
+
+    fprintf(stderr, "Error: Unknown AST node type\n");
+    return 0;
+}
+
+// Start the code of a subtree, returns 0 on malformed input. A subtree shared
+// by several parents is reloaded from its temp once it was computed, any
+// other one waits on the stack until the code of its operands is out.
+static int compile_enter(Compiler_t *c, WalkStack_t *stack, ASTNode_t *node) {
+    if (!node) {
+        fprintf(stderr, "Error: NULL AST node\n");
+        return 0;
+    }
+
+    int index = node->shared;
+    if (index >= 0 && c->emitted[index]) {
+        emit(c, OP_TEMP, index);
+        adjust_depth(c, 1);
+        return 1;
+    }
+
+    return ast_walk_push(stack, node);
+}
+
+// Emit post-order code for a tree, returns 0 on malformed input. Shared
+// subtrees store their value in a temp for the later uses.
+static int compile_tree(Compiler_t *c, ASTNode_t *root) {
+    WalkStack_t stack = {0};
+
+    int ok = compile_enter(c, &stack, root);
+    while (ok && stack.depth > 0) {
+        WalkFrame_t *frame = &stack.frames[stack.depth - 1];
+        ASTNode_t **operand = ast_operand(frame->node, frame->next++);
+        if (operand) {
+            ok = compile_enter(c, &stack, *operand);
+            continue;
+        }
+
+        ASTNode_t *node = frame->node;
+        stack.depth--;
+        ok = compile_value(c, node);
+
+        if (ok && node->shared >= 0) {
+            emit(c, OP_STORE, node->shared);
+            c->emitted[node->shared] = 1;
+        }
+    }
+
+    free(stack.frames);
+    return ok;
+}
+
+// Compile an AST into a flat program, the AST is not needed afterwards
+Bytecode_t *bytecode_compile(ASTNode_t *node) {
+    int nodes = 0;
+    int leaves = 0;
+    int temps = 0;
+    if (!count_nodes(node, &nodes, &leaves, &temps))
+        return NULL;
+
+    Bytecode_t *bc = malloc(sizeof(Bytecode_t));
+    if (!bc) {
+        fprintf(stderr, "Error: Memory allocation failed for bytecode\n");
+        return NULL;
+    }
+
+    // Every node emits at most one instruction plus one OP_STORE if it is
+    // shared, and the stack can never be deeper than the number of leaves
+    bc->code = malloc((nodes + temps + 1) * sizeof(uint32_t));
+    bc->consts = malloc((leaves + 1) * sizeof(double));
+    bc->stack = malloc((leaves + 1) * sizeof(double));
+    bc->temps = malloc((temps + 1) * sizeof(double));
+    bc->code_len = 0;
+    bc->const_count = 0;
+    bc->max_stack = 0;
+    bc->var_count = 0;
+    bc->temp_count = temps;
+
+    Compiler_t compiler = {bc, 0, calloc(temps + 1, 1), 0};
+    STATS_COUNT(STATS_MALLOCS, 6);
+    STATS_COUNT(STATS_MALLOC_BYTES,
+                sizeof(Bytecode_t) + (nodes + temps + 1) * sizeof(uint32_t) +
+                    2 * (leaves + 1) * sizeof(double) +
+                    (temps + 1) * (sizeof(double) + 1));
+
+    if (!bc->code || !bc->consts || !bc->stack || !bc->temps || !compiler.emitted) {
+        fprintf(stderr, "Error: Memory allocation failed for bytecode\n");
+        free(compiler.emitted);
+        bytecode_free(bc);
+        return NULL;
+    }
+
+    int ok = compile_tree(&compiler, node);
+    free(compiler.emitted);
+
+    if (ok && compiler.overflow) {
+        fprintf(stderr, "Error: Too many constants, variables or temps for bytecode\n");
+        ok = 0;
+    }
+
+    if (!ok) {
+        bytecode_free(bc);
+        return NULL;
+    }
+
+    emit(&compiler, OP_END, 0);
+
+    return bc;
+}
+
+// Clean up bytecode memory
+void bytecode_free(Bytecode_t *bc) {
+    if (bc) {
+        free(bc->code);
+        free(bc->consts);
+        free(bc->stack);
+        free(bc->temps);
+        free(bc);
+    }
+}
+
+// Run a compiled program. The top of the stack lives in a local so most
+// instructions touch memory at most once, and nothing is allocated.
+static double run_program(const uint32_t *code, const double *consts, double *stack,
+                          double *temps, const double *vars) {
+    const uint32_t *ip = code;
+    double *sp = stack;
+    double top = 0.0;
+    uint32_t instr;
+
+#ifdef BC_COMPUTED_GOTO
+    static const void *dispatch[] = {
+        [OP_CONST] = &&do_const, [OP_LOAD] = &&do_load, [OP_ADD] = &&do_add,
+        [OP_SUB] = &&do_sub,     [OP_MUL] = &&do_mul,   [OP_DIV] = &&do_div,
+        [OP_POW] = &&do_pow,     [OP_NEG] = &&do_neg,   [OP_POWI] = &&do_powi,
+        [OP_SQRT] = &&do_sqrt,   [OP_STORE] = &&do_store, [OP_TEMP] = &&do_temp,
+        [OP_END] = &&do_end,
+    };
+#define VM_CASE(label, op) label:
+#define VM_NEXT()                                                                        \
+    do {                                                                                 \
+        instr = *ip++;                                                                   \
+        goto *dispatch[BC_OP(instr)];                                                    \
+    } while (0)
+
+    VM_NEXT();
+#else
+#define VM_CASE(label, op) case op:
+#define VM_NEXT() continue
+
+    for (;;) {
+        instr = *ip++;
+        switch (BC_OP(instr)) {
+#endif
+
+    VM_CASE(do_const, OP_CONST) {
+        *sp++ = top;
+        top = consts[BC_ARG(instr)];
+        VM_NEXT();
+    }
+
+    VM_CASE(do_load, OP_LOAD) {
+        *sp++ = top;
+        top = vars[BC_ARG(instr)];
+        VM_NEXT();
+    }
+
+    VM_CASE(do_add, OP_ADD) {
+        top = *--sp + top;
+        VM_NEXT();
+    }
+
+    VM_CASE(do_sub, OP_SUB) {
+        top = *--sp - top;
+        VM_NEXT();
+    }
+
+    VM_CASE(do_mul, OP_MUL) {
+        top = *--sp * top;
+        VM_NEXT();
+    }
+
+    VM_CASE(do_div, OP_DIV) {
+        double left = *--sp;
+        top = top == 0.0 ? 0.0 : left / top;
+        VM_NEXT();
+    }
+
+    VM_CASE(do_pow, OP_POW) {
+        double left = *--sp;
+        top = pow(left, top);
+        VM_NEXT();
+    }
+
+    VM_CASE(do_neg, OP_NEG) {
+        top = -top;
+        VM_NEXT();
+    }
+
+    VM_CASE(do_powi, OP_POWI) {
+        top = ast_powi(top, BC_SARG(instr));
+        VM_NEXT();
+    }
+
+    VM_CASE(do_sqrt, OP_SQRT) {
+        top = ast_sqrt(top);
+        VM_NEXT();
+    }
+
+    VM_CASE(do_store, OP_STORE) {
+        temps[BC_ARG(instr)] = top;
+        VM_NEXT();
+    }
+
+    VM_CASE(do_temp, OP_TEMP) {
+        *sp++ = top;
+        top = temps[BC_ARG(instr)];
+        VM_NEXT();
+    }
+
+    VM_CASE(do_end, OP_END) { return top; }
+
+#ifndef BC_COMPUTED_GOTO
+        }
+    }
+#endif
+
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+// Run a compiled program with vars holding the value of every variable slot
+double bytecode_eval(const Bytecode_t *bc, const double *vars) {
+    uint64_t start = STATS_START();
+    double result = run_program(bc->code, bc->consts, bc->stack, bc->temps, vars);
+    STATS_STOP(STATS_VM, start);
+
+    return result;
+}
+
+// Run a program that lives outside a Bytecode_t, such as one in a mapped
+// calcbin file. stack needs as many entries as the program's max_stack,
+// temps one per temp.
+double bytecode_run(const uint32_t *code, const double *consts, double *stack,
+                    double *temps, const double *vars) {
+    uint64_t start = STATS_START();
+    double result = run_program(code, consts, stack, temps, vars);
+    STATS_STOP(STATS_VM, start);
+
+    return result;
+}
+
+// Convert an opcode to its mnemonic
+const char *opcode_to_string(OpCode op) {
+    switch (op) {
+    case OP_CONST:
+        return "CONST";
+    case OP_LOAD:
+        return "LOAD";
+    case OP_ADD:
+        return "ADD";
+    case OP_SUB:
+        return "SUB";
+    case OP_MUL:
+        return "MUL";
+    case OP_DIV:
+        return "DIV";
+    case OP_POW:
+        return "POW";
+    case OP_NEG:
+        return "NEG";
+    case OP_POWI:
+        return "POWI";
+    case OP_SQRT:
+        return "SQRT";
+    case OP_STORE:
+        return "STORE";
+    case OP_TEMP:
+        return "TEMP";
+    case OP_END:
+        return "END";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+// Print a program listing for debugging
+void bytecode_print(const Bytecode_t *bc) {
+    for (int i = 0; i < bc->code_len; i++) {
+        OpCode op = BC_OP(bc->code[i]);
+        printf("%4d  %s", i, opcode_to_string(op));
+
+        if (op == OP_CONST) {
+            printf(" %g", bc->consts[BC_ARG(bc->code[i])]);
+        } else if (op == OP_LOAD) {
+            printf(" slot %u", BC_ARG(bc->code[i]));
+        } else if (op == OP_POWI) {
+            printf(" %d", BC_SARG(bc->code[i]));
+        } else if (op == OP_STORE || op == OP_TEMP) {
+            printf(" t%u", BC_ARG(bc->code[i]));
+        }
+
+        printf("\n");
+    }
+}
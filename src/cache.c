@@ -0,0 +1,377 @@
+#include "../include/cache.h"
+#include "../include/stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// 64-bit FNV-1a parameters
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// Create an empty cache holding at most max_bytes of entries
+ExprCache_t *cache_init(size_t max_bytes) {
+    ExprCache_t *cache = calloc(1, sizeof(ExprCache_t));
+    if (!cache) {
+        fprintf(stderr, "Error: Memory allocation failed for cache\n");
+        return NULL;
+    }
+
+    cache->bucket_count = CACHE_INITIAL_BUCKETS;
+    cache->buckets = calloc(cache->bucket_count, sizeof(CacheEntry_t *));
+    cache->max_bytes = max_bytes;
+
+    if (!cache->buckets) {
+        fprintf(stderr, "Error: Memory allocation failed for cache\n");
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+// Release every entry and the cache itself
+void cache_free(ExprCache_t *cache) {
+    if (!cache)
+        return;
+
+    CacheEntry_t *entry = cache->newest;
+    while (entry) {
+        CacheEntry_t *older = entry->older;
+        free(entry);
+        entry = older;
+    }
+
+    free(cache->buckets);
+    free(cache->scratch);
+    free(cache->walk);
+    free(cache);
+}
+
+// Whitespace the lexer skips
+static int is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Operators and parentheses are tokens on their own, so whitespace next to
+// them never changes how an expression lexes
+static int is_separator(unsigned char c) {
+    switch (c) {
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '^':
+    case '(':
+    case ')':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Copy input into the scratch buffer with leading, trailing and insignificant
+// whitespace removed, and runs of the remaining whitespace collapsed to one
+// space. Returns the key length, or -1 if the buffer cannot grow.
+static long normalize(ExprCache_t *cache, const char *input, size_t len, uint64_t *hash) {
+    if (len > cache->scratch_cap) {
+        char *scratch = realloc(cache->scratch, len);
+        if (!scratch) {
+            fprintf(stderr, "Error: Memory allocation failed for cache key\n");
+            return -1;
+        }
+        cache->scratch = scratch;
+        cache->scratch_cap = len;
+    }
+
+    char *key = cache->scratch;
+    uint64_t h = FNV_OFFSET;
+    size_t out = 0;
+    int pending_space = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = input[i];
+
+        if (is_space(c)) {
+            pending_space = out > 0;
+            continue;
+        }
+
+        // Keep one space only where it separates two tokens, as in "1 2"
+        if (pending_space && !is_separator(c) && !is_separator(key[out - 1])) {
+            key[out++] = ' ';
+            h = (h ^ ' ') * FNV_PRIME;
+        }
+
+        pending_space = 0;
+        key[out++] = c;
+        h = (h ^ c) * FNV_PRIME;
+    }
+
+    *hash = h;
+    return (long)out;
+}
+
+// Bucket of a hash, folding the high bits in since FNV mixes them best
+static size_t bucket_of(const ExprCache_t *cache, uint64_t hash) {
+    return (size_t)(hash ^ (hash >> 32)) & (cache->bucket_count - 1);
+}
+
+// Find the entry for a normalized key
+static CacheEntry_t *find_entry(const ExprCache_t *cache, const char *key, size_t key_len,
+                                uint64_t hash) {
+    CacheEntry_t *entry = cache->buckets[bucket_of(cache, hash)];
+
+    while (entry) {
+        if (entry->hash == hash && entry->key_len == key_len &&
+            memcmp(entry->key, key, key_len) == 0)
+            return entry;
+        entry = entry->bucket_next;
+    }
+
+    return NULL;
+}
+
+// Take an entry out of the recency list
+static void list_unlink(ExprCache_t *cache, CacheEntry_t *entry) {
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+}
+
+// Put an entry at the most recently used end of the list
+static void list_push_newest(ExprCache_t *cache, CacheEntry_t *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+
+    if (cache->newest)
+        cache->newest->newer = entry;
+    else
+        cache->oldest = entry;
+
+    cache->newest = entry;
+}
+
+// Drop the least recently used entry
+static void evict_oldest(ExprCache_t *cache) {
+    CacheEntry_t *entry = cache->oldest;
+    CacheEntry_t **link = &cache->buckets[bucket_of(cache, entry->hash)];
+
+    while (*link != entry)
+        link = &(*link)->bucket_next;
+    *link = entry->bucket_next;
+
+    list_unlink(cache, entry);
+    cache->entries--;
+    cache->bytes -= entry->size;
+    cache->evictions++;
+    free(entry);
+}
+
+// Double the bucket array, keeps the old one if the allocation fails
+static void grow_buckets(ExprCache_t *cache) {
+    size_t count = cache->bucket_count * 2;
+    CacheEntry_t **buckets = calloc(count, sizeof(CacheEntry_t *));
+    if (!buckets)
+        return;
+
+    CacheEntry_t **old = cache->buckets;
+    size_t old_count = cache->bucket_count;
+    cache->buckets = buckets;
+    cache->bucket_count = count;
+
+    for (size_t i = 0; i < old_count; i++) {
+        CacheEntry_t *entry = old[i];
+        while (entry) {
+            CacheEntry_t *next = entry->bucket_next;
+            size_t b = bucket_of(cache, entry->hash);
+            entry->bucket_next = buckets[b];
+            buckets[b] = entry;
+            entry = next;
+        }
+    }
+
+    free(old);
+}
+
+// Push a node on the walk stack. Returns 0 if the stack could not grow.
+static int walk_push(ExprCache_t *cache, size_t *depth, ASTNode_t *node,
+                     ASTNode_t **copy) {
+    if (*depth == cache->walk_cap) {
+        size_t cap = cache->walk_cap ? cache->walk_cap * 2 : 64;
+        CacheWalk_t *walk = realloc(cache->walk, cap * sizeof(CacheWalk_t));
+        if (!walk) {
+            fprintf(stderr, "Error: Memory allocation failed for cache entry\n");
+            return 0;
+        }
+        cache->walk = walk;
+        cache->walk_cap = cap;
+    }
+
+    cache->walk[(*depth)++] = (CacheWalk_t){node, copy};
+    return 1;
+}
+
+// Count the nodes of a tree and the bytes of its variable names. Returns 0
+// if out of memory.
+static int measure_tree(ExprCache_t *cache, ASTNode_t *root, size_t *nodes,
+                        size_t *names) {
+    size_t depth = 0;
+    int ok = walk_push(cache, &depth, root, NULL);
+
+    while (ok && depth > 0) {
+        ASTNode_t *node = cache->walk[--depth].node;
+        (*nodes)++;
+        if (node->type == AST_VARIABLE && node->data.variable.name)
+            *names += strlen(node->data.variable.name) + 1;
+
+        ASTNode_t **operand;
+        for (int i = 0; ok && (operand = ast_operand(node, i)) != NULL; i++)
+            ok = !*operand || walk_push(cache, &depth, *operand, NULL);
+    }
+
+    return ok;
+}
+
+// Copy a tree into consecutive nodes in pre-order, names are copied into the
+// name area. Returns the copy, or NULL if out of memory.
+static ASTNode_t *copy_tree(ExprCache_t *cache, ASTNode_t *root, ASTNode_t **next_node,
+                            char **next_name) {
+    ASTNode_t *result = NULL;
+    size_t depth = 0;
+    int ok = walk_push(cache, &depth, root, &result);
+
+    while (ok && depth > 0) {
+        CacheWalk_t item = cache->walk[--depth];
+        ASTNode_t *node = item.node;
+
+        // Shared subtrees of a DAG are copied once per parent, so the copy is
+        // a plain tree
+        ASTNode_t *copy = (*next_node)++;
+        *copy = *node;
+        copy->shared = -1;
+        *item.copy = copy;
+
+        if (node->type == AST_VARIABLE && node->data.variable.name) {
+            size_t len = strlen(node->data.variable.name) + 1;
+            memcpy(*next_name, node->data.variable.name, len);
+            copy->data.variable.name = *next_name;
+            *next_name += len;
+        }
+
+        // Right operand first, so the left one is copied next
+        int count = 0;
+        while (ast_operand(copy, count))
+            count++;
+        for (int i = count - 1; ok && i >= 0; i--) {
+            ASTNode_t **operand = ast_operand(copy, i);
+            ok = !*operand || walk_push(cache, &depth, *operand, operand);
+        }
+    }
+
+    return ok ? result : NULL;
+}
+
+// Look up an expression by its source text. Returns the cached tree, which
+// stays valid until the next insert, or NULL on a miss.
+ASTNode_t *cache_lookup(ExprCache_t *cache, const char *input, size_t len) {
+    uint64_t hash;
+    long key_len = normalize(cache, input, len, &hash);
+    if (key_len <= 0)
+        return NULL;
+
+    CacheEntry_t *entry = find_entry(cache, cache->scratch, key_len, hash);
+    if (!entry) {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    if (entry != cache->newest) {
+        list_unlink(cache, entry);
+        list_push_newest(cache, entry);
+    }
+
+    return entry->ast;
+}
+
+// Store a copy of the tree parsed from input, evicting the least recently
+// used entries to stay under the memory cap. The caller keeps ownership of
+// ast. Returns the cached copy, or NULL if it could not be stored.
+ASTNode_t *cache_insert(ExprCache_t *cache, const char *input, size_t len,
+                        ASTNode_t *ast) {
+    uint64_t hash;
+    long key_len = normalize(cache, input, len, &hash);
+    if (key_len <= 0 || !ast)
+        return NULL;
+
+    CacheEntry_t *entry = find_entry(cache, cache->scratch, key_len, hash);
+    if (entry)
+        return entry->ast;
+
+    size_t nodes = 0;
+    size_t names = 0;
+    if (!measure_tree(cache, ast, &nodes, &names))
+        return NULL;
+
+    // Header, nodes, key and names share one block, nodes need no padding
+    // since the header is made of 8 byte fields like a node
+    size_t size = sizeof(CacheEntry_t) + nodes * sizeof(ASTNode_t) + key_len + names;
+    if (size > cache->max_bytes)
+        return NULL;
+
+    while (cache->bytes + size > cache->max_bytes)
+        evict_oldest(cache);
+
+    entry = malloc(size);
+    if (!entry) {
+        fprintf(stderr, "Error: Memory allocation failed for cache entry\n");
+        return NULL;
+    }
+    STATS_COUNT(STATS_MALLOCS, 1);
+    STATS_COUNT(STATS_MALLOC_BYTES, size);
+
+    ASTNode_t *node_area = (ASTNode_t *)(entry + 1);
+    char *key = (char *)(node_area + nodes);
+    char *name_area = key + key_len;
+
+    memcpy(key, cache->scratch, key_len);
+    entry->hash = hash;
+    entry->key = key;
+    entry->key_len = key_len;
+    entry->size = size;
+    entry->ast = copy_tree(cache, ast, &node_area, &name_area);
+    if (!entry->ast) {
+        free(entry);
+        return NULL;
+    }
+
+    if (cache->entries >= cache->bucket_count)
+        grow_buckets(cache);
+
+    size_t b = bucket_of(cache, hash);
+    entry->bucket_next = cache->buckets[b];
+    cache->buckets[b] = entry;
+    list_push_newest(cache, entry);
+
+    cache->entries++;
+    cache->bytes += size;
+
+    return entry->ast;
+}
+
+// Print the cache counters
+void cache_print_stats(const ExprCache_t *cache) {
+    size_t lookups = cache->hits + cache->misses;
+    double rate = lookups ? 100.0 * cache->hits / lookups : 0.0;
+
+    printf("Cache: %zu hits, %zu misses (%.1f%% hit rate), %zu evictions\n", cache->hits,
+           cache->misses, rate, cache->evictions);
+    printf("Cache: %zu entries using %zu of %zu bytes\n", cache->entries, cache->bytes,
+           cache->max_bytes);
+}
@@ -0,0 +1,225 @@
+#include "../include/calc.h"
+#include "../include/batch.h"
+#include "../include/optimizer.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Variables only ever grow, so the slot of a name never changes and trees in
+// the cache stay valid for every later call
+struct CalcContext {
+    BatchContext_t batch; // lexer, parser, arena and cache reused by every call
+    const char **names;   // bound variable names, slot i is names[i]
+    double *values;       // value of every slot
+    int var_count;        // slots in use
+    int var_capacity;     // slots allocated
+};
+
+// Status of a parser or evaluator message, everything the parser reports
+// other than an unknown name is a syntax error
+static CalcStatus status_of(const char *msg, int parsing) {
+    if (strcmp(msg, "Unknown variable") == 0)
+        return CALC_ERR_UNKNOWN_VARIABLE;
+    if (strcmp(msg, "Division by zero") == 0)
+        return CALC_ERR_DIVISION_BY_ZERO;
+    return parsing ? CALC_ERR_SYNTAX : CALC_ERR_EVAL;
+}
+
+// Fill in the caller's error, if any, and return its status
+static CalcStatus fail(CalcError_t *error, CalcStatus status, int position,
+                       const char *msg) {
+    if (error) {
+        error->status = status;
+        error->position = position;
+        error->message = msg ? msg : calc_status_string(status);
+    }
+    return status;
+}
+
+// Create a context. cache_bytes caps the cache of parsed expressions, 0
+// disables it. Returns NULL if an allocation fails.
+CalcContext_t *calc_init(size_t cache_bytes) {
+    CalcContext_t *ctx = calloc(1, sizeof(CalcContext_t));
+    if (!ctx)
+        return NULL;
+
+    BatchOptions_t options = {cache_bytes, NUMFMT_G6, OPT_ALL};
+    if (batch_context_init(&ctx->batch, &options) != 0) {
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+// Release a context and everything it owns
+void calc_free(CalcContext_t *ctx) {
+    if (!ctx)
+        return;
+
+    for (int i = 0; i < ctx->var_count; i++)
+        free((char *)ctx->names[i]);
+    free(ctx->names);
+    free(ctx->values);
+    batch_context_free(&ctx->batch);
+    free(ctx);
+}
+
+// A name the lexer reads as one identifier
+static int valid_name(const char *name) {
+    if (!(name[0] == '_' || (name[0] | 0x20) - 'a' < 26u))
+        return 0;
+
+    for (const char *p = name + 1; *p; p++) {
+        if (!(*p == '_' || (*p | 0x20) - 'a' < 26u || (unsigned)(*p - '0') < 10u))
+            return 0;
+    }
+    return 1;
+}
+
+// Bind a variable for every later calc_eval, or change its value
+CalcStatus calc_set_var(CalcContext_t *ctx, const char *name, double value) {
+    if (!ctx || !name || !valid_name(name))
+        return CALC_ERR_INVALID;
+
+    for (int i = 0; i < ctx->var_count; i++) {
+        if (strcmp(ctx->names[i], name) == 0) {
+            ctx->values[i] = value;
+            return CALC_OK;
+        }
+    }
+
+    if (ctx->var_count == ctx->var_capacity) {
+        int capacity = ctx->var_capacity ? ctx->var_capacity * 2 : 8;
+        const char **names = realloc(ctx->names, capacity * sizeof(const char *));
+        if (!names)
+            return CALC_ERR_MEMORY;
+        ctx->names = names;
+
+        double *values = realloc(ctx->values, capacity * sizeof(double));
+        if (!values)
+            return CALC_ERR_MEMORY;
+        ctx->values = values;
+        ctx->var_capacity = capacity;
+    }
+
+    char *copy = strdup(name);
+    if (!copy)
+        return CALC_ERR_MEMORY;
+
+    ctx->names[ctx->var_count] = copy;
+    ctx->values[ctx->var_count] = value;
+    ctx->var_count++;
+
+    return CALC_OK;
+}
+
+// Parse and evaluate an input for calc_eval and calc_eval_format, result
+// keeps the int64 value of an exact root
+static CalcStatus eval_input(CalcContext_t *ctx, const char *input, size_t length,
+                             ASTValue_t *result, CalcError_t *error) {
+    BatchContext_t *batch = &ctx->batch;
+    Parser_t *parser = batch->parser;
+    ASTNode_t *ast = batch->cache ? cache_lookup(batch->cache, input, length) : NULL;
+
+    if (!ast) {
+        lexer_reset(batch->lexer, input, (int)length);
+        arena_reset(batch->arena);
+        parser_reset(parser);
+
+        if (parser->curr_token.type == TOKEN_EOF)
+            return fail(error, CALC_ERR_EMPTY, -1, NULL);
+
+        // The bound variables are the only names the input may use
+        parser->symbols.names = ctx->names;
+        parser->symbols.count = ctx->var_count;
+        parser->symbols.capacity = ctx->var_count;
+        parser->symbols.fixed = 1;
+
+        ast = parser_parse(parser);
+        if (!ast) {
+            if (!parser->error)
+                return fail(error, CALC_ERR_MEMORY, -1, NULL);
+            return fail(error, status_of(parser->error, 1), parser->error_pos,
+                        parser->error);
+        }
+
+        // Every tree gets the caller's passes, cached ones once for every repeat
+        if (batch->optimizer_flags)
+            ast = ast_optimize(ast, batch->optimizer_flags, NULL);
+        if (batch->cache)
+            cache_insert(batch->cache, input, length, ast);
+    }
+
+    *result = ast_eval_value(ast, ctx->values);
+    if (result->error)
+        return fail(error, status_of(result->error, 0), -1, result->error);
+
+    if (error)
+        fail(error, CALC_OK, -1, NULL);
+    return CALC_OK;
+}
+
+// Parse and evaluate length bytes of input, the input does not need to be
+// NUL terminated. On success the value is stored in result, on failure
+// result is 0 and error, if given, says what went wrong, and for parse
+// errors where. Evaluation errors have position -1, the tree keeps no
+// offsets and an optimized or cached one no longer matches the input.
+CalcStatus calc_eval(CalcContext_t *ctx, const char *input, size_t length, double *result,
+                     CalcError_t *error) {
+    if (!ctx || !input || !result)
+        return fail(error, CALC_ERR_INVALID, -1, NULL);
+
+    ASTValue_t value;
+    CalcStatus status = eval_input(ctx, input, length, &value, error);
+    *result = status == CALC_OK ? value.value : 0.0;
+    return status;
+}
+
+// Same as calc_eval with the result written to buf like calc_format writes
+// it, except that the shortest text of an exact integer result has all its
+// digits, also above 2^53 where the double loses some. On failure buf is
+// empty. buf holds CALC_FORMAT_BUF_SIZE bytes. Returns the status.
+CalcStatus calc_eval_format(CalcContext_t *ctx, const char *input, size_t length,
+                            int shortest, char *buf, CalcError_t *error) {
+    if (!ctx || !input || !buf)
+        return fail(error, CALC_ERR_INVALID, -1, NULL);
+
+    buf[0] = '\0';
+    ASTValue_t value;
+    CalcStatus status = eval_input(ctx, input, length, &value, error);
+    if (status == CALC_OK)
+        numfmt_format_exact(value.value, value.integer,
+                            shortest ? NUMFMT_SHORTEST : NUMFMT_G6, buf);
+    return status;
+}
+
+// Write a result like the calculator prints it, %.6g or the shortest text
+// that reads back as the same double. buf holds CALC_FORMAT_BUF_SIZE bytes.
+// Returns the length written, not counting the NUL.
+int calc_format(double value, int shortest, char *buf) {
+    return numfmt_format(value, shortest ? NUMFMT_SHORTEST : NUMFMT_G6, buf);
+}
+
+// Description of a status
+const char *calc_status_string(CalcStatus status) {
+    switch (status) {
+    case CALC_OK:
+        return "OK";
+    case CALC_ERR_EMPTY:
+        return "Empty expression";
+    case CALC_ERR_SYNTAX:
+        return "Syntax error";
+    case CALC_ERR_UNKNOWN_VARIABLE:
+        return "Unknown variable";
+    case CALC_ERR_DIVISION_BY_ZERO:
+        return "Division by zero";
+    case CALC_ERR_EVAL:
+        return "Evaluation error";
+    case CALC_ERR_MEMORY:
+        return "Memory allocation failed";
+    case CALC_ERR_INVALID:
+        return "Invalid argument";
+    default:
+        return "Unknown status";
+    }
+}
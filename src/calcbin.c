@@ -0,0 +1,562 @@
+#include "../include/calcbin.h"
+#include "../include/sheet.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Expression of a file being written, in name order
+typedef struct {
+    const char *name;
+    PreparedExpr_t *expr;
+} WriteItem_t;
+
+// Order expressions by name for the index
+static int compare_items(const void *a, const void *b) {
+    return strcmp(((const WriteItem_t *)a)->name, ((const WriteItem_t *)b)->name);
+}
+
+// Round a file offset up to a multiple of 8
+static uint64_t align8(uint64_t offset) { return (offset + 7) & ~(uint64_t)7; }
+
+// Write a whole buffer, retrying short writes. Returns -1 on failure.
+static int write_all(int fd, const unsigned char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0)
+            return -1;
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+// Store prepared expressions under their names in a calcbin file. Each one's
+// program, constants and variable names are copied as they are, so a
+// program loaded from the file computes what expr_execute computes without
+// the JIT. Returns 0, or -1 if a name repeats or the file cannot be written.
+int calcbin_write(const char *path, const char *const *names,
+                  PreparedExpr_t *const *exprs, int count) {
+    WriteItem_t *items = malloc((count + 1) * sizeof(WriteItem_t));
+    if (!items) {
+        fprintf(stderr, "Error: Memory allocation failed for calcbin index\n");
+        return -1;
+    }
+
+    uint64_t code_count = 0;
+    uint64_t const_count = 0;
+    uint64_t var_count = 0;
+    uint64_t string_size = 1; // offset 0 is the empty string
+    CalcBinHeader_t header;
+    memset(&header, 0, sizeof(header));
+
+    for (int i = 0; i < count; i++) {
+        const Bytecode_t *bc = exprs[i]->bc;
+        items[i] = (WriteItem_t){names[i], exprs[i]};
+        code_count += bc->code_len;
+        const_count += bc->const_count;
+        var_count += exprs[i]->var_count;
+        string_size += strlen(names[i]) + 1;
+        for (int v = 0; v < exprs[i]->var_count; v++)
+            string_size += strlen(exprs[i]->var_names[v]) + 1;
+
+        if ((uint32_t)bc->max_stack > header.max_stack)
+            header.max_stack = bc->max_stack;
+        if ((uint32_t)bc->temp_count > header.max_temps)
+            header.max_temps = bc->temp_count;
+        if ((uint32_t)exprs[i]->var_count > header.max_vars)
+            header.max_vars = exprs[i]->var_count;
+    }
+
+    qsort(items, count, sizeof(WriteItem_t), compare_items);
+    for (int i = 1; i < count; i++) {
+        if (strcmp(items[i - 1].name, items[i].name) == 0) {
+            fprintf(stderr, "Error: Duplicate expression name: %s\n", items[i].name);
+            free(items);
+            return -1;
+        }
+    }
+
+    // Entries refer to their sections with 32-bit indexes
+    if (code_count > UINT32_MAX || const_count > UINT32_MAX || var_count > UINT32_MAX ||
+        string_size > UINT32_MAX) {
+        fprintf(stderr, "Error: Too many expressions for one calcbin file\n");
+        free(items);
+        return -1;
+    }
+
+    // Constants come first after the index, so every section stays aligned
+    memcpy(header.magic, CALCBIN_MAGIC, sizeof(CALCBIN_MAGIC));
+    header.version = CALCBIN_VERSION;
+    header.byte_order = CALCBIN_BYTE_ORDER;
+    header.expr_count = count;
+    header.index_offset = align8(sizeof(CalcBinHeader_t));
+    header.const_offset = header.index_offset + (uint64_t)count * sizeof(CalcBinEntry_t);
+    header.const_count = const_count;
+    header.code_offset = header.const_offset + const_count * sizeof(double);
+    header.code_count = code_count;
+    header.var_offset = header.code_offset + code_count * sizeof(uint32_t);
+    header.var_count = var_count;
+    header.string_offset = header.var_offset + var_count * sizeof(uint32_t);
+    header.string_size = string_size;
+    header.file_size = align8(header.string_offset + string_size);
+
+    unsigned char *file = calloc(header.file_size, 1);
+    if (!file) {
+        fprintf(stderr, "Error: Memory allocation failed for calcbin file\n");
+        free(items);
+        return -1;
+    }
+
+    memcpy(file, &header, sizeof(header));
+    CalcBinEntry_t *entries = (CalcBinEntry_t *)(file + header.index_offset);
+    double *consts = (double *)(file + header.const_offset);
+    uint32_t *code = (uint32_t *)(file + header.code_offset);
+    uint32_t *vars = (uint32_t *)(file + header.var_offset);
+    char *strings = (char *)(file + header.string_offset);
+
+    uint32_t code_pos = 0;
+    uint32_t const_pos = 0;
+    uint32_t var_pos = 0;
+    uint32_t string_pos = 1;
+
+    for (int i = 0; i < count; i++) {
+        const PreparedExpr_t *expr = items[i].expr;
+        const Bytecode_t *bc = expr->bc;
+        CalcBinEntry_t *entry = &entries[i];
+
+        entry->name = string_pos;
+        size_t length = strlen(items[i].name) + 1;
+        memcpy(strings + string_pos, items[i].name, length);
+        string_pos += length;
+
+        entry->code = code_pos;
+        entry->code_len = bc->code_len;
+        memcpy(code + code_pos, bc->code, bc->code_len * sizeof(uint32_t));
+        code_pos += bc->code_len;
+
+        entry->consts = const_pos;
+        entry->const_count = bc->const_count;
+        memcpy(consts + const_pos, bc->consts, bc->const_count * sizeof(double));
+        const_pos += bc->const_count;
+
+        entry->vars = var_pos;
+        entry->var_count = expr->var_count;
+        for (int v = 0; v < expr->var_count; v++) {
+            vars[var_pos++] = string_pos;
+            length = strlen(expr->var_names[v]) + 1;
+            memcpy(strings + string_pos, expr->var_names[v], length);
+            string_pos += length;
+        }
+
+        entry->max_stack = bc->max_stack;
+        entry->temp_count = bc->temp_count;
+    }
+
+    free(items);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        free(file);
+        return -1;
+    }
+
+    int status = write_all(fd, file, header.file_size);
+    if (status != 0)
+        perror(path);
+    if (close(fd) != 0 && status == 0) {
+        perror(path);
+        status = -1;
+    }
+    if (status != 0)
+        unlink(path);
+
+    free(file);
+    return status;
+}
+
+// Growable lists of the expressions read by calcbin_compile
+typedef struct {
+    char **names;
+    PreparedExpr_t **exprs;
+    int count;
+    int capacity;
+} CompileList_t;
+
+// Append an expression and take ownership of name. Returns -1 if the lists
+// could not grow.
+static int compile_list_add(CompileList_t *list, char *name, PreparedExpr_t *expr) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        char **names = realloc(list->names, capacity * sizeof(char *));
+        if (names)
+            list->names = names;
+        PreparedExpr_t **exprs =
+            names ? realloc(list->exprs, capacity * sizeof(PreparedExpr_t *)) : NULL;
+        if (!exprs) {
+            fprintf(stderr, "Error: Memory allocation failed for calcbin input\n");
+            return -1;
+        }
+        list->exprs = exprs;
+        list->capacity = capacity;
+    }
+
+    list->names[list->count] = name;
+    list->exprs[list->count] = expr;
+    list->count++;
+    return 0;
+}
+
+// Prepare one line of a formula file and add it under its name, the one
+// of "name = expr" or else the line number, optimized with the
+// optimizer_flags passes. Blank lines are skipped.
+// Returns -1 if the line does not compile.
+static int compile_line(CompileList_t *list, const char *line, int line_number,
+                        int optimizer_flags) {
+    const char *p = line;
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+        p++;
+    if (*p == '\0')
+        return 0;
+
+    int name_length;
+    const char *expr_text;
+    const char *name_start = sheet_split_assignment(line, &name_length, &expr_text);
+
+    char number[16];
+    if (!name_start) {
+        name_length = snprintf(number, sizeof(number), "%d", line_number);
+        name_start = number;
+        expr_text = line;
+    }
+
+    PreparedExpr_t *expr = expr_prepare_opt(expr_text, NULL, 0, optimizer_flags);
+    if (!expr) {
+        fprintf(stderr, "Error: Line %d does not compile\n", line_number);
+        return -1;
+    }
+
+    char *name = malloc(name_length + 1);
+    if (!name) {
+        fprintf(stderr, "Error: Memory allocation failed for calcbin input\n");
+        expr_free(expr);
+        return -1;
+    }
+
+    memcpy(name, name_start, name_length);
+    name[name_length] = '\0';
+    if (compile_list_add(list, name, expr) != 0) {
+        free(name);
+        expr_free(expr);
+        return -1;
+    }
+    return 0;
+}
+
+// Parse, optimize with the optimizer_flags passes and compile every line of
+// a formula file and write the programs to a calcbin file. count receives
+// the number of expressions and may be NULL. Returns 0, or -1 on the first
+// line that does not compile.
+int calcbin_compile(const char *in_path, const char *out_path, int optimizer_flags,
+                    int *count) {
+    FILE *in = fopen(in_path, "r");
+    if (!in) {
+        perror(in_path);
+        return -1;
+    }
+
+    CompileList_t list = {0};
+    size_t line_capacity = 256;
+    char *line = malloc(line_capacity);
+    int status = 0;
+    int line_number = 0;
+
+    // Read whole lines of any length
+    while (status == 0) {
+        size_t length = 0;
+        while (line && fgets(line + length, line_capacity - length, in)) {
+            length += strlen(line + length);
+            if (line[length - 1] == '\n' || length + 1 < line_capacity)
+                break;
+
+            char *grown = realloc(line, line_capacity * 2);
+            if (!grown)
+                free(line);
+            line = grown;
+            line_capacity *= 2;
+        }
+        if (!line) {
+            fprintf(stderr, "Error: Memory allocation failed for calcbin input\n");
+            status = -1;
+        }
+        if (length == 0 || status != 0)
+            break;
+
+        if (line[length - 1] == '\n')
+            line[--length] = '\0';
+        status = compile_line(&list, line, ++line_number, optimizer_flags);
+    }
+
+    if (status == 0 && ferror(in)) {
+        fprintf(stderr, "Error: Cannot read %s\n", in_path);
+        status = -1;
+    }
+    fclose(in);
+    free(line);
+
+    if (status == 0)
+        status = calcbin_write(out_path, (const char *const *)list.names, list.exprs,
+                               list.count);
+    if (status == 0 && count)
+        *count = list.count;
+
+    for (int i = 0; i < list.count; i++) {
+        free(list.names[i]);
+        expr_free(list.exprs[i]);
+    }
+    free(list.names);
+    free(list.exprs);
+    return status;
+}
+
+// Check that count elements of size bytes at offset lie inside the file,
+// with offset a multiple of align
+static int section_fits(const CalcBin_t *bin, uint64_t offset, uint64_t count,
+                        size_t size, size_t align) {
+    return offset % align == 0 && offset <= bin->size &&
+           count <= (bin->size - offset) / size;
+}
+
+// Check a program the way the VM will run it: every opcode known, every
+// operand inside the program's constants, variables and temps, and the
+// operand stack never below its start or above max_stack. The program must
+// end with its only OP_END, leaving exactly one value.
+static int program_valid(const uint32_t *code, const CalcBinEntry_t *entry) {
+    uint32_t depth = 0;
+
+    for (uint32_t i = 0; i < entry->code_len; i++) {
+        uint32_t arg = BC_ARG(code[i]);
+        uint32_t pops = 0;
+        uint32_t pushes = 0;
+
+        switch (BC_OP(code[i])) {
+        case OP_CONST:
+            if (arg >= entry->const_count)
+                return 0;
+            pushes = 1;
+            break;
+        case OP_LOAD:
+            if (arg >= entry->var_count)
+                return 0;
+            pushes = 1;
+            break;
+        case OP_TEMP:
+            if (arg >= entry->temp_count)
+                return 0;
+            pushes = 1;
+            break;
+        case OP_STORE:
+            if (arg >= entry->temp_count || depth < 1)
+                return 0;
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_POW:
+            pops = 2;
+            pushes = 1;
+            break;
+        case OP_NEG:
+        case OP_POWI:
+        case OP_SQRT:
+            pops = 1;
+            pushes = 1;
+            break;
+        case OP_END:
+            return i == entry->code_len - 1 && depth == 1;
+        default:
+            return 0;
+        }
+
+        if (depth < pops)
+            return 0;
+        depth += pushes - pops;
+        if (depth > entry->max_stack)
+            return 0;
+    }
+
+    return 0;
+}
+
+// Check everything the VM and the lookups will trust, returns what is wrong
+// or NULL for a valid file
+static const char *check_file(CalcBin_t *bin) {
+    const CalcBinHeader_t *header = (const CalcBinHeader_t *)bin->base;
+
+    if (bin->size < sizeof(CalcBinHeader_t) ||
+        memcmp(header->magic, CALCBIN_MAGIC, sizeof(CALCBIN_MAGIC)) != 0)
+        return "Not a calcbin file";
+    if (header->byte_order != CALCBIN_BYTE_ORDER)
+        return "Written with another byte order";
+    if (header->version != CALCBIN_VERSION)
+        return "Unsupported calcbin version";
+    if (header->file_size != bin->size)
+        return "File size does not match its header";
+
+    if (header->expr_count > INT32_MAX ||
+        !section_fits(bin, header->index_offset, header->expr_count,
+                      sizeof(CalcBinEntry_t), 8) ||
+        !section_fits(bin, header->const_offset, header->const_count,
+                      sizeof(double), 8) ||
+        !section_fits(bin, header->code_offset, header->code_count,
+                      sizeof(uint32_t), 4) ||
+        !section_fits(bin, header->var_offset, header->var_count, sizeof(uint32_t), 4) ||
+        !section_fits(bin, header->string_offset, header->string_size, 1, 1))
+        return "Section outside the file";
+
+    // With a NUL last, every offset inside the section starts a C string
+    const char *strings = (const char *)bin->base + header->string_offset;
+    if (header->string_size == 0 || strings[header->string_size - 1] != '\0')
+        return "Unterminated string section";
+
+    bin->header = header;
+    bin->entries = (const CalcBinEntry_t *)(bin->base + header->index_offset);
+    bin->consts = (const double *)(bin->base + header->const_offset);
+    bin->code = (const uint32_t *)(bin->base + header->code_offset);
+    bin->vars = (const uint32_t *)(bin->base + header->var_offset);
+    bin->strings = strings;
+    bin->count = (int)header->expr_count;
+
+    for (int i = 0; i < bin->count; i++) {
+        const CalcBinEntry_t *entry = &bin->entries[i];
+
+        if (entry->name >= header->string_size ||
+            (uint64_t)entry->code + entry->code_len > header->code_count ||
+            (uint64_t)entry->consts + entry->const_count > header->const_count ||
+            (uint64_t)entry->vars + entry->var_count > header->var_count ||
+            entry->max_stack > header->max_stack ||
+            entry->temp_count > header->max_temps ||
+            entry->var_count > header->max_vars)
+            return "Expression outside its sections";
+
+        if (i > 0 &&
+            strcmp(strings + bin->entries[i - 1].name, strings + entry->name) >= 0)
+            return "Index not sorted by name";
+
+        for (uint32_t v = 0; v < entry->var_count; v++) {
+            if (bin->vars[entry->vars + v] >= header->string_size)
+                return "Variable name outside the string section";
+        }
+
+        if (!program_valid(bin->code + entry->code, entry))
+            return "Invalid program";
+    }
+
+    return NULL;
+}
+
+// Map a calcbin file read only and check it once, after which expressions
+// are looked up and run in place. Returns 0, or -1 with bin cleared if the
+// file cannot be mapped or is not a valid calcbin file of this version.
+int calcbin_open(CalcBin_t *bin, const char *path) {
+    memset(bin, 0, sizeof(CalcBin_t));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    if ((size_t)st.st_size < sizeof(CalcBinHeader_t)) {
+        fprintf(stderr, "Error: %s: Not a calcbin file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+
+    bin->base = data;
+    bin->size = st.st_size;
+
+    const char *problem = check_file(bin);
+    if (problem) {
+        fprintf(stderr, "Error: %s: %s\n", path, problem);
+        calcbin_close(bin);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Unmap a file opened by calcbin_open
+void calcbin_close(CalcBin_t *bin) {
+    if (bin->base)
+        munmap((void *)bin->base, bin->size);
+    memset(bin, 0, sizeof(CalcBin_t));
+}
+
+// Index of the expression with this name, -1 if there is none
+int calcbin_find(const CalcBin_t *bin, const char *name) {
+    int low = 0;
+    int high = bin->count - 1;
+
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        int order = strcmp(bin->strings + bin->entries[mid].name, name);
+        if (order == 0)
+            return mid;
+        if (order < 0)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+
+    return -1;
+}
+
+// Name of an expression, index order is name order
+const char *calcbin_name(const CalcBin_t *bin, int index) {
+    return bin->strings + bin->entries[index].name;
+}
+
+// Variable slots an expression reads, vars passed to calcbin_eval needs as many
+int calcbin_var_count(const CalcBin_t *bin, int index) {
+    return (int)bin->entries[index].var_count;
+}
+
+// Name of the variable an expression reads from a slot
+const char *calcbin_var_name(const CalcBin_t *bin, int index, int slot) {
+    return bin->strings + bin->vars[bin->entries[index].vars + slot];
+}
+
+// Doubles of scratch space calcbin_eval needs for any expression of the file
+size_t calcbin_scratch_size(const CalcBin_t *bin) {
+    return (size_t)bin->header->max_stack + bin->header->max_temps + 1;
+}
+
+// Run an expression straight from the mapping, with vars[i] bound to slot i
+// and scratch holding calcbin_scratch_size(bin) doubles. Nothing is parsed
+// or allocated.
+double calcbin_eval(const CalcBin_t *bin, int index, const double *vars,
+                    double *scratch) {
+    const CalcBinEntry_t *entry = &bin->entries[index];
+    return bytecode_run(bin->code + entry->code, bin->consts + entry->consts, scratch,
+                        scratch + bin->header->max_stack, vars);
+}
@@ -0,0 +1,601 @@
+#include "../include/columneval.h"
+#include "../include/numparse.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Blocks are computed with vector instructions on x86-64, SSE2 is always
+// there and AVX2 is picked at run time
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(CALC_NO_SIMD)
+#define COLUMN_SIMD 1
+#include <immintrin.h>
+#endif
+
+// One instruction applied to n rows of a block. a holds the left or only
+// operand, b the right one (a again for unary instructions), dst may be a.
+typedef void (*BlockKernel)(uint32_t instr, double *dst, const double *a, const double *b,
+                            int n);
+
+// Row by row, the same operations run_program does for one row
+static void block_scalar(uint32_t instr, double *dst, const double *a, const double *b,
+                         int n) {
+    switch (BC_OP(instr)) {
+    case OP_ADD:
+        for (int i = 0; i < n; i++)
+            dst[i] = a[i] + b[i];
+        break;
+    case OP_SUB:
+        for (int i = 0; i < n; i++)
+            dst[i] = a[i] - b[i];
+        break;
+    case OP_MUL:
+        for (int i = 0; i < n; i++)
+            dst[i] = a[i] * b[i];
+        break;
+    case OP_DIV:
+        for (int i = 0; i < n; i++)
+            dst[i] = b[i] == 0.0 ? 0.0 : a[i] / b[i];
+        break;
+    case OP_POW:
+        for (int i = 0; i < n; i++)
+            dst[i] = pow(a[i], b[i]);
+        break;
+    case OP_NEG:
+        for (int i = 0; i < n; i++)
+            dst[i] = -a[i];
+        break;
+    case OP_POWI:
+        for (int i = 0; i < n; i++)
+            dst[i] = ast_powi(a[i], BC_SARG(instr));
+        break;
+    case OP_SQRT:
+        for (int i = 0; i < n; i++)
+            dst[i] = ast_sqrt(a[i]);
+        break;
+    default:
+        break;
+    }
+}
+
+#ifdef COLUMN_SIMD
+
+// Run expr over every whole vector of the block, x and y are the lanes of
+// a and b. Rows left over are done by block_scalar.
+#define LANES_128(expr)                                                                  \
+    for (; i + 2 <= n; i += 2) {                                                         \
+        __m128d x = _mm_loadu_pd(a + i), y = _mm_loadu_pd(b + i);                        \
+        (void)y;                                                                         \
+        _mm_storeu_pd(dst + i, expr);                                                    \
+    }
+#define LANES_256(expr)                                                                  \
+    for (; i + 4 <= n; i += 4) {                                                         \
+        __m256d x = _mm256_loadu_pd(a + i), y = _mm256_loadu_pd(b + i);                  \
+        (void)y;                                                                         \
+        _mm256_storeu_pd(dst + i, expr);                                                 \
+    }
+
+// ast_powi on two lanes, the same multiplies in the same order
+static inline __m128d powi_128(__m128d base, int exponent) {
+    unsigned n = exponent < 0 ? -(unsigned)exponent : (unsigned)exponent;
+    __m128d result = _mm_set1_pd(1.0);
+
+    while (n) {
+        if (n & 1)
+            result = _mm_mul_pd(result, base);
+        n >>= 1;
+        if (n)
+            base = _mm_mul_pd(base, base);
+    }
+
+    return exponent < 0 ? _mm_div_pd(_mm_set1_pd(1.0), result) : result;
+}
+
+// ast_sqrt on two lanes, -inf gives +inf and -0 gives +0
+static inline __m128d sqrt_128(__m128d x) {
+    __m128d root = _mm_add_pd(_mm_sqrt_pd(x), _mm_setzero_pd());
+    __m128d minus_inf = _mm_cmpeq_pd(x, _mm_set1_pd(-INFINITY));
+    return _mm_or_pd(_mm_andnot_pd(minus_inf, root),
+                     _mm_and_pd(minus_inf, _mm_set1_pd(INFINITY)));
+}
+
+// Two rows at a time. Division masks lanes with a zero divisor to +0 and
+// pow has no vector form, it is called per row without going back to the
+// dispatch loop.
+static void block_sse2(uint32_t instr, double *dst, const double *a, const double *b,
+                       int n) {
+    int i = 0;
+
+    switch (BC_OP(instr)) {
+    case OP_ADD:
+        LANES_128(_mm_add_pd(x, y))
+        break;
+    case OP_SUB:
+        LANES_128(_mm_sub_pd(x, y))
+        break;
+    case OP_MUL:
+        LANES_128(_mm_mul_pd(x, y))
+        break;
+    case OP_DIV:
+        LANES_128(_mm_andnot_pd(_mm_cmpeq_pd(y, _mm_setzero_pd()), _mm_div_pd(x, y)))
+        break;
+    case OP_NEG:
+        LANES_128(_mm_xor_pd(x, _mm_set1_pd(-0.0)))
+        break;
+    case OP_POWI:
+        LANES_128(powi_128(x, BC_SARG(instr)))
+        break;
+    case OP_SQRT:
+        LANES_128(sqrt_128(x))
+        break;
+    default:
+        break;
+    }
+
+    block_scalar(instr, dst + i, a + i, b + i, n - i);
+}
+
+// Same for four lanes
+__attribute__((target("avx2"))) static inline __m256d powi_256(__m256d base,
+                                                               int exponent) {
+    unsigned n = exponent < 0 ? -(unsigned)exponent : (unsigned)exponent;
+    __m256d result = _mm256_set1_pd(1.0);
+
+    while (n) {
+        if (n & 1)
+            result = _mm256_mul_pd(result, base);
+        n >>= 1;
+        if (n)
+            base = _mm256_mul_pd(base, base);
+    }
+
+    return exponent < 0 ? _mm256_div_pd(_mm256_set1_pd(1.0), result) : result;
+}
+
+__attribute__((target("avx2"))) static inline __m256d sqrt_256(__m256d x) {
+    __m256d root = _mm256_add_pd(_mm256_sqrt_pd(x), _mm256_setzero_pd());
+    __m256d minus_inf = _mm256_cmp_pd(x, _mm256_set1_pd(-INFINITY), _CMP_EQ_OQ);
+    return _mm256_blendv_pd(root, _mm256_set1_pd(INFINITY), minus_inf);
+}
+
+// Four rows at a time
+__attribute__((target("avx2"))) static void block_avx2(uint32_t instr, double *dst,
+                                                      const double *a, const double *b,
+                                                      int n) {
+    int i = 0;
+
+    switch (BC_OP(instr)) {
+    case OP_ADD:
+        LANES_256(_mm256_add_pd(x, y))
+        break;
+    case OP_SUB:
+        LANES_256(_mm256_sub_pd(x, y))
+        break;
+    case OP_MUL:
+        LANES_256(_mm256_mul_pd(x, y))
+        break;
+    case OP_DIV:
+        LANES_256(_mm256_andnot_pd(_mm256_cmp_pd(y, _mm256_setzero_pd(), _CMP_EQ_OQ),
+                                   _mm256_div_pd(x, y)))
+        break;
+    case OP_NEG:
+        LANES_256(_mm256_xor_pd(x, _mm256_set1_pd(-0.0)))
+        break;
+    case OP_POWI:
+        LANES_256(powi_256(x, BC_SARG(instr)))
+        break;
+    case OP_SQRT:
+        LANES_256(sqrt_256(x))
+        break;
+    default:
+        break;
+    }
+
+    block_scalar(instr, dst + i, a + i, b + i, n - i);
+}
+
+#undef LANES_128
+#undef LANES_256
+
+#endif
+
+// Rows one vector instruction computes on this machine, 1 without them
+int columneval_simd_width(void) {
+#ifdef COLUMN_SIMD
+    return __builtin_cpu_supports("avx2") ? 4 : 2;
+#else
+    return 1;
+#endif
+}
+
+// Evaluate a compiled program for rows rows, variable slot i reading
+// columns[i], with every result written to out. The program is interpreted
+// once per block of rows rather than once per row: an operand is a pointer
+// to a block, column blocks are used in place, and every stack entry and
+// temp has a block of its own. Results are bit for bit those of
+// bytecode_eval on each row. width picks 1, 2 or 4 rows per instruction,
+// 0 or anything the machine lacks the widest it has. Returns 0, or -1 if
+// the scratch blocks could not be allocated.
+int columneval_run(const Bytecode_t *bc, const double *const *columns, size_t rows,
+                   double *out, int width) {
+    int best = columneval_simd_width();
+    if (width <= 0 || width > best)
+        width = best;
+
+    BlockKernel kernel = block_scalar;
+#ifdef COLUMN_SIMD
+    if (width >= 4)
+        kernel = block_avx2;
+    else if (width >= 2)
+        kernel = block_sse2;
+#endif
+
+    // Shorter blocks keep large programs within COLUMN_WORKSPACE, a multiple
+    // of 8 rows so only the last block has a tail
+    size_t slots = (size_t)bc->max_stack + 1 + bc->temp_count + bc->const_count;
+    size_t block = COLUMN_WORKSPACE / slots & ~(size_t)7;
+    if (block < 8)
+        block = 8;
+    if (block > COLUMN_BLOCK)
+        block = COLUMN_BLOCK;
+
+    double *scratch = malloc(slots * block * sizeof(double));
+    const double **stack = malloc((bc->max_stack + 1) * sizeof(double *));
+    if (!scratch || !stack) {
+        fprintf(stderr, "Error: Memory allocation failed for column evaluation\n");
+        free(scratch);
+        free(stack);
+        return -1;
+    }
+
+    double *buffers = scratch; // block of each stack depth
+    double *temps = buffers + (bc->max_stack + 1) * block;
+    double *consts = temps + bc->temp_count * block;
+
+    // Constants are the same in every block, they are spread out once
+    for (int c = 0; c < bc->const_count; c++) {
+        for (size_t i = 0; i < block; i++)
+            consts[c * block + i] = bc->consts[c];
+    }
+
+    for (size_t row = 0; row < rows; row += block) {
+        int n = (int)(rows - row < block ? rows - row : block);
+        int depth = 0;
+
+        for (const uint32_t *ip = bc->code; depth >= 0; ip++) {
+            uint32_t instr = *ip;
+            double *dst;
+
+            switch (BC_OP(instr)) {
+            case OP_CONST:
+                stack[depth++] = consts + BC_ARG(instr) * block;
+                break;
+            case OP_LOAD:
+                stack[depth++] = columns[BC_ARG(instr)] + row;
+                break;
+            case OP_TEMP:
+                stack[depth++] = temps + BC_ARG(instr) * block;
+                break;
+            case OP_STORE:
+                memcpy(temps + BC_ARG(instr) * block, stack[depth - 1],
+                       n * sizeof(double));
+                break;
+            case OP_END:
+                memcpy(out + row, stack[depth - 1], n * sizeof(double));
+                depth = -1;
+                break;
+            case OP_NEG:
+            case OP_POWI:
+            case OP_SQRT:
+                // Results stay at the depth of their operand, in that depth's block
+                dst = buffers + (depth - 1) * block;
+                kernel(instr, dst, stack[depth - 1], stack[depth - 1], n);
+                stack[depth - 1] = dst;
+                break;
+            default:
+                depth--;
+                dst = buffers + (depth - 1) * block;
+                kernel(instr, dst, stack[depth - 1], stack[depth], n);
+                stack[depth - 1] = dst;
+                break;
+            }
+        }
+    }
+
+    free(scratch);
+    free(stack);
+    return 0;
+}
+
+// Whole input of a descriptor, NUL terminated
+static char *read_all(int fd, size_t *length) {
+    size_t cap = 1 << 16;
+    size_t len = 0;
+    char *text = malloc(cap);
+
+    while (text) {
+        if (len + 1 == cap) {
+            char *grown = realloc(text, cap * 2);
+            if (!grown)
+                break;
+            text = grown;
+            cap *= 2;
+        }
+
+        ssize_t n = read(fd, text + len, cap - 1 - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0) {
+                text[len] = '\0';
+                *length = len;
+                return text;
+            }
+            break;
+        }
+        len += n;
+    }
+
+    fprintf(stderr, "Error: Failed to read the columns\n");
+    free(text);
+    return NULL;
+}
+
+// Field of a CSV line from start to the next comma or end, without the
+// blanks around it. Returns where the next field starts, or NULL after the
+// last one.
+static const char *next_field(const char *start, const char *end, const char **field,
+                              int *length) {
+    const char *comma = memchr(start, ',', end - start);
+    const char *stop = comma ? comma : end;
+
+    while (start < stop && (*start == ' ' || *start == '\t'))
+        start++;
+    const char *last = stop;
+    while (last > start && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r'))
+        last--;
+
+    *field = start;
+    *length = (int)(last - start);
+    return comma ? comma + 1 : NULL;
+}
+
+// Value of a field. Plain decimals with an optional sign take the lexer's
+// number parser, anything else strtod reads whole (exponents, inf, nan) is
+// accepted as well. Returns 0, or -1 if the field is not a number.
+static int parse_field(const char *text, int length, double *value) {
+    int sign = length > 0 && (text[0] == '-' || text[0] == '+');
+    int digits = 0, dots = 0, other = 0;
+
+    for (int i = sign; i < length; i++) {
+        if (text[i] >= '0' && text[i] <= '9')
+            digits++;
+        else if (text[i] == '.')
+            dots++;
+        else
+            other++;
+    }
+
+    if (digits && dots <= 1 && !other) {
+        double parsed = numparse_decimal(text + sign, length - sign);
+        *value = text[0] == '-' ? -parsed : parsed;
+        return 0;
+    }
+
+    char copy[64];
+    if (length == 0 || length >= (int)sizeof(copy))
+        return -1;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+
+    char *stop;
+    *value = strtod(copy, &stop);
+    return stop == copy + length ? 0 : -1;
+}
+
+// Add a column by name, values NULL until it is loaded. Returns its index
+// or -1.
+static int add_column(ColumnTable_t *table, const char *name, int length) {
+    int count = table->column_count;
+    char **names = realloc(table->names, (count + 1) * sizeof(char *));
+    if (names)
+        table->names = names;
+    double **values = realloc(table->values, (count + 1) * sizeof(double *));
+    if (values)
+        table->values = values;
+    char *copy = malloc(length + 1);
+
+    if (!names || !values || !copy) {
+        fprintf(stderr, "Error: Memory allocation failed for column %.*s\n", length,
+                name);
+        free(copy);
+        return -1;
+    }
+
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    table->names[count] = copy;
+    table->values[count] = NULL;
+    table->column_count++;
+    return count;
+}
+
+// Read a CSV table from fd into an empty table. The first line names the
+// columns, every other non blank line is one row with a value for every
+// column; fields are not quoted. Only the columns named in wanted are
+// parsed and kept, all of them if wanted is NULL. Returns 0, or -1 with a
+// message naming the line that could not be read.
+int column_table_read_csv(ColumnTable_t *table, int fd, const char *const *wanted,
+                          int wanted_count) {
+    memset(table, 0, sizeof(*table));
+
+    size_t text_len;
+    char *text = read_all(fd, &text_len);
+    if (!text)
+        return -1;
+
+    const char *pos = text;
+    const char *end = text + text_len;
+    const char *header_end = memchr(pos, '\n', end - pos);
+    if (!header_end)
+        header_end = end;
+
+    int status = 0;
+    for (const char *next = pos; next && status == 0;) {
+        const char *field;
+        int length;
+        next = next_field(next, header_end, &field, &length);
+        if (length == 0) {
+            fprintf(stderr, "Error: Line 1: Empty column name\n");
+            status = -1;
+        } else if (add_column(table, field, length) < 0) {
+            status = -1;
+        }
+    }
+
+    // Loaded columns grow together, capacity doubling
+    size_t cap = 1024;
+    for (int c = 0; c < table->column_count && status == 0; c++) {
+        int keep = wanted == NULL;
+        for (int w = 0; w < wanted_count && !keep; w++)
+            keep = strcmp(wanted[w], table->names[c]) == 0;
+        if (keep && !(table->values[c] = malloc(cap * sizeof(double)))) {
+            fprintf(stderr, "Error: Memory allocation failed for column %s\n",
+                    table->names[c]);
+            status = -1;
+        }
+    }
+
+    size_t line = 1;
+    pos = header_end < end ? header_end + 1 : end;
+    for (; pos < end && status == 0; line++) {
+        const char *line_end = memchr(pos, '\n', end - pos);
+        if (!line_end)
+            line_end = end;
+
+        const char *start = pos;
+        pos = line_end < end ? line_end + 1 : end;
+        while (start < line_end && (*start == ' ' || *start == '\t' || *start == '\r'))
+            start++;
+        if (start == line_end)
+            continue;
+
+        if (table->rows == cap) {
+            for (int c = 0; c < table->column_count && status == 0; c++) {
+                if (!table->values[c])
+                    continue;
+                double *grown = realloc(table->values[c], cap * 2 * sizeof(double));
+                if (!grown) {
+                    fprintf(stderr, "Error: Memory allocation failed for column %s\n",
+                            table->names[c]);
+                    status = -1;
+                    break;
+                }
+                table->values[c] = grown;
+            }
+            cap *= 2;
+        }
+
+        int fields = 0;
+        for (const char *next = start; next && status == 0; fields++) {
+            const char *field;
+            int length;
+            next = next_field(next, line_end, &field, &length);
+            if (fields >= table->column_count || !table->values[fields])
+                continue;
+            if (parse_field(field, length, &table->values[fields][table->rows]) != 0) {
+                fprintf(stderr, "Error: Line %zu: Invalid number '%.*s' in column %s\n",
+                        line + 1, length, field, table->names[fields]);
+                status = -1;
+            }
+        }
+
+        if (status == 0 && fields != table->column_count) {
+            fprintf(stderr, "Error: Line %zu: %d fields, expected %d\n", line + 1, fields,
+                    table->column_count);
+            status = -1;
+        }
+        table->rows++;
+    }
+
+    free(text);
+    if (status != 0)
+        column_table_free(table);
+    return status;
+}
+
+// Add a column read from a file of raw doubles in the machine's byte order.
+// Every column of a table has the same number of rows. Returns 0 or -1.
+int column_table_add_binary(ColumnTable_t *table, const char *name, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size % sizeof(double) != 0) {
+        fprintf(stderr, "Error: %s does not hold a whole number of doubles\n", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t rows = st.st_size / sizeof(double);
+    if (table->column_count > 0 && rows != table->rows) {
+        fprintf(stderr, "Error: %s has %zu rows, expected %zu\n", path, rows,
+                table->rows);
+        close(fd);
+        return -1;
+    }
+
+    double *values = malloc((rows + 1) * sizeof(double));
+    size_t done = 0;
+    while (values && done < rows * sizeof(double)) {
+        ssize_t n = read(fd, (char *)values + done, rows * sizeof(double) - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    close(fd);
+
+    if (!values || done != rows * sizeof(double)) {
+        fprintf(stderr, "Error: Failed to read %s\n", path);
+        free(values);
+        return -1;
+    }
+
+    int index = add_column(table, name, (int)strlen(name));
+    if (index < 0) {
+        free(values);
+        return -1;
+    }
+    table->values[index] = values;
+    table->rows = rows;
+    return 0;
+}
+
+// Index of the column called name, -1 if there is none
+int column_table_find(const ColumnTable_t *table, const char *name) {
+    for (int c = 0; c < table->column_count; c++) {
+        if (strcmp(table->names[c], name) == 0)
+            return c;
+    }
+    return -1;
+}
+
+void column_table_free(ColumnTable_t *table) {
+    for (int c = 0; c < table->column_count; c++) {
+        free(table->names[c]);
+        free(table->values[c]);
+    }
+    free(table->names);
+    free(table->values);
+    memset(table, 0, sizeof(*table));
+}
@@ -0,0 +1,154 @@
+#include "../include/exprgen.h"
+#include <stdio.h>
+
+const char *const exprgen_var_names[EXPRGEN_MAX_VARS] = {"x", "y", "z", "w"};
+
+// Output buffer the expression text is written into
+typedef struct {
+    char *buffer;
+    int size;
+    int len;
+    int overflow; // set once the text no longer fits
+} Output_t;
+
+// Init a generator, equal seeds produce equal expression sequences
+void exprgen_init(ExprGen_t *gen, uint64_t seed) {
+    gen->state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    gen->max_depth = 4;
+    gen->max_terms = 3;
+    gen->var_count = 0;
+    gen->literal = EXPRGEN_LITERAL_MIXED;
+    for (int i = 0; i < EXPRGEN_OP_COUNT; i++)
+        gen->op_weights[i] = 1;
+}
+
+// Next raw 64-bit random number (xorshift64*)
+uint64_t exprgen_next(ExprGen_t *gen) {
+    gen->state ^= gen->state >> 12;
+    gen->state ^= gen->state << 25;
+    gen->state ^= gen->state >> 27;
+    return gen->state * 0x2545F4914F6CDD1DULL;
+}
+
+// Random double in [0, 1)
+double exprgen_uniform(ExprGen_t *gen) { return (exprgen_next(gen) >> 11) * 0x1.0p-53; }
+
+// Random integer in [0, n)
+static int random_below(ExprGen_t *gen, int n) { return (int)(exprgen_next(gen) % n); }
+
+// Append formatted text to the output
+static void append(Output_t *out, const char *text) {
+    while (*text) {
+        if (out->len + 1 >= out->size) {
+            out->overflow = 1;
+            return;
+        }
+        out->buffer[out->len++] = *text++;
+    }
+}
+
+// Append a literal in one of the supported spellings: 42, 3.25, .5, or a
+// long 17 digit fraction
+static void append_number(ExprGen_t *gen, Output_t *out) {
+    char text[32];
+    int style;
+
+    switch (gen->literal) {
+    case EXPRGEN_LITERAL_INTEGER:
+        style = 0;
+        break;
+    case EXPRGEN_LITERAL_DECIMAL:
+        style = 1 + random_below(gen, 2);
+        break;
+    case EXPRGEN_LITERAL_LONG:
+        style = 3;
+        break;
+    default:
+        style = random_below(gen, 3);
+        break;
+    }
+
+    switch (style) {
+    case 0:
+        snprintf(text, sizeof(text), "%d", random_below(gen, 100));
+        break;
+    case 1:
+        snprintf(text, sizeof(text), "%d.%d", random_below(gen, 10),
+                 random_below(gen, 100));
+        break;
+    case 2:
+        snprintf(text, sizeof(text), ".%d", random_below(gen, 1000));
+        break;
+    default:
+        snprintf(text, sizeof(text), "%d.%016llu", random_below(gen, 10),
+                 (unsigned long long)(exprgen_next(gen) % 10000000000000000ULL));
+        break;
+    }
+
+    append(out, text);
+}
+
+static void generate_expression(ExprGen_t *gen, Output_t *out, int depth);
+
+// Append an operand: optional unary sign, then a literal, variable or group.
+// The grammar has no unary sign right after '^', so allow_sign is 0 there.
+static void generate_operand(ExprGen_t *gen, Output_t *out, int depth, int allow_sign) {
+    int sign = allow_sign ? random_below(gen, 8) : -1;
+    if (sign == 0)
+        append(out, "-");
+    else if (sign == 1)
+        append(out, "+");
+
+    if (depth < gen->max_depth && random_below(gen, 3) == 0) {
+        append(out, "(");
+        generate_expression(gen, out, depth + 1);
+        append(out, ")");
+    } else if (gen->var_count > 0 && random_below(gen, 2) == 0) {
+        append(out, exprgen_var_names[random_below(gen, gen->var_count)]);
+    } else {
+        append_number(gen, out);
+    }
+}
+
+// Random binary operator index drawn with the generator's op_weights
+static int random_op(ExprGen_t *gen) {
+    int total = 0;
+    for (int i = 0; i < EXPRGEN_OP_COUNT; i++)
+        total += gen->op_weights[i] > 0 ? gen->op_weights[i] : 0;
+    if (total == 0)
+        return 0;
+
+    int pick = random_below(gen, total);
+    for (int i = 0; i < EXPRGEN_OP_COUNT; i++) {
+        int weight = gen->op_weights[i] > 0 ? gen->op_weights[i] : 0;
+        if (pick < weight)
+            return i;
+        pick -= weight;
+    }
+    return 0;
+}
+
+// Append operands joined by random binary operators
+static void generate_expression(ExprGen_t *gen, Output_t *out, int depth) {
+    static const char *ops[EXPRGEN_OP_COUNT] = {" + ", " - ", " * ", " / ", " ^ "};
+    int terms = 1 + random_below(gen, gen->max_terms);
+
+    generate_operand(gen, out, depth, 1);
+    for (int i = 1; i < terms; i++) {
+        int op = random_op(gen);
+        append(out, ops[op]);
+        generate_operand(gen, out, depth, op != 4);
+    }
+}
+
+// Write one random expression into buffer. Returns its length, or -1 if it
+// did not fit in size bytes.
+int exprgen_expression(ExprGen_t *gen, char *buffer, int size) {
+    Output_t out = {buffer, size, 0, 0};
+
+    generate_expression(gen, &out, 0);
+    if (size > 0)
+        buffer[out.len] = '\0';
+
+    return out.overflow ? -1 : out.len;
+}
@@ -0,0 +1,356 @@
+#include "../include/fileeval.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A newline aligned slice of the mapped file and the output it produced
+typedef struct {
+    const char *start; // first byte of the chunk inside the mapping
+    size_t len;        // bytes in the chunk
+    OutBuf_t out;      // results, collected in memory until written in order
+    size_t lines;      // lines evaluated
+    size_t errors;     // lines answered with an error
+    int done;          // set once out is complete
+} Chunk_t;
+
+// Chunk indices owned by one worker. The owner pops from the head, which is
+// its lowest index, thieves take from the tail, the one needed last.
+typedef struct {
+    pthread_mutex_t lock;
+    int *items; // chunk indices in increasing order
+    int head;   // next item the owner takes
+    int tail;   // one past the last item
+} Deque_t;
+
+// State shared by the writer and every worker
+typedef struct {
+    Chunk_t *chunks;
+    int chunk_count;
+    Deque_t *deques;
+    int threads;
+    int window;                    // how far past next_write a chunk may be started
+    const BatchOptions_t *options; // settings every worker's context uses
+    pthread_mutex_t lock;          // guards done flags and next_write
+    pthread_cond_t cond;           // signalled when a chunk finishes or is written
+    int next_write;                // lowest chunk not written out yet
+    int failed;                    // set if a worker could not set up its state
+    int dealt;                     // set once the chunks are on the deques
+} Pool_t;
+
+// Arguments of one worker thread
+typedef struct {
+    Pool_t *pool;
+    int id;
+} Worker_t;
+
+// Number of online CPUs, used when --threads is not given
+int fileeval_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// Take the lowest chunk from a worker's own deque, -1 if empty
+static int deque_pop(Deque_t *deque) {
+    int index = -1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail)
+        index = deque->items[deque->head++];
+    pthread_mutex_unlock(&deque->lock);
+
+    return index;
+}
+
+// Take the highest chunk from another worker's deque, -1 if empty
+static int deque_steal(Deque_t *deque) {
+    int index = -1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail)
+        index = deque->items[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+
+    return index;
+}
+
+// Find the next chunk for a worker, its own first, then stolen
+static int next_chunk(Pool_t *pool, int id) {
+    int index = deque_pop(&pool->deques[id]);
+
+    for (int i = 1; index < 0 && i < pool->threads; i++) {
+        index = deque_steal(&pool->deques[(id + i) % pool->threads]);
+    }
+
+    return index;
+}
+
+// Evaluate every line of one chunk into its own output buffer
+static void run_chunk(BatchContext_t *ctx, Chunk_t *chunk) {
+    const char *pos = chunk->start;
+    const char *end = chunk->start + chunk->len;
+
+    while (pos < end) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        const char *line_end = newline ? newline : end;
+
+        chunk->errors += batch_eval_line(ctx, pos, line_end - pos, &chunk->out);
+        chunk->lines++;
+        pos = line_end + 1;
+    }
+}
+
+// Worker loop, evaluates chunks until every deque is empty
+static void *worker_main(void *arg) {
+    Worker_t *worker = arg;
+    Pool_t *pool = worker->pool;
+
+    BatchContext_t ctx;
+    int ready = batch_context_init(&ctx, pool->options) == 0;
+
+    // Chunks are only dealt to the workers that could be started
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->dealt)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    int index;
+    while ((index = next_chunk(pool, worker->id)) >= 0) {
+        Chunk_t *chunk = &pool->chunks[index];
+
+        // Do not run too far ahead of the writer so memory stays bounded
+        pthread_mutex_lock(&pool->lock);
+        while (index >= pool->next_write + pool->window)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (ready && outbuf_init(&chunk->out, -1, chunk->len / 2 + 64) == 0) {
+            run_chunk(&ctx, chunk);
+        } else {
+            chunk->out.failed = 1;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = 1;
+        if (chunk->out.failed)
+            pool->failed = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (ready)
+        batch_context_free(&ctx);
+
+    return NULL;
+}
+
+// Split the mapping into chunks that end right after a newline
+static Chunk_t *split_chunks(const char *data, size_t size, int *count) {
+    int cap = (int)(size / FILEEVAL_CHUNK_SIZE) + 1;
+    Chunk_t *chunks = calloc(cap, sizeof(Chunk_t));
+    if (!chunks) {
+        fprintf(stderr, "Error: Memory allocation failed for chunks\n");
+        return NULL;
+    }
+
+    size_t pos = 0;
+    int n = 0;
+    while (pos < size) {
+        size_t end = pos + FILEEVAL_CHUNK_SIZE;
+        if (end >= size) {
+            end = size;
+        } else {
+            const char *newline = memchr(data + end, '\n', size - end);
+            end = newline ? (size_t)(newline - data) + 1 : size;
+        }
+
+        // Every chunk holds at least FILEEVAL_CHUNK_SIZE bytes but the last
+        chunks[n].start = data + pos;
+        chunks[n].len = end - pos;
+        n++;
+        pos = end;
+    }
+
+    *count = n;
+    return chunks;
+}
+
+// Write finished chunks in input order until every chunk is out
+static void write_in_order(Pool_t *pool, int out_fd, BatchStats_t *stats) {
+    for (int i = 0; i < pool->chunk_count; i++) {
+        Chunk_t *chunk = &pool->chunks[i];
+
+        pthread_mutex_lock(&pool->lock);
+        while (!chunk->done)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+
+        chunk->out.fd = out_fd;
+        outbuf_flush(&chunk->out);
+        if (chunk->out.failed)
+            pool->failed = 1;
+        outbuf_free(&chunk->out);
+
+        stats->lines += chunk->lines;
+        stats->errors += chunk->errors;
+        stats->bytes += chunk->len;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->next_write = i + 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Evaluate the chunks of a mapped file on a pool of worker threads
+static int run_pool(Chunk_t *chunks, int chunk_count, int threads,
+                    const BatchOptions_t *options, int out_fd, BatchStats_t *stats) {
+    Pool_t pool;
+    pool.chunks = chunks;
+    pool.chunk_count = chunk_count;
+    pool.threads = threads;
+    pool.window = threads * FILEEVAL_WINDOW_PER_THREAD;
+    pool.options = options;
+    pool.next_write = 0;
+    pool.failed = 0;
+    pool.dealt = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pool.deques = calloc(threads, sizeof(Deque_t));
+    int *items = malloc(chunk_count * sizeof(int));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    Worker_t *workers = malloc(threads * sizeof(Worker_t));
+
+    if (!pool.deques || !items || !tids || !workers) {
+        fprintf(stderr, "Error: Memory allocation failed for thread pool\n");
+        free(pool.deques);
+        free(items);
+        free(tids);
+        free(workers);
+        return -1;
+    }
+
+    for (int w = 0; w < threads; w++) {
+        pthread_mutex_init(&pool.deques[w].lock, NULL);
+        pool.deques[w].items = items;
+        pool.deques[w].head = 0;
+        pool.deques[w].tail = 0;
+    }
+
+    int started = 0;
+    for (; started < threads; started++) {
+        workers[started].pool = &pool;
+        workers[started].id = started;
+        if (pthread_create(&tids[started], NULL, worker_main, &workers[started]) != 0) {
+            fprintf(stderr, "Error: Failed to start worker thread\n");
+            break;
+        }
+    }
+
+    // Deal chunks round robin over the workers that started, so they finish
+    // close to input order. A chunk left on the deque of a missing worker
+    // would hold up the writer while the others wait for it to move on.
+    pthread_mutex_lock(&pool.lock);
+    int next = 0;
+    for (int w = 0; w < started; w++) {
+        Deque_t *deque = &pool.deques[w];
+        deque->items = items + next;
+
+        for (int i = w; i < chunk_count; i += started)
+            deque->items[deque->tail++] = i;
+        next += deque->tail;
+    }
+    pool.threads = started;
+    pool.window = started * FILEEVAL_WINDOW_PER_THREAD;
+    pool.dealt = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    if (started > 0) {
+        write_in_order(&pool, out_fd, stats);
+    } else {
+        pool.failed = 1;
+    }
+
+    for (int w = 0; w < started; w++)
+        pthread_join(tids[w], NULL);
+
+    for (int w = 0; w < threads; w++)
+        pthread_mutex_destroy(&pool.deques[w].lock);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+
+    free(pool.deques);
+    free(items);
+    free(tids);
+    free(workers);
+
+    return pool.failed ? -1 : 0;
+}
+
+// Evaluate every line of a file on threads workers, writing results to
+// out_fd in input order. The file is mapped and lexed in place, and every
+// worker keeps its own context set up from options. Returns 0 on success,
+// -1 on failure.
+int fileeval_run(const char *path, int threads, const BatchOptions_t *options, int out_fd,
+                 BatchStats_t *stats) {
+    BatchStats_t local;
+    if (!stats)
+        stats = &local;
+    memset(stats, 0, sizeof(BatchStats_t));
+
+    if (threads < 1)
+        threads = 1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    // Nothing to map for an empty file
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    int chunk_count = 0;
+    Chunk_t *chunks = split_chunks(data, size, &chunk_count);
+    int status = -1;
+
+    if (chunks) {
+        if (threads > chunk_count)
+            threads = chunk_count;
+        status = run_pool(chunks, chunk_count, threads, options, out_fd, stats);
+
+        // Buffers of chunks never written after a failure
+        for (int i = 0; i < chunk_count; i++)
+            outbuf_free(&chunks[i].out);
+        free(chunks);
+    }
+
+    munmap(data, size);
+    return status;
+}
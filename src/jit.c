@@ -0,0 +1,515 @@
+#include "../include/jit.h"
+#include <stdio.h>
+
+#ifdef CALC_JIT_SUPPORTED
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Spill slots and temps the generated code may keep on the native stack
+#define JIT_MAX_SLOTS (1 << 16)
+
+// Node of the emitter's walk waiting for the code of its operands
+typedef struct {
+    ASTNode_t *node;
+    int step;  // operands emitted so far
+    int order; // how a binary node's operands reach xmm0 and xmm1
+} EmitFrame_t;
+
+// Orders of a binary node's operands, decided before either is emitted
+enum { ORDER_RIGHT_LEAF, ORDER_LEFT_LEAF, ORDER_SPILL };
+
+// Growable buffer the machine code is assembled into before it is mapped
+typedef struct {
+    unsigned char *buf;     // emitted bytes
+    size_t len;             // bytes used
+    size_t cap;             // bytes allocated
+    int depth;              // 8 byte spill slots currently pushed on the stack
+    int failed;             // set when an allocation fails or the AST is malformed
+    int max_depth;          // spill slots left on the native stack after the temps
+    unsigned char *emitted; // set once a shared subtree's temp is stored
+    EmitFrame_t *stack;     // nodes waiting for their operands
+    int stack_len;
+    int stack_cap;
+} Emitter_t;
+
+// Append raw bytes to the code buffer
+static void emit_bytes(Emitter_t *e, const void *bytes, size_t count) {
+    if (e->failed)
+        return;
+
+    if (e->len + count > e->cap) {
+        size_t cap = e->cap ? e->cap * 2 : 256;
+        while (cap < e->len + count)
+            cap *= 2;
+
+        unsigned char *buf = realloc(e->buf, cap);
+        if (!buf) {
+            fprintf(stderr, "Error: Memory allocation failed for JIT buffer\n");
+            e->failed = 1;
+            return;
+        }
+
+        e->buf = buf;
+        e->cap = cap;
+    }
+
+    memcpy(e->buf + e->len, bytes, count);
+    e->len += count;
+}
+
+// Append a fixed instruction encoding
+#define EMIT(e, ...)                                                                     \
+    do {                                                                                 \
+        static const unsigned char bytes_[] = {__VA_ARGS__};                             \
+        emit_bytes(e, bytes_, sizeof(bytes_));                                           \
+    } while (0)
+
+// mov rax, imm64
+static void emit_mov_rax(Emitter_t *e, uint64_t imm) {
+    EMIT(e, 0x48, 0xB8);
+    emit_bytes(e, &imm, sizeof(imm));
+}
+
+// Load a literal into xmm0 or xmm1 through rax
+static void emit_load_const(Emitter_t *e, double value, int xmm) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    emit_mov_rax(e, bits);
+
+    if (xmm == 0)
+        EMIT(e, 0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+    else
+        EMIT(e, 0x66, 0x48, 0x0F, 0x6E, 0xC8); // movq xmm1, rax
+}
+
+// Load vars[slot] into xmm0 or xmm1, the vars pointer lives in rbx
+static void emit_load_var(Emitter_t *e, int slot, int xmm) {
+    int32_t disp = slot * (int32_t)sizeof(double);
+
+    if (xmm == 0)
+        EMIT(e, 0xF2, 0x0F, 0x10, 0x83); // movsd xmm0, [rbx + disp32]
+    else
+        EMIT(e, 0xF2, 0x0F, 0x10, 0x8B); // movsd xmm1, [rbx + disp32]
+    emit_bytes(e, &disp, sizeof(disp));
+}
+
+// Offset from rsp of a shared subtree's temp, the temps sit above the spill
+// slots pushed so far
+static int32_t temp_disp(Emitter_t *e, int index) {
+    return (e->depth + index) * (int32_t)sizeof(double);
+}
+
+// Load temp index into xmm0 or xmm1
+static void emit_load_temp(Emitter_t *e, int index, int xmm) {
+    int32_t disp = temp_disp(e, index);
+
+    if (xmm == 0)
+        EMIT(e, 0xF2, 0x0F, 0x10, 0x84, 0x24); // movsd xmm0, [rsp + disp32]
+    else
+        EMIT(e, 0xF2, 0x0F, 0x10, 0x8C, 0x24); // movsd xmm1, [rsp + disp32]
+    emit_bytes(e, &disp, sizeof(disp));
+}
+
+// Store xmm0 into temp index
+static void emit_store_temp(Emitter_t *e, int index) {
+    int32_t disp = temp_disp(e, index);
+
+    EMIT(e, 0xF2, 0x0F, 0x11, 0x84, 0x24); // movsd [rsp + disp32], xmm0
+    emit_bytes(e, &disp, sizeof(disp));
+}
+
+// Check if a node can be loaded straight into a register, a shared subtree
+// can once its temp holds the value
+static int is_leaf(Emitter_t *e, ASTNode_t *node) {
+    if (node->shared >= 0)
+        return e->emitted[node->shared];
+    return node->type == AST_NUMBER || node->type == AST_VARIABLE;
+}
+
+// Load a leaf node into xmm0 or xmm1
+static void emit_leaf(Emitter_t *e, ASTNode_t *node, int xmm) {
+    if (node->shared >= 0)
+        emit_load_temp(e, node->shared, xmm);
+    else if (node->type == AST_NUMBER)
+        emit_load_const(e, node->data.number.value, xmm);
+    else
+        emit_load_var(e, node->data.variable.slot, xmm);
+}
+
+// Find how many temps the shared subtrees of an AST need. Shared nodes are
+// numbered in post-order, so none below one has a higher index and the walk
+// stops there. Returns 0 if the walk ran out of memory.
+static int count_temps(ASTNode_t *root, int *temps) {
+    WalkStack_t stack = {0};
+
+    int ok = !root || ast_walk_push(&stack, root);
+    while (ok && stack.depth > 0) {
+        ASTNode_t *node = stack.frames[--stack.depth].node;
+        if (node->shared >= 0) {
+            if (node->shared >= *temps)
+                *temps = node->shared + 1;
+            continue;
+        }
+
+        ASTNode_t **operand;
+        for (int i = 0; ok && (operand = ast_operand(node, i)) != NULL; i++) {
+            if (*operand)
+                ok = ast_walk_push(&stack, *operand);
+        }
+    }
+
+    free(stack.frames);
+    return ok;
+}
+
+// Call pow(xmm0, xmm1) keeping the stack 16 byte aligned at the call
+static void emit_pow_call(Emitter_t *e) {
+    int pad = e->depth & 1;
+
+    if (pad)
+        EMIT(e, 0x48, 0x83, 0xEC, 0x08); // sub rsp, 8
+
+    emit_mov_rax(e, (uint64_t)(uintptr_t)&pow);
+    EMIT(e, 0xFF, 0xD0); // call rax
+
+    if (pad)
+        EMIT(e, 0x48, 0x83, 0xC4, 0x08); // add rsp, 8
+}
+
+// Raise xmm0 to a constant integer power with the multiplies ast_powi does,
+// unrolled. The result collects in xmm1 while xmm0 is squared.
+static void emit_powi(Emitter_t *e, int exponent) {
+    unsigned n = exponent < 0 ? -(unsigned)exponent : (unsigned)exponent;
+
+    if (n == 0) {
+        emit_load_const(e, 1.0, 0);
+        return;
+    }
+
+    int started = 0;
+    while (n) {
+        if (n & 1) {
+            if (started)
+                EMIT(e, 0xF2, 0x0F, 0x59, 0xC8); // mulsd xmm1, xmm0
+            else
+                EMIT(e, 0x66, 0x0F, 0x28, 0xC8); // movapd xmm1, xmm0
+            started = 1;
+        }
+        n >>= 1;
+        if (n)
+            EMIT(e, 0xF2, 0x0F, 0x59, 0xC0); // mulsd xmm0, xmm0
+    }
+
+    if (exponent < 0) {
+        emit_load_const(e, 1.0, 0);
+        EMIT(e, 0xF2, 0x0F, 0x5E, 0xC1); // divsd xmm0, xmm1
+    } else {
+        EMIT(e, 0x66, 0x0F, 0x28, 0xC1); // movapd xmm0, xmm1
+    }
+}
+
+// Square root of xmm0 with the results of ast_sqrt for -0 and -inf
+static void emit_sqrt(Emitter_t *e) {
+    emit_load_const(e, -INFINITY, 1);
+    EMIT(e, 0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+    EMIT(e, 0xF2, 0x0F, 0x51, 0xC0); // sqrtsd xmm0, xmm0
+    EMIT(e, 0x66, 0x0F, 0x57, 0xC9); // xorpd xmm1, xmm1
+    EMIT(e, 0xF2, 0x0F, 0x58, 0xC1); // addsd xmm0, xmm1, turns -0 into +0
+    EMIT(e, 0x7A, 0x11);             // jp done
+    EMIT(e, 0x75, 0x0F);             // jne done
+    emit_load_const(e, INFINITY, 0); // 15 bytes
+}                                    // done:
+
+// Start the code of a subtree that leaves its value in xmm0. A subtree
+// shared by several parents is reloaded from its temp once it was computed,
+// any other one waits on the stack until the code of its operands is out.
+static void emit_enter(Emitter_t *e, ASTNode_t *node) {
+    if (!node) {
+        e->failed = 1;
+        return;
+    }
+
+    if (node->shared >= 0 && e->emitted[node->shared]) {
+        emit_load_temp(e, node->shared, 0);
+        return;
+    }
+
+    if (e->stack_len == e->stack_cap) {
+        int cap = e->stack_cap ? e->stack_cap * 2 : 64;
+        EmitFrame_t *stack = realloc(e->stack, cap * sizeof(EmitFrame_t));
+        if (!stack) {
+            fprintf(stderr, "Error: Memory allocation failed for JIT buffer\n");
+            e->failed = 1;
+            return;
+        }
+        e->stack = stack;
+        e->stack_cap = cap;
+    }
+
+    // Both operands are checked before either one is emitted, like the
+    // interpreter a leaf goes straight to its register
+    int order = ORDER_SPILL;
+    if (node->type == AST_BINARY_OP) {
+        if (is_leaf(e, node->data.binary_op.right))
+            order = ORDER_RIGHT_LEAF;
+        else if (is_leaf(e, node->data.binary_op.left))
+            order = ORDER_LEFT_LEAF;
+    }
+
+    e->stack[e->stack_len++] = (EmitFrame_t){node, 0, order};
+}
+
+// Emit the code between and after the operands of a binary node. Returns 1
+// once xmm0 holds the left operand and xmm1 the right one.
+static int emit_operands(Emitter_t *e, EmitFrame_t *frame) {
+    ASTNode_t *left = frame->node->data.binary_op.left;
+    ASTNode_t *right = frame->node->data.binary_op.right;
+
+    switch (frame->order) {
+    case ORDER_RIGHT_LEAF:
+        if (frame->step++ == 0) {
+            emit_enter(e, left);
+            return 0;
+        }
+        emit_leaf(e, right, 1);
+        return 1;
+
+    case ORDER_LEFT_LEAF:
+        if (frame->step++ == 0) {
+            emit_enter(e, right);
+            return 0;
+        }
+        EMIT(e, 0x66, 0x0F, 0x28, 0xC8); // movapd xmm1, xmm0
+        emit_leaf(e, left, 0);
+        return 1;
+    }
+
+    // Both sides are subtrees, spill the left result while the right one runs
+    switch (frame->step++) {
+    case 0:
+        emit_enter(e, left);
+        return 0;
+
+    case 1:
+        if (e->depth == e->max_depth) {
+            fprintf(stderr, "Error: Expression too deep for the JIT\n");
+            e->failed = 1;
+            return 0;
+        }
+        EMIT(e, 0x48, 0x83, 0xEC, 0x08);       // sub rsp, 8
+        EMIT(e, 0xF2, 0x0F, 0x11, 0x04, 0x24); // movsd [rsp], xmm0
+        e->depth++;
+        emit_enter(e, right);
+        return 0;
+    }
+
+    EMIT(e, 0x66, 0x0F, 0x28, 0xC8);       // movapd xmm1, xmm0
+    EMIT(e, 0xF2, 0x0F, 0x10, 0x04, 0x24); // movsd xmm0, [rsp]
+    EMIT(e, 0x48, 0x83, 0xC4, 0x08);       // add rsp, 8
+    e->depth--;
+    return 1;
+}
+
+// Emit the code of the node on top of the stack, or of its next operand.
+// Returns 1 once xmm0 holds the value of the node.
+static int emit_step(Emitter_t *e, EmitFrame_t *frame) {
+    ASTNode_t *node = frame->node;
+
+    switch (node->type) {
+    case AST_NUMBER:
+    case AST_VARIABLE:
+        emit_leaf(e, node, 0);
+        return 1;
+
+    case AST_UNARY_OP:
+        if (frame->step++ == 0) {
+            emit_enter(e, node->data.unary_op.operand);
+            return 0;
+        }
+        if (node->data.unary_op.op == TOKEN_MINUS) {
+            emit_mov_rax(e, 0x8000000000000000ULL);
+            EMIT(e, 0x66, 0x48, 0x0F, 0x6E, 0xC8); // movq xmm1, rax
+            EMIT(e, 0x66, 0x0F, 0x57, 0xC1);       // xorpd xmm0, xmm1
+        } else if (node->data.unary_op.op != TOKEN_PLUS) {
+            e->failed = 1;
+        }
+        return 1;
+
+    case AST_BINARY_OP:
+        if (!emit_operands(e, frame))
+            return 0;
+
+        switch (node->data.binary_op.op) {
+        case TOKEN_PLUS:
+            EMIT(e, 0xF2, 0x0F, 0x58, 0xC1); // addsd xmm0, xmm1
+            return 1;
+        case TOKEN_MINUS:
+            EMIT(e, 0xF2, 0x0F, 0x5C, 0xC1); // subsd xmm0, xmm1
+            return 1;
+        case TOKEN_MULTIPLY:
+            EMIT(e, 0xF2, 0x0F, 0x59, 0xC1); // mulsd xmm0, xmm1
+            return 1;
+        case TOKEN_DIVIDE:
+            // Division by zero yields 0 like ast_eval, NaN divisors divide
+            EMIT(e, 0x66, 0x0F, 0x57, 0xD2); // xorpd xmm2, xmm2
+            EMIT(e, 0x66, 0x0F, 0x2E, 0xCA); // ucomisd xmm1, xmm2
+            EMIT(e, 0x7A, 0x08);             // jp divide
+            EMIT(e, 0x75, 0x06);             // jne divide
+            EMIT(e, 0x66, 0x0F, 0x57, 0xC0); // xorpd xmm0, xmm0
+            EMIT(e, 0xEB, 0x04);             // jmp done
+            EMIT(e, 0xF2, 0x0F, 0x5E, 0xC1); // divide: divsd xmm0, xmm1
+            return 1;                        // done:
+        case TOKEN_POWER:
+            emit_pow_call(e);
+            return 1;
+        default:
+            e->failed = 1;
+            return 1;
+        }
+
+    case AST_POWI:
+    case AST_SQRT:
+        if (frame->step++ == 0) {
+            emit_enter(e, node->data.power.base);
+            return 0;
+        }
+        if (node->type == AST_POWI)
+            emit_powi(e, node->data.power.exponent);
+        else
+            emit_sqrt(e);
+        return 1;
+    }
+
+    e->failed = 1;
+    return 1;
+}
+
+// Emit code that leaves the value of a tree in xmm0. A subtree shared by
+// several parents is computed once and stored in its temp.
+static void emit_tree(Emitter_t *e, ASTNode_t *root) {
+    emit_enter(e, root);
+    while (!e->failed && e->stack_len > 0) {
+        // The frame is copied, emitting an operand may move the stack
+        EmitFrame_t frame = e->stack[e->stack_len - 1];
+        int len = e->stack_len;
+        int done = emit_step(e, &frame);
+        e->stack[len - 1] = frame;
+        if (!done)
+            continue;
+
+        e->stack_len--;
+        int index = frame.node->shared;
+        if (index >= 0) {
+            emit_store_temp(e, index);
+            e->emitted[index] = 1;
+        }
+    }
+}
+
+// The JIT is compiled in for this target
+int jit_available(void) { return 1; }
+
+// Translate an AST into native code, returns NULL if it cannot be compiled
+JitCode_t *jit_compile(ASTNode_t *node) {
+    int temps = 0;
+    if (!count_temps(node, &temps))
+        return NULL;
+
+    // The generated code keeps its temps and spills on the native stack
+    if (temps >= JIT_MAX_SLOTS) {
+        fprintf(stderr, "Error: Expression too deep for the JIT\n");
+        return NULL;
+    }
+
+    // The temp area is rounded to 16 bytes so rsp stays aligned
+    int32_t frame = ((temps + 1) & ~1) * (int32_t)sizeof(double);
+    Emitter_t e = {NULL, 0, 0, 0, 0, JIT_MAX_SLOTS - temps, calloc(temps + 1, 1),
+                   NULL, 0, 0};
+    if (!e.emitted) {
+        fprintf(stderr, "Error: Memory allocation failed for JIT buffer\n");
+        return NULL;
+    }
+
+    // The vars pointer is kept in callee-saved rbx so pow calls preserve it,
+    // pushing rbx also realigns rsp to 16 bytes
+    EMIT(&e, 0x53);             // push rbx
+    EMIT(&e, 0x48, 0x89, 0xFB); // mov rbx, rdi
+    if (frame) {
+        EMIT(&e, 0x48, 0x81, 0xEC); // sub rsp, imm32
+        emit_bytes(&e, &frame, sizeof(frame));
+    }
+
+    emit_tree(&e, node);
+
+    if (frame) {
+        EMIT(&e, 0x48, 0x81, 0xC4); // add rsp, imm32
+        emit_bytes(&e, &frame, sizeof(frame));
+    }
+    EMIT(&e, 0x5B); // pop rbx
+    EMIT(&e, 0xC3); // ret
+
+    free(e.emitted);
+    free(e.stack);
+
+    if (e.failed) {
+        free(e.buf);
+        return NULL;
+    }
+
+    JitCode_t *jit = malloc(sizeof(JitCode_t));
+    if (!jit) {
+        fprintf(stderr, "Error: Memory allocation failed for JIT code\n");
+        free(e.buf);
+        return NULL;
+    }
+
+    // Write the code into a fresh mapping, then flip it to read + execute
+    jit->size = e.len;
+    jit->code = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    if (jit->code == MAP_FAILED) {
+        perror("Error: mmap failed for JIT code");
+        free(jit);
+        free(e.buf);
+        return NULL;
+    }
+
+    memcpy(jit->code, e.buf, e.len);
+    free(e.buf);
+
+    if (mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC) != 0) {
+        perror("Error: mprotect failed for JIT code");
+        munmap(jit->code, jit->size);
+        free(jit);
+        return NULL;
+    }
+
+    jit->fn = (JitFn)jit->code;
+    return jit;
+}
+
+// Unmap generated code
+void jit_free(JitCode_t *jit) {
+    if (jit) {
+        munmap(jit->code, jit->size);
+        free(jit);
+    }
+}
+
+#else
+
+// No JIT for this target, callers keep using the interpreter
+int jit_available(void) { return 0; }
+
+JitCode_t *jit_compile(ASTNode_t *node) {
+    (void)node;
+    return NULL;
+}
+
+void jit_free(JitCode_t *jit) { (void)jit; }
+
+#endif
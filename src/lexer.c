@@ -1,7 +1,19 @@
 #include "../include/lexer.h"
+#include "../include/numparse.h"
+#include "../include/stats.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+// Runs of whitespace, digits and identifier characters are scanned with
+// vector compares on x86-64, SSE2 is always there and AVX2 is picked at
+// run time
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(CALC_NO_SIMD)
+#define LEXER_SIMD 1
+#include <immintrin.h>
+#endif
 
 // Init the lexer with the input string
 Lexer_t *lexer_init(const char *input) {
@@ -11,178 +23,435 @@ Lexer_t *lexer_init(const char *input) {
         return NULL;
     }
 
-    lexer->input = input;
-    lexer->pos = 0;
-    lexer->length = strlen(input);
-    lexer->curr_char = input[0];
+    lexer_reset(lexer, input, strlen(input));
+    lexer->silent = 0;
+    lexer->simd = lexer_simd_width();
+    lexer->fd = -1;
+    lexer->buffer = NULL;
+    lexer->capacity = 0;
+    lexer->eof = 1;
+    lexer->read_error = 0;
+
+    return lexer;
+}
+
+// Init a lexer that streams its input from fd, holding at most capacity
+// bytes of it at a time. Tokens longer than that are reported as errors.
+Lexer_t *lexer_init_fd(int fd, int capacity) {
+    Lexer_t *lexer = lexer_init("");
+    if (!lexer)
+        return NULL;
+
+    lexer->buffer = malloc(capacity);
+    if (!lexer->buffer) {
+        fprintf(stderr, "Error: Memory allocation failed for lexer buffer\n");
+        free(lexer);
+        return NULL;
+    }
+
+    lexer_reset(lexer, lexer->buffer, 0);
+    lexer->fd = fd;
+    lexer->capacity = capacity;
+    lexer->eof = 0;
 
     return lexer;
 }
 
-// Clean up lexer memory
+// Point an existing lexer at new input of the given length, the input does
+// not need to be NUL terminated
+void lexer_reset(Lexer_t *lexer, const char *input, int length) {
+    lexer->input = input;
+    lexer->pos = 0;
+    lexer->length = length;
+    lexer->base = 0;
+}
+
+// Clean up lexer memory, the descriptor of a stream is left open
 void lexer_free(Lexer_t *lexer) {
     if (lexer) {
+        free(lexer->buffer);
         free(lexer);
     }
 }
 
-// Clean up token memory
-void token_free(Token_t *token) {
-    if (token) {
-        if (token->value) {
-            free(token->value);
-        }
-        free(token);
+// Character classes used to dispatch on the current input byte
+enum {
+    CHAR_OTHER, // anything the lexer does not recognize
+    CHAR_SPACE, // ' ', '\t', '\n', '\r', '\v', '\f'
+    CHAR_DIGIT, // '0' - '9'
+    CHAR_DOT,   // '.'
+    CHAR_OP,    // single character operators and parentheses
+    CHAR_ALPHA, // 'a' - 'z', 'A' - 'Z', '_'
+};
+
+// Class of every possible input byte
+static const unsigned char char_class[256] = {
+    [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+    ['\v'] = CHAR_SPACE, ['\f'] = CHAR_SPACE, ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT,
+    ['2'] = CHAR_DIGIT,  ['3'] = CHAR_DIGIT,  ['4'] = CHAR_DIGIT,  ['5'] = CHAR_DIGIT,
+    ['6'] = CHAR_DIGIT,  ['7'] = CHAR_DIGIT,  ['8'] = CHAR_DIGIT,  ['9'] = CHAR_DIGIT,
+    ['.'] = CHAR_DOT,    ['+'] = CHAR_OP,     ['-'] = CHAR_OP,     ['*'] = CHAR_OP,
+    ['/'] = CHAR_OP,     ['^'] = CHAR_OP,     ['('] = CHAR_OP,     [')'] = CHAR_OP,
+    ['_'] = CHAR_ALPHA,  ['a' ... 'z'] = CHAR_ALPHA, ['A' ... 'Z'] = CHAR_ALPHA,
+};
+
+// Token type produced by every CHAR_OP byte
+static const unsigned char op_token[256] = {
+    ['+'] = TOKEN_PLUS,   ['-'] = TOKEN_MINUS, ['*'] = TOKEN_MULTIPLY,
+    ['/'] = TOKEN_DIVIDE, ['^'] = TOKEN_POWER, ['('] = TOKEN_LPAREN,
+    [')'] = TOKEN_RPAREN,
+};
+
+// Runs the lexer skips or consumes as a whole
+typedef enum {
+    RUN_SPACE, // whitespace between tokens
+    RUN_DIGIT, // digits of a number
+    RUN_IDENT, // letters, digits and '_' after the first character of a name
+} RunKind;
+
+// Check if a byte continues a run, one byte at a time
+static inline int in_run(unsigned char ch, RunKind kind) {
+    int cls = char_class[ch];
+    switch (kind) {
+    case RUN_SPACE:
+        return cls == CHAR_SPACE;
+    case RUN_DIGIT:
+        return cls == CHAR_DIGIT;
+    default:
+        return cls == CHAR_ALPHA || cls == CHAR_DIGIT;
+    }
+}
+
+#ifdef LEXER_SIMD
+
+// Bytes lo to hi in every lane, signed compares suffice as no class holds a
+// byte above 0x7f
+#define IN_RANGE_128(c, lo, hi)                                                          \
+    _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8((lo) - 1)),                           \
+                  _mm_cmplt_epi8(c, _mm_set1_epi8((hi) + 1)))
+#define IN_RANGE_256(c, lo, hi)                                                          \
+    _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8((lo) - 1)),                   \
+                     _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), c))
+
+// Lanes of 16 bytes that continue a run. Setting bit 5 folds upper case
+// letters onto lower case ones and nothing else onto a to z.
+static inline __m128i run_mask_128(__m128i c, RunKind kind) {
+    switch (kind) {
+    case RUN_SPACE:
+        return _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                            IN_RANGE_128(c, '\t', '\r'));
+    case RUN_DIGIT:
+        return IN_RANGE_128(c, '0', '9');
+    default: {
+        __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        return _mm_or_si128(
+            _mm_or_si128(IN_RANGE_128(lower, 'a', 'z'), IN_RANGE_128(c, '0', '9')),
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+    }
     }
 }
 
-// Check if a character is digit
-static int is_digit(char c) { return c >= '0' && c <= '9'; }
+// Same for 32 bytes
+__attribute__((target("avx2"))) static inline __m256i run_mask_256(__m256i c,
+                                                                   RunKind kind) {
+    switch (kind) {
+    case RUN_SPACE:
+        return _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                               IN_RANGE_256(c, '\t', '\r'));
+    case RUN_DIGIT:
+        return IN_RANGE_256(c, '0', '9');
+    default: {
+        __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+        return _mm256_or_si256(
+            _mm256_or_si256(IN_RANGE_256(lower, 'a', 'z'), IN_RANGE_256(c, '0', '9')),
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')));
+    }
+    }
+}
 
-// Check if a character is any kind of whitespace
-static int is_whitespace(char c) {
-    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+// Scan a run 16 bytes at a time while a whole vector fits before length.
+// Returns the first position not in the run, or where fewer bytes are left.
+static inline int scan_run_sse2(const char *input, int pos, int length, RunKind kind) {
+    while (length - pos >= 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(input + pos));
+        unsigned stop = ~(unsigned)_mm_movemask_epi8(run_mask_128(c, kind)) & 0xffff;
+        if (stop)
+            return pos + __builtin_ctz(stop);
+        pos += 16;
+    }
+    return pos;
 }
 
-// Advance the current pos by one character
-static void advance(Lexer_t *lexer) {
-    lexer->pos++;
-    if (lexer->pos < lexer->length) {
-        lexer->curr_char = lexer->input[lexer->pos];
-    } else {
-        lexer->curr_char = '\0'; // End of input
+// Same 32 bytes at a time, finishing with one 16 byte step
+__attribute__((target("avx2"))) static int scan_run_avx2(const char *input, int pos,
+                                                         int length, RunKind kind) {
+    while (length - pos >= 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(input + pos));
+        unsigned stop = ~(unsigned)_mm256_movemask_epi8(run_mask_256(c, kind));
+        if (stop)
+            return pos + __builtin_ctz(stop);
+        pos += 32;
     }
+
+    if (length - pos >= 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(input + pos));
+        unsigned stop = ~(unsigned)_mm_movemask_epi8(run_mask_128(c, kind)) & 0xffff;
+        pos += stop ? __builtin_ctz(stop) : 16;
+    }
+    return pos;
+}
+
+#endif
+
+// Bytes the vector scan compares at once on this machine, 0 without it
+int lexer_simd_width(void) {
+#ifdef LEXER_SIMD
+    return __builtin_cpu_supports("avx2") ? 32 : 16;
+#else
+    return 0;
+#endif
+}
+
+// Bytes of a run read one at a time before vectors take over, most numbers,
+// names and gaps between tokens end within them
+#define RUN_SCALAR_PREFIX 8
+
+// Continue a run that outgrew RUN_SCALAR_PREFIX, with vectors while enough
+// input is left. Kept out of line so the short runs' loops stay as tight
+// as they were without it.
+static __attribute__((noinline)) int scan_long_run(const Lexer_t *lexer, int pos,
+                                                   RunKind kind) {
+#ifdef LEXER_SIMD
+    if (lexer->simd == 32)
+        pos = scan_run_avx2(lexer->input, pos, lexer->length, kind);
+    else if (lexer->simd)
+        pos = scan_run_sse2(lexer->input, pos, lexer->length, kind);
+#endif
+
+    while (pos < lexer->length && in_run(lexer->input[pos], kind))
+        pos++;
+    return pos;
+}
+
+// Class of the character at pos, or CHAR_OTHER past the end of input
+static int class_at(const Lexer_t *lexer, int pos) {
+    if (pos >= lexer->length)
+        return CHAR_OTHER;
+    return char_class[(unsigned char)lexer->input[pos]];
+}
+
+// Build a token covering length characters starting at offset
+static Token_t make_token(TokenType type, int offset, int length) {
+    Token_t token = {type, offset, length, 0, 0.0};
+    return token;
 }
 
-// Skip over all whitespace characters
-static void skip_whitespace(Lexer_t *lexer) {
-    while (lexer->curr_char != '\0' && is_whitespace(lexer->curr_char)) {
-        advance(lexer);
+// Finish a number token ending at pos
+static inline Token_t number_token(Lexer_t *lexer, int start_pos, int pos,
+                                   int has_decimal) {
+    lexer->pos = pos;
+
+    // The literal is converted in place, no copy of its text is made
+    Token_t token = make_token(TOKEN_NUMBER, start_pos, pos - start_pos);
+    token.integer = !has_decimal;
+    token.value = numparse_decimal(lexer->input + start_pos, pos - start_pos);
+    return token;
+}
+
+// Continue a literal that outgrew RUN_SCALAR_PREFIX, digits with at most
+// one decimal point
+static __attribute__((noinline)) Token_t read_long_number(Lexer_t *lexer, int start_pos,
+                                                          int pos, int has_decimal) {
+    pos = scan_long_run(lexer, pos, RUN_DIGIT);
+    if (!has_decimal && pos < lexer->length && lexer->input[pos] == '.') {
+        has_decimal = 1;
+        pos = scan_long_run(lexer, pos + 1, RUN_DIGIT);
     }
+
+    return number_token(lexer, start_pos, pos, has_decimal);
 }
 
-// Read a number token from input
-static char *read_number(Lexer_t *lexer) {
+// Read a number token from input, digits with at most one decimal point
+static Token_t read_number(Lexer_t *lexer) {
     int start_pos = lexer->pos;
-    int length = 0;
+    int pos = lexer->pos;
     int has_decimal = 0;
 
-    // Read consecutive digits
-    while ((lexer->curr_char != '\0' && is_digit(lexer->curr_char)) ||
-           (lexer->curr_char == '.' && !has_decimal)) {
-
-        if (lexer->curr_char == '.') {
+    while (pos < lexer->length) {
+        int cls = char_class[(unsigned char)lexer->input[pos]];
+        if (cls == CHAR_DOT && !has_decimal) {
             has_decimal = 1;
+        } else if (cls != CHAR_DIGIT) {
+            break;
         }
+        pos++;
 
-        advance(lexer);
-        length++;
+        if (pos - start_pos == RUN_SCALAR_PREFIX)
+            return read_long_number(lexer, start_pos, pos, has_decimal);
     }
 
-    if (length == 1 && has_decimal) {
-        lexer->pos = start_pos;
-        lexer->curr_char = lexer->input[lexer->pos];
-        return NULL;
-    }
+    return number_token(lexer, start_pos, pos, has_decimal);
+}
 
-    // Allocate memory for the number string
-    char *number = malloc(length + 1); // +1 for null terminator
-    if (!number) {
-        fprintf(stderr, "Error: Memory allocation failed for number\n");
-        return NULL;
+// Continue a name that outgrew RUN_SCALAR_PREFIX
+static __attribute__((noinline)) Token_t read_long_ident(Lexer_t *lexer, int start_pos,
+                                                         int pos) {
+    lexer->pos = scan_long_run(lexer, pos, RUN_IDENT);
+    return make_token(TOKEN_IDENT, start_pos, lexer->pos - start_pos);
+}
+
+// Read an identifier, a letter or '_' followed by letters, digits and '_'
+static Token_t read_ident(Lexer_t *lexer) {
+    int start_pos = lexer->pos;
+    int pos = lexer->pos + 1;
+
+    while (pos < lexer->length) {
+        int cls = char_class[(unsigned char)lexer->input[pos]];
+        if (cls != CHAR_ALPHA && cls != CHAR_DIGIT)
+            break;
+        pos++;
+
+        if (pos - start_pos == RUN_SCALAR_PREFIX)
+            return read_long_ident(lexer, start_pos, pos);
     }
 
-    // Copy number of characters into new string
-    strncpy(number, lexer->input + start_pos, length);
-    number[length] = '\0'; // Null terminate the string
+    lexer->pos = pos;
+    return make_token(TOKEN_IDENT, start_pos, pos - start_pos);
+}
+
+static Token_t scan_token(Lexer_t *lexer);
 
-    return number;
+// Skip the rest of a run of whitespace, then scan the token after it
+static __attribute__((noinline)) Token_t skip_long_space(Lexer_t *lexer) {
+    lexer->pos = scan_long_run(lexer, lexer->pos, RUN_SPACE);
+    return scan_token(lexer);
 }
 
-// Create a token with specific type and value
-static Token_t *create_token(TokenType type, char *value) {
-    Token_t *token = malloc(sizeof(Token_t));
-    if (!token) {
-        fprintf(stderr, "Error: Memory allocation failed for token\n");
-        return NULL;
+// Scan the next token from the input
+static Token_t scan_token(Lexer_t *lexer) {
+    while (lexer->pos < lexer->length) {
+        unsigned char ch = lexer->input[lexer->pos];
+
+        switch (char_class[ch]) {
+        case CHAR_SPACE:
+            // Ignore whitespace
+            lexer->pos++;
+            if (class_at(lexer, lexer->pos) == CHAR_SPACE)
+                return skip_long_space(lexer);
+            continue;
+
+        case CHAR_DIGIT:
+            return read_number(lexer);
+
+        case CHAR_ALPHA:
+            return read_ident(lexer);
+
+        case CHAR_DOT:
+            // Leading decimal like ".5", a lone '.' is an error
+            if (class_at(lexer, lexer->pos + 1) == CHAR_DIGIT) {
+                return read_number(lexer);
+            }
+            break;
+
+        case CHAR_OP:
+            lexer->pos++;
+            return make_token(op_token[ch], lexer->pos - 1, 1);
+        }
+
+        // Unknown character return error token
+        lexer_error(lexer, "Unknown character");
+        lexer->pos++;
+        return make_token(TOKEN_ERROR, lexer->pos - 1, 1);
     }
 
-    token->type = type;
-    token->value = value;
+    // Reached end of input
+    return make_token(TOKEN_EOF, lexer->length, 0);
+}
+
+// Drop the window before keep and read more of the stream behind the rest.
+// Returns 0 if nothing was added, at the end of input or with a full window.
+static int refill(Lexer_t *lexer, int keep) {
+    int kept = lexer->length - keep;
+    memmove(lexer->buffer, lexer->buffer + keep, kept);
+    lexer->base += keep;
+    lexer->pos -= keep;
+    lexer->length = kept;
+
+    if (kept == lexer->capacity || lexer->eof)
+        return 0;
+
+    ssize_t n;
+    do {
+        n = read(lexer->fd, lexer->buffer + kept, lexer->capacity - kept);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        lexer->eof = 1;
+        lexer->read_error = n < 0 ? errno : 0;
+        return 0;
+    }
 
-    return token;
+    lexer->length += n;
+    return 1;
 }
 
-// Create a token for a single character symbol like '+'
-static Token_t *create_single_char_token(TokenType type, char ch) {
-    char *value = malloc(2); // 1 character + null terminator
-    if (!value) {
-        fprintf(stderr, "Error: Memory allocation failed for token value\n");
-        return NULL;
+// Scan the next token of a stream. A token that reaches the end of the
+// window may go on in input not read yet, so it is scanned again once more
+// is there. Only the final scan reports an error.
+static __attribute__((noinline)) Token_t scan_stream_token(Lexer_t *lexer) {
+    int silent = lexer->silent;
+    const char *msg = "Unknown character";
+    Token_t token;
+
+    lexer->silent = 1;
+    for (;;) {
+        token = scan_token(lexer);
+        if (lexer->eof || token.offset + token.length < lexer->length)
+            break;
+
+        if (!refill(lexer, token.offset) && lexer->length == lexer->capacity) {
+            // The token fills the whole window, skip what there is of it
+            token = make_token(TOKEN_ERROR, 0, lexer->length);
+            msg = "Token longer than the stream buffer";
+            break;
+        }
+        lexer->pos = 0;
     }
+    lexer->silent = silent;
 
-    value[0] = ch;
-    value[1] = '\0';
+    if (token.type == TOKEN_ERROR) {
+        lexer->pos = token.offset;
+        lexer_error(lexer, msg);
+        lexer->pos = token.offset + token.length;
+    }
 
-    return create_token(type, value);
+    return token;
 }
 
 // Returns the next token from the input
-Token_t *lexer_next_token(Lexer_t *lexer) {
-    while (lexer->curr_char != '\0') {
-        // Ignore whitespace
-        if (is_whitespace(lexer->curr_char)) {
-            skip_whitespace(lexer);
-            continue;
-        }
+Token_t lexer_next_token(Lexer_t *lexer) {
+    uint64_t start = STATS_START();
+    Token_t token = lexer->fd < 0 ? scan_token(lexer) : scan_stream_token(lexer);
+    STATS_STOP(STATS_LEX, start);
+    STATS_COUNT(STATS_TOKENS, token.type != TOKEN_EOF);
 
-        // Handle numbers
-        if (is_digit(lexer->curr_char)) {
-            char *number = read_number(lexer);
-            if (number) {
-                return create_token(TOKEN_NUMBER, number);
-            } else {
-                lexer_error(lexer, "Invalid number format");
-                return create_single_char_token(TOKEN_ERROR, lexer->curr_char);
-            }
-        }
+    return token;
+}
 
-        if (lexer->curr_char == '.' && lexer->pos + 1 < lexer->length &&
-            is_digit(lexer->input[lexer->pos + 1])) {
-            char *number = read_number(lexer);
-            if (number) {
-                return create_token(TOKEN_NUMBER, number);
-            }
-        }
+// Exact value of an integer literal token, -1 if it does not fit in int64.
+// Its double is exact below 2^53, only longer literals are read again.
+int64_t lexer_token_integer(const Lexer_t *lexer, const Token_t *token) {
+    if (token->value < 9007199254740992.0)
+        return (int64_t)token->value;
+    if (token->length > NUMPARSE_MAX_DIGITS)
+        return -1;
 
-        // Handle single character operation
-        char ch = lexer->curr_char;
-        advance(lexer);
-
-        switch (ch) {
-        case '+':
-            return create_single_char_token(TOKEN_PLUS, ch);
-        case '-':
-            return create_single_char_token(TOKEN_MINUS, ch);
-        case '*':
-            return create_single_char_token(TOKEN_MULTIPLY, ch);
-        case '/':
-            return create_single_char_token(TOKEN_DIVIDE, ch);
-        case '^':
-            return create_single_char_token(TOKEN_POWER, ch);
-        case '(':
-            return create_single_char_token(TOKEN_LPAREN, ch);
-        case ')':
-            return create_single_char_token(TOKEN_RPAREN, ch);
-        default:
-            // Unknown character return error token
-            lexer_error(lexer, "Unknown character");
-            return create_single_char_token(TOKEN_ERROR, ch);
-        }
-    }
+    const char *digits = lexer->input + token->offset;
+    uint64_t integer = 0;
+    for (int i = 0; i < token->length; i++)
+        integer = integer * 10 + (digits[i] - '0');
 
-    // Reached end of input
-    return create_token(TOKEN_EOF, NULL);
+    return integer <= INT64_MAX ? (int64_t)integer : -1;
 }
 
 // Convert a token type enum to its string name
@@ -190,6 +459,8 @@ const char *token_type_to_string(TokenType type) {
     switch (type) {
     case TOKEN_NUMBER:
         return "NUMBER";
+    case TOKEN_IDENT:
+        return "IDENT";
     case TOKEN_PLUS:
         return "PLUS";
     case TOKEN_MINUS:
@@ -215,8 +486,11 @@ const char *token_type_to_string(TokenType type) {
 
 // Print a lexical error message with current character and position
 void lexer_error(Lexer_t *lexer, const char *msg) {
-    fprintf(stderr, "Lexical Error at position %d: %s '%c' \n", lexer->pos, msg,
-            lexer->curr_char);
+    if (lexer->silent)
+        return;
+
+    fprintf(stderr, "Lexical Error at position %zu: %s '%c' \n", lexer->base + lexer->pos,
+            msg, lexer->input[lexer->pos]);
 }
 
 // Debug function to print all the tokens from the input
@@ -225,29 +499,22 @@ void print_tokens(const char *input) {
     printf("Input: %s\n\n", input);
 
     Lexer_t *lexer = lexer_init(input);
-    Token_t *token;
+    Token_t token;
 
     printf("[ ");
     int first = 1;
 
     // Keep reading tokens util we hit EOF
-    while ((token = lexer_next_token(lexer))->type != TOKEN_EOF) {
+    while ((token = lexer_next_token(lexer)).type != TOKEN_EOF) {
         if (!first)
             printf(", ");
         first = 0;
 
-        if (token->value) {
-            printf("%s(%s)", token_type_to_string(token->type), token->value);
-        } else {
-            printf("%s", token_type_to_string(token->type));
-        }
-
-        token_free(token);
+        printf("%s(%.*s)", token_type_to_string(token.type), token.length,
+               lexer->input + token.offset);
     }
 
     printf(" ]\n\n");
 
-    // Free final EOF token and cleanup
-    token_free(token);
     lexer_free(lexer);
 }
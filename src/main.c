@@ -1,7 +1,47 @@
+#include "../include/arena.h"
+#include "../include/batch.h"
+#include "../include/bytecode.h"
+#include "../include/calc.h"
+#include "../include/calcbin.h"
+#include "../include/columneval.h"
+#include "../include/cache.h"
+#include "../include/exprgen.h"
+#include "../include/fileeval.h"
+#include "../include/jit.h"
 #include "../include/lexer.h"
+#include "../include/numfmt.h"
+#include "../include/numparse.h"
+#include "../include/optimizer.h"
+#include "../include/pareval.h"
 #include "../include/parser.h"
+#include "../include/prepared.h"
+#include "../include/sheet.h"
+#include "../include/stats.h"
+#include "../include/streameval.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+// Optimizer passes applied between parsing and evaluation, --no-opt clears it
+static int optimizer_flags = OPT_ALL;
+
+// Memory cap of the parsed expression cache, --cache-mb sets it, 0 disables it
+static size_t cache_bytes = CACHE_DEFAULT_BYTES;
+
+// How results are printed, --shortest switches to round-trip output
+static NumFormat result_format = NUMFMT_G6;
+
+// Share identical subtrees while parsing, --cse sets it
+static int hash_cons = 0;
+
+// Threads a single expression is evaluated on, --parallel sets it, 0 keeps
+// ast_eval on the calling thread
+static int parallel_threads = 0;
 
 // Function to demonstrate lexer functionality
 void demo_lexer(const char *input) {
@@ -21,13 +61,23 @@ void demo_parser(const char *input) {
         return;
     }
 
+    // Init arena that owns every AST node
+    Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    if (!arena) {
+        fprintf(stderr, "Error: Failed to initialize arena\n");
+        lexer_free(lexer);
+        return;
+    }
+
     // Init parser
-    Parser_t *parser = parser_init(lexer);
+    Parser_t *parser = parser_init(lexer, arena);
     if (!parser) {
         fprintf(stderr, "Error: Failed to initialize parser\n");
+        arena_free(arena);
         lexer_free(lexer);
         return;
     }
+    parser->hash_cons = hash_cons;
 
     // Parse the expression into AST
     ASTNode_t *ast = parser_parse(parser);
@@ -37,15 +87,44 @@ void demo_parser(const char *input) {
         ast_print(ast, 0);
         printf("\n");
 
-        double result = ast_eval(ast);
-        printf("Result: %.6g\n", result);
+        printf("Arena: %zu bytes in %zu allocations, %zu chunk(s)\n",
+               arena_bytes_used(arena), arena->alloc_count, arena->chunk_count);
+
+        if (hash_cons) {
+            printf("CSE: %d -> %d nodes (%d constructions shared)\n",
+                   ast_count_nodes(ast), ast_mark_shared(ast), parser->cons.hits);
+        }
+
+        if (optimizer_flags) {
+            OptimizerStats_t stats;
+            ast = ast_optimize(ast, optimizer_flags, &stats);
+            optimizer_print_stats(&stats);
+            if (hash_cons) {
+                printf("CSE: %d -> %d nodes after optimizing\n", ast_count_nodes(ast),
+                       ast_mark_shared(ast));
+            }
+            printf("\nOptimized AST\n");
+            ast_print(ast, 0);
+            printf("\n");
+        }
+
+        Bytecode_t *bc = bytecode_compile(ast);
+        if (bc) {
+            printf("Bytecode\n");
+            bytecode_print(bc);
+            printf("\n");
+            bytecode_free(bc);
+        }
 
-        ast_free(ast);
+        char text[NUMFMT_BUF_SIZE];
+        numfmt_format(ast_eval(ast), result_format, text);
+        printf("Result: %s\n", text);
     } else {
         fprintf(stderr, "Error: Faild to parse expression\n");
     }
 
     parser_free(parser);
+    arena_free(arena);
     lexer_free(lexer);
     printf("\n");
 }
@@ -54,9 +133,28 @@ void demo_parser(const char *input) {
 void interactive_mode() {
     char input[256];
 
+    // One arena serves every line, it is reset once a result is printed
+    Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    if (!arena) {
+        fprintf(stderr, "Error: Failed to initialize arena\n");
+        return;
+    }
+
+    // Named cells defined with 'name = expr', expressions may read them
+    Sheet_t sheet;
+    if (sheet_init(&sheet, optimizer_flags) != 0) {
+        arena_free(arena);
+        return;
+    }
+
+    // Repeated expressions skip lexing and parsing, cells are read by slot
+    // so cached trees stay valid when a cell changes
+    ExprCache_t *cache = cache_bytes ? cache_init(cache_bytes) : NULL;
+
     printf("=== INTERACTIVE CALCULATOR ===\n");
-    printf("Enter arithmetic expressions ('quit' to exit): \n");
-    printf("Supported operators: +, -, *, /, (, )\n");
+    printf("Enter arithmetic expressions ('quit' to exit, 'cache' for cache stats): \n");
+    printf("Supported operators: +, -, *, /, ^, (, )\n");
+    printf("Define cells with 'name = expr', 'cells' lists them\n");
 
     while (1) {
         printf("calc> ");
@@ -76,31 +174,70 @@ void interactive_mode() {
         if (strcmp(input, "quit") == 0 || strcmp(input, "exit") == 0)
             break;
 
+        if (strcmp(input, "cache") == 0) {
+            if (cache)
+                cache_print_stats(cache);
+            else
+                printf("Cache disabled\n");
+            continue;
+        }
+
+        if (strcmp(input, "cells") == 0) {
+            sheet_print(&sheet, result_format);
+            continue;
+        }
+
+        // Defining a cell re-evaluates only the cells that read it
+        int name_length;
+        const char *expr;
+        const char *name = sheet_split_assignment(input, &name_length, &expr);
+        if (name) {
+            if (sheet_define(&sheet, name, name_length, expr) >= 0)
+                sheet_print_update(&sheet, result_format);
+            continue;
+        }
+
+        char text[NUMFMT_BUF_SIZE];
+        ASTNode_t *cached = cache ? cache_lookup(cache, input, strlen(input)) : NULL;
+        if (cached) {
+            numfmt_format(ast_eval_vars(cached, sheet.values), result_format, text);
+            printf("= %s\n", text);
+            continue;
+        }
+
         // Processes the expression
         Lexer_t *lexer = lexer_init(input);
         if (!lexer) {
             fprintf(stderr, "Error: Failed to initialize lexer\n");
-            return;
+            break;
         }
 
-        Parser_t *parser = parser_init(lexer);
+        Parser_t *parser = parser_init(lexer, arena);
         if (!parser) {
             fprintf(stderr, "Error: Failed to initialize parser\n");
             lexer_free(lexer);
-            return;
+            break;
         }
+        parser->hash_cons = hash_cons;
+        sheet_bind(&sheet, parser);
 
         ASTNode_t *ast = parser_parse(parser);
         if (ast) {
-            double result = ast_eval(ast);
-            printf("= %0.6g\n", result);
-            ast_free(ast);
+            ast = ast_optimize(ast, optimizer_flags, NULL);
+            if (cache)
+                cache_insert(cache, input, strlen(input), ast);
+            numfmt_format(ast_eval_vars(ast, sheet.values), result_format, text);
+            printf("= %s\n", text);
         }
 
         parser_free(parser);
         lexer_free(lexer);
+        arena_reset(arena);
     }
 
+    cache_free(cache);
+    sheet_free(&sheet);
+    arena_free(arena);
     printf("Goodbye\n");
 }
 
@@ -122,72 +259,2752 @@ void run_tests() {
     };
 
     int num_tests = sizeof(test_cases) / sizeof(test_cases[0]);
+    Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
 
     for (int i = 0; i < num_tests; i++) {
         printf("Test %d: %s\n", i + 1, test_cases[i]);
 
         Lexer_t *lexer = lexer_init(test_cases[i]);
-        Parser_t *parser = parser_init(lexer);
+        Parser_t *parser = parser_init(lexer, arena);
         ASTNode_t *ast = parser_parse(parser);
 
         if (ast) {
             double result = ast_eval(ast);
             printf("Result: %.6g\n", result);
-            ast_free(ast);
+
+            // The bytecode VM must agree with the tree walker bit for bit
+            Bytecode_t *bc = bytecode_compile(ast);
+            double vm_result = bc ? bytecode_eval(bc, NULL) : 0.0;
+            if (!bc || memcmp(&result, &vm_result, sizeof(double)) != 0) {
+                printf("Bytecode mismatch: %.17g\n", vm_result);
+            }
+            bytecode_free(bc);
+
+            // So must the optimized tree
+            double opt_result = ast_eval(ast_optimize(ast, OPT_ALL, NULL));
+            if (memcmp(&result, &opt_result, sizeof(double)) != 0) {
+                printf("Optimizer mismatch: %.17g\n", opt_result);
+            }
         } else {
             printf("Parse failed\n");
         }
 
         parser_free(parser);
         lexer_free(lexer);
+        arena_reset(arena);
         printf("\n");
     }
+
+    // Operands past 24 bits must fail to compile instead of wrapping around
+    ASTNode_t *var = arena_alloc(arena, sizeof(ASTNode_t));
+    ASTNode_t *power = arena_alloc(arena, sizeof(ASTNode_t));
+    memset(var, 0, sizeof(ASTNode_t));
+    memset(power, 0, sizeof(ASTNode_t));
+    var->type = AST_VARIABLE;
+    var->shared = -1;
+    var->data.variable.name = "x";
+    var->data.variable.slot = BC_ARG_MAX;
+    power->type = AST_POWI;
+    power->shared = -1;
+    power->data.power.base = var;
+    power->data.power.exponent = -(BC_ARG_MAX / 2 + 1);
+
+    Bytecode_t *widest = bytecode_compile(power);
+    int wide_ok = widest && widest->var_count == BC_ARG_MAX + 1;
+    bytecode_free(widest);
+
+    printf("Expected errors for operands past %d:\n", BC_ARG_MAX);
+    var->data.variable.slot = BC_ARG_MAX + 1;
+    Bytecode_t *too_wide = bytecode_compile(var);
+    var->data.variable.slot = 0;
+    power->data.power.exponent = BC_ARG_MAX / 2 + 1;
+    Bytecode_t *too_large = bytecode_compile(power);
+    if (!wide_ok || too_wide || too_large)
+        printf("FAIL: bytecode operand range not enforced\n");
+    bytecode_free(too_wide);
+    bytecode_free(too_large);
+    printf("\n");
+
+    // A variable evaluated without values is named in the error
+    const char *error = NULL;
+    ast_eval_checked(var, NULL, &error);
+    if (!error || strcmp(error, "Unbound variable x") != 0)
+        printf("FAIL: unbound variable error %s\n", error ? error : "missing");
+
+    arena_free(arena);
 }
 
-int main(int argc, char *argv[]) {
-    printf("Arithmetic Expression Compiler\n");
-    printf("==============================\n");
+// Function to run prepared expressions against bound variables
+void run_prepared_tests() {
+    printf("=== RUNNING PREPARED EXPRESSIONS ===\n\n");
 
-    // If no argument run in interactive mode
-    if (argc == 1) {
-        interactive_mode();
+    const char *names[] = {"x", "y"};
+    const double values[] = {3.0, -0.5};
+
+    const char *test_cases[] = {
+        "x * 2 + y",               // Variables and constants
+        "(x + y) ^ 2 - x*y*1",     // Identity removed by the optimizer
+        "-(-x) / +y",              // Double negation and unary plus
+        "x ^ 1 - 0 + (2 * 3) * y", // Mixed identities and folding
+    };
+
+    int num_tests = sizeof(test_cases) / sizeof(test_cases[0]);
+
+    for (int i = 0; i < num_tests; i++) {
+        printf("Test %d: %s with x = %g, y = %g\n", i + 1, test_cases[i], values[0],
+               values[1]);
+
+        PreparedExpr_t *expr = expr_prepare(test_cases[i], names, 2);
+        if (!expr) {
+            printf("Prepare failed\n\n");
+            continue;
+        }
+
+        double result = expr_execute(expr, values);
+        printf("Result: %.6g\n", result);
+
+        // Executing must match walking the optimized tree
+        double tree_result = ast_eval_vars(expr->ast, values);
+        if (memcmp(&result, &tree_result, sizeof(double)) != 0) {
+            printf("Prepared mismatch: %.17g\n", tree_result);
+        }
+
+        expr_free(expr);
+        printf("\n");
+    }
+}
+
+// Write a damaged copy of a calcbin file and check that it is rejected when
+// opened. Returns 1 if it was.
+static int calcbin_rejects(const char *path, const unsigned char *data, size_t size) {
+    FILE *file = fopen(path, "wb");
+    if (!file)
         return 0;
+    fwrite(data, 1, size, file);
+    fclose(file);
+
+    CalcBin_t bin;
+    if (calcbin_open(&bin, path) != 0)
+        return 1;
+    calcbin_close(&bin);
+    return 0;
+}
+
+// Write generated expressions to a calcbin file, map it back and compare
+// every result with the prepared expression it was written from. Formula
+// files must compile under their names, and damaged files must be rejected
+// when they are opened.
+void run_calcbin_tests() {
+    printf("=== RUNNING CALCBIN FILES ===\n\n");
+
+    enum { num_exprs = 500, rows = 8 };
+    const int size = 4096;
+    char path[] = "/tmp/calc-calcbin-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        close(fd);
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 31);
+    gen.var_count = EXPRGEN_MAX_VARS;
+
+    PreparedExpr_t *exprs[num_exprs];
+    char names[num_exprs][16];
+    const char *name_list[num_exprs];
+    char *input = malloc(size);
+    int count = 0;
+    int failures = 0;
+
+    // Names in reverse order, so the index has to sort them
+    while (count < num_exprs) {
+        if (exprgen_expression(&gen, input, size) < 0)
+            continue;
+        exprs[count] = expr_prepare(input, NULL, 0);
+        if (!exprs[count])
+            continue;
+        snprintf(names[count], sizeof(names[count]), "f%d", num_exprs - count);
+        name_list[count] = names[count];
+        count++;
     }
 
-    char *command = argv[1];
+    CalcBin_t bin;
+    if (fd < 0 || calcbin_write(path, name_list, exprs, count) != 0 ||
+        calcbin_open(&bin, path) != 0) {
+        printf("FAIL: calcbin file could not be written and opened\n");
+        failures++;
+        memset(&bin, 0, sizeof(bin));
+    }
 
-    // Handle command line arguments
-    if (argc == 2) {
-        if (strcmp(command, "--test") == 0 || strcmp(command, "-t") == 0) {
-            run_tests();
-            return 0;
-        } else if (strcmp(command, "--help") == 0 || strcmp(command, "-h") == 0) {
-            printf("Usage:\n");
-            printf("  calc                    - Interactive calculator mode\n");
-            printf("  calc \"expression\"       - Evaluate single expression\n");
-            printf("  calc --test             - Run test cases\n");
-            printf("  calc --demo \"expr\"      - Show lexer and parser demo\n");
-            printf("  calc --help             - Show this help\n");
-            return 0;
+    double *scratch =
+        bin.base ? malloc(calcbin_scratch_size(&bin) * sizeof(double)) : NULL;
+    int checked = 0;
+
+    for (int i = 0; scratch && i < count; i++) {
+        int index = calcbin_find(&bin, names[i]);
+        int ok = index >= 0 && strcmp(calcbin_name(&bin, index), names[i]) == 0 &&
+                 calcbin_var_count(&bin, index) == exprs[i]->var_count;
+        for (int v = 0; ok && v < exprs[i]->var_count; v++)
+            ok = strcmp(calcbin_var_name(&bin, index, v), exprs[i]->var_names[v]) == 0;
+
+        for (int r = 0; ok && r < rows; r++) {
+            double vars[EXPRGEN_MAX_VARS];
+            for (int v = 0; v < EXPRGEN_MAX_VARS; v++)
+                vars[v] = (exprgen_uniform(&gen) - 0.5) * 8.0;
+
+            double expected = bytecode_eval(exprs[i]->bc, vars);
+            double actual = calcbin_eval(&bin, index, vars, scratch);
+            ok = memcmp(&actual, &expected, sizeof(double)) == 0;
+            checked++;
+        }
+
+        if (!ok) {
+            if (failures < 10)
+                printf("FAIL: expression %s read back wrong\n", names[i]);
+            failures++;
+        }
+    }
+
+    if (bin.base && (bin.count != count || calcbin_find(&bin, "f0") != -1 ||
+                     calcbin_find(&bin, "") != -1)) {
+        printf("FAIL: calcbin lookup\n");
+        failures++;
+    }
+    free(scratch);
+    calcbin_close(&bin);
+
+    // Damage a copy of the file in every way the loader must notice
+    FILE *file = fopen(path, "rb");
+    unsigned char *data = malloc(1 << 20);
+    size_t length = file ? fread(data, 1, 1 << 20, file) : 0;
+    if (file)
+        fclose(file);
+
+    if (length > sizeof(CalcBinHeader_t)) {
+        CalcBinHeader_t *header = (CalcBinHeader_t *)data;
+        CalcBinEntry_t *entries = (CalcBinEntry_t *)(data + header->index_offset);
+        uint32_t *code = (uint32_t *)(data + header->code_offset);
+        uint32_t saved;
+        int rejected = 0;
+        int cases = 0;
+
+        rejected += calcbin_rejects(path, data, length - 8), cases++;
+
+        data[0] ^= 1;
+        rejected += calcbin_rejects(path, data, length), cases++;
+        data[0] ^= 1;
+
+        header->version++;
+        rejected += calcbin_rejects(path, data, length), cases++;
+        header->version--;
+
+        saved = entries[0].name;
+        entries[0].name = entries[1].name;
+        rejected += calcbin_rejects(path, data, length), cases++;
+        entries[0].name = saved;
+
+        // The first program ends without OP_END, then reads a constant
+        // beyond its own, then has an unknown opcode
+        uint32_t *last = &code[entries[0].code + entries[0].code_len - 1];
+        saved = *last;
+        *last = BC_MAKE(OP_NEG, 0);
+        rejected += calcbin_rejects(path, data, length), cases++;
+        *last = saved;
+
+        uint32_t *first = &code[entries[0].code];
+        saved = *first;
+        *first = BC_MAKE(OP_CONST, entries[0].const_count);
+        rejected += calcbin_rejects(path, data, length), cases++;
+        *first = BC_MAKE(OP_END + 1, 0);
+        rejected += calcbin_rejects(path, data, length), cases++;
+        *first = saved;
+
+        // Restored, the copy opens again
+        rejected += !calcbin_rejects(path, data, length), cases++;
+
+        printf("Damaged files rejected: %d of %d\n", rejected, cases);
+        failures += cases - rejected;
+    } else {
+        printf("FAIL: calcbin file could not be read back\n");
+        failures++;
+    }
+    free(data);
+
+    // A formula file, named lines keep their name, others get their number
+    char text_path[] = "/tmp/calc-formulas-XXXXXX";
+    fd = mkstemp(text_path);
+    file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (file) {
+        fprintf(file, "total = 1 + 2 * 3\n\n  x * y - 1\nrate = total / n\n");
+        fclose(file);
+    }
+
+    int compiled = 0;
+    if (file && calcbin_compile(text_path, path, OPT_ALL, &compiled) == 0 &&
+        calcbin_open(&bin, path) == 0) {
+        double vars[2] = {3.0, 4.0};
+        double scratch_space[16];
+        int total = calcbin_find(&bin, "total");
+        int line3 = calcbin_find(&bin, "3");
+        int rate = calcbin_find(&bin, "rate");
+        int ok = compiled == 3 && bin.count == 3 && total >= 0 && line3 >= 0 &&
+                 rate >= 0 && calcbin_scratch_size(&bin) <= 16 &&
+                 calcbin_eval(&bin, total, vars, scratch_space) == 7.0 &&
+                 calcbin_eval(&bin, line3, vars, scratch_space) == 11.0 &&
+                 calcbin_var_count(&bin, rate) == 2 &&
+                 strcmp(calcbin_var_name(&bin, rate, 1), "n") == 0 &&
+                 calcbin_eval(&bin, rate, vars, scratch_space) == 0.75;
+        printf("Formula file: %s\n", ok ? "ok" : "FAIL");
+        failures += !ok;
+        calcbin_close(&bin);
+    } else {
+        printf("FAIL: formula file did not compile\n");
+        failures++;
+    }
+
+    // A line that does not parse and a repeated name fail the whole file
+    file = fopen(text_path, "w");
+    if (file) {
+        fprintf(file, "a = 1\na = 2\n");
+        fclose(file);
+    }
+    if (!file || calcbin_compile(text_path, path, OPT_ALL, NULL) == 0) {
+        printf("FAIL: repeated name accepted\n");
+        failures++;
+    }
+    file = fopen(text_path, "w");
+    if (file) {
+        fprintf(file, "1 +\n");
+        fclose(file);
+    }
+    if (!file || calcbin_compile(text_path, path, OPT_ALL, NULL) == 0) {
+        printf("FAIL: broken line accepted\n");
+        failures++;
+    }
+
+    // The caller's passes reach every line, a reassociated sum rounds
+    // differently from the parse order one
+    file = fopen(text_path, "w");
+    if (file) {
+        fprintf(file, "x + 0.1 + 0.2 + 0.3\n");
+        fclose(file);
+    }
+    double sums[2] = {0.0, 0.0};
+    for (int i = 0; file && i < 2; i++) {
+        int flags = i ? OPT_ALL | OPT_REASSOCIATE : OPT_ALL;
+        double x = 1e-17;
+        double scratch_space[16];
+        if (calcbin_compile(text_path, path, flags, NULL) == 0 &&
+            calcbin_open(&bin, path) == 0) {
+            if (calcbin_scratch_size(&bin) <= 16)
+                sums[i] = calcbin_eval(&bin, 0, &x, scratch_space);
+            calcbin_close(&bin);
+        }
+    }
+    if (sums[0] != 0.1 + 0.2 + 0.3 || sums[1] != 0.1 + (0.2 + 0.3)) {
+        printf("FAIL: calcbin_compile ignores its optimizer passes\n");
+        failures++;
+    }
+
+    unlink(text_path);
+    unlink(path);
+    for (int i = 0; i < count; i++)
+        expr_free(exprs[i]);
+    free(input);
+
+    printf("Compared %d calcbin evaluations: %d failures\n\n", checked, failures);
+}
+
+// Differential test of the JIT against ast_eval on random expressions
+void run_jit_tests() {
+    printf("=== RUNNING JIT DIFFERENTIAL TEST ===\n\n");
+
+    if (!jit_available()) {
+        printf("JIT not available on this target, skipped\n");
+        return;
+    }
+
+    const int num_exprs = 2000;
+    const int num_bindings = 4;
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 42);
+    gen.var_count = EXPRGEN_MAX_VARS;
+
+    char input[1024];
+    int checked = 0;
+    int mismatches = 0;
+
+    for (int i = 0; i < num_exprs; i++) {
+        if (exprgen_expression(&gen, input, sizeof(input)) < 0)
+            continue;
+
+        PreparedExpr_t *expr = expr_prepare(input, exprgen_var_names, EXPRGEN_MAX_VARS);
+        if (!expr || !expr_enable_jit(expr)) {
+            printf("JIT compile failed: %s\n", input);
+            mismatches++;
+            expr_free(expr);
+            continue;
+        }
+
+        for (int b = 0; b < num_bindings; b++) {
+            double values[EXPRGEN_MAX_VARS];
+            for (int v = 0; v < EXPRGEN_MAX_VARS; v++) {
+                values[v] = (exprgen_uniform(&gen) - 0.5) * 8.0;
+            }
+
+            double expected = ast_eval_vars(expr->ast, values);
+            double actual = expr->jit->fn(values);
+            checked++;
+
+            if (memcmp(&expected, &actual, sizeof(double)) != 0) {
+                if (mismatches < 10) {
+                    printf("Mismatch: %s\n  ast_eval %.17g, jit %.17g\n", input, expected,
+                           actual);
+                }
+                mismatches++;
+            }
+        }
+
+        expr_free(expr);
+    }
+
+    printf("Checked %d evaluations of %d expressions: %d mismatches\n\n", checked,
+           num_exprs, mismatches);
+}
+
+// Check that hash-consed DAGs evaluate to the same bits as plain trees on
+// every backend, using generated expressions repeated inside one input
+void run_cse_tests() {
+    printf("=== RUNNING COMMON SUBEXPRESSION ELIMINATION ===\n\n");
+
+    const int num_exprs = 500;
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 99);
+    gen.var_count = EXPRGEN_MAX_VARS;
+
+    char term[256];
+    char input[1536];
+    int checked = 0;
+    int mismatches = 0;
+    long tree_nodes = 0;
+    long dag_nodes = 0;
+
+    for (int i = 0; i < num_exprs; i++) {
+        if (exprgen_expression(&gen, term, sizeof(term)) < 0)
+            continue;
+        snprintf(input, sizeof(input), "(%s)*(%s)^2 - (%s) + x/(%s)", term, term, term,
+                 term);
+
+        // Plain tree, parsed without hash-consing and evaluated as parsed
+        Lexer_t *lexer = lexer_init(input);
+        Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+        Parser_t *parser = parser_init(lexer, arena);
+        for (int v = 0; v < EXPRGEN_MAX_VARS; v++) {
+            parser_declare_variable(parser, exprgen_var_names[v], 1);
+        }
+        parser->symbols.fixed = 1;
+        ASTNode_t *tree = parser_parse(parser);
+
+        PreparedExpr_t *expr = expr_prepare(input, exprgen_var_names, EXPRGEN_MAX_VARS);
+        if (!tree || !expr) {
+            printf("Prepare failed: %s\n", input);
+            mismatches++;
         } else {
-            // Treat as expression to evaluate
-            const char *expression = command;
+            expr_enable_jit(expr);
+            tree_nodes += ast_count_nodes(tree);
+            dag_nodes += ast_mark_shared(expr->ast);
+
+            double values[EXPRGEN_MAX_VARS];
+            for (int v = 0; v < EXPRGEN_MAX_VARS; v++) {
+                values[v] = (exprgen_uniform(&gen) - 0.5) * 8.0;
+            }
+
+            const char *error = NULL;
+            double expected = ast_eval_checked(tree, values, &error);
+            double results[3];
+            results[0] = ast_eval_checked(expr->ast, values, &error);
+            results[1] = bytecode_eval(expr->bc, values);
+            results[2] = expr->jit ? expr->jit->fn(values) : results[1];
+
+            // The sign of a NaN depends on operand order, which the compiler
+            // may swap for + and *, so any two NaNs are accepted as equal
+            for (int r = 0; r < 3; r++) {
+                checked++;
+                if (memcmp(&expected, &results[r], sizeof(double)) != 0 &&
+                    !(isnan(expected) && isnan(results[r]))) {
+                    if (mismatches < 10) {
+                        printf("Mismatch: %s\n  tree %.17g, backend %d %.17g\n", input,
+                               expected, r, results[r]);
+                    }
+                    mismatches++;
+                }
+            }
+        }
+
+        expr_free(expr);
+        parser_free(parser);
+        arena_free(arena);
+        lexer_free(lexer);
+    }
+
+    printf("CSE: %ld tree nodes -> %ld DAG nodes\n", tree_nodes, dag_nodes);
+    printf("Checked %d evaluations of %d expressions: %d mismatches\n", checked,
+           num_exprs, mismatches);
+
+    // An exact subtree first reached from a double parent must still give
+    // its int64 value to an exact parent later
+    const char *mixed = "(1+2)*x + ((1+2)*3)";
+    Lexer_t *lexer = lexer_init(mixed);
+    Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    Parser_t *parser = parser_init(lexer, arena);
+    parser->hash_cons = 1;
+    parser_declare_variable(parser, "x", 1);
+    ASTNode_t *ast = parser_parse(parser);
+    double x = 5.0;
+    if (!ast || ast_eval_vars(ast, &x) != 24.0) {
+        printf("FAIL: shared exact subtree %s\n", mixed);
+        mismatches++;
+    }
+
+    // A shared subtree is optimized once for all its parents, (1+2) is folded
+    // and x*1 reduced a single time
+    const char *repeated = "x*1 + (x*1)*(1+2) - (1+2)";
+    lexer_reset(lexer, repeated, strlen(repeated));
+    arena_reset(arena);
+    parser_reset(parser);
+    ast = parser_parse(parser);
+    OptimizerStats_t stats;
+    ast = ast ? ast_optimize(ast, OPT_ALL, &stats) : NULL;
+    if (!ast || stats.folded != 1 || stats.identities_applied != 1 ||
+        ast_eval_vars(ast, &x) != 17.0) {
+        printf("FAIL: shared subtree optimized more than once in %s\n", repeated);
+        mismatches++;
+    }
+
+    // Every level uses the one below twice, 2^100 paths that only finish if
+    // each of the 99 shared nodes is computed once
+    ASTNode_t *dag = arena_alloc(arena, sizeof(ASTNode_t));
+    memset(dag, 0, sizeof(ASTNode_t));
+    dag->type = AST_VARIABLE;
+    dag->shared = -1;
+    dag->data.variable.name = "x";
+    for (int level = 0; level < 100; level++) {
+        ASTNode_t *sum = arena_alloc(arena, sizeof(ASTNode_t));
+        memset(sum, 0, sizeof(ASTNode_t));
+        sum->type = AST_BINARY_OP;
+        sum->shared = level < 99 ? level : -1; // as ast_mark_shared numbers them
+        sum->data.binary_op.op = TOKEN_PLUS;
+        sum->data.binary_op.left = dag;
+        sum->data.binary_op.right = dag;
+        dag = sum;
+    }
+    if (ast_eval_vars(dag, &x) != ldexp(x, 100)) {
+        printf("FAIL: DAG with more than %d shared nodes\n", EVAL_MEMO_SLOTS);
+        mismatches++;
+    }
+    parser_free(parser);
+    arena_free(arena);
+    lexer_free(lexer);
+
+    printf("Shared subtree checks: %d failures\n\n", mismatches);
+}
+
+// Append count random decimal digits to buf
+static int random_digits(ExprGen_t *gen, char *buf, int count) {
+    for (int i = 0; i < count; i++) {
+        buf[i] = '0' + exprgen_next(gen) % 10;
+    }
+    return count;
+}
+
+// Check that the lexer's number parser returns the same bits as strtod on a
+// randomized corpus of literal shapes, including ones that must round to
+// even, underflow or overflow
+void run_number_tests() {
+    printf("=== RUNNING NUMBER PARSING ===\n\n");
+
+    const int num_cases = 1000000;
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 2024);
+
+    char text[1024];
+    int mismatches = 0;
+
+    for (int i = 0; i < num_cases; i++) {
+        int len = 0;
+
+        switch (i % 6) {
+        case 0: // short integer and fraction
+            len += random_digits(&gen, text, 1 + exprgen_next(&gen) % 10);
+            text[len++] = '.';
+            len += random_digits(&gen, text + len, exprgen_next(&gen) % 10);
+            break;
+        case 1: // more digits than fit in 64 bits
+            len += random_digits(&gen, text, 15 + exprgen_next(&gen) % 30);
+            text[len++] = '.';
+            len += random_digits(&gen, text + len, exprgen_next(&gen) % 30);
+            break;
+        case 2: { // tiny values down to the subnormal range and below
+            int zeros = exprgen_next(&gen) % 340;
+            text[len++] = '.';
+            memset(text + len, '0', zeros);
+            len += zeros;
+            len += random_digits(&gen, text + len, 1 + exprgen_next(&gen) % 25);
+            break;
+        }
+        case 3: // huge values up to overflow
+            len += random_digits(&gen, text, 280 + exprgen_next(&gen) % 40);
+            break;
+        case 4: { // exact decimal expansion of a double
+            uint64_t bits = exprgen_next(&gen) & 0x7FEFFFFFFFFFFFFFULL;
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            if (d > 1e30 || d < 1e-30)
+                d = exprgen_uniform(&gen) * 1e6;
+            len = snprintf(text, sizeof(text), "%.60f", d);
+            break;
+        }
+        default: { // halfway between two adjacent doubles
+            int exponent = (int)(exprgen_next(&gen) % 40) - 20;
+            double d = exprgen_uniform(&gen) * pow(10.0, exponent);
+            long double mid = ((long double)d + (long double)nextafter(d, INFINITY)) / 2;
+            len = snprintf(text, sizeof(text), "%.80Lf", mid);
+            break;
+        }
+        }
+
+        if (len <= 0 || len >= (int)sizeof(text))
+            continue;
+        text[len] = '\0';
+
+        double expected = strtod(text, NULL);
+        double actual = numparse_decimal(text, len);
+
+        if (memcmp(&expected, &actual, sizeof(double)) != 0) {
+            if (mismatches < 10) {
+                printf("Mismatch: %s\n  strtod %.17g, numparse %.17g\n", text, expected,
+                       actual);
+            }
+            mismatches++;
+        }
+    }
+
+    printf("Checked %d literals against strtod: %d mismatches\n\n", num_cases,
+           mismatches);
+}
+
+// Significant digits in formatted text, leading and trailing zeros excluded
+static int significant_digits(const char *text) {
+    int first = -1;
+    int last = -1;
+
+    for (int i = 0; text[i] && text[i] != 'e'; i++) {
+        if (text[i] >= '1' && text[i] <= '9') {
+            if (first < 0)
+                first = i;
+            last = i;
+        }
+    }
+
+    int count = 0;
+    for (int i = first; first >= 0 && i <= last; i++) {
+        count += text[i] != '.';
+    }
+
+    return count;
+}
+
+// Check the result formatter against printf on random doubles: %.6g mode
+// must produce the same text, shortest mode must read back as the same bits
+// Test integer evaluation in int64 and its fallback to double
+void run_exact_tests() {
+    printf("=== RUNNING EXACT INTEGER TESTS ===\n\n");
+
+    const struct {
+        const char *input;
+        double expected;
+    } cases[] = {
+        {"9007199254740993 - 9007199254740992", 1.0}, // both above 2^53
+        {"(2^53 + 1) * 3 - 2^53 * 3", 3.0},
+        {"(2^62 + 1) - 2^62", 1.0},
+        {"(-2) ^ 63", -9223372036854775808.0},
+        {"9223372036854775807 - 9223372036854775806", 1.0},
+        {"3^40 - 3^40 + 7", 7.0}, // overflows, falls back to double
+        {"2^63 - 1", 9223372036854775808.0},
+        {"7 / 2", 3.5},
+        {"10 / 4 * 4", 10.0},
+        {"2 ^ (-1)", 0.5},
+        {"2 ^ 0.5 * 2 ^ 0.5", 2.0000000000000004},
+        {"-0", -0.0}, // -0 only exists in double
+        {"0 * -5", -0.0},
+        {"0 / -5", -0.0},
+        {"-(3 - 3)", -0.0},
+        {"0 ^ 0", 1.0},
+        {"(-1) ^ 9223372036854775807", -1.0},
+        {"99999999999999999999 - 99999999999999999999", 0.0}, // too long for int64
+    };
+    int num_cases = sizeof(cases) / sizeof(cases[0]);
+    int failures = 0;
+
+    Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    Lexer_t *lexer = lexer_init("");
+    Parser_t *parser = parser_init(lexer, arena);
+
+    // As parsed, with constants folded, and with shared subtrees
+    for (int mode = 0; mode < 3; mode++) {
+        for (int i = 0; i < num_cases; i++) {
+            lexer_reset(lexer, cases[i].input, strlen(cases[i].input));
+            arena_reset(arena);
+            parser->hash_cons = mode == 2;
+            parser_reset(parser);
 
-            Lexer_t *lexer = lexer_init(expression);
-            Parser_t *parser = parser_init(lexer);
             ASTNode_t *ast = parser_parse(parser);
+            if (ast && mode == 1)
+                ast = ast_optimize(ast, OPT_ALL, NULL);
 
-            if (!ast) {
-                fprintf(stderr, "Error: Failed to parser expression: %s\n", expression);
-                return 1;
+            const char *error = NULL;
+            double result = ast ? ast_eval_checked(ast, NULL, &error) : 0.0;
+            if (!ast || error ||
+                memcmp(&result, &cases[i].expected, sizeof(double)) != 0) {
+                printf("FAIL: %-42s mode %d: %.17g\n", cases[i].input, mode, result);
+                failures++;
             }
+        }
+    }
 
-            double result = ast_eval(ast);
-            printf("Input: %s\n", expression);
-            printf("Result: %.6g\n", result);
-            ast_free(ast);
+    // Integer literals still carry the correctly rounded double
+    ExprGen_t gen;
+    exprgen_init(&gen, 2053);
+    char text[32];
 
-            parser_free(parser);
+    for (int i = 0; i < 100000; i++) {
+        int len = random_digits(&gen, text, 1 + exprgen_next(&gen) % 19);
+        text[len] = '\0';
+        lexer_reset(lexer, text, len);
+        Token_t token = lexer_next_token(lexer);
+
+        double expected = strtod(text, NULL);
+        if (memcmp(&token.value, &expected, sizeof(double)) != 0) {
+            printf("FAIL: literal %s read as %.17g\n", text, token.value);
+            failures++;
+        }
+    }
+
+    parser_free(parser);
+    lexer_free(lexer);
+    arena_free(arena);
+
+    printf("Exact integer checks: %d failures\n\n", failures);
+}
+
+// Check if two results are the same bits, any two NaNs count as equal
+static int same_result(double a, double b) {
+    return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+// Evaluate generated expressions over columns at every vector width and
+// compare each row with bytecode_eval on that row. Inputs include zeros,
+// infinities and NaNs, row counts are not multiples of the block, and one
+// program has enough constants to get shorter blocks. CSV tables must skip
+// the columns not asked for and reject rows that do not parse.
+void run_column_tests() {
+    printf("=== RUNNING COLUMN EVALUATION ===\n\n");
+
+    enum { num_exprs = 1000, max_rows = 2 * COLUMN_BLOCK + 13, num_terms = 2000 };
+    const size_t row_counts[] = {1, 3, 8, COLUMN_BLOCK, max_rows};
+    const double specials[] = {0.0, -0.0, 1.0, -1.0, INFINITY, -INFINITY, NAN};
+    const int size = 1 << 16;
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 37);
+    gen.var_count = EXPRGEN_MAX_VARS;
+
+    double *data = malloc(EXPRGEN_MAX_VARS * max_rows * sizeof(double));
+    double *out = malloc(max_rows * sizeof(double));
+    char *input = malloc(size);
+    const double *columns[EXPRGEN_MAX_VARS];
+    int widths = columneval_simd_width();
+    int checked = 0;
+    int failures = 0;
+
+    for (int v = 0; v < EXPRGEN_MAX_VARS; v++) {
+        columns[v] = data + v * max_rows;
+        for (int r = 0; r < max_rows; r++) {
+            uint64_t pick = exprgen_next(&gen) % 16;
+            data[v * max_rows + r] = pick < sizeof(specials) / sizeof(specials[0])
+                                         ? specials[pick]
+                                         : (exprgen_uniform(&gen) - 0.5) * 8.0;
+        }
+    }
+
+    for (int i = 0; i <= num_exprs; i++) {
+        // The last program sums many distinct constants
+        if (i == num_exprs) {
+            int len = 0;
+            for (int t = 0; t < num_terms; t++)
+                len += snprintf(input + len, size - len, "%s%s*%d.5", t ? "+" : "",
+                                exprgen_var_names[t % EXPRGEN_MAX_VARS], t);
+        } else if (exprgen_expression(&gen, input, size) < 0) {
+            continue;
+        }
+
+        PreparedExpr_t *expr = expr_prepare(input, exprgen_var_names, EXPRGEN_MAX_VARS);
+        if (!expr)
+            continue;
+
+        size_t rows = row_counts[i % (sizeof(row_counts) / sizeof(row_counts[0]))];
+        if (i == num_exprs)
+            rows = max_rows;
+
+        for (int width = 1; width <= widths; width *= 2) {
+            int ok = columneval_run(expr->bc, columns, rows, out, width) == 0;
+            for (size_t r = 0; ok && r < rows; r++) {
+                double vars[EXPRGEN_MAX_VARS];
+                for (int v = 0; v < EXPRGEN_MAX_VARS; v++)
+                    vars[v] = columns[v][r];
+                double expected = bytecode_eval(expr->bc, vars);
+                ok = same_result(out[r], expected);
+                if (!ok && failures < 10)
+                    printf("FAIL: width %d row %zu of %s\n"
+                           "  bytecode %.17g, columns %.17g\n",
+                           width, r, input, expected, out[r]);
+            }
+            checked++;
+            failures += !ok;
+        }
+
+        expr_free(expr);
+    }
+
+    printf("Checked %d column runs at widths up to %d: %d failures\n", checked, widths,
+           failures);
+
+    // Blanks, signs, exponents and a text column nobody reads
+    const char *csv = "a, b ,name\n1,2,x\n\n -1.5 ,+2.25,y\r\n1e3,inf,z\n";
+    const char *wanted[] = {"b", "a"};
+    const double expected_a[] = {1.0, -1.5, 1000.0};
+    const double expected_b[] = {2.0, 2.25, INFINITY};
+    char path[] = "/tmp/calc-columns-XXXXXX";
+    int fd = mkstemp(path);
+    ColumnTable_t table;
+    int ok = 0;
+
+    if (fd >= 0 && write(fd, csv, strlen(csv)) == (ssize_t)strlen(csv) &&
+        lseek(fd, 0, SEEK_SET) == 0 &&
+        column_table_read_csv(&table, fd, wanted, 2) == 0) {
+        int a = column_table_find(&table, "a");
+        int b = column_table_find(&table, "b");
+        int name = column_table_find(&table, "name");
+        ok = table.rows == 3 && a == 0 && b == 1 && name == 2 && !table.values[name] &&
+             column_table_find(&table, "c") == -1;
+        for (size_t r = 0; ok && r < table.rows; r++)
+            ok = table.values[a][r] == expected_a[r] &&
+                 table.values[b][r] == expected_b[r];
+        column_table_free(&table);
+    }
+    if (!ok) {
+        printf("FAIL: CSV table read back wrong\n");
+        failures++;
+    }
+
+    // A row with a missing field and one with a bad number
+    const char *broken[] = {"a,b\n1,2\n3\n", "a,b\n1,2\n3,4x\n"};
+    for (int i = 0; fd >= 0 && i < 2; i++) {
+        if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0 ||
+            write(fd, broken[i], strlen(broken[i])) != (ssize_t)strlen(broken[i]) ||
+            lseek(fd, 0, SEEK_SET) != 0 ||
+            column_table_read_csv(&table, fd, NULL, 0) == 0) {
+            printf("FAIL: broken CSV table %d accepted\n", i + 1);
+            failures++;
+            column_table_free(&table);
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+    free(data);
+    free(out);
+    free(input);
+
+    printf("Column evaluation: %d failures\n\n", failures);
+}
+
+// Lex random text with long runs twice, with the vector scan and one byte at
+// a time, and check that both produce the same tokens
+void run_scan_tests() {
+    printf("=== RUNNING LEXER SCAN TESTS ===\n\n");
+
+    if (!lexer_simd_width()) {
+        printf("Vector scan not available on this target, skipped\n\n");
+        return;
+    }
+
+    // Pieces repeated into runs, including bytes no class accepts
+    static const char *const pieces[] = {" ",  "\t", "\n", "\r\f\v", "7",  "0", ".",
+                                         "x",  "Q",  "_",  "+",      "-",  "*", "/",
+                                         "^",  "(",  ")",  "\x80",   "\xe9", "@", "`",
+                                         "{",  "[",  "~"};
+    int num_pieces = sizeof(pieces) / sizeof(pieces[0]);
+
+    const int num_inputs = 3000;
+    char text[512];
+    ExprGen_t gen;
+    exprgen_init(&gen, 31);
+
+    Lexer_t *vector = lexer_init("");
+    Lexer_t *scalar = lexer_init("");
+    vector->silent = 1;
+    scalar->silent = 1;
+    scalar->simd = 0;
+
+    int tokens = 0;
+    int failures = 0;
+
+    for (int i = 0; i < num_inputs; i++) {
+        int len = 0;
+        int target = exprgen_next(&gen) % (sizeof(text) - 64);
+        while (len < target) {
+            const char *piece = pieces[exprgen_next(&gen) % num_pieces];
+            int repeat = exprgen_next(&gen) % 4 == 0 ? exprgen_next(&gen) % 48 : 1;
+            for (int r = 0; r < repeat && len < target; r++)
+                for (const char *c = piece; *c && len < target; c++)
+                    text[len++] = *c;
+        }
+
+        // SSE2, and AVX2 where the machine has it
+        for (int width = 16; width <= lexer_simd_width(); width *= 2) {
+            vector->simd = width;
+            lexer_reset(vector, text, len);
+            lexer_reset(scalar, text, len);
+
+            Token_t a, b;
+            do {
+                a = lexer_next_token(vector);
+                b = lexer_next_token(scalar);
+                tokens++;
+
+                if (a.type != b.type || a.offset != b.offset || a.length != b.length ||
+                    a.integer != b.integer ||
+                    memcmp(&a.value, &b.value, sizeof(double)) != 0) {
+                    if (failures < 10)
+                        printf("FAIL: input %d width %d at offset %d: %s/%d vs %s/%d\n",
+                               i, width, b.offset, token_type_to_string(a.type), a.length,
+                               token_type_to_string(b.type), b.length);
+                    failures++;
+                    break;
+                }
+            } while (b.type != TOKEN_EOF);
+        }
+    }
+
+    lexer_free(vector);
+    lexer_free(scalar);
+
+    printf("Compared %d tokens of %d inputs up to %d bytes per scan: %d failures\n\n",
+           tokens, num_inputs, lexer_simd_width(), failures);
+}
+
+// Evaluate len bytes of text with a streaming lexer of the given capacity,
+// read back from file. Returns streameval_run's result.
+static int stream_text(FILE *file, const char *text, size_t len, int capacity,
+                       StreamResult_t *result) {
+    int fd = fileno(file);
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, text, len, 0) != (ssize_t)len ||
+        lseek(fd, 0, SEEK_SET) != 0) {
+        result->error = "Temporary file failed";
+        return -1;
+    }
+
+    Lexer_t *lexer = lexer_init_fd(fd, capacity);
+    if (!lexer) {
+        result->error = "Lexer allocation failed";
+        return -1;
+    }
+    lexer->silent = 1;
+
+    int status = streameval_run(lexer, result);
+    lexer_free(lexer);
+    return status;
+}
+
+// Check the streaming lexer and evaluator against the string lexer and the
+// parser. Small windows make most tokens straddle a refill, and a long flat
+// chain must be evaluated with a constant number of values held.
+void run_stream_tests() {
+    printf("=== RUNNING STREAMING TESTS ===\n\n");
+
+    FILE *file = tmpfile();
+    if (!file) {
+        printf("FAIL: no temporary file\n\n");
+        return;
+    }
+
+    static const char *const fixed[] = {
+        "",
+        "1+",
+        "(1",
+        "1)",
+        "2/0",
+        "x + 1",
+        "1 @ 2",
+        "-2^2",
+        "2^-1",
+        "((2))",
+        "- - -3",
+        "9007199254740993 - 9007199254740992",
+        ".5 .",
+        "3 . 4",
+        "2^-2",
+        "1/(2-2)",
+        "0 * -1",
+        "-(9223372036854775807 + 1) * 2",
+    };
+    const int num_fixed = sizeof(fixed) / sizeof(fixed[0]);
+    const int num_exprs = 1500;
+    const int capacities[] = {24, 25, 64, LEXER_STREAM_BUFFER};
+    const int num_capacities = sizeof(capacities) / sizeof(capacities[0]);
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 57);
+
+    Lexer_t *lexer = lexer_init("");
+    Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    Parser_t *parser = parser_init(lexer, arena);
+    lexer->silent = 1;
+    parser->silent = 1;
+
+    char input[1024];
+    int checked = 0;
+    int failures = 0;
+
+    for (int i = 0; i < num_fixed + num_exprs; i++) {
+        int len;
+        if (i < num_fixed) {
+            len = snprintf(input, sizeof(input), "%s", fixed[i]);
+        } else {
+            gen.literal = exprgen_next(&gen) % 4;
+            if (exprgen_expression(&gen, input, sizeof(input) - 64) < 0)
+                continue;
+            len = strlen(input);
+
+            // Whitespace runs longer than the smallest window
+            if (exprgen_next(&gen) % 2) {
+                int at = exprgen_next(&gen) % (len + 1);
+                int spaces = exprgen_next(&gen) % 40;
+                memmove(input + at + spaces, input + at, len - at + 1);
+                memset(input + at, ' ', spaces);
+                len += spaces;
+            }
+        }
+
+        // The parser and tree evaluator give the expected result
+        arena_reset(arena);
+        lexer_reset(lexer, input, len);
+        parser_reset(parser);
+        ASTNode_t *ast = parser_parse(parser);
+        const char *expected_error = parser->error;
+        double expected = 0.0;
+        if (ast)
+            expected = ast_eval_checked(ast, NULL, &expected_error);
+
+        for (int c = 0; c < num_capacities; c++) {
+            // Tokens against the string lexer
+            lexer_reset(lexer, input, len);
+            Lexer_t *stream = NULL;
+            if (ftruncate(fileno(file), 0) == 0 &&
+                pwrite(fileno(file), input, len, 0) == (ssize_t)len &&
+                lseek(fileno(file), 0, SEEK_SET) == 0)
+                stream = lexer_init_fd(fileno(file), capacities[c]);
+            if (!stream) {
+                failures++;
+                continue;
+            }
+            stream->silent = 1;
+
+            Token_t a, b;
+            do {
+                a = lexer_next_token(stream);
+                b = lexer_next_token(lexer);
+                if (a.type != b.type || stream->base + a.offset != (size_t)b.offset ||
+                    a.length != b.length || a.integer != b.integer ||
+                    memcmp(&a.value, &b.value, sizeof(double)) != 0) {
+                    if (failures < 10)
+                        printf("FAIL: token at %d of \"%s\" with %d bytes: "
+                               "%s/%d vs %s/%d\n",
+                               b.offset, input, capacities[c],
+                               token_type_to_string(a.type), a.length,
+                               token_type_to_string(b.type), b.length);
+                    failures++;
+                    break;
+                }
+            } while (b.type != TOKEN_EOF);
+            lexer_free(stream);
+
+            // Value and error against the parser
+            StreamResult_t result;
+            stream_text(file, input, len, capacities[c], &result);
+            checked++;
+
+            if ((result.error == NULL) != (expected_error == NULL) ||
+                memcmp(&result.value, &expected, sizeof(double)) != 0) {
+                if (failures < 10)
+                    printf("FAIL: \"%s\" with %d bytes: %.17g (%s), "
+                           "expected %.17g (%s)\n",
+                           input, capacities[c], result.value,
+                           result.error ? result.error : "ok", expected,
+                           expected_error ? expected_error : "ok");
+                failures++;
+            }
+        }
+    }
+
+    // A literal longer than the window is an error, not a split number
+    StreamResult_t result;
+    if (stream_text(file, "1 + 123456789012", 16, 8, &result) == 0) {
+        printf("FAIL: token longer than the window was accepted\n");
+        failures++;
+    }
+
+    // A flat chain of a million operators stays at three values
+    const int terms = 250000;
+    const char *term = " + 3 * 2 - 5";
+    size_t term_len = strlen(term);
+    char *chain = malloc(1 + terms * term_len);
+    if (chain) {
+        chain[0] = '1';
+        for (int t = 0; t < terms; t++)
+            memcpy(chain + 1 + t * term_len, term, term_len);
+
+        if (stream_text(file, chain, 1 + terms * term_len, 4096, &result) != 0 ||
+            result.value != 1.0 + terms || result.max_depth > 3 ||
+            result.tokens != 1 + 6 * (size_t)terms) {
+            printf("FAIL: flat chain gave %.17g with %d values held after %zu tokens\n",
+                   result.value, result.max_depth, result.tokens);
+            failures++;
+        }
+        free(chain);
+    } else {
+        failures++;
+    }
+
+    parser_free(parser);
+    arena_free(arena);
+    lexer_free(lexer);
+    fclose(file);
+
+    printf("Compared %d streamed evaluations at %d window sizes: %d failures\n\n",
+           checked, num_capacities, failures);
+}
+
+// Check that parallel evaluation gives the value and first error of
+// ast_eval_checked bit for bit, for every grain, thread count and the
+// exact integer paths that cross task boundaries
+void run_parallel_tests() {
+    printf("=== RUNNING PARALLEL EVALUATION ===\n\n");
+
+    const int num_exprs = 400;
+    const int grains[] = {2, 3, 7, 64};
+    const int thread_counts[] = {1, 2, 4};
+    const int size = 1 << 16;
+    const char ops[] = "+-*/^";
+
+    char *input = malloc(size);
+    char *joined = malloc(size);
+    char *piece = malloc(size);
+    Lexer_t *lexer = lexer_init("");
+    Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    Parser_t *parser = parser_init(lexer, arena);
+    lexer->silent = 1;
+    parser->silent = 1;
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 23);
+
+    int checked = 0;
+    int failures = 0;
+
+    for (int i = 0; i < num_exprs; i++) {
+        // Half with variables, half integers only so exact nodes get cut
+        gen.var_count = i % 2 ? EXPRGEN_MAX_VARS : 0;
+        gen.literal = i % 2 ? EXPRGEN_LITERAL_MIXED : EXPRGEN_LITERAL_INTEGER;
+
+        // Join generated pieces on random sides, so trees of up to about a
+        // thousand nodes with both deep spines and wide subtrees come out
+        int len = 0;
+        int pieces = 1 + exprgen_next(&gen) % 120;
+        for (int k = 0; k < pieces; k++) {
+            if (!gen.var_count && k % 5 == 4) {
+                // The sum is exact only in int64, double rounds it
+                unsigned long long a = (1ULL << 53) + exprgen_next(&gen) % 1000;
+                int b = (int)(exprgen_next(&gen) % 100);
+                unsigned long long c = (1ULL << 53) + exprgen_next(&gen) % 1000;
+                sprintf(piece, "%llu + %d - %llu", a, b, c);
+            } else if (exprgen_expression(&gen, piece, size / 128) < 0) {
+                continue;
+            }
+            if (len == 0) {
+                len = sprintf(input, "%s", piece);
+                continue;
+            }
+
+            char op = ops[exprgen_next(&gen) % (sizeof(ops) - 1)];
+            int left = exprgen_next(&gen) % 2;
+            len = snprintf(joined, size, "(%s)%c(%s)", left ? input : piece, op,
+                           left ? piece : input);
+
+            char *swap = input;
+            input = joined;
+            joined = swap;
+        }
+        if (len == 0)
+            continue;
+
+        arena_reset(arena);
+        lexer_reset(lexer, input, strlen(input));
+        parser_reset(parser);
+        for (int v = 0; v < EXPRGEN_MAX_VARS; v++) {
+            const char *name = exprgen_var_names[v];
+            parser_declare_variable(parser, name, strlen(name));
+        }
+        ASTNode_t *ast = parser_parse(parser);
+        if (!ast)
+            continue;
+        if (i % 4 == 1)
+            ast = ast_optimize(ast, OPT_ALL | OPT_FAST_POWERS, NULL);
+
+        double vars[EXPRGEN_MAX_VARS];
+        for (int v = 0; v < EXPRGEN_MAX_VARS; v++)
+            vars[v] = (exprgen_uniform(&gen) - 0.5) * 8.0;
+
+        const char *expected_error = NULL;
+        double expected = ast_eval_checked(ast, vars, &expected_error);
+
+        for (int g = 0; g < (int)(sizeof(grains) / sizeof(grains[0])); g++) {
+            ParPlan_t *plan = pareval_plan(ast, grains[g]);
+            if (!plan) {
+                failures++;
+                continue;
+            }
+
+            int num_counts = sizeof(thread_counts) / sizeof(thread_counts[0]);
+            for (int t = 0; t < num_counts; t++) {
+                const char *error = NULL;
+                double actual = pareval_run(plan, vars, thread_counts[t], &error);
+                checked++;
+
+                if (memcmp(&actual, &expected, sizeof(double)) != 0 ||
+                    error != expected_error) {
+                    if (failures < 10)
+                        printf("FAIL: grain %d, %d threads: %.17g (%s), "
+                               "expected %.17g (%s)\n",
+                               grains[g], thread_counts[t], actual, error ? error : "ok",
+                               expected, expected_error ? expected_error : "ok");
+                    failures++;
+                }
+            }
+
+            pareval_free(plan);
+        }
+    }
+
+    // A left-deep chain of a million levels, every task stays grain nodes
+    // deep
+    const int depth = 1000000;
+    char *chain = malloc(depth * 2 + 2);
+    int len = 0;
+    for (int i = 0; i < depth; i++) {
+        chain[len++] = '1';
+        chain[len++] = '-';
+    }
+    chain[len++] = '1';
+
+    arena_reset(arena);
+    lexer_reset(lexer, chain, len);
+    parser_reset(parser);
+    ASTNode_t *ast = parser_parse(parser);
+    ParPlan_t *plan = ast ? pareval_plan(ast, PAREVAL_DEFAULT_GRAIN) : NULL;
+    for (int threads = 1; plan && threads <= 4; threads *= 2) {
+        const char *error = NULL;
+        double actual = pareval_run(plan, NULL, threads, &error);
+        if (actual != 1.0 - depth || error) {
+            printf("FAIL: chain of %d on %d threads gave %.17g\n", depth, threads,
+                   actual);
+            failures++;
+        }
+    }
+    if (!plan || plan->nodes != 2L * depth + 1)
+        failures++;
+    pareval_free(plan);
+
+    // Optimized first, as calc --parallel does, x keeps the chain unfolded
+    chain[0] = 'x';
+    arena_reset(arena);
+    lexer_reset(lexer, chain, len);
+    parser_reset(parser);
+    ast = parser_parse(parser);
+    ast = ast ? ast_optimize(ast, OPT_ALL, NULL) : NULL;
+    plan = ast ? pareval_plan(ast, PAREVAL_DEFAULT_GRAIN) : NULL;
+    double x = 1.0;
+    const char *error = NULL;
+    double actual = plan ? pareval_run(plan, &x, 2, &error) : 0.0;
+    if (!plan || actual != 1.0 - depth || error) {
+        printf("FAIL: optimized chain of %d gave %.17g\n", depth, actual);
+        failures++;
+    }
+    pareval_free(plan);
+    free(chain);
+
+    // Hash-consed trees are DAGs, which are left to the sequential evaluator
+    arena_reset(arena);
+    lexer_reset(lexer, "(1+2)*(1+2)", 11);
+    parser_reset(parser);
+    parser->hash_cons = 1;
+    ast = parser_parse(parser);
+    parser->hash_cons = 0;
+    plan = ast ? pareval_plan(ast, 2) : NULL;
+    if (!ast || plan) {
+        printf("FAIL: a shared tree was planned\n");
+        failures++;
+    }
+    pareval_free(plan);
+
+    parser_free(parser);
+    arena_free(arena);
+    lexer_free(lexer);
+    free(input);
+    free(joined);
+    free(piece);
+
+    printf("Compared %d parallel evaluations: %d failures\n\n", checked, failures);
+}
+
+// Check powers with a constant exponent once the optimizer has replaced pow.
+// Special values must give the bits of pow, finite results must stay within
+// the documented ulp of it, and the VM and JIT must agree with ast_eval.
+void run_power_tests() {
+    printf("=== RUNNING POWER STRENGTH REDUCTION TESTS ===\n\n");
+
+    const struct {
+        const char *exponent;
+        double value;
+        int reduced;  // node type the default passes leave, -1 if pow stays
+        int fast;     // node type with OPT_FAST_POWERS, -1 if pow stays
+        double ulps;  // allowed distance from pow for finite results with
+                      // OPT_FAST_POWERS, only the correctly rounded
+                      // exponents get it without
+    } cases[] = {
+        {"0", 0.0, AST_POWI, AST_POWI, 0.0},
+        {"1", 1.0, AST_VARIABLE, AST_VARIABLE, 0.0},
+        {"2", 2.0, AST_POWI, AST_POWI, 1.0}, // pow itself is off by up to 1 ulp
+        {"(-1)", -1.0, AST_POWI, AST_POWI, 1.0},
+        {"3", 3.0, -1, AST_POWI, 4.0},
+        {"4", 4.0, -1, AST_POWI, 5.0},
+        {"7", 7.0, -1, AST_POWI, 8.0},
+        {"(-2)", -2.0, -1, AST_POWI, 3.0},
+        {"(-5)", -5.0, -1, AST_POWI, 6.0},
+        {"16", 16.0, -1, AST_POWI, 17.0},
+        {"(-16)", -16.0, -1, AST_POWI, 17.0},
+        {"0.5", 0.5, AST_SQRT, AST_SQRT, 1.0},
+        {"17", 17.0, -1, -1, 0.0},
+        {"2.5", 2.5, -1, -1, 0.0},
+    };
+    int num_cases = sizeof(cases) / sizeof(cases[0]);
+
+    const double specials[] = {0.0, -0.0, 1.0, -1.0, 0.5, -3.0, 1e-300, 1e300,
+                               INFINITY, -INFINITY, NAN};
+    int num_specials = sizeof(specials) / sizeof(specials[0]);
+    const int num_random = 2000;
+
+    const char *names[] = {"x"};
+    ExprGen_t gen;
+    exprgen_init(&gen, 577);
+    int failures = 0;
+
+    for (int i = 0; i < num_cases; i++) {
+        char input[32];
+        snprintf(input, sizeof(input), "x ^ %s", cases[i].exponent);
+
+        for (int fast = 0; fast < 2; fast++) {
+            int flags = fast ? OPT_ALL | OPT_FAST_POWERS : OPT_ALL;
+            PreparedExpr_t *expr = expr_prepare_opt(input, names, 1, flags);
+            if (!expr) {
+                printf("FAIL: %s does not prepare\n", input);
+                failures++;
+                continue;
+            }
+
+            int type = fast ? cases[i].fast : cases[i].reduced;
+            int actual_type =
+                expr->ast->type == AST_BINARY_OP ? -1 : (int)expr->ast->type;
+            if (actual_type != type) {
+                printf("FAIL: %s fast %d left node type %d\n", input, fast, actual_type);
+                failures++;
+            }
+
+            JitCode_t *jit = jit_compile(expr->ast);
+            double ulps = fast || cases[i].reduced != -1 ? cases[i].ulps : 0.0;
+
+            for (int k = 0; k < num_specials + num_random; k++) {
+                double x =
+                    k < num_specials ? specials[k] : (exprgen_uniform(&gen) - 0.5) * 8.0;
+                double expected = pow(x, cases[i].value);
+                double result = ast_eval_vars(expr->ast, &x);
+
+                // Zeros, infinities and NaN always give the bits of pow
+                int ok = same_result(result, expected);
+                if (!ok && ulps > 0.0 && k >= num_specials && isfinite(expected)) {
+                    double ulp = nextafter(fabs(expected), INFINITY) - fabs(expected);
+                    ok = fabs(result - expected) <= ulps * ulp;
+                }
+
+                double vm_result = bytecode_eval(expr->bc, &x);
+                double jit_result = jit ? jit->fn(&x) : result;
+                if (!ok || !same_result(vm_result, result) ||
+                    !same_result(jit_result, result)) {
+                    if (failures < 10)
+                        printf("FAIL: %s fast %d at x = %.17g: pow %.17g, eval %.17g, vm "
+                               "%.17g, jit %.17g\n",
+                               input, fast, x, expected, result, vm_result, jit_result);
+                    failures++;
+                }
+            }
+
+            jit_free(jit);
+            expr_free(expr);
+        }
+    }
+
+    printf("Power checks: %d failures\n\n", failures);
+}
+
+// and have no shorter form that does
+void run_format_tests() {
+    printf("=== RUNNING RESULT FORMATTING ===\n\n");
+
+    const int num_cases = 1000000;
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 77);
+
+    int g6_mismatches = 0;
+    int shortest_mismatches = 0;
+
+    for (int i = 0; i < num_cases; i++) {
+        double value;
+        uint64_t bits = exprgen_next(&gen);
+
+        switch (i % 4) {
+        case 0: // any bit pattern, NaN, infinities and subnormals included
+            memcpy(&value, &bits, sizeof(value));
+            break;
+        case 3: // subnormals and zeros, whose shortest digits can be too few
+            bits &= i % 8 == 3 ? 0x800fffffffffffffULL : 0x80000000000003ffULL;
+            memcpy(&value, &bits, sizeof(value));
+            break;
+        case 1: // ratios of small integers, like typical results
+            value =
+                (double)(int64_t)(bits % 2000001 - 1000000) / (double)(1 + bits % 997);
+            break;
+        default: // integers, where %.6g switches notation
+            value = (double)(bits % 100000000);
+            break;
+        }
+
+        char actual[NUMFMT_BUF_SIZE];
+        char expected[64];
+
+        numfmt_g6(value, actual);
+        snprintf(expected, sizeof(expected), "%.6g", value);
+        if (strcmp(actual, expected) != 0) {
+            if (g6_mismatches < 10)
+                printf("Mismatch: %%.6g %s, numfmt %s\n", expected, actual);
+            g6_mismatches++;
+        }
+
+        if (isnan(value))
+            continue;
+
+        numfmt_shortest(value, actual);
+        double back = strtod(actual, NULL);
+        int digits = significant_digits(actual);
+        int ok = memcmp(&back, &value, sizeof(double)) == 0;
+
+        // One digit less must not round-trip
+        if (ok && digits > 1) {
+            snprintf(expected, sizeof(expected), "%.*e", digits - 2, value);
+            double shorter = strtod(expected, NULL);
+            ok = memcmp(&shorter, &value, sizeof(double)) != 0;
+        }
+
+        if (!ok) {
+            if (shortest_mismatches < 10)
+                printf("Mismatch: %.17g shortest %s\n", value, actual);
+            shortest_mismatches++;
+        }
+    }
+
+    printf("Checked %d values: %d %%.6g mismatches, %d shortest mismatches\n\n",
+           num_cases, g6_mismatches, shortest_mismatches);
+}
+
+// Check the library interface: results, statuses and positions, variables,
+// and a context reused with and without its cache
+void run_library_tests() {
+    printf("=== RUNNING LIBRARY INTERFACE ===\n\n");
+
+    // Outcome with x = 2 and then with x = 1.5, rate is 0.25 throughout
+    const struct {
+        const char *input;
+        CalcStatus status[2];
+        double expected[2];
+        int position;
+    } cases[] = {
+        {"3 + 4 * 2", {CALC_OK, CALC_OK}, {11.0, 11.0}, -1},
+        {"rate * (x - 1)", {CALC_OK, CALC_OK}, {0.25, 0.125}, -1},
+        {"x ^ 2 / rate", {CALC_OK, CALC_OK}, {16.0, 9.0}, -1},
+        {"1 / (x - 1.5)", {CALC_OK, CALC_ERR_DIVISION_BY_ZERO}, {2.0, 0.0}, -1},
+        {"   ", {CALC_ERR_EMPTY, CALC_ERR_EMPTY}, {0.0, 0.0}, -1},
+        {"3 + * 4", {CALC_ERR_SYNTAX, CALC_ERR_SYNTAX}, {0.0, 0.0}, 4},
+        {"(1 + 2", {CALC_ERR_SYNTAX, CALC_ERR_SYNTAX}, {0.0, 0.0}, 6},
+        {"1 + 2)", {CALC_ERR_SYNTAX, CALC_ERR_SYNTAX}, {0.0, 0.0}, 5},
+        {"2 $ 3", {CALC_ERR_SYNTAX, CALC_ERR_SYNTAX}, {0.0, 0.0}, 2},
+        {"x + y", {CALC_ERR_UNKNOWN_VARIABLE, CALC_ERR_UNKNOWN_VARIABLE}, {0.0, 0.0}, 4},
+    };
+    int num_cases = sizeof(cases) / sizeof(cases[0]);
+    int failures = 0;
+
+    size_t cache_sizes[] = {0, CACHE_DEFAULT_BYTES};
+    for (int c = 0; c < 2; c++) {
+        CalcContext_t *ctx = calc_init(cache_sizes[c]);
+        if (!ctx || calc_set_var(ctx, "x", 2.0) != CALC_OK ||
+            calc_set_var(ctx, "rate", 1.0) != CALC_OK ||
+            calc_set_var(ctx, "rate", 0.25) != CALC_OK ||
+            calc_set_var(ctx, "2x", 1.0) != CALC_ERR_INVALID) {
+            printf("FAIL: context setup\n");
+            calc_free(ctx);
+            failures++;
+            continue;
+        }
+
+        // The second round comes from the cache when it is enabled
+        for (int round = 0; round < 2; round++) {
+            if (round == 1)
+                calc_set_var(ctx, "x", 1.5);
+
+            for (int i = 0; i < num_cases; i++) {
+                double result;
+                CalcError_t error;
+                const char *input = cases[i].input;
+                CalcStatus status = calc_eval(ctx, input, strlen(input), &result, &error);
+
+                int ok = status == cases[i].status[round] && error.status == status;
+                if (ok && status == CALC_OK)
+                    ok = result == cases[i].expected[round];
+                else if (ok)
+                    ok = result == 0.0 && error.message &&
+                         (status != CALC_ERR_SYNTAX && status != CALC_ERR_UNKNOWN_VARIABLE
+                              ? error.position == -1
+                              : error.position == cases[i].position);
+
+                if (!ok) {
+                    printf("FAIL: %-16s cache %d round %d: %s at %d, result %.17g\n",
+                           cases[i].input, c, round, calc_status_string(status),
+                           error.position, result);
+                    failures++;
+                }
+            }
+        }
+
+        calc_free(ctx);
+    }
+
+    char text[CALC_FORMAT_BUF_SIZE];
+    calc_format(1.0 / 3.0, 0, text);
+    if (strcmp(text, "0.333333") != 0) {
+        printf("FAIL: calc_format %s\n", text);
+        failures++;
+    }
+
+    // Exact integer results keep every digit in the shortest format, from the
+    // library and from batch lines alike
+    const struct {
+        const char *input;
+        int shortest;
+        const char *text; // empty for an error
+    } formatted[] = {
+        {"10^18 + 1", 1, "1000000000000000001"},
+        {"9007199254740993 + 0", 1, "9007199254740993"},
+        {"-(2^62) - 5", 1, "-4611686018427387909"},
+        {"10^18 + 1", 0, "1e+18"},
+        {"7 / 2", 1, "3.5"},
+        {"2^63", 1, "9.223372036854776e+18"},
+        {"1 / 0", 1, ""},
+    };
+    int num_formatted = sizeof(formatted) / sizeof(formatted[0]);
+
+    CalcContext_t *ctx = calc_init(0);
+    OutBuf_t out;
+    outbuf_init(&out, -1, 256);
+    for (int i = 0; ctx && i < num_formatted; i++) {
+        const char *input = formatted[i].input;
+        int shortest = formatted[i].shortest;
+        CalcStatus status =
+            calc_eval_format(ctx, input, strlen(input), shortest, text, NULL);
+        int ok = (status == CALC_OK) == (formatted[i].text[0] != '\0') &&
+                 strcmp(text, formatted[i].text) == 0;
+
+        BatchOptions_t options = {0, shortest ? NUMFMT_SHORTEST : NUMFMT_G6, OPT_ALL};
+        BatchContext_t batch;
+        if (ok && status == CALC_OK && batch_context_init(&batch, &options) == 0) {
+            out.len = 0;
+            batch_eval_line(&batch, input, strlen(input), &out);
+            size_t len = strlen(text);
+            ok = out.len == len + 1 && memcmp(out.data, text, len) == 0;
+            batch_context_free(&batch);
+        }
+
+        if (!ok) {
+            printf("FAIL: formatted %s: %s\n", input, text);
+            failures++;
+        }
+    }
+    outbuf_free(&out);
+    calc_free(ctx);
+
+    printf("Library checks: %d failures\n\n", failures);
+}
+
+// Follow a chain of operator nodes without recursion: side 0 follows left
+// operands, side 1 right operands, unary nodes are followed either way.
+// Returns the number of operator nodes, leaf is set to the node it ends at.
+static int chain_length(ASTNode_t *node, int side, ASTNode_t **leaf) {
+    int length = 0;
+
+    while (node && (node->type == AST_BINARY_OP || node->type == AST_UNARY_OP)) {
+        if (node->type == AST_UNARY_OP)
+            node = node->data.unary_op.operand;
+        else
+            node = side ? node->data.binary_op.right : node->data.binary_op.left;
+        length++;
+    }
+
+    *leaf = node;
+    return length;
+}
+
+// Check that nesting depth and long sign or power chains are parsed,
+// optimized and evaluated without running out of C stack, into the expected
+// shapes and values
+void run_depth_tests() {
+    printf("=== RUNNING DEEP NESTING ===\n\n");
+
+    const int depth = 1000000;
+    char *input = malloc(depth * 4 + 16);
+    Arena_t *arena = arena_init(1 << 20);
+    Lexer_t *lexer = lexer_init("");
+    Parser_t *parser = parser_init(lexer, arena);
+    parser->silent = 1;
+    int failures = 0;
+
+    // Batch lines as parsed and optimized, each twice to evaluate a copy
+    // from a cache large enough to hold them
+    BatchContext_t batch[2];
+    OutBuf_t out;
+    outbuf_init(&out, -1, 256);
+    for (int i = 0; i < 2; i++) {
+        BatchOptions_t options = {(size_t)1 << 28, NUMFMT_SHORTEST, i ? OPT_ALL : 0};
+        if (batch_context_init(&batch[i], &options) != 0) {
+            printf("FAIL: batch context for deep lines\n");
+            failures++;
+        }
+    }
+
+    for (int shape = 0; shape < 6; shape++) {
+        int len = 0;
+        int side = 1;
+        int expected = depth;
+        double value = 0.0;
+
+        switch (shape) {
+        case 0: // ((((1))))
+            memset(input, '(', depth);
+            len = depth;
+            input[len++] = '1';
+            memset(input + len, ')', depth);
+            len += depth;
+            expected = 0;
+            value = 1.0;
+            break;
+        case 1: // ----x
+            memset(input, '-', depth);
+            len = depth;
+            input[len++] = 'x';
+            value = 3.0;
+            break;
+        case 2: // 2^2^2^2, right associative
+            for (int i = 0; i < depth; i++)
+                len += sprintf(input + len, "2^");
+            input[len++] = '2';
+            value = INFINITY;
+            break;
+        case 3: // (1+(1+(1+1)))
+            for (int i = 0; i < depth; i++)
+                len += sprintf(input + len, "(1+");
+            input[len++] = '1';
+            memset(input + len, ')', depth);
+            len += depth;
+            value = depth + 1;
+            break;
+        case 4: // 1-1-1-1, left associative
+            for (int i = 0; i < depth; i++)
+                len += sprintf(input + len, "1-");
+            input[len++] = '1';
+            side = 0;
+            value = 1 - depth;
+            break;
+        default: // ((((1 never closed
+            memset(input, '(', depth);
+            len = depth;
+            input[len++] = '1';
+            break;
+        }
+
+        lexer_reset(lexer, input, len);
+        arena_reset(arena);
+        parser_reset(parser);
+        ASTNode_t *ast = parser_parse(parser);
+
+        int ok;
+        if (shape == 5) {
+            ok = !ast && parser->error && strcmp(parser->error, "Expected ')'") == 0 &&
+                 parser->error_pos == len;
+        } else {
+            ASTNode_t *leaf;
+            ok = ast && chain_length(ast, side, &leaf) == expected && leaf &&
+                 leaf->type == (shape == 1 ? AST_VARIABLE : AST_NUMBER);
+        }
+
+        // As parsed, optimized, and hash-consed then optimized and balanced
+        double x = 3.0;
+        for (int pass = 0; ok && shape != 5 && pass < 3; pass++) {
+            if (pass == 2) {
+                lexer_reset(lexer, input, len);
+                arena_reset(arena);
+                parser->hash_cons = 1;
+                parser_reset(parser);
+                ast = parser_parse(parser);
+                parser->hash_cons = 0;
+            }
+            int flags = pass == 1 ? OPT_ALL : OPT_ALL | OPT_REASSOCIATE;
+            if (ast && pass > 0)
+                ast = ast_optimize(ast, flags, NULL);
+
+            const char *error = NULL;
+            double result = ast ? ast_eval_checked(ast, &x, &error) : 0.0;
+            ok = ast && !error && result == value;
+        }
+
+        // Batch lines have no variables to bind
+        char text[NUMFMT_BUF_SIZE + 1];
+        int text_len = numfmt_format(value, NUMFMT_SHORTEST, text);
+        text[text_len++] = '\n';
+        for (int i = 0; ok && shape != 1 && shape != 5 && i < 4; i++) {
+            out.len = 0;
+            batch_eval_line(&batch[i / 2], input, len, &out);
+            ok = out.len == (size_t)text_len && memcmp(out.data, text, text_len) == 0;
+        }
+
+        printf("Shape %d, %d levels: %s\n", shape, depth, ok ? "ok" : "FAIL");
+        failures += !ok;
+    }
+
+    // Compiled to bytecode and native code. x*(x*(x*x)) keeps one value in
+    // flight, (x*1)+((x*2)+(x*3+x)) spills every left term, more than the
+    // native stack of the JIT is allowed to hold.
+    char *compiled = malloc(depth * 16 + 16);
+    for (int shape = 0; compiled && shape < 2; shape++) {
+        int len = 0;
+        for (int i = 1; i <= depth; i++)
+            len += shape ? sprintf(compiled + len, "(x*%d)+(", i)
+                         : sprintf(compiled + len, "x*(");
+        compiled[len++] = 'x';
+        memset(compiled + len, ')', depth);
+        compiled[len + depth] = '\0';
+
+        const char *names[] = {"x"};
+        double x = shape ? 1.0 : -1.0;
+        double value = shape ? (double)depth * (depth + 1) / 2 + 1 : -1.0;
+        PreparedExpr_t *expr = expr_prepare(compiled, names, 1);
+        int ok = expr && expr_execute(expr, &x) == value;
+        if (ok && jit_available()) {
+            int jit = expr_enable_jit(expr);
+            ok = shape ? !jit : jit && expr_execute(expr, &x) == value;
+        }
+        expr_free(expr);
+
+        printf("Compiled shape %d, %d levels: %s\n", shape, depth, ok ? "ok" : "FAIL");
+        failures += !ok;
+    }
+    free(compiled);
+
+    for (int i = 0; i < 2; i++)
+        batch_context_free(&batch[i]);
+    outbuf_free(&out);
+    parser_free(parser);
+    lexer_free(lexer);
+    arena_free(arena);
+    free(input);
+
+    printf("Deep nesting checks: %d failures\n\n", failures);
+}
+
+// Write a random chain of '+', '-' and '*' over variables and literals from 0
+// to 3, 1 to 3 with literals_only. A factor may be a parenthesized chain
+// while nested is above 0. With at most one level of nesting and variables
+// from -3 to 3, every value and every partial sum or product in any grouping
+// stays below 2^53. Literal only chains also add terms above 2^53 at the top,
+// which only int64 holds, and leave out 0, since a product that would be -0
+// drops them to double at a node that depends on the grouping.
+static int reassoc_chain(ExprGen_t *gen, char *buf, int nested, int literals_only) {
+    int len = 0;
+    int terms = 1 + exprgen_next(gen) % 12;
+
+    for (int t = 0; t < terms; t++) {
+        if (t)
+            len += sprintf(buf + len, " %c ", exprgen_next(gen) % 2 ? '+' : '-');
+
+        int factors = 1 + exprgen_next(gen) % 4;
+        for (int f = 0; f < factors; f++) {
+            if (f)
+                buf[len++] = '*';
+
+            int pick = exprgen_next(gen) % 10;
+            if (literals_only && nested && factors == 1 && pick >= 8) {
+                // Exact only in int64, the sum stays far below its limit
+                unsigned long long big = (1ULL << 53) + exprgen_next(gen) % 1000;
+                len += sprintf(buf + len, "%llu", big);
+            } else if (nested && pick < 2) {
+                buf[len++] = '(';
+                len += reassoc_chain(gen, buf + len, nested - 1, literals_only);
+                buf[len++] = ')';
+            } else if (pick < 6 && !literals_only) {
+                const char *name = exprgen_var_names[pick % EXPRGEN_MAX_VARS];
+                len += sprintf(buf + len, "%s", name);
+            } else {
+                int literal = (int)(exprgen_next(gen) % 4) + literals_only;
+                len += sprintf(buf + len, "%d", literal);
+            }
+        }
+    }
+
+    buf[len] = '\0';
+    return len;
+}
+
+// Check the reassociation pass. Chains whose values are all integers below
+// 2^53 must give the same result in any grouping, on the tree walker and
+// the VM, with and without hash-consing and in the int64 path. Long chains
+// must come out balanced, and a reassociated sum of random doubles must
+// stay within the rounding error bound of the sum in parse order.
+void run_reassoc_tests() {
+    printf("=== RUNNING REASSOCIATION ===\n\n");
+
+    const int num_exprs = 2000;
+    const int size = 1 << 16;
+    char *input = malloc(size);
+    Lexer_t *lexer = lexer_init("");
+    Arena_t *arena = arena_init(1 << 20);
+    Parser_t *parser = parser_init(lexer, arena);
+    lexer->silent = 1;
+    parser->silent = 1;
+
+    ExprGen_t gen;
+    exprgen_init(&gen, 29);
+
+    int failures = 0;
+    int balanced = 0;
+
+    for (int i = 0; i < num_exprs; i++) {
+        int literals_only = i % 4 == 3;
+        int len = reassoc_chain(&gen, input, 1, literals_only);
+
+        // Parse twice, once to keep in parse order and once to rebalance.
+        // Literal chains skip the other passes, which would fold them.
+        ASTNode_t *trees[2];
+        arena_reset(arena);
+        for (int k = 0; k < 2; k++) {
+            lexer_reset(lexer, input, len);
+            parser_reset(parser);
+            parser->hash_cons = i % 2;
+            for (int v = 0; v < EXPRGEN_MAX_VARS; v++)
+                parser_declare_variable(parser, exprgen_var_names[v],
+                                        strlen(exprgen_var_names[v]));
+            trees[k] = parser_parse(parser);
+        }
+        parser->hash_cons = 0;
+        if (!trees[0] || !trees[1]) {
+            printf("FAIL: parse %s\n", input);
+            failures++;
+            continue;
+        }
+
+        OptimizerStats_t stats;
+        int flags = literals_only ? 0 : OPT_ALL;
+        if (flags)
+            trees[0] = ast_optimize(trees[0], flags, NULL);
+        trees[1] = ast_optimize(trees[1], flags | OPT_REASSOCIATE, &stats);
+        balanced += stats.chains_balanced;
+
+        double vars[EXPRGEN_MAX_VARS];
+        for (int v = 0; v < EXPRGEN_MAX_VARS; v++)
+            vars[v] = (double)(exprgen_next(&gen) % 7) - 3.0;
+
+        double expected = ast_eval_vars(trees[0], vars);
+        double actual = ast_eval_vars(trees[1], vars);
+        // The VM has no int64 path, it rounds literal chains like double
+        double vm_actual = expected;
+        if (!literals_only) {
+            Bytecode_t *bc = bytecode_compile(trees[1]);
+            vm_actual = bc ? bytecode_eval(bc, vars) : NAN;
+            bytecode_free(bc);
+        }
+
+        // -0 and +0 may swap with the order, both compare equal
+        if (actual != expected || vm_actual != expected) {
+            if (failures < 10)
+                printf("FAIL: %s: %.17g, VM %.17g, expected %.17g\n", input, actual,
+                       vm_actual, expected);
+            failures++;
+        }
+    }
+
+    if (balanced == 0) {
+        printf("FAIL: no chain was balanced\n");
+        failures++;
+    }
+
+    // Chains of a million terms, balanced before the other passes. Both outer
+    // spines of a balanced tree are log2(n) long.
+    const int depth = 1000000;
+    const char *chains[] = {"x+", "x-", "x*"};
+    const double expected_values[] = {(depth + 1) * 0.5, 0.5 - depth * 0.5, -1.0};
+    char *chain = malloc(depth * 2 + 2);
+
+    for (int c = 0; c < 3; c++) {
+        int len = 0;
+        for (int i = 0; i < depth; i++) {
+            chain[len++] = chains[c][0];
+            chain[len++] = chains[c][1];
+        }
+        chain[len++] = 'x';
+
+        arena_reset(arena);
+        lexer_reset(lexer, chain, len);
+        parser_reset(parser);
+        parser_declare_variable(parser, "x", 1);
+        ASTNode_t *ast = parser_parse(parser);
+        if (ast)
+            ast = ast_optimize(ast, OPT_ALL | OPT_REASSOCIATE, NULL);
+
+        ASTNode_t *leaf;
+        double x = c == 2 ? -1.0 : 0.5;
+        int ok = ast && chain_length(ast, 0, &leaf) <= 21 &&
+                 chain_length(ast, 1, &leaf) <= 21 &&
+                 ast_eval_vars(ast, &x) == expected_values[c];
+        printf("Chain %s%s... of %d terms: %s\n", chains[c], chains[c], depth + 1,
+               ok ? "ok" : "FAIL");
+        failures += !ok;
+    }
+    free(chain);
+
+    // Sums of random doubles in parse order and balanced are each within
+    // (n - 1) * eps * sum |x| of the exact sum, so within twice that of
+    // each other
+    const int terms = 10000;
+    char *sum = malloc(terms * 32);
+    for (int round = 0; round < 20; round++) {
+        int len = 0;
+        double magnitude = 0.0;
+        for (int i = 0; i < terms; i++) {
+            double term = exprgen_uniform(&gen) * 1000.0;
+            len += sprintf(sum + len, "%s%.17g", i ? (round % 2 ? "-" : "+") : "", term);
+            magnitude += term;
+        }
+
+        Lexer_t *strict_lexer = lexer_init(sum);
+        StreamResult_t strict;
+        streameval_run(strict_lexer, &strict);
+        lexer_free(strict_lexer);
+
+        arena_reset(arena);
+        lexer_reset(lexer, sum, len);
+        parser_reset(parser);
+        ASTNode_t *ast = parser_parse(parser);
+        if (ast)
+            ast = ast_optimize(ast, OPT_ALL | OPT_REASSOCIATE, NULL);
+        double actual = ast ? ast_eval(ast) : NAN;
+
+        double bound = 2.0 * (terms - 1) * DBL_EPSILON * magnitude;
+        if (strict.error || !(fabs(actual - strict.value) <= bound)) {
+            printf("FAIL: sum of %d doubles: %.17g, parse order %.17g\n", terms, actual,
+                   strict.value);
+            failures++;
+        }
+    }
+    free(sum);
+
+    parser_free(parser);
+    arena_free(arena);
+    lexer_free(lexer);
+    free(input);
+
+    printf("Reassociation checks: %d failures\n\n", failures);
+}
+
+// Define a cell from "name = expr" text, -1 if it is rejected
+static int define_cell(Sheet_t *sheet, const char *line) {
+    int name_length;
+    const char *expr;
+    const char *name = sheet_split_assignment(line, &name_length, &expr);
+    return name ? sheet_define(sheet, name, name_length, expr) : -1;
+}
+
+// Test named cells and their incremental updates
+void run_sheet_tests() {
+    printf("=== RUNNING CELL TESTS ===\n\n");
+
+    // Each step defines one cell, then checks one cell's value or error and
+    // how many cells the update evaluated
+    const struct {
+        const char *line;
+        int accepted;
+        const char *check;
+        double expected;
+        const char *error;
+        size_t recomputed;
+    } steps[] = {
+        {"a = 2", 1, "a", 2.0, NULL, 1},
+        {"b = a * 3", 1, "b", 6.0, NULL, 1},
+        {"c = b + 1", 1, "c", 7.0, NULL, 1},
+        {"d = 10", 1, "d", 10.0, NULL, 1},
+        {"e = a + d", 1, "e", 12.0, NULL, 1},
+        {"a = 4", 1, "c", 13.0, NULL, 4},        // a, b, c and e
+        {"d = 5 + 5", 1, "e", 14.0, NULL, 1},    // same value, e is reused
+        {"  f=c-b ", 1, "f", 1.0, NULL, 1},      // spacing around '='
+        {"a = 5", 1, "f", 1.0, NULL, 5},         // f is recomputed once
+        {"a = c", 0, "a", 5.0, NULL, 0},         // cycle, a is unchanged
+        {"b = b + 1", 0, "b", 15.0, NULL, 0},    // reads itself
+        {"g = h + 1", 0, "e", 15.0, NULL, 0},    // unknown cell
+        {"g = 1 / (a - 5)", 1, "g", 0.0, "Division by zero", 1},
+        {"h = g * 2", 1, "h", 0.0, "Division by zero", 1},
+        {"a = 6", 1, "h", 2.0, NULL, 7},         // errors clear with a
+        {"b = d", 1, "f", 1.0, NULL, 3},         // b, c and f, b no longer reads a
+        {"a = 7", 1, "b", 10.0, NULL, 4},        // a, e, g and h
+    };
+    int num_steps = sizeof(steps) / sizeof(steps[0]);
+    int failures = 0;
+
+    Sheet_t sheet;
+    if (sheet_init(&sheet, OPT_ALL) != 0) {
+        printf("Cell checks: 1 failures\n\n");
+        return;
+    }
+
+    for (int i = 0; i < num_steps; i++) {
+        size_t before = sheet.total.recomputed;
+        int accepted = define_cell(&sheet, steps[i].line) >= 0;
+        int slot = sheet_find(&sheet, steps[i].check, strlen(steps[i].check));
+
+        int ok = accepted == steps[i].accepted && slot >= 0 &&
+                 sheet.total.recomputed - before == steps[i].recomputed;
+        if (ok && steps[i].error) {
+            ok = sheet.cells[slot].error &&
+                 strcmp(sheet.cells[slot].error, steps[i].error) == 0;
+        } else if (ok) {
+            ok = !sheet.cells[slot].error && sheet.values[slot] == steps[i].expected;
+        }
+
+        if (!ok) {
+            printf("FAIL: %-16s %s = %.17g, %zu recomputed\n", steps[i].line,
+                   steps[i].check, slot >= 0 ? sheet.values[slot] : 0.0,
+                   sheet.total.recomputed - before);
+            failures++;
+        }
+    }
+
+    // Plain expressions are not definitions
+    int name_length;
+    const char *expr;
+    if (sheet_split_assignment("a + 1", &name_length, &expr) ||
+        sheet_split_assignment("2 = 3", &name_length, &expr)) {
+        printf("FAIL: expression read as a definition\n");
+        failures++;
+    }
+
+    sheet_free(&sheet);
+    printf("Cell checks: %d failures\n\n", failures);
+}
+
+// Check that cache lookups normalize whitespace without merging tokens, and
+// that the memory cap evicts the least recently used entries
+void run_cache_tests() {
+    printf("=== RUNNING EXPRESSION CACHE ===\n\n");
+
+    // Second spelling must find the first one's entry only if expected
+    const struct {
+        const char *stored;
+        const char *lookup;
+        int hit;
+    } cases[] = {
+        {"3 + 4 * 2", "  3+4*2\t", 1},   // Whitespace around operators
+        {"(1 + 2) ^ 2", "( 1+2 )^2", 1}, // Whitespace inside parentheses
+        {"12 * 3", "1 2 * 3", 0},        // Space splitting a number
+        {"2.5 - 1", "2.5  -  1 ", 1},    // Runs of spaces
+    };
+
+    int num_tests = sizeof(cases) / sizeof(cases[0]);
+    int failures = 0;
+
+    for (int i = 0; i < num_tests; i++) {
+        ExprCache_t *cache = cache_init(CACHE_DEFAULT_BYTES);
+        Lexer_t *lexer = lexer_init(cases[i].stored);
+        Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+        Parser_t *parser = parser_init(lexer, arena);
+        ASTNode_t *ast = parser_parse(parser);
+
+        if (!cache || !ast) {
+            printf("Test %d: setup failed\n", i + 1);
+            failures++;
+        } else {
+            cache_insert(cache, cases[i].stored, strlen(cases[i].stored), ast);
+            const char *lookup = cases[i].lookup;
+            ASTNode_t *found = cache_lookup(cache, lookup, strlen(lookup));
+
+            double expected = ast_eval(ast);
+            double result = found ? ast_eval(found) : expected;
+            int ok = (found != NULL) == cases[i].hit &&
+                     memcmp(&result, &expected, sizeof(double)) == 0;
+
+            printf("Test %d: \"%s\" then \"%s\": %s\n", i + 1, cases[i].stored,
+                   cases[i].lookup, found ? "hit" : "miss");
+            if (!ok) {
+                printf("Cache mismatch\n");
+                failures++;
+            }
+        }
+
+        parser_free(parser);
+        arena_free(arena);
+        lexer_free(lexer);
+        cache_free(cache);
+    }
+
+    // A cap of a few entries must evict the oldest first and stay under it
+    ExprCache_t *cache = cache_init(1024);
+    Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    Lexer_t *lexer = lexer_init("");
+    Parser_t *parser = parser_init(lexer, arena);
+    char input[64];
+
+    for (int i = 0; i < 64 && cache && parser; i++) {
+        int len = snprintf(input, sizeof(input), "%d * 2 + 1", i);
+        lexer_reset(lexer, input, len);
+        arena_reset(arena);
+        parser_reset(parser);
+
+        ASTNode_t *ast = parser_parse(parser);
+        if (ast)
+            cache_insert(cache, input, len, ast);
+
+        if (cache->bytes > cache->max_bytes)
+            failures++;
+    }
+
+    if (cache && (cache->evictions == 0 || cache_lookup(cache, "0 * 2 + 1", 9) ||
+                  !cache_lookup(cache, "63 * 2 + 1", 10))) {
+        printf("Eviction mismatch\n");
+        failures++;
+    }
+
+    if (cache)
+        cache_print_stats(cache);
+
+    parser_free(parser);
+    lexer_free(lexer);
+    arena_free(arena);
+    cache_free(cache);
+
+    // Batch lines get the caller's passes with and without the cache, so both
+    // print the same, and --no-opt leaves cached trees as parsed
+    const char *lines[] = {"+(-(-2))", "2^0.5 * 3", "1/0", "x", "0.1 + 0.2 - 0.3"};
+    int num_lines = sizeof(lines) / sizeof(lines[0]);
+
+    for (int flags = 0; flags <= OPT_ALL; flags += OPT_ALL) {
+        OutBuf_t outputs[2];
+        for (int c = 0; c < 2; c++) {
+            size_t cache_bytes = c ? CACHE_DEFAULT_BYTES : 0;
+            BatchOptions_t options = {cache_bytes, NUMFMT_SHORTEST, flags};
+            BatchContext_t ctx;
+            outbuf_init(&outputs[c], -1, 256);
+            if (batch_context_init(&ctx, &options) != 0) {
+                failures++;
+                continue;
+            }
+
+            for (int i = 0; i < num_lines; i++)
+                batch_eval_line(&ctx, lines[i], strlen(lines[i]), &outputs[c]);
+
+            ASTNode_t *tree =
+                c ? cache_lookup(ctx.cache, lines[0], strlen(lines[0])) : NULL;
+            if (c && (!tree || (tree->type == AST_NUMBER) != (flags != 0))) {
+                printf("Cached tree ignores the optimizer flags %d\n", flags);
+                failures++;
+            }
+            batch_context_free(&ctx);
+        }
+
+        if (outputs[0].len != outputs[1].len ||
+            memcmp(outputs[0].data, outputs[1].data, outputs[0].len) != 0) {
+            printf("Batch output depends on the cache with optimizer flags %d\n", flags);
+            failures++;
+        }
+        outbuf_free(&outputs[0]);
+        outbuf_free(&outputs[1]);
+    }
+
+    printf("Cache checks: %d failures\n\n", failures);
+}
+
+// Batch mode, stdin to stdout with no banner and in-band errors
+int batch_mode() {
+    BatchOptions_t options = {cache_bytes, result_format, optimizer_flags};
+    BatchStats_t stats;
+    if (batch_run(0, 1, &options, &stats) != 0) {
+        fprintf(stderr, "Error: Batch mode failed after %zu lines\n", stats.lines);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Read all of stdin into a NUL terminated malloc'd buffer, NULL on failure
+static char *read_stdin(void) {
+    size_t cap = 1 << 16;
+    size_t len = 0;
+    char *text = malloc(cap);
+
+    while (text) {
+        if (len + 1 == cap) {
+            char *grown = realloc(text, cap * 2);
+            if (!grown)
+                break;
+            text = grown;
+            cap *= 2;
+        }
+
+        ssize_t n = read(0, text + len, cap - 1 - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0) {
+                text[len] = '\0';
+                return text;
+            }
+            break;
+        }
+        len += n;
+    }
+
+    fprintf(stderr, "Error: Failed to read the expression from stdin\n");
+    free(text);
+    return NULL;
+}
+
+// Evaluate a parsed expression like ast_eval, split into tasks on
+// parallel_threads workers if --parallel was given and the tree allows it.
+// The int64 value of an exact root is kept for printing.
+static ASTValue_t eval_tree(ASTNode_t *ast) {
+    ParPlan_t *plan =
+        parallel_threads > 0 ? pareval_plan(ast, PAREVAL_DEFAULT_GRAIN) : NULL;
+    ASTValue_t result;
+
+    if (plan) {
+        const char *error = NULL;
+        pareval_run(plan, NULL, parallel_threads, &error);
+        result = plan->results[plan->task_count - 1];
+        pareval_free(plan);
+    } else {
+        result = ast_eval_value(ast, NULL);
+    }
+
+    if (result.error)
+        fprintf(stderr, "Error: %s\n", result.error);
+    return result;
+}
+
+// Print the value of an expression in parse order next to its reassociated
+// result, and how many ulp of the former they are apart
+static void report_reassociation(const char *expression, double result) {
+    Lexer_t *lexer = lexer_init(expression);
+    if (!lexer)
+        return;
+
+    // The stream evaluator neither builds nor recurses through a tree
+    StreamResult_t strict;
+    lexer->silent = 1;
+    streameval_run(lexer, &strict);
+    lexer_free(lexer);
+
+    double ulp = nextafter(fabs(strict.value), INFINITY) - fabs(strict.value);
+    double apart = result == strict.value ? 0.0 : fabs(result - strict.value) / ulp;
+    char text[NUMFMT_BUF_SIZE];
+    numfmt_format(strict.value, result_format, text);
+    printf("Parse order: %s (%.3g ulp apart)\n", text, apart);
+}
+
+// Stream mode, evaluates a single expression of any size from a file or
+// stdin while holding only the lexer's window of it
+int stream_mode(const char *path) {
+    int fd = 0;
+    if (path && strcmp(path, "-") != 0) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+    }
+
+    Lexer_t *lexer = lexer_init_fd(fd, LEXER_STREAM_BUFFER);
+    if (!lexer) {
+        if (fd != 0)
+            close(fd);
+        return 1;
+    }
+
+    StreamResult_t result;
+    int status = streameval_run(lexer, &result);
+    if (status != 0) {
+        fprintf(stderr, "Error: %s at offset %zu\n", result.error, result.error_offset);
+    } else {
+        char text[NUMFMT_BUF_SIZE];
+        numfmt_format(result.value, result_format, text);
+        printf("%s\n", text);
+    }
+
+    lexer_free(lexer);
+    if (fd != 0)
+        close(fd);
+    return status != 0;
+}
+
+// Compile mode, parses and optimizes every line of a formula file once and
+// writes the programs to a calcbin file for --run
+int compile_mode(const char *in_path, const char *out_path) {
+    int count = 0;
+    if (calcbin_compile(in_path, out_path, optimizer_flags, &count) != 0) {
+        fprintf(stderr, "Error: Nothing written to %s\n", out_path);
+        return 1;
+    }
+
+    printf("Compiled %d expressions to %s\n", count, out_path);
+    return 0;
+}
+
+// Run mode, evaluates expressions of a calcbin file in place. Arguments of
+// the form name=value bind a variable for every expression, the others pick
+// the expressions to print, all of them in name order by default.
+int run_mode(const char *path, int argc, char **argv) {
+    CalcBin_t bin;
+    if (calcbin_open(&bin, path) != 0)
+        return 1;
+
+    double *scratch = malloc(calcbin_scratch_size(&bin) * sizeof(double));
+    double *vars = malloc((bin.header->max_vars + 1) * sizeof(double));
+    int *picked = malloc((argc + bin.count + 1) * sizeof(int));
+    double *values = malloc((argc + 1) * sizeof(double));
+    int status = scratch && vars && picked && values ? 0 : 1;
+    if (status)
+        fprintf(stderr, "Error: Memory allocation failed for run mode\n");
+
+    int pick_count = 0;
+    for (int i = 0; i < argc && !status; i++) {
+        char *equals = strchr(argv[i], '=');
+        if (equals) {
+            char *end;
+            values[i] = strtod(equals + 1, &end);
+            if (end == equals + 1 || *end != '\0') {
+                fprintf(stderr, "Error: Invalid value: %s\n", argv[i]);
+                status = 1;
+            }
+            continue;
+        }
+
+        picked[pick_count] = calcbin_find(&bin, argv[i]);
+        if (picked[pick_count] < 0) {
+            fprintf(stderr, "Error: No expression named %s in %s\n", argv[i], path);
+            status = 1;
+        }
+        pick_count++;
+    }
+
+    if (pick_count == 0) {
+        for (int i = 0; i < bin.count; i++)
+            picked[pick_count++] = i;
+    }
+
+    for (int p = 0; p < pick_count && !status; p++) {
+        int index = picked[p];
+        const char *name = calcbin_name(&bin, index);
+
+        // Bind every slot by name, a later binding of a name wins
+        int bound = 1;
+        for (int slot = 0; slot < calcbin_var_count(&bin, index) && bound; slot++) {
+            const char *var = calcbin_var_name(&bin, index, slot);
+            size_t length = strlen(var);
+            bound = 0;
+            for (int i = 0; i < argc; i++) {
+                if (strncmp(argv[i], var, length) == 0 && argv[i][length] == '=') {
+                    vars[slot] = values[i];
+                    bound = 1;
+                }
+            }
+            if (!bound) {
+                fprintf(stderr, "Error: %s: Unbound variable %s\n", name, var);
+                status = 1;
+            }
+        }
+        if (!bound)
+            continue;
+
+        char text[NUMFMT_BUF_SIZE];
+        numfmt_format(calcbin_eval(&bin, index, vars, scratch), result_format, text);
+        printf("%s = %s\n", name, text);
+    }
+
+    free(scratch);
+    free(vars);
+    free(picked);
+    free(values);
+    calcbin_close(&bin);
+    return status;
+}
+
+// Columns mode, evaluates one expression for every row of a table and
+// binds each variable to the column of the same name. The table is a CSV
+// file, or stdin, whose first line names the columns, and results are
+// printed one per line. With --binary name=path ... columns are files of
+// raw doubles instead and results are written to stdout the same way.
+int columns_mode(const char *expression, int argc, char **argv) {
+    int binary = argc >= 1 && strcmp(argv[0], "--binary") == 0;
+    if ((binary && argc < 2) || (!binary && argc > 1)) {
+        fprintf(stderr, "Error: Invalid arguments. Use --help for usage information.\n");
+        return 1;
+    }
+
+    PreparedExpr_t *expr = expr_prepare_opt(expression, NULL, 0, optimizer_flags);
+    if (!expr) {
+        fprintf(stderr, "Error: Failed to parse expression: %s\n", expression);
+        return 1;
+    }
+
+    ColumnTable_t table;
+    int status = 0;
+    memset(&table, 0, sizeof(table));
+
+    if (binary) {
+        for (int i = 1; i < argc && status == 0; i++) {
+            char *equals = strchr(argv[i], '=');
+            if (!equals || equals == argv[i]) {
+                fprintf(stderr, "Error: Expected name=path: %s\n", argv[i]);
+                status = 1;
+                continue;
+            }
+            *equals = '\0';
+            status = column_table_add_binary(&table, argv[i], equals + 1) != 0;
+        }
+    } else {
+        int fd = argc == 1 ? open(argv[0], O_RDONLY) : 0;
+        if (fd < 0) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", argv[0], strerror(errno));
+            status = 1;
+        } else {
+            status =
+                column_table_read_csv(&table, fd, expr->var_names, expr->var_count) != 0;
+            if (fd != 0)
+                close(fd);
+        }
+    }
+
+    const double **columns = malloc((expr->var_count + 1) * sizeof(double *));
+    double *results = malloc((table.rows + 1) * sizeof(double));
+    if (status == 0 && (!columns || !results)) {
+        fprintf(stderr, "Error: Memory allocation failed for columns mode\n");
+        status = 1;
+    }
+
+    for (int v = 0; v < expr->var_count && status == 0; v++) {
+        int c = column_table_find(&table, expr->var_names[v]);
+        if (c < 0) {
+            fprintf(stderr, "Error: No column named %s\n", expr->var_names[v]);
+            status = 1;
+        } else {
+            columns[v] = table.values[c];
+        }
+    }
+
+    if (status == 0 && columneval_run(expr->bc, columns, table.rows, results, 0) != 0)
+        status = 1;
+
+    OutBuf_t out;
+    if (status == 0 && outbuf_init(&out, 1, BATCH_WRITE_SIZE) == 0) {
+        if (binary) {
+            // In pieces, a single append of everything would grow the buffer
+            const char *bytes = (const char *)results;
+            size_t total = table.rows * sizeof(double);
+            for (size_t done = 0; done < total; done += BATCH_WRITE_SIZE) {
+                size_t piece =
+                    total - done < BATCH_WRITE_SIZE ? total - done : BATCH_WRITE_SIZE;
+                outbuf_append(&out, bytes + done, piece);
+            }
+        } else {
+            char text[NUMFMT_BUF_SIZE + 1];
+            for (size_t r = 0; r < table.rows; r++) {
+                int length = numfmt_format(results[r], result_format, text);
+                text[length] = '\n';
+                outbuf_append(&out, text, length + 1);
+            }
+        }
+        outbuf_flush(&out);
+        status = out.failed;
+        outbuf_free(&out);
+    } else if (status == 0) {
+        status = 1;
+    }
+
+    free(columns);
+    free(results);
+    column_table_free(&table);
+    expr_free(expr);
+    return status;
+}
+
+// File mode, evaluates a file on worker threads with results in input order
+int file_mode(const char *path, const char *threads_arg) {
+    int threads = fileeval_default_threads();
+
+    if (threads_arg) {
+        char *end;
+        long n = strtol(threads_arg, &end, 10);
+        if (*end != '\0' || n < 1 || n > 1024) {
+            fprintf(stderr, "Error: Invalid thread count: %s\n", threads_arg);
+            return 1;
+        }
+        threads = (int)n;
+    }
+
+    BatchOptions_t options = {cache_bytes, result_format, optimizer_flags};
+    BatchStats_t stats;
+    if (fileeval_run(path, threads, &options, 1, &stats) != 0) {
+        fprintf(stderr, "Error: File mode failed after %zu lines\n", stats.lines);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    // Global options come before the mode arguments
+    while (argc > 1) {
+        if (strcmp(argv[1], "--no-opt") == 0) {
+            optimizer_flags = 0;
+        } else if (strcmp(argv[1], "--fast-pow") == 0) {
+            optimizer_flags |= OPT_FAST_POWERS;
+        } else if (strcmp(argv[1], "--reassociate") == 0) {
+            optimizer_flags |= OPT_REASSOCIATE;
+        } else if (strcmp(argv[1], "--cse") == 0) {
+            hash_cons = 1;
+        } else if (strcmp(argv[1], "--shortest") == 0) {
+            result_format = NUMFMT_SHORTEST;
+        } else if (strcmp(argv[1], "--stats") == 0) {
+            // Before any worker thread starts, they inherit the signal mask
+            if (stats_install() != 0)
+                return 1;
+        } else if (strcmp(argv[1], "--parallel") == 0 && argc > 2) {
+            char *end;
+            long n = strtol(argv[2], &end, 10);
+            if (*end != '\0' || n < 1 || n > 1024) {
+                fprintf(stderr, "Error: Invalid thread count: %s\n", argv[2]);
+                return 1;
+            }
+            parallel_threads = (int)n;
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--cache-mb") == 0 && argc > 2) {
+            char *end;
+            long mb = strtol(argv[2], &end, 10);
+            if (*end != '\0' || mb < 0 || mb > 65536) {
+                fprintf(stderr, "Error: Invalid cache size: %s\n", argv[2]);
+                return 1;
+            }
+            cache_bytes = (size_t)mb << 20;
+            argv++;
+            argc--;
+        } else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
+
+    // Batch output is meant for other programs, so it skips the banner
+    if (argc == 2 && strcmp(argv[1], "--batch") == 0) {
+        return batch_mode();
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--file") == 0) {
+        if (argc == 3)
+            return file_mode(argv[2], NULL);
+        if (argc == 5 && strcmp(argv[3], "--threads") == 0)
+            return file_mode(argv[2], argv[4]);
+    }
+
+    if (argc == 5 && strcmp(argv[1], "--compile") == 0 && strcmp(argv[3], "-o") == 0) {
+        return compile_mode(argv[2], argv[4]);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--run") == 0) {
+        return run_mode(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--columns") == 0) {
+        return columns_mode(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "--stream") == 0) {
+        return stream_mode(argc == 3 ? argv[2] : NULL);
+    }
+
+    printf("Arithmetic Expression Compiler\n");
+    printf("==============================\n");
+
+    // If no argument run in interactive mode
+    if (argc == 1) {
+        interactive_mode();
+        return 0;
+    }
+
+    char *command = argv[1];
+
+    // Handle command line arguments
+    if (argc == 2) {
+        if (strcmp(command, "--test") == 0 || strcmp(command, "-t") == 0) {
+            run_tests();
+            run_prepared_tests();
+            run_jit_tests();
+            run_calcbin_tests();
+            run_column_tests();
+            run_cse_tests();
+            run_cache_tests();
+            run_number_tests();
+            run_scan_tests();
+            run_stream_tests();
+            run_exact_tests();
+            run_power_tests();
+            run_format_tests();
+            run_library_tests();
+            run_depth_tests();
+            run_parallel_tests();
+            run_reassoc_tests();
+            run_sheet_tests();
+            return 0;
+        } else if (strcmp(command, "--help") == 0 || strcmp(command, "-h") == 0) {
+            printf("Usage:\n");
+            printf("  calc                    - Interactive calculator mode\n");
+            printf("  calc \"expression\"       - Evaluate single expression\n");
+            printf("  calc --test             - Run test cases\n");
+            printf("  calc --demo \"expr\"      - Show lexer and parser demo\n");
+            printf("  calc --batch            - Evaluate stdin line by line to stdout\n");
+            printf("  calc --file path [--threads N]\n");
+            printf("                          - Evaluate a file on N threads\n");
+            printf("  calc --stream [path]    - Evaluate one expression of any size\n");
+            printf("                            from path or stdin in constant\n");
+            printf("                            memory, as parsed\n");
+            printf("  calc --compile in -o out.calcbin\n");
+            printf("                          - Compile formulas, one per line\n");
+            printf("  calc --run file.calcbin [name ...] [var=value ...]\n");
+            printf("                          - Evaluate compiled formulas\n");
+            printf("  calc --columns \"expr\" [file.csv]\n");
+            printf("                          - Evaluate expr on every row of a CSV\n");
+            printf("                            file or stdin, variables bound to the\n");
+            printf("                            columns of the same name\n");
+            printf("  calc --columns \"expr\" --binary name=path ...\n");
+            printf("                          - Same over files of raw doubles,\n");
+            printf("                            writing raw doubles\n");
+            printf("  calc -                  - Evaluate one expression from stdin\n");
+            printf("  calc --help             - Show this help\n");
+            printf("\nOptions (before the mode):\n");
+            printf("  --no-opt                - Evaluate the AST exactly as parsed\n");
+            printf("  --fast-pow              - Unroll x^n up to |n| = %d into\n",
+                   POWI_MAX_EXPONENT);
+            printf("                            multiplies, within |n| ulp of the\n");
+            printf("                            exact power\n");
+            printf("  --reassociate           - Balance long chains of +, - and *,\n");
+            printf("                            which rounds differently, and print\n");
+            printf("                            the parse order result\n");
+            printf("  --shortest              - Print round-trip digits, not %%.6g\n");
+            printf("  --cse                   - Share repeated subexpressions\n");
+            printf("  --cache-mb N            - Cap the parse cache, 0 disables it\n");
+            printf("  --parallel N            - Evaluate a single expression as\n");
+            printf("                            subtree tasks on N threads, results\n");
+            printf("                            match ast_eval exactly\n");
+            printf("  --stats                 - Print phase latencies and counters to\n");
+            printf("                            stderr at exit and on SIGUSR1\n");
+            printf("                            (bin/calc-stats, 'make stats')\n");
+            return 0;
+        } else {
+            // Treat as expression to evaluate, "-" reads it from stdin
+            const char *expression = command;
+            const char *shown = command;
+            char *from_stdin = NULL;
+            if (strcmp(command, "-") == 0) {
+                from_stdin = read_stdin();
+                if (!from_stdin)
+                    return 1;
+                expression = from_stdin;
+                shown = "(stdin)";
+            }
+
+            Lexer_t *lexer = lexer_init(expression);
+            Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+            Parser_t *parser = parser_init(lexer, arena);
+            parser->hash_cons = hash_cons;
+            // Nothing binds a variable here, any name is unknown
+            parser->symbols.fixed = 1;
+            ASTNode_t *ast = parser_parse(parser);
+
+            if (!ast) {
+                fprintf(stderr, "Error: Failed to parser expression: %s\n", shown);
+                return 1;
+            }
+
+            if (optimizer_flags)
+                ast = ast_optimize(ast, optimizer_flags, NULL);
+            ASTValue_t result = eval_tree(ast);
+            char text[NUMFMT_BUF_SIZE];
+            numfmt_format_exact(result.value, result.integer, result_format, text);
+            printf("Input: %s\n", shown);
+            printf("Result: %s\n", text);
+            if (optimizer_flags & OPT_REASSOCIATE)
+                report_reassociation(expression, result.value);
+
+            parser_free(parser);
+            arena_free(arena);
+            lexer_free(lexer);
+            free(from_stdin);
             return 0;
         }
     }
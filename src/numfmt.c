@@ -0,0 +1,392 @@
+#include "../include/numfmt.h"
+#include "../include/numfmt_table.h"
+#include "../include/stats.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Decimal digits of a finite, non-zero double, value = digits * 10^exp10
+typedef struct {
+    uint64_t digits; // at most 17 decimal digits
+    int exp10;       // power of ten of the last digit
+} Decimal_t;
+
+// floor(log10(2^e)) for 0 <= e <= 1650
+static int log10_pow2(int e) { return (int)(((uint32_t)e * 78913) >> 18); }
+
+// floor(log10(5^e)) for 0 <= e <= 2620
+static int log10_pow5(int e) { return (int)(((uint32_t)e * 732923) >> 20); }
+
+// ceil(log2(5^e)), 1 for e = 0
+static int pow5_bits(int e) { return (int)(((uint32_t)e * 1217359) >> 19) + 1; }
+
+// Number of times 5 divides value
+static int pow5_factor(uint64_t value) {
+    int count = 0;
+    while (value % 5 == 0) {
+        value /= 5;
+        count++;
+    }
+    return count;
+}
+
+static int multiple_of_pow5(uint64_t value, int p) { return pow5_factor(value) >= p; }
+
+static int multiple_of_pow2(uint64_t value, int p) {
+    return (value & ((1ULL << p) - 1)) == 0;
+}
+
+// (m * mul) >> j for a 125-bit multiplier, j >= 64
+static uint64_t mul_shift(uint64_t m, const uint64_t *mul, int j) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 b0 = (unsigned __int128)m * mul[0];
+    unsigned __int128 b2 = (unsigned __int128)m * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+#else
+    // Schoolbook product of m with each half, then the same shift
+    uint64_t m_lo = (uint32_t)m, m_hi = m >> 32;
+    uint64_t parts[2][2];
+    for (int h = 0; h < 2; h++) {
+        uint64_t b_lo = (uint32_t)mul[h], b_hi = mul[h] >> 32;
+        uint64_t ll = m_lo * b_lo, lh = m_lo * b_hi, hl = m_hi * b_lo, hh = m_hi * b_hi;
+        uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+        parts[h][0] = (mid << 32) | (uint32_t)ll;
+        parts[h][1] = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    }
+    uint64_t lo = parts[0][1] + parts[1][0];
+    uint64_t hi = parts[1][1] + (lo < parts[0][1]);
+    int shift = j - 64;
+    return shift == 0 ? lo : (hi << (64 - shift)) | (lo >> shift);
+#endif
+}
+
+// Ryu: find the shortest decimal inside the interval of reals that round to
+// the double, and of those the one closest to it
+static Decimal_t shortest_decimal(uint64_t ieee_mantissa, int ieee_exponent) {
+    int e2;
+    uint64_t m2;
+    if (ieee_exponent == 0) {
+        e2 = 1 - 1023 - 52 - 2;
+        m2 = ieee_mantissa;
+    } else {
+        e2 = ieee_exponent - 1023 - 52 - 2;
+        m2 = (1ULL << 52) | ieee_mantissa;
+    }
+
+    int accept_bounds = (m2 & 1) == 0;
+
+    // The interval is [mv - mm_shift - 1, mv + 2] in units of 2^e2 / 4, it is
+    // narrower below powers of two
+    uint64_t mv = 4 * m2;
+    int mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+
+    uint64_t vr, vp, vm;
+    int e10;
+    int vm_trailing_zeros = 0;
+    int vr_trailing_zeros = 0;
+
+    if (e2 >= 0) {
+        int q = log10_pow2(e2) - (e2 > 3);
+        e10 = q;
+        int k = NUMFMT_POW5_INV_BITCOUNT + pow5_bits(q) - 1;
+        int i = -e2 + q + k;
+        vr = mul_shift(4 * m2, pow5_inv_split[q], i);
+        vp = mul_shift(4 * m2 + 2, pow5_inv_split[q], i);
+        vm = mul_shift(4 * m2 - 1 - mm_shift, pow5_inv_split[q], i);
+
+        if (q <= 21) {
+            // Only one of mp, mv and mm can be a multiple of 5
+            if (mv % 5 == 0)
+                vr_trailing_zeros = multiple_of_pow5(mv, q);
+            else if (accept_bounds)
+                vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+            else
+                vp -= multiple_of_pow5(mv + 2, q);
+        }
+    } else {
+        int q = log10_pow5(-e2) - (-e2 > 1);
+        e10 = q + e2;
+        int i = -e2 - q;
+        int k = pow5_bits(i) - NUMFMT_POW5_BITCOUNT;
+        int j = q - k;
+        vr = mul_shift(4 * m2, pow5_split[i], j);
+        vp = mul_shift(4 * m2 + 2, pow5_split[i], j);
+        vm = mul_shift(4 * m2 - 1 - mm_shift, pow5_split[i], j);
+
+        if (q <= 1) {
+            // mv has at least q trailing zero bits
+            vr_trailing_zeros = 1;
+            if (accept_bounds)
+                vm_trailing_zeros = mm_shift == 1;
+            else
+                vp--;
+        } else if (q < 63) {
+            vr_trailing_zeros = multiple_of_pow2(mv, q);
+        }
+    }
+
+    // Drop digits while the interval still holds a shorter number
+    int removed = 0;
+    int last_removed = 0;
+    uint64_t output;
+
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        // Rare path, tracks whether the dropped digits of vm and vr are zero
+        while (vp / 10 > vm / 10) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = (int)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+
+        if (vm_trailing_zeros) {
+            while (vm % 10 == 0) {
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = (int)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+
+        // Exactly halfway, round to even
+        if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0)
+            last_removed = 4;
+
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) ||
+                       last_removed >= 5);
+    } else {
+        // Common path, two digits at a time first
+        int round_up = 0;
+        if (vp / 100 > vm / 100) {
+            round_up = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+
+        while (vp / 10 > vm / 10) {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+
+        output = vr + (vr == vm || round_up);
+    }
+
+    Decimal_t result = {output, e10 + removed};
+    return result;
+}
+
+// Write the text of NaN and infinities like printf does, returns 0 for
+// finite values
+static int format_special(double value, uint64_t bits, char *buf) {
+    int exponent = (int)((bits >> 52) & 0x7FF);
+    if (exponent != 0x7FF)
+        return 0;
+
+    const char *text;
+    if (bits & ((1ULL << 52) - 1))
+        text = (bits >> 63) ? "-nan" : "nan";
+    else
+        text = value < 0 ? "-inf" : "inf";
+
+    int len = (int)strlen(text);
+    memcpy(buf, text, len + 1);
+    return len;
+}
+
+// Render digits scaled so the first one has power of ten point, like %g
+// does with the given precision: fixed notation for -4 <= point < precision,
+// scientific otherwise. Trailing zeros must already be stripped.
+static int write_decimal(char *buf, int negative, const char *digits, int count,
+                         int point, int precision) {
+    char *p = buf;
+    if (negative)
+        *p++ = '-';
+
+    if (point < -4 || point >= precision) {
+        *p++ = digits[0];
+        if (count > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, count - 1);
+            p += count - 1;
+        }
+
+        *p++ = 'e';
+        *p++ = point < 0 ? '-' : '+';
+        int exp = point < 0 ? -point : point;
+        if (exp >= 100)
+            *p++ = '0' + exp / 100;
+        *p++ = '0' + exp / 10 % 10;
+        *p++ = '0' + exp % 10;
+    } else if (point < 0) {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -point - 1);
+        p += -point - 1;
+        memcpy(p, digits, count);
+        p += count;
+    } else if (count <= point + 1) {
+        memcpy(p, digits, count);
+        p += count;
+        memset(p, '0', point + 1 - count);
+        p += point + 1 - count;
+    } else {
+        memcpy(p, digits, point + 1);
+        p += point + 1;
+        *p++ = '.';
+        memcpy(p, digits + point + 1, count - point - 1);
+        p += count - point - 1;
+    }
+
+    *p = '\0';
+    return (int)(p - buf);
+}
+
+// Split a finite double into sign and shortest digits, returns the digit
+// count and sets the power of ten of the first digit. Zero yields "0".
+static int shortest_digits(double value, uint64_t bits, char *digits, int *point) {
+    uint64_t mantissa = bits & ((1ULL << 52) - 1);
+    int exponent = (int)((bits >> 52) & 0x7FF);
+
+    if (mantissa == 0 && exponent == 0) {
+        digits[0] = '0';
+        *point = 0;
+        return 1;
+    }
+
+    Decimal_t dec = shortest_decimal(mantissa, exponent);
+
+    // Trailing zeros are possible for integers Ryu kept whole
+    while (dec.digits % 10 == 0) {
+        dec.digits /= 10;
+        dec.exp10++;
+    }
+
+    char tmp[20];
+    int count = 0;
+    while (dec.digits) {
+        tmp[count++] = '0' + dec.digits % 10;
+        dec.digits /= 10;
+    }
+
+    for (int i = 0; i < count; i++)
+        digits[i] = tmp[count - 1 - i];
+
+    *point = dec.exp10 + count - 1;
+    return count;
+}
+
+// Write the shortest text that strtod reads back as exactly the same double,
+// in %g style with up to 17 significant digits. buf holds NUMFMT_BUF_SIZE
+// bytes. Returns the length.
+int numfmt_shortest(double value, char *buf) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int len = format_special(value, bits, buf);
+    if (len)
+        return len;
+
+    char digits[20];
+    int point;
+    int count = shortest_digits(value, bits, digits, &point);
+
+    return write_decimal(buf, (int)(bits >> 63), digits, count, point, 17);
+}
+
+// Write the same text as printf("%.6g"). The shortest digits round to the
+// same six digits as the exact value unless they end in an exact tie at the
+// seventh digit, those rare values go through snprintf. So do subnormals,
+// whose few bits can make the shortest digits shorter than the six %.6g
+// shows, 1e-320 is 9.99989e-321. buf holds NUMFMT_BUF_SIZE bytes. Returns
+// the length.
+int numfmt_g6(double value, char *buf) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int len = format_special(value, bits, buf);
+    if (len)
+        return len;
+
+    if ((bits & 0x7ff0000000000000ULL) == 0 && (bits << 1) != 0)
+        return snprintf(buf, NUMFMT_BUF_SIZE, "%.6g", value);
+
+    char digits[20];
+    int point;
+    int count = shortest_digits(value, bits, digits, &point);
+
+    if (count > 6) {
+        if (count == 7 && digits[6] == '5')
+            return snprintf(buf, NUMFMT_BUF_SIZE, "%.6g", value);
+
+        int round_up = digits[6] >= '5';
+        count = 6;
+
+        if (round_up) {
+            int i = 5;
+            while (i >= 0 && digits[i] == '9')
+                digits[i--] = '0';
+
+            if (i < 0) {
+                // 999999.5 and up carries into a new leading digit
+                digits[0] = '1';
+                count = 1;
+                point++;
+            } else {
+                digits[i]++;
+            }
+        }
+
+        while (count > 1 && digits[count - 1] == '0')
+            count--;
+    }
+
+    return write_decimal(buf, (int)(bits >> 63), digits, count, point, 6);
+}
+
+// Format a value in the given mode, buf holds NUMFMT_BUF_SIZE bytes
+int numfmt_format(double value, NumFormat format, char *buf) {
+    uint64_t start = STATS_START();
+    int len =
+        format == NUMFMT_SHORTEST ? numfmt_shortest(value, buf) : numfmt_g6(value, buf);
+    STATS_STOP(STATS_FORMAT, start);
+
+    return len;
+}
+
+// Format a result that may also be exact in int64, integer is INT64_MIN if
+// it is not. The shortest mode writes an exact result as an integer with
+// all its digits, which the double loses above 2^53, %.6g keeps its six.
+// buf holds NUMFMT_BUF_SIZE bytes.
+int numfmt_format_exact(double value, int64_t integer, NumFormat format, char *buf) {
+    if (format != NUMFMT_SHORTEST || integer == INT64_MIN)
+        return numfmt_format(value, format, buf);
+
+    uint64_t start = STATS_START();
+    uint64_t magnitude = integer < 0 ? -(uint64_t)integer : (uint64_t)integer;
+    char tmp[20];
+    int count = 0;
+    do {
+        tmp[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+
+    char *p = buf;
+    if (integer < 0)
+        *p++ = '-';
+    while (count)
+        *p++ = tmp[--count];
+    *p = '\0';
+    STATS_STOP(STATS_FORMAT, start);
+
+    return (int)(p - buf);
+}
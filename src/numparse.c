@@ -0,0 +1,212 @@
+#include "../include/numparse.h"
+#include "../include/numparse_table.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Exact powers of ten usable by the Clinger fast path
+static const double exact_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Full 64 x 64 -> 128 bit product
+static void mul_64x64(uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 p = (unsigned __int128)a * b;
+    *hi = (uint64_t)(p >> 64);
+    *lo = (uint64_t)p;
+#else
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi, hl = a_hi * b_lo, hh = a_hi * b_hi;
+    uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+    *lo = (mid << 32) | (uint32_t)ll;
+    *hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+// Number of leading zero bits of a non-zero value
+static int leading_zeros(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    while (!(x >> 63)) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// Assemble a positive double from its biased exponent and mantissa bits
+static double make_double(uint64_t mantissa, int biased_exp) {
+    uint64_t bits = ((uint64_t)biased_exp << 52) | mantissa;
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Eisel-Lemire: round w * 10^q to the nearest double using a 128-bit
+// approximation of 5^q. Returns 0 if the approximation is too close to a
+// rounding boundary to decide, the caller then takes the slow path.
+static int eisel_lemire(uint64_t w, int q, double *out) {
+    if (w == 0 || q < NUMPARSE_MIN_POW10) {
+        *out = 0.0;
+        return 1;
+    }
+    if (q > NUMPARSE_MAX_POW10) {
+        *out = make_double(0, 0x7FF);
+        return 1;
+    }
+
+    int lz = leading_zeros(w);
+    w <<= lz;
+
+    // Keep 55 significant bits, the low half of the table entry is only
+    // needed when the bits below them are all ones
+    const uint64_t *entry = pow5_128[q - NUMPARSE_MIN_POW10];
+    uint64_t hi, lo;
+    mul_64x64(w, entry[0], &hi, &lo);
+
+    const uint64_t precision_mask = UINT64_MAX >> 55;
+    if ((hi & precision_mask) == precision_mask) {
+        uint64_t hi2, lo2;
+        mul_64x64(w, entry[1], &hi2, &lo2);
+        lo += hi2;
+        if (hi2 > lo)
+            hi++;
+
+        if (lo == UINT64_MAX)
+            return 0;
+    }
+
+    int upper_bit = (int)(hi >> 63);
+    uint64_t mantissa = hi >> (upper_bit + 9);
+
+    // floor(q * log2(10)) + 63, exact for the table's range
+    int power2 =
+        (int)(((152170 + 65536) * (int64_t)q) >> 16) + 63 + upper_bit - lz + 1023;
+
+    if (power2 <= 0) {
+        // Subnormal result, shift the mantissa into place and round
+        if (-power2 + 1 >= 64) {
+            *out = 0.0;
+            return 1;
+        }
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        power2 = mantissa < (1ULL << 52) ? 0 : 1;
+        *out = make_double(mantissa & ((1ULL << 52) - 1), power2);
+        return 1;
+    }
+
+    // Exactly halfway between two doubles, only possible for small q, rounds
+    // to even
+    if (lo <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 &&
+        (mantissa << (upper_bit + 9)) == hi) {
+        mantissa &= ~1ULL;
+    }
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (2ULL << 52)) {
+        mantissa = 1ULL << 52;
+        power2++;
+    }
+
+    if (power2 >= 0x7FF) {
+        *out = make_double(0, 0x7FF);
+        return 1;
+    }
+
+    *out = make_double(mantissa & ((1ULL << 52) - 1), power2);
+    return 1;
+}
+
+// Convert with strtod on a NUL terminated copy, for the rare inputs the
+// fast paths cannot decide
+static double slow_path(const char *text, int length) {
+    char buffer[128];
+
+    if (length < (int)sizeof(buffer)) {
+        memcpy(buffer, text, length);
+        buffer[length] = '\0';
+        return strtod(buffer, NULL);
+    }
+
+    char *copy = malloc(length + 1);
+    if (!copy) {
+        fprintf(stderr, "Error: Memory allocation failed for number\n");
+        return 0.0;
+    }
+
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    double value = strtod(copy, NULL);
+    free(copy);
+
+    return value;
+}
+
+// Convert a decimal literal of digits with at most one '.' to the nearest
+// double, the same value strtod returns. Works on the span in place.
+double numparse_decimal(const char *text, int length) {
+    uint64_t w = 0;
+    int digits = 0;      // significant digits accumulated into w
+    int exp10 = 0;       // power of ten applied to w
+    int truncated = 0;   // a non-zero digit did not fit into w
+    int seen_dot = 0;
+
+    for (int i = 0; i < length; i++) {
+        char c = text[i];
+
+        if (c == '.') {
+            seen_dot = 1;
+            continue;
+        }
+
+        int d = c - '0';
+        if (digits == 0 && d == 0) {
+            // Leading zeros only move the decimal point
+            if (seen_dot)
+                exp10--;
+        } else if (digits < NUMPARSE_MAX_DIGITS) {
+            w = w * 10 + d;
+            digits++;
+            if (seen_dot)
+                exp10--;
+        } else {
+            // Digits past the 19th are dropped, integer ones still scale
+            truncated |= d != 0;
+            if (!seen_dot)
+                exp10++;
+        }
+    }
+
+    if (!truncated) {
+        // Clinger: both factors are exact doubles, so one operation rounds
+        // correctly
+        if (w <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+            double value = (double)w;
+            return exp10 < 0 ? value / exact_pow10[-exp10] : value * exact_pow10[exp10];
+        }
+
+        double value;
+        if (eisel_lemire(w, exp10, &value))
+            return value;
+        return slow_path(text, length);
+    }
+
+    // The true value lies between w and w + 1 scaled, if both round to the
+    // same double it is the answer
+    double low, high;
+    if (eisel_lemire(w, exp10, &low) && eisel_lemire(w + 1, exp10, &high) &&
+        memcmp(&low, &high, sizeof(double)) == 0)
+        return low;
+
+    return slow_path(text, length);
+}
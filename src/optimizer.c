@@ -0,0 +1,510 @@
+#include "../include/optimizer.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Check if a node is a literal with exactly this value, sign of zero included
+static int is_number(ASTNode_t *node, double value) {
+    return node->type == AST_NUMBER &&
+           memcmp(&node->data.number.value, &value, sizeof(double)) == 0;
+}
+
+// Apply a binary operator to two constants like ast_eval does in double
+static double fold_binary(TokenType op, double left, double right) {
+    switch (op) {
+    case TOKEN_PLUS:
+        return left + right;
+    case TOKEN_MINUS:
+        return left - right;
+    case TOKEN_MULTIPLY:
+        return left * right;
+    case TOKEN_DIVIDE:
+        return left / right;
+    case TOKEN_POWER:
+        return pow(left, right);
+    default:
+        return 0.0;
+    }
+}
+
+// Turn a node into a literal in place, its old children stay in the arena
+static ASTNode_t *make_number(ASTNode_t *node, double value) {
+    node->type = AST_NUMBER;
+    node->data.number.value = value;
+    node->data.number.integer = 0;
+    node->exact = 0;
+    return node;
+}
+
+// Turn a node into an exact integer literal in place
+static ASTNode_t *make_integer(ASTNode_t *node, int64_t value) {
+    make_number(node, (double)value);
+    node->data.number.integer = value;
+    node->exact = 1;
+    return node;
+}
+
+// Remove operations that provably return their left operand unchanged for
+// every input. x+0 is not among them since -0 + 0 is +0.
+static ASTNode_t *apply_identities(ASTNode_t *node, OptimizerStats_t *stats) {
+    TokenType op = node->data.binary_op.op;
+    ASTNode_t *left = node->data.binary_op.left;
+    ASTNode_t *right = node->data.binary_op.right;
+    ASTNode_t *result = NULL;
+
+    switch (op) {
+    case TOKEN_MULTIPLY:
+        if (is_number(right, 1.0))
+            result = left;
+        else if (is_number(left, 1.0))
+            result = right;
+        break;
+    case TOKEN_DIVIDE:
+    case TOKEN_POWER:
+        if (is_number(right, 1.0))
+            result = left;
+        break;
+    case TOKEN_MINUS:
+        if (is_number(right, 0.0))
+            result = left;
+        break;
+    case TOKEN_PLUS:
+        if (is_number(right, -0.0))
+            result = left;
+        else if (is_number(left, -0.0))
+            result = right;
+        break;
+    default:
+        break;
+    }
+
+    if (!result)
+        return node;
+
+    stats->identities_applied++;
+    return result;
+}
+
+// Replace a power with a constant exponent by multiplies, a reciprocal or a
+// square root. Exponents whose result is rounded once only need OPT_POWERS,
+// the others need OPT_FAST_POWERS. Exact bases are left to the evaluator's
+// int64 path.
+static ASTNode_t *reduce_power(ASTNode_t *node, int flags, OptimizerStats_t *stats) {
+    ASTNode_t *base = node->data.binary_op.left;
+    ASTNode_t *right = node->data.binary_op.right;
+    if (right->type != AST_NUMBER || base->exact)
+        return node;
+
+    double value = right->data.number.value;
+    if (value == 0.5) {
+        if (!(flags & (OPT_POWERS | OPT_FAST_POWERS)))
+            return node;
+        node->type = AST_SQRT;
+        node->data.power.exponent = 0;
+    } else if (value >= -POWI_MAX_EXPONENT && value <= POWI_MAX_EXPONENT &&
+               value == (int)value) {
+        int exponent = (int)value;
+        int rounded_once = exponent >= -1 && exponent <= 2;
+        if (!(flags & (rounded_once ? OPT_POWERS | OPT_FAST_POWERS : OPT_FAST_POWERS)))
+            return node;
+        node->type = AST_POWI;
+        node->data.power.exponent = exponent;
+    } else {
+        return node;
+    }
+
+    node->data.power.base = base;
+    stats->powers_reduced++;
+    return node;
+}
+
+// Rewrite a node whose operands are optimized already and return its
+// replacement
+static ASTNode_t *rewrite_node(ASTNode_t *node, int flags, OptimizerStats_t *stats) {
+    switch (node->type) {
+    case AST_NUMBER:
+    case AST_VARIABLE:
+        return node;
+
+    case AST_UNARY_OP: {
+        ASTNode_t *operand = node->data.unary_op.operand;
+
+        if (flags & OPT_SIMPLIFY_UNARY) {
+            // +x is x
+            if (node->data.unary_op.op == TOKEN_PLUS) {
+                stats->unary_removed++;
+                return operand;
+            }
+
+            // -(-x) is x
+            if (operand->type == AST_UNARY_OP &&
+                operand->data.unary_op.op == TOKEN_MINUS) {
+                stats->unary_removed += 2;
+                return operand->data.unary_op.operand;
+            }
+        }
+
+        if ((flags & OPT_FOLD_CONSTANTS) && operand->type == AST_NUMBER) {
+            stats->folded++;
+            int64_t integer = operand->data.number.integer;
+            TokenType op = node->data.unary_op.op;
+            if (operand->exact &&
+                (op == TOKEN_PLUS || ast_exact_negate(integer, &integer)))
+                return make_integer(node, integer);
+
+            double value = operand->data.number.value;
+            return make_number(node, op == TOKEN_MINUS ? -value : value);
+        }
+
+        node->exact = operand->exact;
+        return node;
+    }
+
+    case AST_BINARY_OP: {
+        ASTNode_t *left = node->data.binary_op.left;
+        ASTNode_t *right = node->data.binary_op.right;
+
+        // Division by zero is left for the evaluator to report
+        TokenType op = node->data.binary_op.op;
+        if ((flags & OPT_FOLD_CONSTANTS) && left->type == AST_NUMBER &&
+            right->type == AST_NUMBER &&
+            !(op == TOKEN_DIVIDE && right->data.number.value == 0.0)) {
+            stats->folded++;
+            int64_t integer;
+            if (left->exact && right->exact &&
+                ast_exact_binary(op, left->data.number.integer,
+                                 right->data.number.integer, &integer))
+                return make_integer(node, integer);
+
+            return make_number(node, fold_binary(op, left->data.number.value,
+                                                 right->data.number.value));
+        }
+
+        node->exact = left->exact && right->exact;
+
+        if (flags & OPT_IDENTITIES) {
+            ASTNode_t *result = apply_identities(node, stats);
+            if (result != node)
+                return result;
+        }
+
+        if (op == TOKEN_POWER && (flags & (OPT_POWERS | OPT_FAST_POWERS)))
+            return reduce_power(node, flags, stats);
+
+        return node;
+    }
+
+    case AST_POWI:
+    case AST_SQRT:
+        return node;
+    }
+
+    return node;
+}
+
+// Node of the optimizer's walk whose operands are being optimized
+typedef struct {
+    ASTNode_t *node;
+    ASTNode_t **link; // where the parent keeps node, receives its replacement
+    int next;         // operand to optimize next
+} OptimizeFrame_t;
+
+// Optimize a tree bottom up and return its replacement. A node with one of
+// the shared indices below shared is rewritten on its first visit, its other
+// parents link to the replacement kept in a table. If the stack cannot grow,
+// the operands not reached yet are left as they are and the rest is still
+// rewritten.
+static ASTNode_t *optimize_tree(ASTNode_t *root, int flags, int shared,
+                                OptimizerStats_t *stats) {
+    ASTNode_t *result = root;
+    int capacity = 64;
+    int depth = 0;
+    OptimizeFrame_t *stack = malloc(capacity * sizeof(OptimizeFrame_t));
+    ASTNode_t **replaced = shared ? calloc(shared, sizeof(ASTNode_t *)) : NULL;
+    int ok = stack != NULL && (!shared || replaced);
+    if (ok)
+        stack[depth++] = (OptimizeFrame_t){root, &result, 0};
+
+    while (depth > 0) {
+        OptimizeFrame_t *frame = &stack[depth - 1];
+        ASTNode_t **operand = ok ? ast_operand(frame->node, frame->next++) : NULL;
+
+        if (operand) {
+            ASTNode_t *child = *operand;
+            if (child->type == AST_NUMBER || child->type == AST_VARIABLE)
+                continue;
+            if (child->shared >= 0 && replaced[child->shared]) {
+                *operand = replaced[child->shared];
+                continue;
+            }
+
+            if (depth == capacity) {
+                OptimizeFrame_t *grown =
+                    realloc(stack, capacity * 2 * sizeof(OptimizeFrame_t));
+                if (!grown) {
+                    ok = 0;
+                    continue;
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[depth++] = (OptimizeFrame_t){child, operand, 0};
+            continue;
+        }
+
+        int index = frame->node->shared;
+        *frame->link = rewrite_node(frame->node, flags, stats);
+        if (index >= 0)
+            replaced[index] = *frame->link;
+        depth--;
+    }
+
+    if (!ok)
+        fprintf(stderr, "Error: Memory allocation failed for optimizer\n");
+    free(stack);
+    free(replaced);
+    return result;
+}
+
+// Node on one of the reassociation pass's work lists
+typedef struct {
+    ASTNode_t *node;
+    int negated; // on the walk, set below the right side of an odd number of '-'
+} ChainItem_t;
+
+typedef struct {
+    ChainItem_t *items;
+    int count;
+    int capacity;
+} ChainList_t;
+
+// Work lists of the reassociation pass, malloc'd and only growing
+typedef struct {
+    ChainList_t pending;    // subtrees still to visit
+    ChainList_t walk;       // chain nodes still to flatten
+    ChainList_t nodes;      // operator nodes of the chain, free to be relinked
+    ChainList_t added;      // terms of the chain, left to right
+    ChainList_t subtracted; // terms after a '-', left to right
+} Reassociate_t;
+
+// Append a node to a work list. Returns 0 if the list could not grow.
+static int push_item(ChainList_t *list, ASTNode_t *node, int negated) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        ChainItem_t *items = realloc(list->items, capacity * sizeof(ChainItem_t));
+        if (!items) {
+            fprintf(stderr, "Error: Memory allocation failed for optimizer work list\n");
+            return 0;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count++] = (ChainItem_t){node, negated};
+    return 1;
+}
+
+// Check if a node continues a chain of op, where TOKEN_PLUS stands for '+'
+// and '-'. A shared node ends the chain, its other parents need it as is.
+static int in_chain(ASTNode_t *node, TokenType op) {
+    if (node->type != AST_BINARY_OP || node->shared >= 0)
+        return 0;
+
+    TokenType node_op = node->data.binary_op.op;
+    return node_op == op || (op == TOKEN_PLUS && node_op == TOKEN_MINUS);
+}
+
+// Link terms into a balanced tree of op, taking the operator nodes from
+// nodes in order. Recurses only log2(count) deep.
+static ASTNode_t *build_balanced(ChainItem_t *terms, int count, TokenType op,
+                                 ChainItem_t *nodes, int *used) {
+    if (count == 1)
+        return terms[0].node;
+
+    ASTNode_t *node = nodes[(*used)++].node;
+    int half = count / 2;
+    ASTNode_t *left = build_balanced(terms, half, op, nodes, used);
+    ASTNode_t *right = build_balanced(terms + half, count - half, op, nodes, used);
+    node->data.binary_op.op = op;
+    node->data.binary_op.left = left;
+    node->data.binary_op.right = right;
+    node->exact = left->exact && right->exact;
+    return node;
+}
+
+// Flatten the chain below root into its terms and relink the same nodes
+// into a balanced tree. Sums and differences become (added terms) -
+// (subtracted terms). root stays on top, so its parent needs no update.
+// Returns 0 if out of memory, with the chain still unchanged.
+static int balance_chain(Reassociate_t *r, ASTNode_t *root, OptimizerStats_t *stats) {
+    TokenType op =
+        root->data.binary_op.op == TOKEN_MULTIPLY ? TOKEN_MULTIPLY : TOKEN_PLUS;
+    r->nodes.count = 0;
+    r->added.count = 0;
+    r->subtracted.count = 0;
+
+    if (!push_item(&r->walk, root, 0))
+        return 0;
+
+    while (r->walk.count > 0) {
+        ChainItem_t item = r->walk.items[--r->walk.count];
+        ASTNode_t *node = item.node;
+
+        if (!in_chain(node, op)) {
+            if (!push_item(item.negated ? &r->subtracted : &r->added, node, 0))
+                return 0;
+            continue;
+        }
+
+        // Right side first, so the terms come off the walk left to right
+        int flip = node->data.binary_op.op == TOKEN_MINUS;
+        if (!push_item(&r->nodes, node, 0) ||
+            !push_item(&r->walk, node->data.binary_op.right, item.negated ^ flip) ||
+            !push_item(&r->walk, node->data.binary_op.left, item.negated))
+            return 0;
+    }
+
+    // Two terms are a single operation already
+    if (r->added.count + r->subtracted.count < 3)
+        return 1;
+
+    int used = 0;
+    if (r->subtracted.count == 0) {
+        build_balanced(r->added.items, r->added.count, op, r->nodes.items, &used);
+    } else {
+        // The leftmost term is never subtracted, so both sides exist
+        used = 1;
+        ASTNode_t *left = build_balanced(r->added.items, r->added.count, TOKEN_PLUS,
+                                         r->nodes.items, &used);
+        ASTNode_t *right = build_balanced(r->subtracted.items, r->subtracted.count,
+                                          TOKEN_PLUS, r->nodes.items, &used);
+        root->data.binary_op.op = TOKEN_MINUS;
+        root->data.binary_op.left = left;
+        root->data.binary_op.right = right;
+        root->exact = left->exact && right->exact;
+    }
+
+    stats->chains_balanced++;
+    return 1;
+}
+
+// Rebalance every chain of '+' and '-', and every chain of '*', so that a
+// chain of n terms is log2(n) deep instead of n. The parser builds such
+// chains as a left spine, which evaluates as one long dependency chain.
+// Subtrees shared through hash-consing are left as they are.
+static void reassociate(ASTNode_t *root, OptimizerStats_t *stats) {
+    Reassociate_t r;
+    memset(&r, 0, sizeof(r));
+
+    int ok = push_item(&r.pending, root, 0);
+    while (ok && r.pending.count > 0) {
+        ASTNode_t *node = r.pending.items[--r.pending.count].node;
+        if (node->shared >= 0)
+            continue;
+
+        switch (node->type) {
+        case AST_BINARY_OP:
+            if (in_chain(node, TOKEN_PLUS) || in_chain(node, TOKEN_MULTIPLY)) {
+                ok = balance_chain(&r, node, stats);
+                for (int i = 0; ok && i < r.added.count; i++)
+                    ok = push_item(&r.pending, r.added.items[i].node, 0);
+                for (int i = 0; ok && i < r.subtracted.count; i++)
+                    ok = push_item(&r.pending, r.subtracted.items[i].node, 0);
+            } else {
+                ok = push_item(&r.pending, node->data.binary_op.left, 0) &&
+                     push_item(&r.pending, node->data.binary_op.right, 0);
+            }
+            break;
+        case AST_UNARY_OP:
+            ok = push_item(&r.pending, node->data.unary_op.operand, 0);
+            break;
+        case AST_POWI:
+        case AST_SQRT:
+            ok = push_item(&r.pending, node->data.power.base, 0);
+            break;
+        case AST_NUMBER:
+        case AST_VARIABLE:
+            break;
+        }
+    }
+
+    free(r.pending.items);
+    free(r.walk.items);
+    free(r.nodes.items);
+    free(r.added.items);
+    free(r.subtracted.items);
+}
+
+// Count the nodes of a tree, shared subtrees once per parent, and note one
+// past the highest shared index, 0 if nothing is shared. Walks with the
+// reassociation pass's work list.
+static int count_tree(ASTNode_t *root, int *shared) {
+    ChainList_t pending = {0};
+    int count = 0;
+
+    int ok = push_item(&pending, root, 0);
+    while (ok && pending.count > 0) {
+        ASTNode_t *node = pending.items[--pending.count].node;
+        if (node->shared >= *shared)
+            *shared = node->shared + 1;
+        count++;
+
+        ASTNode_t **operand;
+        for (int i = 0; ok && (operand = ast_operand(node, i)) != NULL; i++)
+            ok = push_item(&pending, *operand, 0);
+    }
+
+    free(pending.items);
+    return count;
+}
+
+// Rewrite an AST into a cheaper equivalent. The result evaluates to the same
+// bits as the original for every input, except for powers with a constant
+// exponent. OPT_POWERS computes x^2, x^-1 and x^0.5 with one correctly
+// rounded multiply, division or square root, where pow is off by one ulp
+// for a few inputs. OPT_FAST_POWERS also unrolls x^n for 3 <= |n| <=
+// POWI_MAX_EXPONENT, which rounds once per multiply and stays within |n|
+// ulp of the exact power as long as x^|n| neither overflows nor becomes
+// subnormal. Zeros, infinities and NaN give the same results as pow either
+// way. OPT_REASSOCIATE, which OPT_ALL leaves out, rebalances chains of
+// '+', '-' and '*' before the other passes. That rounds in a different
+// order, so results may differ in the last bits, overflow where the parse
+// order did not, or leave int64 for double at another node. Nodes shared
+// through hash-consing are rewritten once for all their parents. stats may
+// be NULL.
+ASTNode_t *ast_optimize(ASTNode_t *node, int flags, OptimizerStats_t *stats) {
+    OptimizerStats_t local;
+    if (!stats)
+        stats = &local;
+
+    memset(stats, 0, sizeof(OptimizerStats_t));
+
+    if (!node)
+        return NULL;
+
+    // First, so that the passes below see the balanced tree
+    if (flags & OPT_REASSOCIATE)
+        reassociate(node, stats);
+
+    int shared = 0;
+    stats->nodes_before = count_tree(node, &shared);
+    node = optimize_tree(node, flags, shared, stats);
+    stats->nodes_after = ast_count_nodes(node);
+
+    // Rewrites change which subtrees are shared, a shared node may even have
+    // become a literal
+    if (shared)
+        ast_mark_shared(node);
+
+    return node;
+}
+
+// Print a one line summary of an optimizer run
+void optimizer_print_stats(const OptimizerStats_t *stats) {
+    printf("Optimizer: %d -> %d nodes (%d removed: %d folded, %d unary, %d identities), "
+           "%d powers reduced, %d chains balanced\n",
+           stats->nodes_before, stats->nodes_after,
+           stats->nodes_before - stats->nodes_after, stats->folded, stats->unary_removed,
+           stats->identities_applied, stats->powers_reduced, stats->chains_balanced);
+}
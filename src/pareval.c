@@ -0,0 +1,414 @@
+#include "../include/pareval.h"
+#include "../include/stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Node of the planner's explicit stack, trees may be millions of nodes deep
+typedef struct {
+    ASTNode_t *node;
+    int next_child; // index of the child to visit next
+    int weight;     // nodes of the subtree not cut off into tasks so far
+} PlanFrame_t;
+
+// Task indices owned by one worker. The owner pushes and pops at the top,
+// so a parent made ready runs next on the same core, thieves take from the
+// bottom, the oldest and usually largest piece of work.
+typedef struct {
+    pthread_mutex_t lock;
+    int *items;
+    int bottom; // next item a thief takes
+    int top;    // one past the item the owner takes
+} ParDeque_t;
+
+// State shared by every worker of one run
+typedef struct {
+    ParPlan_t *plan;
+    const double *vars;
+    ParDeque_t *deques;
+    int threads;
+    pthread_mutex_t lock; // guards queued and remaining
+    pthread_cond_t cond;  // signalled when a task is queued or the last one ends
+    int queued;           // tasks waiting in a deque
+    int remaining;        // tasks not finished yet
+} ParPool_t;
+
+// Arguments of one worker thread
+typedef struct {
+    ParPool_t *pool;
+    int id;
+} ParWorker_t;
+
+// Child i of a node in evaluation order, NULL past the last
+static ASTNode_t *child_at(const ASTNode_t *node, int i) {
+    switch (node->type) {
+    case AST_BINARY_OP:
+        return i == 0   ? node->data.binary_op.left
+               : i == 1 ? node->data.binary_op.right
+                        : NULL;
+    case AST_UNARY_OP:
+        return i == 0 ? node->data.unary_op.operand : NULL;
+    case AST_POWI:
+    case AST_SQRT:
+        return i == 0 ? node->data.power.base : NULL;
+    default:
+        return NULL;
+    }
+}
+
+// Make node the root of a new task. Returns 0 if tasks could not grow.
+static int add_task(ParPlan_t *plan, int *capacity, ASTNode_t *node, int nodes) {
+    if (plan->task_count == *capacity) {
+        int grown = *capacity * 2;
+        ParTask_t *tasks = realloc(plan->tasks, grown * sizeof(ParTask_t));
+        if (!tasks)
+            return 0;
+        plan->tasks = tasks;
+        *capacity = grown;
+    }
+
+    ParTask_t *task = &plan->tasks[plan->task_count];
+    task->root = node;
+    task->parent = -1;
+    task->children = 0;
+    task->nodes = nodes;
+    task->pending = 0;
+    node->shared = plan->task_count++;
+    return 1;
+}
+
+// Cut the tree into tasks in one post-order pass. A node becomes a task root
+// once the part of its subtree not already cut off reaches grain nodes, so
+// every task evaluates between grain and about twice grain nodes. Returns 0
+// on allocation failure, or -1 if the tree has shared nodes.
+static int cut_tasks(ParPlan_t *plan, int grain) {
+    int capacity = 64;
+    int stack_capacity = 256;
+    int depth = 0;
+    PlanFrame_t *stack = malloc(stack_capacity * sizeof(PlanFrame_t));
+    plan->tasks = malloc(capacity * sizeof(ParTask_t));
+    if (!stack || !plan->tasks) {
+        free(stack);
+        return 0;
+    }
+
+    if (plan->root->shared >= 0) {
+        free(stack);
+        return -1;
+    }
+    stack[depth++] = (PlanFrame_t){plan->root, 0, 0};
+
+    while (depth > 0) {
+        PlanFrame_t *frame = &stack[depth - 1];
+        ASTNode_t *child = child_at(frame->node, frame->next_child++);
+
+        if (child) {
+            // A DAG would need some of its tasks before several parents
+            if (child->shared >= 0) {
+                free(stack);
+                return -1;
+            }
+
+            if (depth == stack_capacity) {
+                stack_capacity *= 2;
+                PlanFrame_t *grown = realloc(stack, stack_capacity * sizeof(PlanFrame_t));
+                if (!grown) {
+                    free(stack);
+                    return 0;
+                }
+                stack = grown;
+            }
+            stack[depth++] = (PlanFrame_t){child, 0, 0};
+            continue;
+        }
+
+        // Every child is done, the node itself counts as one more
+        ASTNode_t *node = frame->node;
+        int weight = frame->weight + 1;
+        depth--;
+        plan->nodes++;
+
+        if (weight >= grain || depth == 0) {
+            if (!add_task(plan, &capacity, node, weight)) {
+                free(stack);
+                return 0;
+            }
+            weight = 1;
+        }
+
+        if (depth > 0)
+            stack[depth - 1].weight += weight;
+    }
+
+    free(stack);
+    return 1;
+}
+
+// Link every task to the nearest task root above it, walking the tree again
+// with the task each node belongs to. Returns 0 on allocation failure.
+static int link_tasks(ParPlan_t *plan) {
+    typedef struct {
+        ASTNode_t *node;
+        int task;
+    } LinkFrame_t;
+
+    int capacity = 256;
+    int depth = 0;
+    LinkFrame_t *stack = malloc(capacity * sizeof(LinkFrame_t));
+    if (!stack)
+        return 0;
+    stack[depth++] = (LinkFrame_t){plan->root, plan->root->shared};
+
+    while (depth > 0) {
+        LinkFrame_t frame = stack[--depth];
+
+        ASTNode_t *child;
+        for (int i = 0; (child = child_at(frame.node, i)) != NULL; i++) {
+            int task = frame.task;
+            if (child->shared >= 0) {
+                task = child->shared;
+                plan->tasks[task].parent = frame.task;
+                plan->tasks[frame.task].children++;
+            }
+
+            if (depth == capacity) {
+                capacity *= 2;
+                LinkFrame_t *grown = realloc(stack, capacity * sizeof(LinkFrame_t));
+                if (!grown) {
+                    free(stack);
+                    return 0;
+                }
+                stack = grown;
+            }
+            stack[depth++] = (LinkFrame_t){child, task};
+        }
+    }
+
+    free(stack);
+    return 1;
+}
+
+// Split a tree into tasks of at least grain nodes for pareval_run. The task
+// roots are marked through their shared field until pareval_free, which
+// other evaluators read as a subtree used once. Returns NULL if the tree
+// has shared subtrees, such as after hash-consing, or on allocation failure.
+ParPlan_t *pareval_plan(ASTNode_t *root, int grain) {
+    ParPlan_t *plan = calloc(1, sizeof(ParPlan_t));
+    if (!plan) {
+        fprintf(stderr, "Error: Memory allocation failed for parallel plan\n");
+        return NULL;
+    }
+    plan->root = root;
+
+    int status = cut_tasks(plan, grain < 2 ? 2 : grain);
+    if (status > 0 && link_tasks(plan)) {
+        plan->results = malloc(plan->task_count * sizeof(ASTValue_t));
+        if (plan->results)
+            return plan;
+    }
+
+    if (status >= 0)
+        fprintf(stderr, "Error: Memory allocation failed for parallel plan\n");
+    pareval_free(plan);
+    return NULL;
+}
+
+// Give the tree its task roots back as plain nodes and free the plan
+void pareval_free(ParPlan_t *plan) {
+    if (!plan)
+        return;
+
+    for (int i = 0; i < plan->task_count; i++)
+        plan->tasks[i].root->shared = -1;
+
+    free(plan->tasks);
+    free(plan->results);
+    free(plan);
+}
+
+// Add a task on top of a worker's own deque
+static void deque_push(ParDeque_t *deque, int index) {
+    pthread_mutex_lock(&deque->lock);
+    deque->items[deque->top++] = index;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Take the newest task of a worker's own deque, -1 if empty
+static int deque_pop(ParDeque_t *deque) {
+    int index = -1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom < deque->top) {
+        index = deque->items[--deque->top];
+        if (deque->bottom == deque->top)
+            deque->bottom = deque->top = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return index;
+}
+
+// Take the oldest task of another worker's deque, -1 if empty
+static int deque_steal(ParDeque_t *deque) {
+    int index = -1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom < deque->top)
+        index = deque->items[deque->bottom++];
+    pthread_mutex_unlock(&deque->lock);
+
+    return index;
+}
+
+// Find the next task for a worker, its own first, then stolen
+static int next_task(ParPool_t *pool, int id) {
+    int index = deque_pop(&pool->deques[id]);
+
+    for (int i = 1; index < 0 && i < pool->threads; i++) {
+        index = deque_steal(&pool->deques[(id + i) % pool->threads]);
+    }
+
+    return index;
+}
+
+// Worker loop, runs tasks until the root's task is done. Finishing the last
+// child of a task queues that task on the same worker.
+static void *worker_main(void *arg) {
+    ParWorker_t *worker = arg;
+    ParPool_t *pool = worker->pool;
+    ParPlan_t *plan = pool->plan;
+
+    for (;;) {
+        int index = next_task(pool, worker->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (index < 0) {
+            while (pool->queued == 0 && pool->remaining > 0)
+                pthread_cond_wait(&pool->cond, &pool->lock);
+            int finished = pool->remaining == 0;
+            pthread_mutex_unlock(&pool->lock);
+            if (finished)
+                break;
+            continue;
+        }
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        ParTask_t *task = &plan->tasks[index];
+        plan->results[index] = ast_eval_task(task->root, pool->vars, plan->results);
+
+        int ready = task->parent >= 0 &&
+                    __atomic_sub_fetch(&plan->tasks[task->parent].pending, 1,
+                                       __ATOMIC_ACQ_REL) == 0;
+        if (ready)
+            deque_push(&pool->deques[worker->id], task->parent);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->queued += ready;
+        pool->remaining--;
+        if (ready || pool->remaining == 0)
+            pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+// Run the tasks of a plan on threads workers, the calling thread being one
+// of them. Returns -1 if the pool could not be set up.
+static int run_pool(ParPlan_t *plan, const double *vars, int threads) {
+    ParPool_t pool;
+    pool.plan = plan;
+    pool.vars = vars;
+    pool.threads = threads;
+    pool.queued = 0;
+    pool.remaining = plan->task_count;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pool.deques = calloc(threads, sizeof(ParDeque_t));
+    int *items = malloc((size_t)threads * plan->task_count * sizeof(int));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    ParWorker_t *workers = malloc(threads * sizeof(ParWorker_t));
+
+    if (!pool.deques || !items || !tids || !workers) {
+        fprintf(stderr, "Error: Memory allocation failed for thread pool\n");
+        free(pool.deques);
+        free(items);
+        free(tids);
+        free(workers);
+        return -1;
+    }
+
+    // Any deque may end up holding every task
+    for (int w = 0; w < threads; w++) {
+        pthread_mutex_init(&pool.deques[w].lock, NULL);
+        pool.deques[w].items = items + (size_t)w * plan->task_count;
+    }
+
+    // Deal the tasks without children round robin, the rest become ready
+    // as their children finish
+    int next = 0;
+    for (int i = 0; i < plan->task_count; i++) {
+        ParTask_t *task = &plan->tasks[i];
+        task->pending = task->children;
+        if (task->children == 0) {
+            ParDeque_t *deque = &pool.deques[next++ % threads];
+            deque->items[deque->top++] = i;
+            pool.queued++;
+        }
+    }
+
+    int started = 1;
+    for (; started < threads; started++) {
+        workers[started].pool = &pool;
+        workers[started].id = started;
+        if (pthread_create(&tids[started], NULL, worker_main, &workers[started]) != 0) {
+            fprintf(stderr, "Error: Failed to start worker thread\n");
+            break;
+        }
+    }
+
+    // Tasks dealt to workers that failed to start are stolen by the others
+    workers[0].pool = &pool;
+    workers[0].id = 0;
+    worker_main(&workers[0]);
+
+    for (int w = 1; w < started; w++)
+        pthread_join(tids[w], NULL);
+
+    for (int w = 0; w < threads; w++)
+        pthread_mutex_destroy(&pool.deques[w].lock);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+
+    free(pool.deques);
+    free(items);
+    free(tids);
+    free(workers);
+    return 0;
+}
+
+// Evaluate a planned tree on threads workers. Every task computes its
+// subtree exactly as ast_eval_checked would, reading the results of the
+// tasks below it, so value and first error match sequential evaluation bit
+// for bit. With one thread, or a single task, the tasks run in order on the
+// calling thread, which still keeps recursion within one task's depth.
+double pareval_run(ParPlan_t *plan, const double *vars, int threads, const char **error) {
+    uint64_t start = STATS_START();
+    int last = plan->task_count - 1;
+
+    if (threads > last + 1)
+        threads = last + 1;
+
+    if (threads <= 1 || run_pool(plan, vars, threads) != 0) {
+        for (int i = 0; i <= last; i++)
+            plan->results[i] = ast_eval_task(plan->tasks[i].root, vars, plan->results);
+    }
+
+    STATS_STOP(STATS_EVAL, start);
+
+    if (!*error)
+        *error = plan->results[last].error;
+    return plan->results[last].value;
+}
@@ -1,10 +1,13 @@
 #include "../include/parser.h"
+#include "../include/stats.h"
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-// Init parser with lexer
-Parser_t *parser_init(Lexer_t *lexer) {
+// Init parser with lexer and the arena that will own the AST nodes
+Parser_t *parser_init(Lexer_t *lexer, Arena_t *arena) {
     Parser_t *parser = malloc(sizeof(Parser_t));
     if (!parser) {
         fprintf(stderr, "Error: Memory allocation failed for parser\n");
@@ -12,250 +15,1063 @@ Parser_t *parser_init(Lexer_t *lexer) {
     }
 
     parser->lexer = lexer;
-    parser->curr_token = lexer_next_token(lexer); // Load the first token
+    parser->arena = arena;
+    parser->silent = 0;
+    parser->hash_cons = 0;
+    memset(&parser->stack, 0, sizeof(ParseStack_t));
+    parser_reset(parser);
 
     return parser;
 }
 
+// Prepare the parser for the lexer's current input. Variables and errors
+// from the previous parse are forgotten, the arena should be reset as well.
+void parser_reset(Parser_t *parser) {
+    parser->symbols.names = NULL;
+    parser->symbols.count = 0;
+    parser->symbols.capacity = 0;
+    parser->symbols.fixed = 0;
+    parser->cons.slots = NULL;
+    parser->cons.capacity = 0;
+    parser->cons.count = 0;
+    parser->cons.hits = 0;
+    parser->error = NULL;
+    parser->error_pos = 0;
+    parser->curr_token = lexer_next_token(parser->lexer); // Load the first token
+}
+
 // Clean up parser memory
 void parser_free(Parser_t *parser) {
     if (parser) {
-        if (parser->curr_token) {
-            token_free(parser->curr_token);
-        }
+        free(parser->stack.operands);
+        free(parser->stack.ops);
         free(parser);
     }
 }
 
-// Recursively free AST nodes and all its children
-void ast_free(ASTNode_t *node) {
-    if (!node)
-        return;
+// Move past a token the caller has already matched
+static inline void advance(Parser_t *parser) {
+    parser->curr_token = lexer_next_token(parser->lexer);
+}
+
+// Hash of a node's contents, children are compared by identity since they
+// were interned before their parent
+static uint64_t node_hash(const ASTNode_t *node) {
+    uint64_t h = node->type;
 
     switch (node->type) {
+    case AST_NUMBER: {
+        uint64_t bits;
+        memcpy(&bits, &node->data.number.value, sizeof(bits));
+        h = h * 31 + bits;
+        h = h * 31 + (uint64_t)node->data.number.integer;
+        break;
+    }
+    case AST_VARIABLE:
+        h = h * 31 + node->data.variable.slot;
+        break;
     case AST_BINARY_OP:
-        ast_free(node->data.binary_op.left);
-        ast_free(node->data.binary_op.right);
+        h = h * 31 + node->data.binary_op.op;
+        h = h * 31 + (uintptr_t)node->data.binary_op.left;
+        h = h * 31 + (uintptr_t)node->data.binary_op.right;
         break;
     case AST_UNARY_OP:
-        ast_free(node->data.unary_op.operand);
+        h = h * 31 + node->data.unary_op.op;
+        h = h * 31 + (uintptr_t)node->data.unary_op.operand;
         break;
-    case AST_NUMBER:
+    case AST_POWI:
+    case AST_SQRT:
+        h = h * 31 + (uint64_t)node->data.power.exponent;
+        h = h * 31 + (uintptr_t)node->data.power.base;
         break;
     }
 
-    free(node);
+    // Spread the pointer bits into the low bits used to pick a slot
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
 }
 
-// Move to next token if current one matches expected type
-static void eat(Parser_t *parser, TokenType expected) {
-    if (parser->curr_token->type == expected) {
-        token_free(parser->curr_token);
-        parser->curr_token = lexer_next_token(parser->lexer);
-    } else {
-        fprintf(stderr, "Parser Error: Expected token type %s, get %s\n",
-                token_type_to_string(expected),
-                token_type_to_string(parser->curr_token->type));
-        exit(1);
+// Check if two nodes have the same contents, numbers are compared bit for
+// bit so 0 and -0 stay apart, and by their integer value so integers that
+// round to the same double do too
+static int node_equal(const ASTNode_t *a, const ASTNode_t *b) {
+    if (a->type != b->type)
+        return 0;
+
+    switch (a->type) {
+    case AST_NUMBER:
+        return a->exact == b->exact &&
+               a->data.number.integer == b->data.number.integer &&
+               memcmp(&a->data.number.value, &b->data.number.value, sizeof(double)) == 0;
+    case AST_VARIABLE:
+        return a->data.variable.slot == b->data.variable.slot;
+    case AST_BINARY_OP:
+        return a->data.binary_op.op == b->data.binary_op.op &&
+               a->data.binary_op.left == b->data.binary_op.left &&
+               a->data.binary_op.right == b->data.binary_op.right;
+    case AST_UNARY_OP:
+        return a->data.unary_op.op == b->data.unary_op.op &&
+               a->data.unary_op.operand == b->data.unary_op.operand;
+    case AST_POWI:
+    case AST_SQRT:
+        return a->data.power.exponent == b->data.power.exponent &&
+               a->data.power.base == b->data.power.base;
     }
+
+    return 0;
 }
 
-// Create a number node from a give value
-static ASTNode_t *create_number_node(double value) {
-    ASTNode_t *node = malloc(sizeof(ASTNode_t));
-    if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for AST node\n");
-        return NULL;
+// Place a node in the first free slot of its probe sequence
+static void cons_insert(ConsTable_t *cons, ASTNode_t *node) {
+    size_t mask = cons->capacity - 1;
+    size_t i = node_hash(node) & mask;
+
+    while (cons->slots[i])
+        i = (i + 1) & mask;
+    cons->slots[i] = node;
+}
+
+// Double the cons table, the old slot array is left behind in the arena
+static int cons_grow(Parser_t *parser) {
+    ConsTable_t *cons = &parser->cons;
+    int capacity = cons->capacity ? cons->capacity * 2 : 64;
+
+    ASTNode_t **slots = arena_alloc(parser->arena, capacity * sizeof(ASTNode_t *));
+    if (!slots) {
+        fprintf(stderr, "Error: Memory allocation failed for cons table\n");
+        return 0;
     }
+    memset(slots, 0, capacity * sizeof(ASTNode_t *));
 
-    node->type = AST_NUMBER;
-    node->data.number = value;
+    ASTNode_t **old = cons->slots;
+    int old_capacity = cons->capacity;
+    cons->slots = slots;
+    cons->capacity = capacity;
 
-    return node;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i])
+            cons_insert(cons, old[i]);
+    }
+
+    return 1;
 }
 
-// Create a binary operator node (+, -, *, /, ^)
-static ASTNode_t *create_binary_node(TokenType op, ASTNode_t *left, ASTNode_t *right) {
-    ASTNode_t *node = malloc(sizeof(ASTNode_t));
+// Copy a node into the arena. With hash-consing on, an existing node with
+// the same contents is returned instead, so identical subtrees are shared.
+static ASTNode_t *intern_node(Parser_t *parser, const ASTNode_t *proto) {
+    ConsTable_t *cons = &parser->cons;
+
+    if (parser->hash_cons) {
+        if (cons->count * 2 >= cons->capacity && !cons_grow(parser))
+            return NULL;
+
+        size_t mask = cons->capacity - 1;
+        for (size_t i = node_hash(proto) & mask; cons->slots[i]; i = (i + 1) & mask) {
+            if (node_equal(cons->slots[i], proto)) {
+                cons->hits++;
+                return cons->slots[i];
+            }
+        }
+    }
+
+    ASTNode_t *node = arena_alloc(parser->arena, sizeof(ASTNode_t));
     if (!node) {
         fprintf(stderr, "Error: Memory allocation failed for AST node\n");
         return NULL;
     }
 
-    node->type = AST_BINARY_OP;
-    node->data.binary_op.op = op;
-    node->data.binary_op.left = left;
-    node->data.binary_op.right = right;
+    *node = *proto;
+    STATS_COUNT(STATS_NODES, 1);
+
+    if (parser->hash_cons) {
+        cons_insert(cons, node);
+        cons->count++;
+    }
 
     return node;
 }
 
+// Create a number node from a literal's value, integer is its exact value or
+// -1 if it has none
+static ASTNode_t *create_number_node(Parser_t *parser, double value, int64_t integer) {
+    ASTNode_t node;
+    node.type = AST_NUMBER;
+    node.shared = -1;
+    node.exact = integer >= 0;
+    node.data.number.value = value;
+    node.data.number.integer = integer >= 0 ? integer : 0;
+
+    return intern_node(parser, &node);
+}
+
+// Create a binary operator node (+, -, *, /, ^)
+static ASTNode_t *create_binary_node(Parser_t *parser, TokenType op, ASTNode_t *left,
+                                     ASTNode_t *right) {
+    ASTNode_t node;
+    node.type = AST_BINARY_OP;
+    node.shared = -1;
+    node.exact = left->exact && right->exact;
+    node.data.binary_op.op = op;
+    node.data.binary_op.left = left;
+    node.data.binary_op.right = right;
+
+    return intern_node(parser, &node);
+}
+
 // Create a unary operator node (+, -)
-static ASTNode_t *create_unary_node(TokenType op, ASTNode_t *operand) {
-    ASTNode_t *node = malloc(sizeof(ASTNode_t));
-    if (!node) {
-        fprintf(stderr, "Error: Memory allocation failed for AST node\n");
-        return NULL;
-    }
+static ASTNode_t *create_unary_node(Parser_t *parser, TokenType op, ASTNode_t *operand) {
+    ASTNode_t node;
+    node.type = AST_UNARY_OP;
+    node.shared = -1;
+    node.exact = operand->exact;
+    node.data.unary_op.op = op;
+    node.data.unary_op.operand = operand;
+
+    return intern_node(parser, &node);
+}
 
-    node->type = AST_UNARY_OP;
-    node->data.unary_op.op = op;
-    node->data.unary_op.operand = operand;
+// Create a variable node bound to a symbol table slot
+static ASTNode_t *create_variable_node(Parser_t *parser, int slot) {
+    ASTNode_t node;
+    node.type = AST_VARIABLE;
+    node.shared = -1;
+    node.exact = 0;
+    node.data.variable.name = parser->symbols.names[slot];
+    node.data.variable.slot = slot;
 
-    return node;
+    return intern_node(parser, &node);
+}
+
+// Find the slot of a variable name, or -1 if it is not known yet
+static int find_variable(const SymbolTable_t *symbols, const char *name, int length) {
+    for (int i = 0; i < symbols->count; i++) {
+        if (strncmp(symbols->names[i], name, length) == 0 &&
+            symbols->names[i][length] == '\0') {
+            return i;
+        }
+    }
+
+    return -1;
 }
 
-// Parse primary elements (numbers and parans)
-ASTNode_t *parse_primary(Parser_t *parser) {
-    Token_t *token = parser->curr_token;
+// Return the slot of a variable, adding it to the symbol table if needed.
+// Returns -1 on allocation failure.
+int parser_declare_variable(Parser_t *parser, const char *name, int length) {
+    SymbolTable_t *symbols = &parser->symbols;
 
-    if (token->type == TOKEN_NUMBER) {
-        double value = atof(token->value);
-        eat(parser, TOKEN_NUMBER);
-        return create_number_node(value);
+    int slot = find_variable(symbols, name, length);
+    if (slot >= 0)
+        return slot;
+
+    // Grow the name array, the old one is left behind in the arena
+    if (symbols->count == symbols->capacity) {
+        int capacity = symbols->capacity ? symbols->capacity * 2 : 8;
+        const char **names = arena_alloc(parser->arena, capacity * sizeof(const char *));
+        if (!names) {
+            fprintf(stderr, "Error: Memory allocation failed for symbol table\n");
+            return -1;
+        }
+
+        if (symbols->count)
+            memcpy(names, symbols->names, symbols->count * sizeof(const char *));
+        symbols->names = names;
+        symbols->capacity = capacity;
     }
 
-    if (token->type == TOKEN_LPAREN) {
-        eat(parser, TOKEN_LPAREN);
-        ASTNode_t *node = parse_expression(parser);
-        eat(parser, TOKEN_RPAREN);
-        return node;
+    char *copy = arena_alloc(parser->arena, length + 1);
+    if (!copy) {
+        fprintf(stderr, "Error: Memory allocation failed for variable name\n");
+        return -1;
     }
 
-    parser_error(parser, "Expected number or '('");
-    return NULL;
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+
+    symbols->names[symbols->count] = copy;
+    return symbols->count++;
 }
 
-// Parse exponentiation, right associative power
-ASTNode_t *parser_power(Parser_t *parser) {
-    ASTNode_t *left = parse_primary(parser);
+// Parse a number or variable, the operands that are not groups
+static inline ASTNode_t *parse_leaf(Parser_t *parser) {
+    Token_t token = parser->curr_token;
 
-    if (parser->curr_token->type == TOKEN_POWER) {
-        TokenType op = parser->curr_token->type;
-        eat(parser, TOKEN_POWER);
-        ASTNode_t *right = parser_power(parser); // right associative
-        return create_binary_node(op, left, right);
+    if (token.type == TOKEN_NUMBER) {
+        advance(parser);
+        int64_t integer = token.integer ? lexer_token_integer(parser->lexer, &token) : -1;
+        return create_number_node(parser, token.value, integer);
     }
 
-    return left;
+    if (token.type == TOKEN_IDENT) {
+        const char *name = parser->lexer->input + token.offset;
+        int slot = find_variable(&parser->symbols, name, token.length);
+
+        if (slot < 0 && parser->symbols.fixed) {
+            parser_error(parser, "Unknown variable");
+            return NULL;
+        }
+
+        if (slot < 0)
+            slot = parser_declare_variable(parser, name, token.length);
+        if (slot < 0)
+            return NULL;
+
+        advance(parser);
+        return create_variable_node(parser, slot);
+    }
+
+    parser_error(parser, "Expected number, variable or '('");
+    return NULL;
 }
 
-// Parse unary operations (+, -)
-ASTNode_t *parser_factor(Parser_t *parser) {
-    Token_t *token = parser->curr_token;
+// Binding power of every binary operator token, 0 for other tokens. A
+// prefix sign binds tighter than '*' and '/' but looser than '^', so -2^2
+// is -(2^2) while -2*3 is (-2)*3.
+#define PREC_SIGN 3
+#define PREC_POWER 4
 
-    if (token->type == TOKEN_MINUS) {
-        eat(parser, TOKEN_MINUS);
-        ASTNode_t *operand = parser_factor(parser);
-        return create_unary_node(TOKEN_MINUS, operand);
+static const unsigned char binary_precedence[TOKEN_ERROR + 1] = {
+    [TOKEN_PLUS] = 1,   [TOKEN_MINUS] = 1,          [TOKEN_MULTIPLY] = 2,
+    [TOKEN_DIVIDE] = 2, [TOKEN_POWER] = PREC_POWER,
+};
+
+// Double the operand stack. Returns 0 if it could not grow.
+static int grow_operands(ParseStack_t *stack) {
+    int capacity = stack->operand_capacity ? stack->operand_capacity * 2 : 64;
+    ASTNode_t **operands = realloc(stack->operands, capacity * sizeof(ASTNode_t *));
+    if (!operands) {
+        fprintf(stderr, "Error: Memory allocation failed for parser stack\n");
+        return 0;
     }
 
-    if (token->type == TOKEN_PLUS) {
-        eat(parser, TOKEN_PLUS);
-        ASTNode_t *operand = parser_factor(parser);
-        return create_unary_node(TOKEN_PLUS, operand);
+    stack->operands = operands;
+    stack->operand_capacity = capacity;
+    return 1;
+}
+
+// Double the operator stack. Returns 0 if it could not grow.
+static int grow_ops(ParseStack_t *stack) {
+    int capacity = stack->op_capacity ? stack->op_capacity * 2 : 64;
+    PendingOp_t *ops = realloc(stack->ops, capacity * sizeof(PendingOp_t));
+    if (!ops) {
+        fprintf(stderr, "Error: Memory allocation failed for parser stack\n");
+        return 0;
     }
 
-    return parser_power(parser);
+    stack->ops = ops;
+    stack->op_capacity = capacity;
+    return 1;
 }
 
-// Parse multiplication and division, left associative
-ASTNode_t *parse_term(Parser_t *parser) {
-    ASTNode_t *left = parser_factor(parser);
+// Replace the operands of op on top of the operand stack with the node
+// they form. The stack never grows here. Returns 0 on allocation failure.
+static inline int reduce(Parser_t *parser, PendingOp_t op, ASTNode_t **operands,
+                         int *count) {
+    ASTNode_t *node;
 
-    while (parser->curr_token->type == TOKEN_MULTIPLY ||
-           parser->curr_token->type == TOKEN_DIVIDE) {
-        TokenType op = parser->curr_token->type;
-        eat(parser, op);
-        ASTNode_t *right = parser_factor(parser);
-        left = create_binary_node(op, left, right);
+    if (op.unary) {
+        node = create_unary_node(parser, op.op, operands[*count - 1]);
+    } else {
+        (*count)--;
+        node = create_binary_node(parser, op.op, operands[*count - 1], operands[*count]);
     }
 
-    return left;
+    operands[*count - 1] = node;
+    return node != NULL;
 }
 
-// Parse addition and subtraction, left associative
+// Parse a full expression with precedence climbing over explicit stacks,
+// so neither nesting depth nor chains of signs or powers use C stack.
+// Grammar, loosest first:
+//   expression := term (('+' | '-') term)*
+//   term       := factor (('*' | '/') factor)*
+//   factor     := ('+' | '-') factor | power
+//   power      := primary ('^' power)?
+//   primary    := number | variable | '(' expression ')'
+// A sign may not follow '^' directly, as in the grammar above. The stack
+// tops live in locals, node creation writes memory the compiler would
+// otherwise have to assume they alias.
 ASTNode_t *parse_expression(Parser_t *parser) {
-    ASTNode_t *left = parse_term(parser);
+    ParseStack_t *stack = &parser->stack;
+    if ((!stack->operands && !grow_operands(stack)) || (!stack->ops && !grow_ops(stack)))
+        return NULL;
 
-    while (parser->curr_token->type == TOKEN_PLUS ||
-           parser->curr_token->type == TOKEN_MINUS) {
-        TokenType op = parser->curr_token->type;
-        eat(parser, op);
-        ASTNode_t *right = parse_term(parser);
-        left = create_binary_node(op, left, right);
-    }
+    ASTNode_t **operands = stack->operands;
+    PendingOp_t *ops = stack->ops;
+    int operand_count = 0;
+    int op_count = 0;
+    int open_groups = 0;
+    int after_power = 0;
+
+    for (;;) {
+        // Expect an operand: prefix signs and open groups, then a leaf
+        for (;;) {
+            TokenType type = parser->curr_token.type;
+            PendingOp_t op;
+
+            if ((type == TOKEN_MINUS || type == TOKEN_PLUS) && !after_power) {
+                op = (PendingOp_t){type, 1, PREC_SIGN};
+            } else if (type == TOKEN_LPAREN) {
+                op = (PendingOp_t){type, 0, 0};
+                open_groups++;
+                after_power = 0;
+            } else {
+                break;
+            }
+
+            if (op_count == stack->op_capacity) {
+                if (!grow_ops(stack))
+                    return NULL;
+                ops = stack->ops;
+            }
+            ops[op_count++] = op;
+            advance(parser);
+        }
+
+        ASTNode_t *leaf = parse_leaf(parser);
+        if (!leaf)
+            return NULL;
+
+        if (operand_count == stack->operand_capacity) {
+            if (!grow_operands(stack))
+                return NULL;
+            operands = stack->operands;
+        }
+        operands[operand_count++] = leaf;
+
+        // Expect an operator, closing any groups that end here first
+        for (;;) {
+            TokenType type = parser->curr_token.type;
+            int prec = binary_precedence[type];
+
+            if (prec) {
+                // '^' is right associative and only yields to tighter
+                // operators, everything else also to its own level
+                int yield = prec == PREC_POWER ? prec + 1 : prec;
+                while (op_count > 0 && ops[op_count - 1].prec >= yield) {
+                    if (!reduce(parser, ops[--op_count], operands, &operand_count))
+                        return NULL;
+                }
+
+                if (op_count == stack->op_capacity) {
+                    if (!grow_ops(stack))
+                        return NULL;
+                    ops = stack->ops;
+                }
+                ops[op_count++] = (PendingOp_t){type, 0, prec};
+                advance(parser);
+                after_power = type == TOKEN_POWER;
+                break;
+            }
 
-    return left;
+            // Finish the innermost group, or the expression if none is open
+            while (op_count > 0 && ops[op_count - 1].prec > 0) {
+                if (!reduce(parser, ops[--op_count], operands, &operand_count))
+                    return NULL;
+            }
+
+            if (open_groups == 0)
+                return operands[0];
+
+            if (type != TOKEN_RPAREN) {
+                parser_error(parser, "Expected ')'");
+                return NULL;
+            }
+
+            op_count--;
+            open_groups--;
+            advance(parser);
+        }
+    }
 }
 
 // Main parsing function, constructs full AST from input
 ASTNode_t *parser_parse(Parser_t *parser) {
+    uint64_t start = STATS_START();
     ASTNode_t *ast = parse_expression(parser);
 
-    if (parser->curr_token->type != TOKEN_EOF) {
+    if (!parser->error && parser->curr_token.type != TOKEN_EOF) {
         parser_error(parser, "Unexpected token after expression");
-        ast_free(ast);
+    }
+
+    if (parser->error) {
+        // A partial tree is reclaimed with the arena
+        STATS_STOP(STATS_PARSE, start);
         return NULL;
     }
 
+    if (parser->hash_cons)
+        ast_mark_shared(ast);
+
+    STATS_STOP(STATS_PARSE, start);
     return ast;
 }
 
-// Recursively evaluates the AST
-double ast_eval(ASTNode_t *node) {
+// Evaluates an AST without variable bindings
+double ast_eval(ASTNode_t *node) { return ast_eval_vars(node, NULL); }
+
+// Evaluates the AST, vars holds the value of every variable slot.
+// Errors are printed to stderr and the failing operation evaluates to 0.
+double ast_eval_vars(ASTNode_t *node, const double *vars) {
+    const char *error = NULL;
+    double result = ast_eval_checked(node, vars, &error);
+
+    if (error) {
+        fprintf(stderr, "Error: %s\n", error);
+    }
+
+    return result;
+}
+
+// Record the first error met during an evaluation
+static double eval_error(const char **error, const char *msg) {
+    if (!*error)
+        *error = msg;
+    return 0.0;
+}
+
+// Record an unbound variable as the first error. The message names the
+// variable and stays valid until the thread next meets an unbound one.
+static double eval_unbound(const char **error, const ASTNode_t *node) {
+    static __thread char message[96];
+
+    if (!*error) {
+        const char *name = node->data.variable.name;
+        snprintf(message, sizeof(message), "Unbound variable %s", name ? name : "");
+        *error = message;
+    }
+    return 0.0;
+}
+
+// Integer power by repeated squaring. Returns 0 on overflow or a negative
+// exponent.
+static int exact_power(int64_t base, int64_t exponent, int64_t *result) {
+    if (exponent < 0)
+        return 0;
+
+    int64_t value = 1;
+    while (1) {
+        if ((exponent & 1) && __builtin_mul_overflow(value, base, &value))
+            return 0;
+        exponent >>= 1;
+        if (!exponent)
+            break;
+        if (__builtin_mul_overflow(base, base, &base))
+            return 0;
+    }
+
+    *result = value;
+    return 1;
+}
+
+// Apply a binary operator to two integers. Returns 0, leaving the operation
+// to double arithmetic, if the result overflows, is not an integer, needs a
+// division by zero to be reported, or would be -0 in double. INT64_MIN is
+// left to double as well, which holds it exactly, so it can mark a value
+// that is not an integer during evaluation.
+static inline int exact_binary(TokenType op, int64_t left, int64_t right,
+                               int64_t *result) {
+    int ok;
+
+    switch (op) {
+    case TOKEN_PLUS:
+        ok = !__builtin_add_overflow(left, right, result);
+        break;
+    case TOKEN_MINUS:
+        ok = !__builtin_sub_overflow(left, right, result);
+        break;
+    case TOKEN_MULTIPLY:
+        ok = !__builtin_mul_overflow(left, right, result) &&
+             (*result != 0 || (left | right) >= 0);
+        break;
+    case TOKEN_DIVIDE:
+        if (right == 0 || (left == 0 && right < 0) || (left == INT64_MIN && right == -1))
+            return 0;
+        *result = left / right;
+        ok = *result * right == left;
+        break;
+    case TOKEN_POWER:
+        ok = exact_power(left, right, result);
+        break;
+    default:
+        return 0;
+    }
+
+    return ok && *result != INT64_MIN;
+}
+
+int ast_exact_binary(TokenType op, int64_t left, int64_t right, int64_t *result) {
+    return exact_binary(op, left, right, result);
+}
+
+// Negate an integer. Returns 0 if the result would be -0 or the operand is
+// INT64_MIN.
+int ast_exact_negate(int64_t operand, int64_t *result) {
+    if (operand == 0 || operand == INT64_MIN)
+        return 0;
+    *result = -operand;
+    return 1;
+}
+
+// Raise a value to a constant integer power by repeated squaring. x^0 is 1
+// even for NaN like pow, x^2 and x^-1 are rounded once, larger exponents
+// once per multiply, see ast_optimize.
+double ast_powi(double base, int exponent) {
+    unsigned n = exponent < 0 ? -(unsigned)exponent : (unsigned)exponent;
+    double result = 1.0;
+
+    while (n) {
+        if (n & 1)
+            result *= base;
+        n >>= 1;
+        if (n)
+            base *= base;
+    }
+
+    return exponent < 0 ? 1.0 / result : result;
+}
+
+// Square root with the results pow(base, 0.5) gives for -0 and -inf, where
+// sqrt alone would return -0 and NaN
+double ast_sqrt(double base) {
+    if (base == -INFINITY)
+        return INFINITY;
+    return sqrt(base) + 0.0;
+}
+
+// Result of an exact subtree that could not be computed in int64, its double
+// value is passed on separately
+#define INEXACT INT64_MIN
+
+// Value of a subtree, the double value and for an exact subtree its int64
+// value, or INEXACT
+typedef struct {
+    double value;    // value in double
+    int64_t integer; // int64 value of an exact subtree, or INEXACT
+} MemoSlot_t;
+
+// Operator node whose operands are being evaluated
+typedef struct {
+    ASTNode_t *node;
+    MemoSlot_t left;     // value of a binary node's left operand once known
+    int stage;           // operands delivered so far
+    int exact;           // computed in int64 where possible
+    int memo;            // value goes into the memo at node->shared
+} EvalFrame_t;
+
+// Per evaluation state, values of shared subtrees are remembered by index.
+// With results set, every shared node was evaluated apart and is only read.
+// Operator nodes waiting for their operands sit on an explicit stack, so a
+// tree of any depth evaluates without recursing.
+typedef struct {
+    const double *vars;
+    const char **error;
+    const ASTValue_t *results;  // values of shared nodes by index, or NULL
+    MemoSlot_t *memo;           // values by shared index, NULL until one is met
+    unsigned char *done;        // done[i] set once memo[i] holds a value
+    int memo_capacity;          // entries of memo and done
+    EvalFrame_t *frames;        // operator nodes still waiting for operands
+    int depth;                  // frames in use
+    int frame_capacity;         // entries of frames
+    MemoSlot_t memo_inline[EVAL_MEMO_SLOTS];     // memo of small DAGs
+    unsigned char done_inline[EVAL_MEMO_SLOTS];  // done of small DAGs
+    EvalFrame_t frames_inline[EVAL_STACK_SLOTS]; // frames of shallow trees
+} EvalState_t;
+
+// Apply a binary operator in double. Kept out of line, so that a sum or
+// product of two NaNs keeps the left one like the other evaluators, an
+// inlined copy may get its commutative operands swapped.
+static __attribute__((noinline)) double apply_binary(EvalState_t *state, TokenType op,
+                                                     double left_val, double right_val) {
+    switch (op) {
+    case TOKEN_PLUS:
+        return left_val + right_val;
+    case TOKEN_MINUS:
+        return left_val - right_val;
+    case TOKEN_MULTIPLY:
+        return left_val * right_val;
+    case TOKEN_DIVIDE:
+        if (right_val == 0.0) {
+            return eval_error(state->error, "Division by zero");
+        }
+        return left_val / right_val;
+    case TOKEN_POWER:
+        return pow(left_val, right_val);
+    default:
+        return eval_error(state->error, "Unknown binary operator");
+    }
+}
+
+// Apply a unary operator in double
+static double apply_unary(EvalState_t *state, TokenType op, double operand_val) {
+    switch (op) {
+    case TOKEN_MINUS:
+        return -operand_val;
+    case TOKEN_PLUS:
+        return operand_val;
+    default:
+        return eval_error(state->error, "Unknown unary operator");
+    }
+}
+
+// Read the value of a shared node computed apart, its first error counts
+// as met at this point of the evaluation
+static MemoSlot_t read_result(EvalState_t *state, int index) {
+    const ASTValue_t *result = &state->results[index];
+    if (result->error)
+        eval_error(state->error, result->error);
+    return (MemoSlot_t){result->value, result->integer};
+}
+
+// Make room in the memo for a shared index. The first EVAL_MEMO_SLOTS
+// entries live in the state, more are allocated doubling. Returns 0 if the
+// memo could not grow, the node is then evaluated without being remembered.
+static int memo_reserve(EvalState_t *state, int index) {
+    if (index < state->memo_capacity)
+        return 1;
+
+    if (!state->memo) {
+        state->memo = state->memo_inline;
+        state->done = state->done_inline;
+        state->memo_capacity = EVAL_MEMO_SLOTS;
+        memset(state->done_inline, 0, sizeof(state->done_inline));
+        if (index < EVAL_MEMO_SLOTS)
+            return 1;
+    }
+
+    int capacity = state->memo_capacity * 2;
+    while (capacity <= index)
+        capacity *= 2;
+
+    MemoSlot_t *memo = malloc(capacity * sizeof(MemoSlot_t));
+    unsigned char *done = calloc(capacity, 1);
+    if (!memo || !done) {
+        free(memo);
+        free(done);
+        return 0;
+    }
+
+    memcpy(memo, state->memo, state->memo_capacity * sizeof(MemoSlot_t));
+    memcpy(done, state->done, state->memo_capacity);
+    if (state->memo != state->memo_inline) {
+        free(state->memo);
+        free(state->done);
+    }
+
+    state->memo = memo;
+    state->done = done;
+    state->memo_capacity = capacity;
+    return 1;
+}
+
+// Make room for one more frame. The first EVAL_STACK_SLOTS live in the
+// state, deeper trees get a stack allocated doubling. Returns 0 if the
+// stack could not grow.
+static int frames_reserve(EvalState_t *state) {
+    if (state->depth < state->frame_capacity)
+        return 1;
+
+    int capacity = state->frame_capacity * 2;
+    EvalFrame_t *frames = malloc(capacity * sizeof(EvalFrame_t));
+    if (!frames) {
+        fprintf(stderr, "Error: Memory allocation failed for evaluation stack\n");
+        return 0;
+    }
+
+    memcpy(frames, state->frames, state->depth * sizeof(EvalFrame_t));
+    if (state->frames != state->frames_inline)
+        free(state->frames);
+
+    state->frames = frames;
+    state->frame_capacity = capacity;
+    return 1;
+}
+
+// Set up the memo and frame stack of an evaluation
+static void eval_state_init(EvalState_t *state, const double *vars, const char **error,
+                            const ASTValue_t *results) {
+    state->vars = vars;
+    state->error = error;
+    state->results = results;
+    state->memo = NULL;
+    state->memo_capacity = 0;
+    state->frames = state->frames_inline;
+    state->depth = 0;
+    state->frame_capacity = EVAL_STACK_SLOTS;
+}
+
+// Release a memo or frame stack that outgrew the state
+static void eval_state_free(EvalState_t *state) {
+    if (state->memo && state->memo != state->memo_inline) {
+        free(state->memo);
+        free(state->done);
+    }
+    if (state->frames != state->frames_inline)
+        free(state->frames);
+}
+
+// Start evaluating a node. A leaf, or a shared node already known, has its
+// value stored in *value and 1 is returned. An operator node is pushed as a
+// frame waiting for its operands and 0 is returned. exact is set when an
+// exact parent asks for the node's int64 value, a shared node is computed
+// by its own exact flag so that exact and double parents can both read it.
+static __attribute__((noinline)) int eval_enter_node(EvalState_t *state, ASTNode_t *node,
+                                                     int exact, int lookup,
+                                                     MemoSlot_t *value) {
     if (!node) {
-        fprintf(stderr, "Error: NULL AST node\n");
-        return 0.0;
+        *value = (MemoSlot_t){eval_error(state->error, "NULL AST node"), INEXACT};
+        return 1;
+    }
+
+    int memo = 0;
+    if (lookup && node->shared >= 0) {
+        int index = node->shared;
+        if (state->results) {
+            *value = read_result(state, index);
+            return 1;
+        }
+        if (memo_reserve(state, index)) {
+            if (state->done[index]) {
+                *value = state->memo[index];
+                return 1;
+            }
+            memo = 1;
+        }
+        exact = 0;
     }
 
     switch (node->type) {
     case AST_NUMBER:
-        return node->data.number;
-
-    case AST_BINARY_OP: {
-        double left_val = ast_eval(node->data.binary_op.left);
-        double right_val = ast_eval(node->data.binary_op.right);
-
-        switch (node->data.binary_op.op) {
-        case TOKEN_PLUS:
-            return left_val + right_val;
-        case TOKEN_MINUS:
-            return left_val - right_val;
-        case TOKEN_MULTIPLY:
-            return left_val * right_val;
-        case TOKEN_DIVIDE:
-            if (right_val == 0.0) {
-                fprintf(stderr, "Error: Division by zero\n");
-                return 0.0;
-            }
-            return left_val / right_val;
-        case TOKEN_POWER:
-            return pow(left_val, right_val);
-        default:
-            fprintf(stderr, "Error: Unknown binary operator\n");
-            return 0.0;
+        *value = (MemoSlot_t){node->data.number.value,
+                              node->exact ? node->data.number.integer : INEXACT};
+        return 1;
+
+    case AST_VARIABLE:
+        if (!state->vars) {
+            *value = (MemoSlot_t){eval_unbound(state->error, node), INEXACT};
+            return 1;
         }
+        *value = (MemoSlot_t){state->vars[node->data.variable.slot], INEXACT};
+        return 1;
+
+    case AST_BINARY_OP:
+    case AST_UNARY_OP:
+        exact |= node->exact;
+        break;
+
+    case AST_POWI:
+    case AST_SQRT:
+        exact = 0;
+        break;
+
+    default:
+        *value = (MemoSlot_t){eval_error(state->error, "Unknown AST node type"), INEXACT};
+        return 1;
+    }
+
+    if (!frames_reserve(state)) {
+        *value = (MemoSlot_t){eval_error(state->error, "Out of memory"), INEXACT};
+        return 1;
+    }
+
+    EvalFrame_t *frame = &state->frames[state->depth++];
+    frame->node = node;
+    frame->stage = 0;
+    frame->exact = exact;
+    frame->memo = memo;
+    return 0;
+}
+
+// Compute a binary node from the values of its operands. An exact node is
+// computed in int64 and only falls back to double, with INEXACT as its
+// integer, once some operation could not be done exactly.
+static inline MemoSlot_t eval_binary(EvalState_t *state, ASTNode_t *node, int exact,
+                                     MemoSlot_t left, MemoSlot_t right) {
+    TokenType op = node->data.binary_op.op;
+    if (exact) {
+        int64_t result;
+        if (left.integer != INEXACT && right.integer != INEXACT &&
+            exact_binary(op, left.integer, right.integer, &result))
+            return (MemoSlot_t){(double)result, result};
+
+        left.value = left.integer != INEXACT ? (double)left.integer : left.value;
+        right.value = right.integer != INEXACT ? (double)right.integer : right.value;
     }
 
+    return (MemoSlot_t){apply_binary(state, op, left.value, right.value), INEXACT};
+}
+
+// Compute a unary, AST_POWI or AST_SQRT node from the value of its operand
+static inline MemoSlot_t eval_single(EvalState_t *state, ASTNode_t *node, int exact,
+                                     MemoSlot_t operand) {
+    MemoSlot_t value = {0.0, INEXACT};
+
+    switch (node->type) {
     case AST_UNARY_OP: {
-        double operand_val = ast_eval(node->data.unary_op.operand);
-
-        switch (node->data.unary_op.op) {
-        case TOKEN_MINUS:
-            return -operand_val;
-        case TOKEN_PLUS:
-            return operand_val;
-        default:
-            fprintf(stderr, "Error: Unknown unary operator\n");
-            return 0.0;
+        TokenType op = node->data.unary_op.op;
+        if (exact && operand.integer != INEXACT) {
+            int64_t result = operand.integer;
+            if (op == TOKEN_PLUS ||
+                (op == TOKEN_MINUS && ast_exact_negate(result, &result)))
+                return (MemoSlot_t){(double)result, result};
+            operand.value = (double)operand.integer;
         }
+        value.value = apply_unary(state, op, operand.value);
+        break;
     }
 
+    case AST_POWI:
+        value.value = ast_powi(operand.value, node->data.power.exponent);
+        break;
+
+    case AST_SQRT:
+        value.value = ast_sqrt(operand.value);
+        break;
+
     default:
-        fprintf(stderr, "Error: Unknown AST node type\n");
-        return 0.0;
+        break;
     }
+
+    return value;
+}
+
+// Value of a literal, or of a variable when vars are bound, read in place.
+// Leaves are never shared. Returns 0 for any other node, which needs
+// eval_enter.
+static inline int eval_leaf(EvalState_t *state, ASTNode_t *node, MemoSlot_t *value) {
+    if (node && node->type == AST_NUMBER) {
+        value->value = node->data.number.value;
+        value->integer = node->exact ? node->data.number.integer : INEXACT;
+        return 1;
+    }
+    if (node && node->type == AST_VARIABLE && state->vars) {
+        value->value = state->vars[node->data.variable.slot];
+        value->integer = INEXACT;
+        return 1;
+    }
+    return 0;
+}
+
+// Evaluate the tree at root in post-order on the state's frame stack. The
+// walk goes down first operands until one is known, then up the frames
+// until a binary node still needs its right operand, which it keeps its
+// left value for. Operator nodes that are not shared are pushed in place,
+// eval_enter_node handles the rest. With lookup clear, root itself is
+// computed even if shared.
+static MemoSlot_t eval_walk(EvalState_t *state, ASTNode_t *root, int lookup) {
+    EvalFrame_t *frames = state->frames;
+    int depth = 0;
+    MemoSlot_t value;
+    ASTNode_t *node = root;
+    int exact = 0;
+
+    while (1) {
+        while (!eval_leaf(state, node, &value)) {
+            if (node && (node->type == AST_BINARY_OP || node->type == AST_UNARY_OP) &&
+                (!lookup || node->shared < 0) && depth < state->frame_capacity) {
+                EvalFrame_t *frame = &frames[depth++];
+                frame->node = node;
+                frame->stage = 0;
+                frame->exact = exact | node->exact;
+                frame->memo = 0;
+            } else {
+                MemoSlot_t known;
+                state->depth = depth;
+                int ready = eval_enter_node(state, node, exact, lookup, &known);
+                frames = state->frames;
+                depth = state->depth;
+                if (ready) {
+                    value = known;
+                    break;
+                }
+            }
+
+            EvalFrame_t *frame = &frames[depth - 1];
+            ASTNode_t *parent = frame->node;
+            node = parent->type == AST_BINARY_OP  ? parent->data.binary_op.left
+                   : parent->type == AST_UNARY_OP ? parent->data.unary_op.operand
+                                                  : parent->data.power.base;
+            exact = frame->exact;
+            lookup = 1;
+        }
+        lookup = 1;
+
+        while (1) {
+            if (depth == 0)
+                return value;
+
+            EvalFrame_t *frame = &frames[depth - 1];
+            ASTNode_t *parent = frame->node;
+            if (parent->type != AST_BINARY_OP) {
+                value = eval_single(state, parent, frame->exact, value);
+            } else if (frame->stage) {
+                value = eval_binary(state, parent, frame->exact, frame->left, value);
+            } else {
+                // A right operand that is a leaf completes its node at once
+                MemoSlot_t left = value;
+                node = parent->data.binary_op.right;
+                if (!eval_leaf(state, node, &value)) {
+                    frame->left = left;
+                    frame->stage = 1;
+                    exact = frame->exact;
+                    break;
+                }
+                value = eval_binary(state, parent, frame->exact, left, value);
+            }
+
+            if (frame->memo) {
+                state->memo[parent->shared] = value;
+                state->done[parent->shared] = 1;
+            }
+            depth--;
+        }
+    }
+}
+
+// Evaluates the AST without printing anything or recursing. The first error
+// is stored in *error, which the caller initializes to NULL, and the
+// failing operation evaluates to 0 so the result matches ast_eval_vars.
+double ast_eval_checked(ASTNode_t *node, const double *vars, const char **error) {
+    ASTValue_t value = ast_eval_value(node, vars);
+    if (value.error && !*error)
+        *error = value.error;
+
+    return value.value;
+}
+
+// Same as ast_eval_checked, the value comes with its int64 form if the root
+// is exact, which keeps every digit above 2^53, and with the first error
+ASTValue_t ast_eval_value(ASTNode_t *node, const double *vars) {
+    ASTValue_t value = {0.0, INEXACT, NULL};
+
+    EvalState_t state;
+    eval_state_init(&state, vars, &value.error, NULL);
+
+    uint64_t start = STATS_START();
+    MemoSlot_t result = eval_walk(&state, node, 1);
+    STATS_STOP(STATS_EVAL, start);
+    eval_state_free(&state);
+
+    value.value = result.value;
+    value.integer = result.integer;
+    return value;
+}
+
+// Evaluate the subtree at root, whose shared nodes below it have all been
+// evaluated already into results by their index. The value comes with its
+// int64 form for an exact root and the first error met, so the parent can
+// carry on as if it had evaluated root itself.
+ASTValue_t ast_eval_task(ASTNode_t *root, const double *vars, const ASTValue_t *results) {
+    ASTValue_t value = {0.0, INEXACT, NULL};
+
+    EvalState_t state;
+    eval_state_init(&state, vars, &value.error, results);
+    MemoSlot_t result = eval_walk(&state, root, 0);
+    eval_state_free(&state);
+
+    value.value = result.value;
+    value.integer = result.integer;
+    return value;
 }
 
 // Print AST tree for debugging
@@ -269,29 +1085,176 @@ void ast_print(ASTNode_t *node, int indent) {
 
     switch (node->type) {
     case AST_NUMBER:
-        printf("NUMBER: %.6f\n", node->data.number);
+        printf("NUMBER: %.6f\n", node->data.number.value);
+        break;
+
+    case AST_VARIABLE:
+        printf("VARIABLE: %s (slot %d)\n", node->data.variable.name,
+               node->data.variable.slot);
         break;
 
     case AST_BINARY_OP:
-        printf("BINARY_OP: %s\n", token_type_to_string(node->data.binary_op.op));
+        printf("BINARY_OP: %s", token_type_to_string(node->data.binary_op.op));
+        if (node->shared >= 0)
+            printf(" (shared #%d)", node->shared);
+        printf("\n");
         ast_print(node->data.binary_op.left, indent + 1);
         ast_print(node->data.binary_op.right, indent + 1);
         break;
 
     case AST_UNARY_OP:
-        printf("UNARY_OP: %s\n", token_type_to_string(node->data.unary_op.op));
+        printf("UNARY_OP: %s", token_type_to_string(node->data.unary_op.op));
+        if (node->shared >= 0)
+            printf(" (shared #%d)", node->shared);
+        printf("\n");
         ast_print(node->data.unary_op.operand, indent + 1);
         break;
+
+    case AST_POWI:
+    case AST_SQRT:
+        if (node->type == AST_POWI)
+            printf("POWI: %d", node->data.power.exponent);
+        else
+            printf("SQRT");
+        if (node->shared >= 0)
+            printf(" (shared #%d)", node->shared);
+        printf("\n");
+        ast_print(node->data.power.base, indent + 1);
+        break;
+    }
+}
+
+// Address of operand i of a node in evaluation order, or NULL past the last,
+// so walks can visit and replace operands of any node type alike
+ASTNode_t **ast_operand(ASTNode_t *node, int i) {
+    switch (node->type) {
+    case AST_BINARY_OP:
+        return i == 0   ? &node->data.binary_op.left
+               : i == 1 ? &node->data.binary_op.right
+                        : NULL;
+    case AST_UNARY_OP:
+        return i == 0 ? &node->data.unary_op.operand : NULL;
+    case AST_POWI:
+    case AST_SQRT:
+        return i == 0 ? &node->data.power.base : NULL;
+    default:
+        return NULL;
+    }
+}
+
+// Push a node none of whose operands were visited yet. Returns 0 if the
+// stack could not grow.
+int ast_walk_push(WalkStack_t *stack, ASTNode_t *node) {
+    if (stack->depth == stack->capacity) {
+        int capacity = stack->capacity ? stack->capacity * 2 : 64;
+        WalkFrame_t *frames = realloc(stack->frames, capacity * sizeof(WalkFrame_t));
+        if (!frames) {
+            fprintf(stderr, "Error: Memory allocation failed for tree walk\n");
+            return 0;
+        }
+        stack->frames = frames;
+        stack->capacity = capacity;
+    }
+
+    stack->frames[stack->depth++] = (WalkFrame_t){node, 0};
+    return 1;
+}
+
+// Push every operand of a node. Returns 0 if the stack could not grow.
+static int walk_push_operands(WalkStack_t *stack, ASTNode_t *node) {
+    ASTNode_t **operand;
+    for (int i = 0; (operand = ast_operand(node, i)) != NULL; i++) {
+        if (*operand && !ast_walk_push(stack, *operand))
+            return 0;
+    }
+    return 1;
+}
+
+// Count the nodes reachable from an AST root, shared subtrees once per parent
+int ast_count_nodes(ASTNode_t *node) {
+    WalkStack_t stack = {0};
+    int count = 0;
+
+    int ok = node && ast_walk_push(&stack, node);
+    while (ok && stack.depth > 0) {
+        node = stack.frames[--stack.depth].node;
+        count++;
+        ok = walk_push_operands(&stack, node);
     }
+
+    free(stack.frames);
+    return count;
+}
+
+// Give every operator node reachable through more than one parent an index,
+// so evaluators can compute it once and reuse the value. Must be run again
+// after the DAG is rewritten. Returns the number of distinct nodes.
+int ast_mark_shared(ASTNode_t *root) {
+    WalkStack_t stack = {0};
+    int distinct = 0;
+    int next = 0;
+
+    // First pass, clears the parent count of every node
+    int ok = root && ast_walk_push(&stack, root);
+    while (ok && stack.depth > 0) {
+        ASTNode_t *node = stack.frames[--stack.depth].node;
+        node->shared = 0;
+        ok = walk_push_operands(&stack, node);
+    }
+
+    // Second pass, counts parents as negative numbers and distinct nodes.
+    // Operands of a node are only counted on its first visit.
+    ok = ok && ast_walk_push(&stack, root);
+    while (ok && stack.depth > 0) {
+        ASTNode_t *node = stack.frames[--stack.depth].node;
+        if (node->shared-- < 0)
+            continue;
+        distinct++;
+        ok = walk_push_operands(&stack, node);
+    }
+
+    // Third pass, numbers operator nodes with more than one parent in
+    // post-order. Leaves are cheaper to reload than to remember.
+    ok = ok && ast_walk_push(&stack, root);
+    while (ok && stack.depth > 0) {
+        WalkFrame_t *frame = &stack.frames[stack.depth - 1];
+        ASTNode_t **operand = ast_operand(frame->node, frame->next++);
+        if (operand) {
+            if (*operand && (*operand)->shared < 0)
+                ok = ast_walk_push(&stack, *operand);
+            continue;
+        }
+
+        ASTNode_t *node = frame->node;
+        stack.depth--;
+        if (node->type == AST_NUMBER || node->type == AST_VARIABLE)
+            node->shared = -1;
+        else
+            node->shared = node->shared < -1 ? next++ : -1;
+    }
+
+    free(stack.frames);
+    return distinct;
 }
 
 // Print a parser error message
 void parser_error(Parser_t *parser, const char *msg) {
+    // Only the first error is kept, later ones are usually follow-on noise
+    if (parser->error)
+        return;
+
+    parser->error = msg;
+    parser->error_pos = parser->curr_token.offset;
+
+    if (parser->silent)
+        return;
+
     fprintf(stderr, "Parser Error: %s... Current token: %s", msg,
-            token_type_to_string(parser->curr_token->type));
+            token_type_to_string(parser->curr_token.type));
 
-    if (parser->curr_token->value) {
-        fprintf(stderr, "(%s)", parser->curr_token->value);
+    if (parser->curr_token.length > 0) {
+        fprintf(stderr, "(%.*s)", parser->curr_token.length,
+                parser->lexer->input + parser->curr_token.offset);
     }
 
     fprintf(stderr, "\n");
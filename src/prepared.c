@@ -0,0 +1,100 @@
+#include "../include/prepared.h"
+#include "../include/lexer.h"
+#include "../include/optimizer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Parse, optimize and compile an expression. If names is given, slot i is
+// names[i] and any other variable is an error, otherwise slots are assigned
+// in order of first appearance.
+PreparedExpr_t *expr_prepare(const char *input, const char *const *names,
+                             int name_count) {
+    return expr_prepare_opt(input, names, name_count, OPT_ALL);
+}
+
+// Same as expr_prepare with a choice of optimizer passes, for instance
+// OPT_ALL | OPT_FAST_POWERS
+PreparedExpr_t *expr_prepare_opt(const char *input, const char *const *names,
+                                 int name_count, int optimizer_flags) {
+    PreparedExpr_t *expr = malloc(sizeof(PreparedExpr_t));
+    if (!expr) {
+        fprintf(stderr, "Error: Memory allocation failed for prepared expression\n");
+        return NULL;
+    }
+
+    memset(expr, 0, sizeof(PreparedExpr_t));
+
+    Lexer_t *lexer = lexer_init(input);
+    expr->arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    Parser_t *parser = (lexer && expr->arena) ? parser_init(lexer, expr->arena) : NULL;
+
+    if (parser) {
+        for (int i = 0; i < name_count; i++) {
+            parser_declare_variable(parser, names[i], strlen(names[i]));
+        }
+        parser->symbols.fixed = names != NULL;
+
+        // Prepared expressions run many times, so a repeated subterm is
+        // worth sharing and computing once per execution
+        parser->hash_cons = 1;
+
+        expr->ast = parser_parse(parser);
+        expr->var_names = parser->symbols.names;
+        expr->var_count = parser->symbols.count;
+    }
+
+    parser_free(parser);
+    lexer_free(lexer);
+
+    if (!expr->ast) {
+        expr_free(expr);
+        return NULL;
+    }
+
+    expr->ast = ast_optimize(expr->ast, optimizer_flags, NULL);
+    expr->bc = bytecode_compile(expr->ast);
+    if (!expr->bc) {
+        expr_free(expr);
+        return NULL;
+    }
+
+    return expr;
+}
+
+// Clean up a prepared expression and everything it owns
+void expr_free(PreparedExpr_t *expr) {
+    if (expr) {
+        bytecode_free(expr->bc);
+        jit_free(expr->jit);
+        arena_free(expr->arena);
+        free(expr);
+    }
+}
+
+// Compile the expression to native code for expr_execute. Returns 0 and
+// keeps using the bytecode VM when the JIT is not available.
+int expr_enable_jit(PreparedExpr_t *expr) {
+    if (!expr->jit)
+        expr->jit = jit_compile(expr->ast);
+
+    return expr->jit != NULL;
+}
+
+// Find the slot a variable must be stored at, or -1 if it is not used
+int expr_var_slot(const PreparedExpr_t *expr, const char *name) {
+    for (int i = 0; i < expr->var_count; i++) {
+        if (strcmp(expr->var_names[i], name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+// Evaluate with values[i] bound to slot i, never touches the lexer or parser
+double expr_execute(const PreparedExpr_t *expr, const double *values) {
+    if (expr->jit)
+        return expr->jit->fn(values);
+
+    return bytecode_eval(expr->bc, values);
+}
@@ -0,0 +1,426 @@
+#include "../include/sheet.h"
+#include "../include/optimizer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Create an empty sheet. Returns -1 if an allocation fails.
+int sheet_init(Sheet_t *sheet, int optimizer_flags) {
+    memset(sheet, 0, sizeof(Sheet_t));
+    sheet->optimizer_flags = optimizer_flags;
+
+    sheet->lexer = lexer_init("");
+    sheet->spare = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+    sheet->parser = sheet->lexer ? parser_init(sheet->lexer, sheet->spare) : NULL;
+
+    if (!sheet->lexer || !sheet->spare || !sheet->parser) {
+        fprintf(stderr, "Error: Failed to initialize sheet\n");
+        sheet_free(sheet);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Release every cell and the sheet's own state
+void sheet_free(Sheet_t *sheet) {
+    for (int i = 0; i < sheet->count; i++) {
+        Cell_t *cell = &sheet->cells[i];
+        free(cell->name);
+        arena_free(cell->arena);
+        free(cell->deps);
+        free(cell->users);
+    }
+
+    free(sheet->cells);
+    free(sheet->names);
+    free(sheet->values);
+    free(sheet->order);
+    parser_free(sheet->parser);
+    lexer_free(sheet->lexer);
+    arena_free(sheet->spare);
+    memset(sheet, 0, sizeof(Sheet_t));
+}
+
+// Whether a character may start or continue an identifier
+static int ident_start(char c) { return c == '_' || (unsigned)((c | 0x20) - 'a') < 26u; }
+static int ident_char(char c) { return ident_start(c) || (unsigned)(c - '0') < 10u; }
+
+// Recognize "name = expr". Returns the start of the name and stores its
+// length and the expression text, or returns NULL for a plain expression.
+const char *sheet_split_assignment(const char *line, int *name_length,
+                                   const char **expr) {
+    const char *p = line;
+    while (*p == ' ' || *p == '\t')
+        p++;
+
+    if (!ident_start(*p))
+        return NULL;
+
+    const char *name = p;
+    while (ident_char(*p))
+        p++;
+
+    int length = (int)(p - name);
+    while (*p == ' ' || *p == '\t')
+        p++;
+
+    if (*p != '=')
+        return NULL;
+
+    *name_length = length;
+    *expr = p + 1;
+    return name;
+}
+
+// Slot of a cell, -1 if no cell has that name
+int sheet_find(const Sheet_t *sheet, const char *name, int length) {
+    for (int i = 0; i < sheet->count; i++) {
+        if (strncmp(sheet->names[i], name, length) == 0 &&
+            sheet->names[i][length] == '\0')
+            return i;
+    }
+    return -1;
+}
+
+// Let a parser read cells, names that are not cells are rejected
+void sheet_bind(const Sheet_t *sheet, Parser_t *parser) {
+    parser->symbols.names = sheet->names;
+    parser->symbols.count = sheet->count;
+    parser->symbols.capacity = sheet->count;
+    parser->symbols.fixed = 1;
+}
+
+// Make room for one more cell. Returns -1 if an allocation fails.
+static int sheet_grow(Sheet_t *sheet) {
+    if (sheet->count < sheet->capacity)
+        return 0;
+
+    int capacity = sheet->capacity ? sheet->capacity * 2 : 16;
+
+    Cell_t *cells = realloc(sheet->cells, capacity * sizeof(Cell_t));
+    if (cells)
+        sheet->cells = cells;
+    const char **names = realloc(sheet->names, capacity * sizeof(const char *));
+    if (names)
+        sheet->names = names;
+    double *values = realloc(sheet->values, capacity * sizeof(double));
+    if (values)
+        sheet->values = values;
+    int *order = realloc(sheet->order, capacity * sizeof(int));
+    if (order)
+        sheet->order = order;
+
+    if (!cells || !names || !values || !order) {
+        fprintf(stderr, "Error: Memory allocation failed for sheet\n");
+        return -1;
+    }
+
+    sheet->capacity = capacity;
+    return 0;
+}
+
+// Append the slot of every variable in a tree to deps, once per cell
+static void collect_deps(Sheet_t *sheet, ASTNode_t *node, int *deps, int *count) {
+    switch (node->type) {
+    case AST_BINARY_OP:
+        collect_deps(sheet, node->data.binary_op.left, deps, count);
+        collect_deps(sheet, node->data.binary_op.right, deps, count);
+        break;
+    case AST_UNARY_OP:
+        collect_deps(sheet, node->data.unary_op.operand, deps, count);
+        break;
+    case AST_POWI:
+    case AST_SQRT:
+        collect_deps(sheet, node->data.power.base, deps, count);
+        break;
+    case AST_VARIABLE: {
+        Cell_t *dep = &sheet->cells[node->data.variable.slot];
+        if (dep->stamp != sheet->stamp) {
+            dep->stamp = sheet->stamp;
+            deps[(*count)++] = node->data.variable.slot;
+        }
+        break;
+    }
+    case AST_NUMBER:
+        break;
+    }
+}
+
+// Whether target is among deps or anything they read, in which case making
+// target read deps would close a cycle
+static int reaches(Sheet_t *sheet, const int *deps, int dep_count, int target) {
+    int *stack = sheet->order;
+    int top = 0;
+
+    sheet->stamp++;
+    for (int i = 0; i < dep_count; i++) {
+        sheet->cells[deps[i]].stamp = sheet->stamp;
+        stack[top++] = deps[i];
+    }
+
+    while (top > 0) {
+        int slot = stack[--top];
+        if (slot == target)
+            return 1;
+
+        Cell_t *cell = &sheet->cells[slot];
+        for (int i = 0; i < cell->dep_count; i++) {
+            Cell_t *dep = &sheet->cells[cell->deps[i]];
+            if (dep->stamp != sheet->stamp) {
+                dep->stamp = sheet->stamp;
+                stack[top++] = cell->deps[i];
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Remove slot from the users of every cell it reads
+static void detach(Sheet_t *sheet, int slot) {
+    Cell_t *cell = &sheet->cells[slot];
+
+    for (int i = 0; i < cell->dep_count; i++) {
+        Cell_t *dep = &sheet->cells[cell->deps[i]];
+        for (int j = 0; j < dep->user_count; j++) {
+            if (dep->users[j] == slot) {
+                dep->users[j] = dep->users[--dep->user_count];
+                break;
+            }
+        }
+    }
+}
+
+// Add slot to the users of every cell it reads. Returns -1 if an
+// allocation fails.
+static int attach(Sheet_t *sheet, int slot) {
+    Cell_t *cell = &sheet->cells[slot];
+
+    for (int i = 0; i < cell->dep_count; i++) {
+        Cell_t *dep = &sheet->cells[cell->deps[i]];
+        if (dep->user_count == dep->user_capacity) {
+            int capacity = dep->user_capacity ? dep->user_capacity * 2 : 4;
+            int *users = realloc(dep->users, capacity * sizeof(int));
+            if (!users) {
+                fprintf(stderr, "Error: Memory allocation failed for sheet\n");
+                return -1;
+            }
+            dep->users = users;
+            dep->user_capacity = capacity;
+        }
+        dep->users[dep->user_count++] = slot;
+    }
+
+    return 0;
+}
+
+// Evaluate a cell from the current values of the cells it reads. An error
+// in one of them becomes the cell's error. Returns 1 if the value changed.
+static int recompute(Sheet_t *sheet, int slot) {
+    Cell_t *cell = &sheet->cells[slot];
+    const char *error = NULL;
+    double value = 0.0;
+
+    for (int i = 0; i < cell->dep_count && !error; i++)
+        error = sheet->cells[cell->deps[i]].error;
+
+    if (!error)
+        value = ast_eval_checked(cell->ast, sheet->values, &error);
+
+    int changed =
+        error != cell->error || memcmp(&value, &sheet->values[slot], sizeof(double));
+    cell->error = error;
+    sheet->values[slot] = value;
+    return changed;
+}
+
+// Bring the sheet up to date after root was (re)defined. Only cells reading
+// root, directly or through others, can change, they are evaluated in
+// dependency order and a cell none of whose inputs changed keeps its value.
+static void sheet_update(Sheet_t *sheet, int root) {
+    int *order = sheet->order;
+    int count = 1;
+
+    // Find the affected cells and count how many of its inputs each waits for
+    sheet->stamp++;
+    sheet->cells[root].stamp = sheet->stamp;
+    sheet->cells[root].pending = 0;
+    order[0] = root;
+
+    for (int i = 0; i < count; i++) {
+        Cell_t *cell = &sheet->cells[order[i]];
+        for (int j = 0; j < cell->user_count; j++) {
+            Cell_t *user = &sheet->cells[cell->users[j]];
+            if (user->stamp != sheet->stamp) {
+                user->stamp = sheet->stamp;
+                user->pending = 0;
+                order[count++] = cell->users[j];
+            }
+            user->pending++;
+        }
+    }
+
+    // Run them in topological order, reusing order as the queue of cells
+    // whose inputs are all final
+    size_t recomputed = 0;
+    int tail = 1;
+
+    for (int head = 0; head < tail; head++) {
+        int slot = order[head];
+        Cell_t *cell = &sheet->cells[slot];
+
+        int stale = slot == root;
+        for (int i = 0; i < cell->dep_count && !stale; i++) {
+            Cell_t *dep = &sheet->cells[cell->deps[i]];
+            stale = dep->stamp == sheet->stamp && dep->changed;
+        }
+
+        cell->changed = 0;
+        if (stale) {
+            cell->changed = recompute(sheet, slot);
+            recomputed++;
+        }
+
+        for (int j = 0; j < cell->user_count; j++) {
+            Cell_t *user = &sheet->cells[cell->users[j]];
+            if (--user->pending == 0)
+                order[tail++] = cell->users[j];
+        }
+    }
+
+    sheet->affected = tail;
+    sheet->last.recomputed = recomputed;
+    sheet->last.reused = sheet->count - recomputed;
+    sheet->total.recomputed += sheet->last.recomputed;
+    sheet->total.reused += sheet->last.reused;
+}
+
+// Define a new cell or replace the expression of an existing one, then
+// update every cell that reads it. A definition that fails to parse or
+// would make a cell read itself leaves the sheet unchanged. Returns the
+// cell's slot, or -1 after printing an error.
+int sheet_define(Sheet_t *sheet, const char *name, int name_length, const char *expr) {
+    Parser_t *parser = sheet->parser;
+    int slot = sheet_find(sheet, name, name_length);
+
+    // A new cell needs its slot before any tree can be kept
+    if (slot < 0 && sheet_grow(sheet) != 0)
+        return -1;
+
+    arena_reset(sheet->spare);
+    lexer_reset(sheet->lexer, expr, (int)strlen(expr));
+    parser->arena = sheet->spare;
+    parser_reset(parser);
+
+    if (parser->curr_token.type == TOKEN_EOF) {
+        fprintf(stderr, "Error: Empty definition of %.*s\n", name_length, name);
+        return -1;
+    }
+
+    sheet_bind(sheet, parser);
+    ASTNode_t *ast = parser_parse(parser);
+    if (!ast)
+        return -1;
+    ast = ast_optimize(ast, sheet->optimizer_flags, NULL);
+
+    int *deps = malloc((sheet->count + 1) * sizeof(int));
+    if (!deps) {
+        fprintf(stderr, "Error: Memory allocation failed for sheet\n");
+        return -1;
+    }
+
+    int dep_count = 0;
+    sheet->stamp++;
+    collect_deps(sheet, ast, deps, &dep_count);
+
+    if (slot >= 0 && reaches(sheet, deps, dep_count, slot)) {
+        fprintf(stderr, "Error: Circular reference to %.*s\n", name_length, name);
+        free(deps);
+        return -1;
+    }
+
+    if (slot < 0) {
+        char *copy = malloc(name_length + 1);
+        Arena_t *arena = arena_init(ARENA_DEFAULT_CHUNK_SIZE);
+        if (!copy || !arena) {
+            fprintf(stderr, "Error: Memory allocation failed for sheet\n");
+            free(copy);
+            arena_free(arena);
+            free(deps);
+            return -1;
+        }
+        memcpy(copy, name, name_length);
+        copy[name_length] = '\0';
+
+        slot = sheet->count++;
+        memset(&sheet->cells[slot], 0, sizeof(Cell_t));
+        sheet->cells[slot].name = copy;
+        sheet->cells[slot].arena = arena;
+        sheet->names[slot] = copy;
+        sheet->values[slot] = 0.0;
+
+        // A first value counts as a change even if it happens to be 0
+        sheet->cells[slot].error = "";
+    }
+
+    Cell_t *cell = &sheet->cells[slot];
+    detach(sheet, slot);
+    free(cell->deps);
+    cell->deps = deps;
+    cell->dep_count = dep_count;
+    if (attach(sheet, slot) != 0) {
+        cell->dep_count = 0;
+        cell->error = "Memory allocation failed";
+        return -1;
+    }
+
+    // The new tree lives in the spare arena, the old one is reclaimed with it
+    Arena_t *old = cell->arena;
+    cell->arena = sheet->spare;
+    sheet->spare = old;
+    cell->ast = ast;
+
+    sheet_update(sheet, slot);
+    return slot;
+}
+
+// Print one cell's value or error
+static void print_cell(const Sheet_t *sheet, int slot, const char *indent,
+                       NumFormat format) {
+    const Cell_t *cell = &sheet->cells[slot];
+
+    if (cell->error) {
+        printf("%s%s: %s\n", indent, cell->name, cell->error);
+        return;
+    }
+
+    char text[NUMFMT_BUF_SIZE];
+    numfmt_format(sheet->values[slot], format, text);
+    printf("%s%s = %s\n", indent, cell->name, text);
+}
+
+// Print the cell the latest update started from, every other cell whose
+// value changed, and how much work the update took
+void sheet_print_update(const Sheet_t *sheet, NumFormat format) {
+    print_cell(sheet, sheet->order[0], "", format);
+
+    for (int i = 1; i < sheet->affected; i++) {
+        if (sheet->cells[sheet->order[i]].changed)
+            print_cell(sheet, sheet->order[i], "  ", format);
+    }
+
+    if (sheet->affected > 1) {
+        printf("(recomputed %zu, reused %zu)\n", sheet->last.recomputed,
+               sheet->last.reused);
+    }
+}
+
+// Print every cell and the counters of all updates so far
+void sheet_print(const Sheet_t *sheet, NumFormat format) {
+    for (int i = 0; i < sheet->count; i++)
+        print_cell(sheet, i, "  ", format);
+
+    printf("Cells: %d defined, %zu recomputed and %zu reused in total\n", sheet->count,
+           sheet->total.recomputed, sheet->total.reused);
+}
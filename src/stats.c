@@ -0,0 +1,231 @@
+#include "../include/stats.h"
+#include <stdio.h>
+
+#ifdef CALC_STATS
+
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *phase_names[STATS_PHASE_COUNT] = {
+    "lex", "parse", "eval", "vm", "format", "write", "line",
+};
+
+static const char *counter_names[STATS_COUNTER_COUNT] = {
+    "tokens", "nodes", "arena allocs", "arena bytes", "mallocs", "malloc bytes",
+};
+
+// Measurements of one thread. Only the owning thread writes a shard, so
+// recording needs no locked instructions. Dumps read every shard with
+// relaxed loads while they may still be written.
+typedef struct StatsShard StatsShard_t;
+
+struct StatsShard {
+    uint64_t count[STATS_PHASE_COUNT];
+    uint64_t total[STATS_PHASE_COUNT];
+    uint64_t max[STATS_PHASE_COUNT];
+    uint64_t buckets[STATS_PHASE_COUNT][STATS_BUCKETS];
+    uint64_t counters[STATS_COUNTER_COUNT];
+    StatsShard_t *next;
+};
+
+// Every shard ever created, shards live until the process exits
+static StatsShard_t *shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread StatsShard_t *local_shard = NULL;
+
+// The calling thread's shard, created on first use. NULL if out of memory,
+// the measurement is then dropped.
+static StatsShard_t *get_shard(void) {
+    if (local_shard)
+        return local_shard;
+
+    StatsShard_t *shard = calloc(1, sizeof(StatsShard_t));
+    if (!shard)
+        return NULL;
+
+    pthread_mutex_lock(&shards_lock);
+    shard->next = shards;
+    shards = shard;
+    pthread_mutex_unlock(&shards_lock);
+
+    local_shard = shard;
+    return shard;
+}
+
+// Add to a value only the calling thread writes
+static void bump(uint64_t *slot, uint64_t n) {
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// Bucket of a latency: exact below 4 ns, then four buckets per power of two
+static int bucket_index(uint64_t ns) {
+    if (ns < 4)
+        return (int)ns;
+
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (exp - 2)) & 3;
+    return (exp - 1) * 4 + sub;
+}
+
+// Largest latency that falls into a bucket
+static uint64_t bucket_limit(int index) {
+    if (index < 4)
+        return index;
+
+    int exp = index / 4 + 1;
+    uint64_t low = (uint64_t)(4 + index % 4) << (exp - 2);
+    return low + ((uint64_t)1 << (exp - 2)) - 1;
+}
+
+// Monotonic time in nanoseconds
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Record one timed run of a phase
+void stats_record(StatsPhase phase, uint64_t ns) {
+    StatsShard_t *shard = get_shard();
+    if (!shard)
+        return;
+
+    bump(&shard->count[phase], 1);
+    bump(&shard->total[phase], ns);
+    bump(&shard->buckets[phase][bucket_index(ns)], 1);
+    if (ns > __atomic_load_n(&shard->max[phase], __ATOMIC_RELAXED))
+        __atomic_store_n(&shard->max[phase], ns, __ATOMIC_RELAXED);
+}
+
+// Add n to a counter
+void stats_count(StatsCounter counter, uint64_t n) {
+    StatsShard_t *shard = get_shard();
+    if (shard)
+        bump(&shard->counters[counter], n);
+}
+
+// Smallest bucket limit at or above the q-th fraction of the samples
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, double q) {
+    uint64_t rank = (uint64_t)(q * count);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return bucket_limit(i);
+    }
+    return bucket_limit(STATS_BUCKETS - 1);
+}
+
+// Sum every shard and print the phases and counters to fd
+void stats_dump(int fd) {
+    static StatsShard_t sum;
+    static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&dump_lock);
+
+    uint64_t *totals = (uint64_t *)&sum;
+    size_t words = offsetof(StatsShard_t, next) / sizeof(uint64_t);
+    for (size_t i = 0; i < words; i++)
+        totals[i] = 0;
+
+    pthread_mutex_lock(&shards_lock);
+    for (StatsShard_t *shard = shards; shard; shard = shard->next) {
+        const uint64_t *values = (const uint64_t *)shard;
+        for (size_t i = 0; i < words; i++) {
+            uint64_t value = __atomic_load_n(&values[i], __ATOMIC_RELAXED);
+            if (i >= offsetof(StatsShard_t, max) / sizeof(uint64_t) &&
+                i < offsetof(StatsShard_t, buckets) / sizeof(uint64_t)) {
+                if (value > totals[i])
+                    totals[i] = value;
+            } else {
+                totals[i] += value;
+            }
+        }
+    }
+    pthread_mutex_unlock(&shards_lock);
+
+    dprintf(fd, "\n=== calc stats ===\n");
+    dprintf(fd, "%-8s %12s %12s %10s %10s %10s %10s %12s\n", "phase", "count", "total ms",
+            "mean ns", "p50 ns", "p99 ns", "p999 ns", "max ns");
+
+    for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+        uint64_t count = sum.count[p];
+        if (count == 0)
+            continue;
+
+        dprintf(fd, "%-8s %12llu %12.3f %10.1f %10llu %10llu %10llu %12llu\n",
+                phase_names[p], (unsigned long long)count, sum.total[p] / 1e6,
+                (double)sum.total[p] / count,
+                (unsigned long long)percentile(sum.buckets[p], count, 0.50),
+                (unsigned long long)percentile(sum.buckets[p], count, 0.99),
+                (unsigned long long)percentile(sum.buckets[p], count, 0.999),
+                (unsigned long long)sum.max[p]);
+    }
+
+    dprintf(fd, "%-14s %14s\n", "counter", "value");
+    for (int c = 0; c < STATS_COUNTER_COUNT; c++) {
+        dprintf(fd, "%-14s %14llu\n", counter_names[c],
+                (unsigned long long)sum.counters[c]);
+    }
+
+    pthread_mutex_unlock(&dump_lock);
+}
+
+static void dump_at_exit(void) { stats_dump(2); }
+
+// Thread that dumps to stderr every time SIGUSR1 arrives
+static void *signal_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0) {
+        stats_dump(2);
+    }
+
+    return NULL;
+}
+
+// Dump to stderr at exit and on every SIGUSR1. SIGUSR1 is blocked in the
+// calling thread, and so in every thread created after this, and taken by a
+// dedicated thread with sigwait. Call before starting other threads.
+// Returns 0 on success, -1 on failure.
+int stats_install(void) {
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot block SIGUSR1 for stats\n");
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, signal_thread, &set) != 0) {
+        fprintf(stderr, "Error: Cannot start the stats signal thread\n");
+        return -1;
+    }
+    pthread_detach(thread);
+
+    atexit(dump_at_exit);
+    return 0;
+}
+
+#else
+
+// Stats are not compiled in, nothing is recorded so nothing can be dumped
+int stats_install(void) {
+    fprintf(stderr, "Error: Built without stats, use bin/calc-stats from 'make stats'\n");
+    return -1;
+}
+
+void stats_dump(int fd) { (void)fd; }
+
+#endif
@@ -0,0 +1,319 @@
+#include "../include/streameval.h"
+#include "../include/parser.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Same binding powers as the parser, a prefix sign binds tighter than '*'
+// and '/' but looser than '^'
+#define PREC_SIGN 3
+#define PREC_POWER 4
+
+static const unsigned char binary_precedence[TOKEN_ERROR + 1] = {
+    [TOKEN_PLUS] = 1,   [TOKEN_MINUS] = 1,          [TOKEN_MULTIPLY] = 2,
+    [TOKEN_DIVIDE] = 2, [TOKEN_POWER] = PREC_POWER,
+};
+
+// Integer of an exact value that had to fall back to double
+#define INEXACT INT64_MIN
+
+// Value of a finished operand. exact is set where the tree would have an
+// exact node, integer then holds the value or INEXACT after a fallback.
+typedef struct {
+    double value;    // value in double, (double)integer for an exact one
+    int64_t integer; // int64 value, valid if exact is set and not INEXACT
+    int exact;       // set if the operand is made only of integer literals
+} StreamValue_t;
+
+// Operator waiting for its right operand
+typedef struct {
+    TokenType op;  // operator token, TOKEN_LPAREN marks an open group
+    int unary;     // set for a prefix sign
+    int prec;      // binding power, 0 for an open group
+    size_t offset; // stream offset of the operator, for errors
+} StreamOp_t;
+
+// State of one streamed evaluation, the stacks are malloc'd and only grow
+// with nesting and with chains of signs and '^'
+typedef struct {
+    Lexer_t *lexer;
+    Token_t token;             // current token
+    StreamValue_t *values;     // finished operands
+    StreamOp_t *ops;           // operators still missing an operand
+    int value_capacity;        // entries values can hold
+    int op_capacity;           // entries ops can hold
+    const char *parse_error;   // first syntax error, it wins over the others
+    size_t parse_offset;       // stream offset of the token at parse_error
+    const char *eval_error;    // first evaluation error
+    size_t eval_offset;        // stream offset of the operator at eval_error
+    StreamResult_t *result;
+} StreamEval_t;
+
+// Move to the next token
+static inline void advance(StreamEval_t *se) {
+    se->token = lexer_next_token(se->lexer);
+    se->result->tokens += se->token.type != TOKEN_EOF;
+}
+
+// Stream offset of the current token
+static inline size_t token_offset(const StreamEval_t *se) {
+    return se->lexer->base + se->token.offset;
+}
+
+// Record the first syntax error at the current token
+static void parse_error(StreamEval_t *se, const char *msg) {
+    if (se->parse_error)
+        return;
+    se->parse_error = msg;
+    se->parse_offset = token_offset(se);
+}
+
+// Record the first evaluation error, the operation then evaluates to 0
+static double eval_error(StreamEval_t *se, const char *msg, size_t offset) {
+    if (!se->eval_error) {
+        se->eval_error = msg;
+        se->eval_offset = offset;
+    }
+    return 0.0;
+}
+
+// Double the value stack. Returns 0 if it could not grow.
+static int grow_values(StreamEval_t *se) {
+    int capacity = se->value_capacity ? se->value_capacity * 2 : 64;
+    StreamValue_t *values = realloc(se->values, capacity * sizeof(StreamValue_t));
+    if (!values) {
+        fprintf(stderr, "Error: Memory allocation failed for stream stack\n");
+        return 0;
+    }
+
+    se->values = values;
+    se->value_capacity = capacity;
+    return 1;
+}
+
+// Double the operator stack. Returns 0 if it could not grow.
+static int grow_ops(StreamEval_t *se) {
+    int capacity = se->op_capacity ? se->op_capacity * 2 : 64;
+    StreamOp_t *ops = realloc(se->ops, capacity * sizeof(StreamOp_t));
+    if (!ops) {
+        fprintf(stderr, "Error: Memory allocation failed for stream stack\n");
+        return 0;
+    }
+
+    se->ops = ops;
+    se->op_capacity = capacity;
+    return 1;
+}
+
+// Apply a binary operator in double, like the tree evaluator
+static double apply_binary(StreamEval_t *se, StreamOp_t op, double left, double right) {
+    switch (op.op) {
+    case TOKEN_PLUS:
+        return left + right;
+    case TOKEN_MINUS:
+        return left - right;
+    case TOKEN_MULTIPLY:
+        return left * right;
+    case TOKEN_DIVIDE:
+        if (right == 0.0)
+            return eval_error(se, "Division by zero", op.offset);
+        return left / right;
+    case TOKEN_POWER:
+        return pow(left, right);
+    default:
+        return eval_error(se, "Unknown binary operator", op.offset);
+    }
+}
+
+// Replace the operands of op on top of the value stack with its result,
+// computed in int64 where the tree evaluator would
+static void reduce(StreamEval_t *se, StreamOp_t op, StreamValue_t *values, int *count) {
+    StreamValue_t *top = &values[*count - 1];
+
+    if (op.unary) {
+        int64_t result = top->integer;
+        if (op.op == TOKEN_MINUS) {
+            if (top->exact && top->integer != INEXACT &&
+                ast_exact_negate(top->integer, &result)) {
+                top->integer = result;
+                top->value = (double)result;
+            } else {
+                top->integer = INEXACT;
+                top->value = -top->value;
+            }
+        }
+        return;
+    }
+
+    StreamValue_t *left = top - 1;
+    (*count)--;
+
+    if (left->exact && top->exact) {
+        int64_t result;
+        if (left->integer != INEXACT && top->integer != INEXACT &&
+            ast_exact_binary(op.op, left->integer, top->integer, &result)) {
+            left->integer = result;
+            left->value = (double)result;
+            return;
+        }
+        left->integer = INEXACT;
+    } else {
+        left->exact = 0;
+    }
+
+    left->value = apply_binary(se, op, left->value, top->value);
+}
+
+// Read the operand at the current token, a number or a variable, which is
+// never bound in a stream. Returns 0 at a syntax error.
+static int read_leaf(StreamEval_t *se, StreamValue_t *leaf) {
+    Token_t token = se->token;
+
+    if (token.type == TOKEN_NUMBER) {
+        int64_t integer = token.integer ? lexer_token_integer(se->lexer, &token) : -1;
+        leaf->value = token.value;
+        leaf->integer = integer;
+        leaf->exact = integer >= 0;
+    } else if (token.type == TOKEN_IDENT) {
+        leaf->value = eval_error(se, "Unbound variable", token_offset(se));
+        leaf->integer = INEXACT;
+        leaf->exact = 0;
+    } else {
+        parse_error(se, "Expected number, variable or '('");
+        return 0;
+    }
+
+    advance(se);
+    return 1;
+}
+
+// Evaluate the expression with the parser's precedence climbing, except
+// that every reduction computes a value instead of building a node. Only
+// the token being read is held, so a flat chain such as a + b * c - d ...
+// runs in constant memory however long it is. Returns 0 at an error.
+static int eval_expression(StreamEval_t *se) {
+    StreamValue_t *values = se->values;
+    StreamOp_t *ops = se->ops;
+    int value_count = 0;
+    int op_count = 0;
+    int open_groups = 0;
+    int after_power = 0;
+
+    for (;;) {
+        // Expect an operand: prefix signs and open groups, then a leaf
+        for (;;) {
+            TokenType type = se->token.type;
+            StreamOp_t op;
+
+            if ((type == TOKEN_MINUS || type == TOKEN_PLUS) && !after_power) {
+                op = (StreamOp_t){type, 1, PREC_SIGN, token_offset(se)};
+            } else if (type == TOKEN_LPAREN) {
+                op = (StreamOp_t){type, 0, 0, token_offset(se)};
+                open_groups++;
+                after_power = 0;
+            } else {
+                break;
+            }
+
+            if (op_count == se->op_capacity) {
+                if (!grow_ops(se))
+                    return 0;
+                ops = se->ops;
+            }
+            ops[op_count++] = op;
+            advance(se);
+        }
+
+        if (value_count == se->value_capacity) {
+            if (!grow_values(se))
+                return 0;
+            values = se->values;
+        }
+        if (!read_leaf(se, &values[value_count]))
+            return 0;
+        value_count++;
+        if (value_count > se->result->max_depth)
+            se->result->max_depth = value_count;
+
+        // Expect an operator, closing any groups that end here first
+        for (;;) {
+            TokenType type = se->token.type;
+            int prec = binary_precedence[type];
+
+            if (prec) {
+                // '^' is right associative and only yields to tighter
+                // operators, everything else also to its own level
+                int yield = prec == PREC_POWER ? prec + 1 : prec;
+                while (op_count > 0 && ops[op_count - 1].prec >= yield)
+                    reduce(se, ops[--op_count], values, &value_count);
+
+                if (op_count == se->op_capacity) {
+                    if (!grow_ops(se))
+                        return 0;
+                    ops = se->ops;
+                }
+                ops[op_count++] = (StreamOp_t){type, 0, prec, token_offset(se)};
+                advance(se);
+                after_power = type == TOKEN_POWER;
+                break;
+            }
+
+            // Finish the innermost group, or the expression if none is open
+            while (op_count > 0 && ops[op_count - 1].prec > 0)
+                reduce(se, ops[--op_count], values, &value_count);
+
+            if (open_groups == 0) {
+                se->result->value = values[0].value;
+                return 1;
+            }
+
+            if (type != TOKEN_RPAREN) {
+                parse_error(se, "Expected ')'");
+                return 0;
+            }
+
+            op_count--;
+            open_groups--;
+            advance(se);
+        }
+    }
+}
+
+// Evaluate the whole input of lexer, usually a streaming one, as a single
+// expression without building a tree. The result is the one the parser and
+// ast_eval give for the same text. Returns 0, or -1 with result->error set.
+int streameval_run(Lexer_t *lexer, StreamResult_t *result) {
+    StreamEval_t se = {0};
+    se.lexer = lexer;
+    se.result = result;
+
+    result->value = 0.0;
+    result->error = NULL;
+    result->error_offset = 0;
+    result->tokens = 0;
+    result->max_depth = 0;
+
+    advance(&se);
+    int ok = eval_expression(&se);
+    if (ok && se.token.type != TOKEN_EOF)
+        parse_error(&se, "Unexpected token after expression");
+
+    if (lexer->read_error) {
+        result->error = "Failed to read input";
+        result->error_offset = lexer->base + lexer->length;
+    } else if (se.parse_error) {
+        result->error = se.parse_error;
+        result->error_offset = se.parse_offset;
+        result->value = 0.0;
+    } else if (!ok) {
+        result->error = "Out of memory";
+    } else if (se.eval_error) {
+        result->error = se.eval_error;
+        result->error_offset = se.eval_offset;
+    }
+
+    free(se.values);
+    free(se.ops);
+    return result->error ? -1 : 0;
+}